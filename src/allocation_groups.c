@@ -0,0 +1,213 @@
+#include "allocation_groups.h"
+
+#include <stdlib.h>
+
+/**
+ * Adds a region to the end of a group's table while the groups are being
+ * built. Regions are added in order of location.
+ */
+static bool appendRegion(AllocationGroup* group, uint64_t location,
+	uint64_t size, bool dirty)
+{
+	FreeSpaceTable* table = group->table;
+	FreeSpaceTableNode* node = freeSpaceTableInsert(table, table->last, location, size);
+	if(node == NULL)
+	{
+		return false;
+	}
+	node->dirty = dirty;
+	return true;
+}
+
+bool allocationGroupsInit(AllocationGroups* groups, FreeSpaceTable* table,
+	uint64_t filesystemSize, size_t numGroups)
+{
+	if(numGroups == 0)
+	{
+		numGroups = 1;
+	}
+	if(filesystemSize / numGroups < ALLOCATION_GROUP_MIN_PAGES)
+	{
+		numGroups = filesystemSize / ALLOCATION_GROUP_MIN_PAGES;
+		numGroups = numGroups > 0 ? numGroups : 1;
+	}
+	groups->numGroups = numGroups;
+	groups->groupSize = (filesystemSize + numGroups - 1) / numGroups;
+	if(posix_memalign((void**) &groups->groups, 64, sizeof(AllocationGroup) * numGroups) != 0)
+	{
+		return false;
+	}
+	for(size_t i = 0; i < numGroups; i++)
+	{
+		AllocationGroup* group = &groups->groups[i];
+		pthread_mutex_init(&group->lock, NULL);
+		group->table = constructFreeSpaceTable();
+		group->start = groups->groupSize * i;
+		group->end = i + 1 < numGroups ? groups->groupSize * (i + 1) : filesystemSize;
+		if(group->table == NULL)
+		{
+			return false;
+		}
+	}
+
+	/*
+	 * A region crossing a boundary keeps its header on disk, but shrinks
+	 * to end at the boundary. The rest of it gets a new header in the
+	 * next group, so both must be written back.
+	 */
+	FreeSpaceTableNode* node = table->head;
+	while(node->next != NULL)
+	{
+		node = node->next;
+		uint64_t location = node->location;
+		uint64_t remaining = node->size;
+		bool split = false;
+		while(remaining > 0)
+		{
+			AllocationGroup* group = &groups->groups[allocationGroupOf(groups, location)];
+			uint64_t size = group->end - location < remaining ? group->end - location : remaining;
+			split = split || size < remaining;
+			if(!appendRegion(group, location, size, split || node->dirty))
+			{
+				return false;
+			}
+			location += size;
+			remaining -= size;
+		}
+	}
+	destroyFreeSpaceTable(table);
+	return true;
+}
+
+size_t allocationGroupOf(AllocationGroups* groups, uint64_t location)
+{
+	size_t index = location / groups->groupSize;
+	return index < groups->numGroups ? index : groups->numGroups - 1;
+}
+
+uint64_t allocationGroupsAllocate(AllocationGroups* groups, size_t hint,
+	uint64_t size)
+{
+	for(size_t i = 0; i < groups->numGroups; i++)
+	{
+		AllocationGroup* group = &groups->groups[(hint + i) % groups->numGroups];
+		pthread_mutex_lock(&group->lock);
+		uint64_t location = freeSpaceTableAllocate(group->table, size);
+		pthread_mutex_unlock(&group->lock);
+		if(location != 0)
+		{
+			return location;
+		}
+	}
+	return 0;
+}
+
+bool allocationGroupsAllocateAt(AllocationGroups* groups, uint64_t location,
+	uint64_t size)
+{
+	AllocationGroup* group = &groups->groups[allocationGroupOf(groups, location)];
+	if(location + size > group->end)
+	{
+		return false;
+	}
+	pthread_mutex_lock(&group->lock);
+	bool success = freeSpaceTableAllocateAt(group->table, location, size);
+	pthread_mutex_unlock(&group->lock);
+	return success;
+}
+
+uint64_t allocationGroupsAllocateLargest(AllocationGroups* groups,
+	size_t hint, uint64_t maxSize, uint64_t* size)
+{
+	/*
+	 * The largest region may change between finding it and allocating
+	 * from it, so this is retried a bounded number of times.
+	 */
+	for(size_t attempt = 0; attempt < groups->numGroups + 1; attempt++)
+	{
+		size_t best = hint % groups->numGroups;
+		uint64_t bestSize = 0;
+		for(size_t i = 0; i < groups->numGroups && bestSize < maxSize; i++)
+		{
+			size_t index = (hint + i) % groups->numGroups;
+			AllocationGroup* group = &groups->groups[index];
+			pthread_mutex_lock(&group->lock);
+			uint64_t largest = freeSpaceTableLargest(group->table);
+			pthread_mutex_unlock(&group->lock);
+			if(largest > bestSize)
+			{
+				best = index;
+				bestSize = largest;
+			}
+		}
+		if(bestSize == 0)
+		{
+			break;
+		}
+		AllocationGroup* group = &groups->groups[best];
+		pthread_mutex_lock(&group->lock);
+		uint64_t location = freeSpaceTableAllocateLargest(group->table, maxSize, size);
+		pthread_mutex_unlock(&group->lock);
+		if(location != 0)
+		{
+			return location;
+		}
+	}
+	*size = 0;
+	return 0;
+}
+
+bool allocationGroupsRelease(AllocationGroups* groups, uint64_t location,
+	uint64_t size)
+{
+	bool success = true;
+	while(size > 0)
+	{
+		AllocationGroup* group = &groups->groups[allocationGroupOf(groups, location)];
+		uint64_t piece = group->end - location < size ? group->end - location : size;
+		pthread_mutex_lock(&group->lock);
+		success = freeSpaceTableRelease(group->table, location, piece) && success;
+		pthread_mutex_unlock(&group->lock);
+		location += piece;
+		size -= piece;
+	}
+	return success;
+}
+
+uint64_t allocationGroupsFreePages(AllocationGroups* groups)
+{
+	uint64_t freePages = 0;
+	for(size_t i = 0; i < groups->numGroups; i++)
+	{
+		freePages += __atomic_load_n(&groups->groups[i].table->freePages, __ATOMIC_RELAXED);
+	}
+	return freePages;
+}
+
+void allocationGroupsLockAll(AllocationGroups* groups)
+{
+	for(size_t i = 0; i < groups->numGroups; i++)
+	{
+		pthread_mutex_lock(&groups->groups[i].lock);
+	}
+}
+
+void allocationGroupsUnlockAll(AllocationGroups* groups)
+{
+	for(size_t i = groups->numGroups; i > 0; i--)
+	{
+		pthread_mutex_unlock(&groups->groups[i - 1].lock);
+	}
+}
+
+void destroyAllocationGroups(AllocationGroups* groups)
+{
+	for(size_t i = 0; i < groups->numGroups; i++)
+	{
+		pthread_mutex_destroy(&groups->groups[i].lock);
+		destroyFreeSpaceTable(groups->groups[i].table);
+	}
+	free(groups->groups);
+	groups->groups = NULL;
+	groups->numGroups = 0;
+}
@@ -0,0 +1,187 @@
+#ifndef __EFSFUSE_ALLOCATION_GROUPS
+#define __EFSFUSE_ALLOCATION_GROUPS
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "free_space_table.h"
+
+/**
+ * The smallest number of pages an allocation group may cover. Images too
+ * small to give every group this many pages use fewer groups.
+ */
+#define ALLOCATION_GROUP_MIN_PAGES 16384
+
+/**
+ * The free space within one contiguous range of pages. Each group has its
+ * own lock, so that files allocating from different groups do not
+ * contend. Groups are aligned to cache lines so that their locks do not
+ * share one.
+ */
+typedef struct allocation_group
+{
+	/**
+	 * Held while the free space of this group is read or changed.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The regions of free space within this group, sorted by location.
+	 * No region crosses the boundary of a group.
+	 */
+	FreeSpaceTable* table;
+
+	/**
+	 * The first page covered by this group.
+	 */
+	uint64_t start;
+
+	/**
+	 * One past the last page covered by this group.
+	 */
+	uint64_t end;
+
+} __attribute__((aligned(64))) AllocationGroup;
+
+/**
+ * The free space of the filesystem, split into allocation groups of equal
+ * size. On disk the regions still form a single list sorted by location;
+ * the list is stitched together from every group when it is written back.
+ */
+typedef struct allocation_groups
+{
+	/**
+	 * Every group, in order of location.
+	 */
+	AllocationGroup* groups;
+
+	/**
+	 * The number of groups.
+	 */
+	size_t numGroups;
+
+	/**
+	 * The number of pages covered by each group. The last group may
+	 * cover fewer.
+	 */
+	uint64_t groupSize;
+
+} AllocationGroups;
+
+/**
+ * Splits the regions of a free space table into allocation groups. Regions
+ * which cross the boundary of a group are split in two, and marked dirty so
+ * that their headers are rewritten. The table is destroyed.
+ *
+ * @param groups The allocation groups to initialize
+ * @param table The free space of the filesystem, as read from disk
+ * @param filesystemSize The size of the filesystem in pages
+ * @param numGroups The number of groups wanted. Fewer may be used if the
+ * filesystem is small.
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool allocationGroupsInit(AllocationGroups* groups, FreeSpaceTable* table,
+	uint64_t filesystemSize, size_t numGroups);
+
+/**
+ * Finds the group containing a page.
+ *
+ * @param groups The allocation groups
+ * @param location The page index
+ *
+ * @returns The index of the group.
+ */
+size_t allocationGroupOf(AllocationGroups* groups, uint64_t location);
+
+/**
+ * Allocates a contiguous region of the specified size, trying the hinted
+ * group first and then every other group in turn.
+ *
+ * @param groups The allocation groups to allocate from
+ * @param hint The index of the preferred group. May be any number; it is
+ * reduced modulo the number of groups.
+ * @param size The number of pages to allocate
+ *
+ * @returns The page index of the allocated region. 0 if no group has a
+ * region large enough.
+ */
+uint64_t allocationGroupsAllocate(AllocationGroups* groups, size_t hint,
+	uint64_t size);
+
+/**
+ * Allocates a region starting at exactly the given page, if it is free and
+ * the region lies within a single group.
+ *
+ * @param groups The allocation groups to allocate from
+ * @param location The page index the region must start at
+ * @param size The number of pages to allocate
+ *
+ * @returns true upon success, false if the pages are not free.
+ */
+bool allocationGroupsAllocateAt(AllocationGroups* groups, uint64_t location,
+	uint64_t size);
+
+/**
+ * Allocates as much as possible of the specified size from the largest
+ * region of free space in any group. The hinted group is preferred when
+ * it can satisfy the whole request.
+ *
+ * @param groups The allocation groups to allocate from
+ * @param hint The index of the preferred group
+ * @param maxSize The maximum number of pages to allocate
+ * @param size Set to the number of pages actually allocated
+ *
+ * @returns The page index of the allocated region. 0 if there is no free
+ * space.
+ */
+uint64_t allocationGroupsAllocateLargest(AllocationGroups* groups,
+	size_t hint, uint64_t maxSize, uint64_t* size);
+
+/**
+ * Returns a region to the groups covering it, splitting it at the
+ * boundaries between groups.
+ *
+ * @param groups The allocation groups to release into
+ * @param location The page index of the region
+ * @param size The size of the region in pages
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool allocationGroupsRelease(AllocationGroups* groups, uint64_t location,
+	uint64_t size);
+
+/**
+ * Counts the free pages in every group without taking any lock.
+ *
+ * @param groups The allocation groups
+ *
+ * @returns The number of free pages.
+ */
+uint64_t allocationGroupsFreePages(AllocationGroups* groups);
+
+/**
+ * Locks every group, in order of location. Used to take a consistent
+ * snapshot of all free space.
+ *
+ * @param groups The allocation groups to lock
+ */
+void allocationGroupsLockAll(AllocationGroups* groups);
+
+/**
+ * Unlocks every group locked by allocationGroupsLockAll.
+ *
+ * @param groups The allocation groups to unlock
+ */
+void allocationGroupsUnlockAll(AllocationGroups* groups);
+
+/**
+ * Deallocates every group and the free space tables they contain.
+ *
+ * @param groups The allocation groups to destroy
+ */
+void destroyAllocationGroups(AllocationGroups* groups);
+
+#endif
@@ -0,0 +1,359 @@
+#include "allocator.h"
+#include "allocation_groups.h"
+#include "checksum.h"
+#include "compression.h"
+#include "dedup.h"
+#include "util.h"
+#include "writeback.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t fragmentPages(const EFSFragmentDescriptor* fragment)
+{
+	if(fragment->fragmentSize & EFS_FRAGMENT_COMPRESSED)
+	{
+		return fragment->fragmentSize & 0xFFFFFFFF;
+	}
+	return fragment->fragmentSize;
+}
+
+uint64_t fragmentPhysicalPages(const EFSFragmentDescriptor* fragment)
+{
+	if(fragment->fragmentSize & EFS_FRAGMENT_COMPRESSED)
+	{
+		return (fragment->fragmentSize & ~EFS_FRAGMENT_COMPRESSED) >> 32;
+	}
+	return fragment->fragmentSize;
+}
+
+bool fragmentIsCompressed(const EFSFragmentDescriptor* fragment)
+{
+	return (fragment->fragmentSize & EFS_FRAGMENT_COMPRESSED) != 0;
+}
+
+void fragmentSetCompressed(EFSFragmentDescriptor* fragment, uint64_t location,
+	uint64_t pages, uint64_t physicalPages)
+{
+	fragment->fragmentLocation = location;
+	fragment->fragmentSize = EFS_FRAGMENT_COMPRESSED | (physicalPages << 32) | pages;
+}
+
+uint64_t allocatedPages(EFSCompactFileDescriptor* descriptor)
+{
+	uint64_t pages = 0;
+	for(uint64_t i = 0; i < descriptor->numFragments; i++)
+	{
+		pages += fragmentPages(&descriptor->fragments[i]);
+	}
+	return pages;
+}
+
+bool allocatorFind(EFSCompactFileDescriptor* descriptor, uint64_t offset,
+	uint64_t* index, uint64_t* fragmentOffset)
+{
+	uint64_t fragmentStart = 0;
+	for(uint64_t i = 0; i < descriptor->numFragments; i++)
+	{
+		uint64_t fragmentBytes = fragmentPages(&descriptor->fragments[i]) * PAGE_SIZE;
+		if(offset < fragmentStart + fragmentBytes)
+		{
+			*index = i;
+			*fragmentOffset = offset - fragmentStart;
+			return true;
+		}
+		fragmentStart += fragmentBytes;
+	}
+	return false;
+}
+
+bool allocatorMap(EFSCompactFileDescriptor* descriptor, uint64_t offset,
+	uint64_t* imageOffset, uint64_t* length)
+{
+	uint64_t index;
+	uint64_t fragmentOffset;
+	if(!allocatorFind(descriptor, offset, &index, &fragmentOffset)
+		|| fragmentIsCompressed(&descriptor->fragments[index]))
+	{
+		return false;
+	}
+	*imageOffset = descriptor->fragments[index].fragmentLocation * PAGE_SIZE + fragmentOffset;
+	*length = descriptor->fragments[index].fragmentSize * PAGE_SIZE - fragmentOffset;
+	return true;
+}
+
+/**
+ * Chooses the allocation group new pages of a file should come from. A
+ * file keeps allocating from the group its last fragment is in, so that
+ * it stays close together. A file with no fragments is placed by inode,
+ * which spreads files written at the same time across every group.
+ */
+static size_t allocationHint(EFSState* state, EFSCompactFileDescriptor* descriptor)
+{
+	AllocationGroups* groups = &state->allocationGroups;
+	if(descriptor->numFragments > 0)
+	{
+		return allocationGroupOf(groups,
+			descriptor->fragments[descriptor->numFragments - 1].fragmentLocation);
+	}
+	return descriptor->fileID % groups->numGroups;
+}
+
+bool allocatorExtend(EFSState* state, FileTableNode* file, uint64_t pages)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	AllocationGroups* groups = &state->allocationGroups;
+	if(pages == 0)
+	{
+		return true;
+	}
+	if(descriptor->numFragments > 0)
+	{
+		EFSFragmentDescriptor* last = &descriptor->fragments[descriptor->numFragments - 1];
+		if(!fragmentIsCompressed(last)
+			&& (!file->deduplicated || dedupModify(state, last))
+			&& allocationGroupsAllocateAt(groups, last->fragmentLocation + last->fragmentSize, pages))
+		{
+			checksumClear(state, last->fragmentLocation + last->fragmentSize, pages);
+			last->fragmentSize += pages;
+			file->extentGeneration++;
+			if(file->descriptorNode != NULL)
+			{
+				writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+			}
+			return true;
+		}
+	}
+
+	size_t hint = allocationHint(state, descriptor);
+	size_t maxExtents = EFS_MAX_FRAGMENTS - 1 - descriptor->numFragments;
+	EFSFragmentDescriptor* extents = malloc(sizeof(EFSFragmentDescriptor) * (maxExtents + 1));
+	size_t numExtents = 0;
+	uint64_t remaining = pages;
+	if(extents != NULL && maxExtents > 0)
+	{
+		uint64_t location = allocationGroupsAllocate(groups, hint, pages);
+		if(location != 0)
+		{
+			extents[0].fragmentLocation = location;
+			extents[0].fragmentSize = pages;
+			numExtents = 1;
+			remaining = 0;
+		}
+		while(remaining > 0 && numExtents < maxExtents)
+		{
+			uint64_t size;
+			location = allocationGroupsAllocateLargest(groups, hint, remaining, &size);
+			if(location == 0)
+			{
+				break;
+			}
+			extents[numExtents].fragmentLocation = location;
+			extents[numExtents].fragmentSize = size;
+			numExtents++;
+			remaining -= size;
+		}
+	}
+	/*
+	 * The writeback thread serializes descriptors without taking the
+	 * file's lock, so the array is replaced rather than reallocated in
+	 * place, and the old one is retired.
+	 */
+	uint64_t numFragments = descriptor->numFragments;
+	EFSFragmentDescriptor* fragments = remaining == 0
+		? malloc(sizeof(EFSFragmentDescriptor) * (numFragments + numExtents)) : NULL;
+	if(fragments == NULL)
+	{
+		printf("\tCould not allocate %" PRIu64 " pages to inode %" PRIu64 ".\n", pages, descriptor->fileID);
+		for(size_t i = 0; i < numExtents; i++)
+		{
+			allocationGroupsRelease(groups, extents[i].fragmentLocation, extents[i].fragmentSize);
+		}
+		free(extents);
+		return false;
+	}
+	for(size_t i = 0; i < numExtents; i++)
+	{
+		checksumClear(state, extents[i].fragmentLocation, extents[i].fragmentSize);
+	}
+	memcpy(fragments, descriptor->fragments, sizeof(EFSFragmentDescriptor) * numFragments);
+	memcpy(fragments + numFragments, extents, sizeof(EFSFragmentDescriptor) * numExtents);
+	allocatorPublish(state, descriptor, fragments, numFragments + numExtents);
+	file->extentGeneration++;
+	atomic_fetch_add(&state->stats.fragments, numExtents);
+	free(extents);
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	}
+	return true;
+}
+
+/**
+ * Gives a file its own copy of a shared fragment which a truncation only
+ * partly keeps, so that every fragment sharing an extent still covers all
+ * of it.
+ */
+static void unshareBoundary(EFSState* state, FileTableNode* file, uint64_t pages)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t start = 0;
+	for(uint64_t i = 0; i < descriptor->numFragments && start < pages; i++)
+	{
+		EFSFragmentDescriptor* fragment = &descriptor->fragments[i];
+		uint64_t size = fragmentPages(fragment);
+		if(pages < start + size && dedupShared(state, fragment))
+		{
+			int error;
+			dedupBreak(state, file, i, &error);
+		}
+		start += size;
+	}
+}
+
+void allocatorTruncate(EFSState* state, FileTableNode* file, uint64_t pages)
+{
+	if(file->deduplicated)
+	{
+		unshareBoundary(state, file, pages);
+	}
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t kept = 0;
+	uint64_t numFragments = 0;
+	for(uint64_t i = 0; i < descriptor->numFragments; i++)
+	{
+		EFSFragmentDescriptor* fragment = &descriptor->fragments[i];
+		uint64_t size = fragmentPages(fragment);
+		uint64_t keep = kept + size <= pages ? size : pages - kept;
+		if(keep == 0)
+		{
+			allocatorRelease(state, fragment);
+		}
+		else if(keep < size && fragmentIsCompressed(fragment))
+		{
+			/*
+			 * Compressed data cannot be split, so the whole fragment
+			 * stays in the image until it is rewritten or removed.
+			 */
+			fragmentSetCompressed(fragment, fragment->fragmentLocation, keep,
+				fragmentPhysicalPages(fragment));
+		}
+		else if(keep < size && file->deduplicated && !dedupModify(state, fragment))
+		{
+			/*
+			 * The shared extent could not be copied, so its pages stay
+			 * in the image until every fragment sharing it is released.
+			 */
+			fragment->fragmentSize = keep;
+		}
+		else if(keep < size)
+		{
+			allocationGroupsRelease(&state->allocationGroups,
+				fragment->fragmentLocation + keep, size - keep);
+			fragment->fragmentSize = keep;
+		}
+		if(keep > 0)
+		{
+			numFragments++;
+		}
+		kept += keep;
+	}
+	file->extentGeneration++;
+	if(numFragments != descriptor->numFragments)
+	{
+		/*
+		 * Shrinking the count in place is safe for concurrent readers,
+		 * since the array itself is left as it was.
+		 */
+		atomic_fetch_sub(&state->stats.fragments, descriptor->numFragments - numFragments);
+		__atomic_store_n(&descriptor->numFragments, numFragments, __ATOMIC_RELEASE);
+	}
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	}
+}
+
+uint64_t allocatorReserve(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	uint64_t pages)
+{
+	return allocationGroupsAllocate(&state->allocationGroups,
+		allocationHint(state, descriptor), pages);
+}
+
+bool allocatorAppend(EFSState* state, FileTableNode* file,
+	const EFSFragmentDescriptor* fragment)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t numFragments = descriptor->numFragments;
+	if(numFragments >= EFS_MAX_FRAGMENTS - 1)
+	{
+		return false;
+	}
+	EFSFragmentDescriptor* fragments = malloc(sizeof(EFSFragmentDescriptor) * (numFragments + 1));
+	if(fragments == NULL)
+	{
+		return false;
+	}
+	memcpy(fragments, descriptor->fragments, sizeof(EFSFragmentDescriptor) * numFragments);
+	fragments[numFragments] = *fragment;
+	allocatorPublish(state, descriptor, fragments, numFragments + 1);
+	file->extentGeneration++;
+	atomic_fetch_add(&state->stats.fragments, 1);
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	}
+	return true;
+}
+
+bool allocatorReplace(EFSState* state, FileTableNode* file, uint64_t index,
+	const EFSFragmentDescriptor* fragment)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t numFragments = descriptor->numFragments;
+	EFSFragmentDescriptor* fragments = malloc(sizeof(EFSFragmentDescriptor) * numFragments);
+	if(fragments == NULL)
+	{
+		return false;
+	}
+	memcpy(fragments, descriptor->fragments, sizeof(EFSFragmentDescriptor) * numFragments);
+	EFSFragmentDescriptor old = fragments[index];
+	fragments[index] = *fragment;
+	allocatorPublish(state, descriptor, fragments, numFragments);
+	allocatorRelease(state, &old);
+	file->extentGeneration++;
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	}
+	return true;
+}
+
+void allocatorRelease(EFSState* state, const EFSFragmentDescriptor* fragment)
+{
+	uint64_t pages = fragmentPhysicalPages(fragment);
+	if(fragmentIsCompressed(fragment))
+	{
+		compressionForget(state, fragment->fragmentLocation);
+	}
+	else
+	{
+		pages = dedupRelease(state, fragment);
+	}
+	if(pages > 0)
+	{
+		allocationGroupsRelease(&state->allocationGroups, fragment->fragmentLocation, pages);
+	}
+}
+
+void allocatorPublish(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	EFSFragmentDescriptor* fragments, uint64_t numFragments)
+{
+	EFSFragmentDescriptor* replaced = descriptor->fragments;
+	__atomic_store_n(&descriptor->fragments, fragments, __ATOMIC_RELEASE);
+	__atomic_store_n(&descriptor->numFragments, numFragments, __ATOMIC_RELEASE);
+	epochRetire(&state->epoch, free, replaced);
+}
@@ -0,0 +1,205 @@
+#ifndef __EFSFUSE_ALLOCATOR
+#define __EFSFUSE_ALLOCATOR
+
+#include <EFS/file_descriptor.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "efsstate.h"
+#include "file_table.h"
+
+/**
+ * Set in the size of a fragment whose data is compressed. The low 32 bits
+ * of the size then hold the number of pages the fragment covers within
+ * the file, and the next 31 bits the number of pages it occupies in the
+ * image.
+ */
+#define EFS_FRAGMENT_COMPRESSED (1ULL << 63)
+
+/**
+ * Returns the number of pages of the file a fragment covers.
+ *
+ * @param fragment The fragment to measure
+ *
+ * @returns The number of pages of the file the fragment holds.
+ */
+uint64_t fragmentPages(const EFSFragmentDescriptor* fragment);
+
+/**
+ * Returns the number of pages a fragment occupies in the image. Smaller
+ * than \link fragmentPages \endlink if the fragment is compressed.
+ *
+ * @param fragment The fragment to measure
+ *
+ * @returns The number of pages of the image the fragment holds.
+ */
+uint64_t fragmentPhysicalPages(const EFSFragmentDescriptor* fragment);
+
+/**
+ * Checks whether the data of a fragment is compressed.
+ *
+ * @param fragment The fragment to check
+ *
+ * @returns true if the fragment is compressed, otherwise false.
+ */
+bool fragmentIsCompressed(const EFSFragmentDescriptor* fragment);
+
+/**
+ * Fills in a compressed fragment.
+ *
+ * @param fragment The fragment to fill in
+ * @param location The first page of the fragment in the image
+ * @param pages The number of pages of the file the fragment covers
+ * @param physicalPages The number of pages the fragment occupies in the
+ * image
+ */
+void fragmentSetCompressed(EFSFragmentDescriptor* fragment, uint64_t location,
+	uint64_t pages, uint64_t physicalPages);
+
+/**
+ * Counts the pages allocated to a file across all of its fragments.
+ *
+ * @param descriptor The descriptor of the file
+ *
+ * @returns The number of pages allocated to the file
+ */
+uint64_t allocatedPages(EFSCompactFileDescriptor* descriptor);
+
+/**
+ * Finds the fragment holding a byte of a file.
+ *
+ * @param descriptor The descriptor of the file
+ * @param offset The offset of the byte within the file
+ * @param index Set to the index of the fragment holding the byte
+ * @param fragmentOffset Set to the offset of the byte within the data of
+ * the fragment
+ *
+ * @returns true upon success, false if offset lies beyond the pages
+ * allocated to the file.
+ */
+bool allocatorFind(EFSCompactFileDescriptor* descriptor, uint64_t offset,
+	uint64_t* index, uint64_t* fragmentOffset);
+
+/**
+ * Finds where a byte of a file is stored within the image.
+ *
+ * @param descriptor The descriptor of the file
+ * @param offset The offset of the byte within the file
+ * @param imageOffset Set to the offset of the byte within the image
+ * @param length Set to the number of bytes from offset to the end of the
+ * fragment containing it
+ *
+ * @returns true upon success, false if offset lies beyond the pages
+ * allocated to the file, or in a compressed fragment.
+ */
+bool allocatorMap(EFSCompactFileDescriptor* descriptor, uint64_t offset,
+	uint64_t* imageOffset, uint64_t* length);
+
+/**
+ * Takes a single region of free space for a file, near the rest of the
+ * file, without adding it to the file's fragments.
+ *
+ * @param state The current filesystem state
+ * @param descriptor The descriptor of the file the pages are for
+ * @param pages The number of pages to take
+ *
+ * @returns The first page of the region, or 0 if there is no region large
+ * enough.
+ */
+uint64_t allocatorReserve(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	uint64_t pages);
+
+/**
+ * Adds a fragment, whose pages have already been taken, to the end of a
+ * file. Marks the descriptor of the file as dirty. Must be called with the
+ * file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file to add the fragment to
+ * @param fragment The fragment to add
+ *
+ * @returns true upon success, false if the file cannot be fragmented
+ * further or memory could not be allocated.
+ */
+bool allocatorAppend(EFSState* state, FileTableNode* file,
+	const EFSFragmentDescriptor* fragment);
+
+/**
+ * Replaces a fragment of a file with one covering the same pages of the
+ * file, and releases the pages of the old fragment. Marks the descriptor
+ * of the file as dirty. Must be called with the file's lock held for
+ * writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file to change
+ * @param index The index of the fragment to replace
+ * @param fragment The new fragment, whose pages have already been taken
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool allocatorReplace(EFSState* state, FileTableNode* file, uint64_t index,
+	const EFSFragmentDescriptor* fragment);
+
+/**
+ * Returns the pages of a fragment to free space, unless other fragments
+ * share them, and drops any of its data held decompressed in memory.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment to release
+ */
+void allocatorRelease(EFSState* state, const EFSFragmentDescriptor* fragment);
+
+/**
+ * Allocates pages to the end of a file. The pages directly after the
+ * last fragment are used if they are free, so that the last fragment
+ * grows in place. Otherwise, the first region of free space large enough
+ * to hold every page is used. Only if no such region exists are the pages
+ * split across several regions, largest first.
+ *
+ * A compressed or shared last fragment is never grown. Pages are taken
+ * from the allocation group of the file's last fragment where possible.
+ * The new pages have no checksums until they are written. Marks the
+ * descriptor of the file as dirty. Fails without allocating anything if
+ * there is not enough free space, or if the file cannot be fragmented
+ * further. Must be called with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file to allocate pages to
+ * @param pages The number of pages to allocate
+ *
+ * @returns true upon success, false upon failure.
+ */
+bool allocatorExtend(EFSState* state, FileTableNode* file, uint64_t pages);
+
+/**
+ * Releases every page of a file beyond the specified number of pages,
+ * and marks the descriptor of the file as dirty. A compressed fragment
+ * which is only partly kept keeps all of its pages in the image, and only
+ * covers fewer pages of the file. A shared fragment which is only partly
+ * kept is first copied, so that the other files sharing it keep all of
+ * it. Must be called with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file to release pages from
+ * @param pages The number of pages the file should keep
+ */
+void allocatorTruncate(EFSState* state, FileTableNode* file, uint64_t pages);
+
+/**
+ * Replaces the fragment array of a descriptor, and retires the old array
+ * to be deallocated once no reader can hold it. The new array is stored
+ * before the new count, so a reader which loads the count and then the
+ * array never indexes past the end of the array it loads, provided the
+ * new array has at least as many entries as the old count.
+ *
+ * @param state The current filesystem state
+ * @param descriptor The descriptor to change
+ * @param fragments The new array of fragments. Owned by the descriptor
+ * afterwards.
+ * @param numFragments The number of fragments in use in the new array
+ */
+void allocatorPublish(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	EFSFragmentDescriptor* fragments, uint64_t numFragments);
+
+#endif
@@ -0,0 +1,464 @@
+#include "checksum.h"
+#include "allocation_groups.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * The reflected CRC32C (Castagnoli) polynomial.
+ */
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+/**
+ * The number of bytes in each of the three streams the accelerated kernel
+ * interleaves. The crc32 instruction takes three cycles but can start
+ * every cycle, so three independent streams keep it busy. Three streams
+ * cover all but the last 16 bytes of a page.
+ */
+#define CRC32C_STREAM 1360
+
+/**
+ * Tables for computing CRC32C eight bytes at a time in software.
+ */
+static uint32_t crcTables[8][256];
+
+/**
+ * Tables which advance a CRC register over CRC32C_STREAM zero bytes, one
+ * for each byte of the register. Used to join the three streams.
+ */
+static uint32_t shiftTables[4][256];
+
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static bool accelerated;
+
+/**
+ * Advances a CRC register over bytes one at a time.
+ */
+static uint32_t crc32cBytes(uint32_t crc, const unsigned char* data, size_t length)
+{
+	while(length-- > 0)
+	{
+		crc = crcTables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+static void buildTables()
+{
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+		}
+		crcTables[0][i] = crc;
+	}
+	for(uint32_t i = 0; i < 256; i++)
+	{
+		for(int table = 1; table < 8; table++)
+		{
+			uint32_t previous = crcTables[table - 1][i];
+			crcTables[table][i] = crcTables[0][previous & 0xFF] ^ (previous >> 8);
+		}
+	}
+	unsigned char zeroes[CRC32C_STREAM] = { 0 };
+	for(int table = 0; table < 4; table++)
+	{
+		for(uint32_t i = 0; i < 256; i++)
+		{
+			shiftTables[table][i] = crc32cBytes(i << (8 * table), zeroes, CRC32C_STREAM);
+		}
+	}
+#if defined(__x86_64__)
+	accelerated = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/**
+ * Advances a CRC register over CRC32C_STREAM zero bytes. Since a CRC is
+ * linear, the register of two streams joined end to end is that of the
+ * first advanced over the length of the second, combined with that of
+ * the second.
+ */
+static uint32_t crc32cShift(uint32_t crc)
+{
+	return shiftTables[0][crc & 0xFF] ^ shiftTables[1][(crc >> 8) & 0xFF]
+		^ shiftTables[2][(crc >> 16) & 0xFF] ^ shiftTables[3][crc >> 24];
+}
+
+static uint64_t load64(const unsigned char* data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+/**
+ * Advances a CRC register using tables, eight bytes at a time.
+ */
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t length)
+{
+	while(length >= 8)
+	{
+		uint64_t word = load64(data) ^ crc;
+		crc = crcTables[7][word & 0xFF] ^ crcTables[6][(word >> 8) & 0xFF]
+			^ crcTables[5][(word >> 16) & 0xFF] ^ crcTables[4][(word >> 24) & 0xFF]
+			^ crcTables[3][(word >> 32) & 0xFF] ^ crcTables[2][(word >> 40) & 0xFF]
+			^ crcTables[1][(word >> 48) & 0xFF] ^ crcTables[0][word >> 56];
+		data += 8;
+		length -= 8;
+	}
+	return crc32cBytes(crc, data, length);
+}
+
+#if defined(__x86_64__)
+/**
+ * Advances a CRC register with the crc32 instruction, over three streams
+ * at once where there is enough data.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t length)
+{
+	uint64_t first = crc;
+	while(length >= 3 * CRC32C_STREAM)
+	{
+		uint64_t second = 0;
+		uint64_t third = 0;
+		for(size_t i = 0; i < CRC32C_STREAM; i += 8)
+		{
+			first = _mm_crc32_u64(first, load64(data + i));
+			second = _mm_crc32_u64(second, load64(data + CRC32C_STREAM + i));
+			third = _mm_crc32_u64(third, load64(data + 2 * CRC32C_STREAM + i));
+		}
+		first = crc32cShift(crc32cShift(first) ^ second) ^ third;
+		data += 3 * CRC32C_STREAM;
+		length -= 3 * CRC32C_STREAM;
+	}
+	while(length >= 8)
+	{
+		first = _mm_crc32_u64(first, load64(data));
+		data += 8;
+		length -= 8;
+	}
+	uint32_t result = first;
+	while(length-- > 0)
+	{
+		result = _mm_crc32_u8(result, *data++);
+	}
+	return result;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+	pthread_once(&tablesOnce, buildTables);
+#if defined(__x86_64__)
+	if(accelerated)
+	{
+		return ~crc32cHardware(~crc, data, length);
+	}
+#endif
+	return ~crc32cSoftware(~crc, data, length);
+}
+
+uint32_t crc32cTable(uint32_t crc, const void* data, size_t length)
+{
+	pthread_once(&tablesOnce, buildTables);
+	return ~crc32cSoftware(~crc, data, length);
+}
+
+bool crc32cAccelerated()
+{
+	pthread_once(&tablesOnce, buildTables);
+	return accelerated;
+}
+
+bool checksumEnabled(EFSState* state)
+{
+	return state->checksums.sums != NULL;
+}
+
+/**
+ * Stores the checksum of a page, and marks the page of the table holding
+ * it as needing to be written back.
+ */
+static void storeChecksum(ChecksumTable* table, uint64_t page, uint32_t sum)
+{
+	__atomic_store_n(&table->sums[page], sum, __ATOMIC_RELAXED);
+	__atomic_store_n(&table->dirty[page * sizeof(uint32_t) / PAGE_SIZE], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads a whole page of the image and computes its checksum.
+ */
+static bool checksumPage(EFSState* state, uint64_t page, uint32_t* sum)
+{
+	char buffer[PAGE_SIZE];
+	if(!imageRead(state, buffer, PAGE_SIZE, page * PAGE_SIZE))
+	{
+		return false;
+	}
+	*sum = crc32c(0, buffer, PAGE_SIZE);
+	return true;
+}
+
+bool checksumUpdate(EFSState* state, uint64_t imageOffset, const char* data,
+	uint64_t length)
+{
+	ChecksumTable* table = &state->checksums;
+	if(table->sums == NULL || length == 0)
+	{
+		return true;
+	}
+	bool success = true;
+	uint64_t end = imageOffset + length;
+	for(uint64_t page = imageOffset / PAGE_SIZE; page * PAGE_SIZE < end; page++)
+	{
+		uint64_t start = page * PAGE_SIZE;
+		uint32_t sum;
+		if(start >= imageOffset && start + PAGE_SIZE <= end)
+		{
+			sum = crc32c(0, data + (start - imageOffset), PAGE_SIZE);
+		}
+		else if(!checksumPage(state, page, &sum))
+		{
+			sum = 0;
+			success = false;
+		}
+		storeChecksum(table, page, sum);
+	}
+	return success;
+}
+
+void checksumClear(EFSState* state, uint64_t page, uint64_t numPages)
+{
+	ChecksumTable* table = &state->checksums;
+	for(uint64_t i = 0; table->sums != NULL && i < numPages; i++)
+	{
+		storeChecksum(table, page + i, 0);
+	}
+}
+
+void checksumCopy(EFSState* state, uint64_t from, uint64_t to,
+	uint64_t numPages)
+{
+	ChecksumTable* table = &state->checksums;
+	for(uint64_t i = 0; table->sums != NULL && i < numPages; i++)
+	{
+		storeChecksum(table, to + i, __atomic_load_n(&table->sums[from + i], __ATOMIC_RELAXED));
+	}
+}
+
+/**
+ * Reports a page which does not match its checksum.
+ */
+static void checksumMismatch(EFSState* state, uint64_t page, uint32_t expected,
+	uint32_t actual)
+{
+	printf("\tChecksum mismatch at page %" PRIu64 ": expected %08x, found %08x.\n", page, expected, actual);
+	atomic_fetch_add(&state->stats.checksumFailures, 1);
+}
+
+bool checksumVerify(EFSState* state, uint64_t imageOffset, const char* data,
+	uint64_t length)
+{
+	ChecksumTable* table = &state->checksums;
+	if(table->sums == NULL || length == 0)
+	{
+		return true;
+	}
+	uint64_t end = imageOffset + length;
+	uint64_t verified = 0;
+	bool success = true;
+	for(uint64_t page = imageOffset / PAGE_SIZE; success && page * PAGE_SIZE < end; page++)
+	{
+		uint32_t expected = __atomic_load_n(&table->sums[page], __ATOMIC_RELAXED);
+		if(expected == 0)
+		{
+			continue;
+		}
+		uint64_t start = page * PAGE_SIZE;
+		uint32_t actual;
+		if(start >= imageOffset && start + PAGE_SIZE <= end)
+		{
+			actual = crc32c(0, data + (start - imageOffset), PAGE_SIZE);
+		}
+		else if(!checksumPage(state, page, &actual))
+		{
+			return false;
+		}
+		if(actual != expected)
+		{
+			checksumMismatch(state, page, expected, actual);
+			success = false;
+		}
+		verified++;
+	}
+	atomic_fetch_add(&state->stats.checksumPagesVerified, verified);
+	return success;
+}
+
+uint64_t checksumScrub(EFSState* state, uint64_t page, const char* data,
+	uint64_t numPages)
+{
+	ChecksumTable* table = &state->checksums;
+	uint64_t mismatches = 0;
+	for(uint64_t i = 0; table->sums != NULL && i < numPages; i++)
+	{
+		uint32_t expected = __atomic_load_n(&table->sums[page + i], __ATOMIC_RELAXED);
+		uint32_t actual = crc32c(0, data + i * PAGE_SIZE, PAGE_SIZE);
+		if(expected == 0)
+		{
+			storeChecksum(table, page + i, actual);
+			atomic_fetch_add(&state->stats.scrubPagesAdopted, 1);
+		}
+		else if(actual != expected)
+		{
+			checksumMismatch(state, page + i, expected, actual);
+			mismatches++;
+		}
+	}
+	atomic_fetch_add(&state->stats.checksumPagesVerified, numPages);
+	return mismatches;
+}
+
+/**
+ * Computes the number of pages a table of checksums for the whole image
+ * occupies.
+ */
+static uint64_t tablePages(EFSState* state)
+{
+	return (state->filesystemSize * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+/**
+ * Allocates a table with no checksums, and writes it and the record
+ * locating it to the image.
+ */
+static bool createTable(EFSState* state, ChecksumTable* table)
+{
+	table->location = allocationGroupsAllocate(&state->allocationGroups, 0, table->numPages);
+	if(table->location == 0)
+	{
+		printf("No free region of %" PRIu64 " pages for the checksum table.\n", table->numPages);
+		return false;
+	}
+	ChecksumRecord record;
+	memcpy(record.magic, CHECKSUM_RECORD_MAGIC, sizeof(record.magic));
+	record.location = table->location;
+	record.numPages = table->numPages;
+	if(!imageWrite(state, table->sums, table->numPages * PAGE_SIZE, table->location * PAGE_SIZE)
+		|| !imageSync(state)
+		|| !imageWrite(state, &record, sizeof(record), CHECKSUM_RECORD_OFFSET)
+		|| !imageSync(state))
+	{
+		printf("Failed to write the checksum table.\n");
+		allocationGroupsRelease(&state->allocationGroups, table->location, table->numPages);
+		return false;
+	}
+	printf("Created checksum table of %" PRIu64 " pages at page %" PRIu64 ".\n", table->numPages, table->location);
+	return true;
+}
+
+bool checksumOpen(EFSState* state, bool create)
+{
+	ChecksumTable* table = &state->checksums;
+	ChecksumRecord record;
+	if(!imageRead(state, &record, sizeof(record), CHECKSUM_RECORD_OFFSET))
+	{
+		return false;
+	}
+	bool exists = memcmp(record.magic, CHECKSUM_RECORD_MAGIC, sizeof(record.magic)) == 0;
+	if(!exists && !create)
+	{
+		return true;
+	}
+	table->numPages = tablePages(state);
+	if(exists && record.numPages != table->numPages)
+	{
+		printf("Checksum table has %" PRIu64 " pages, expected %" PRIu64 ".\n", record.numPages, table->numPages);
+		return false;
+	}
+	table->sums = calloc(table->numPages, PAGE_SIZE);
+	table->dirty = calloc(table->numPages, 1);
+	if(table->sums == NULL || table->dirty == NULL)
+	{
+		checksumClose(state);
+		return false;
+	}
+	if(exists)
+	{
+		table->location = record.location;
+		if(!imageRead(state, table->sums, table->numPages * PAGE_SIZE, table->location * PAGE_SIZE))
+		{
+			printf("Failed to read the checksum table.\n");
+			checksumClose(state);
+			return false;
+		}
+	}
+	else if(!createTable(state, table))
+	{
+		checksumClose(state);
+		return false;
+	}
+	printf("Verifying pages with %s CRC32C.\n", crc32cAccelerated() ? "SSE4.2" : "table driven");
+	return true;
+}
+
+void checksumClose(EFSState* state)
+{
+	ChecksumTable* table = &state->checksums;
+	free(table->sums);
+	free(table->dirty);
+	table->sums = NULL;
+	table->dirty = NULL;
+}
+
+bool checksumFlush(EFSState* state)
+{
+	ChecksumTable* table = &state->checksums;
+	bool success = true;
+	uint64_t page = 0;
+	while(table->sums != NULL && page < table->numPages)
+	{
+		/*
+		 * Each flag is cleared before its page is written, so that a
+		 * checksum stored during the write marks the page again.
+		 */
+		uint64_t first = page;
+		while(page < table->numPages && __atomic_exchange_n(&table->dirty[page], 0, __ATOMIC_ACQUIRE))
+		{
+			page++;
+		}
+		if(page > first)
+		{
+			char* start = (char*) table->sums + first * PAGE_SIZE;
+			if(!imageWrite(state, start, (page - first) * PAGE_SIZE, (table->location + first) * PAGE_SIZE))
+			{
+				printf("Failed to write checksum table pages %" PRIu64 " to %" PRIu64 ".\n", first, page - 1);
+				for(uint64_t i = first; i < page; i++)
+				{
+					__atomic_store_n(&table->dirty[i], 1, __ATOMIC_RELAXED);
+				}
+				success = false;
+			}
+		}
+		else
+		{
+			page++;
+		}
+	}
+	return success;
+}
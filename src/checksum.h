@@ -0,0 +1,217 @@
+#ifndef __EFSFUSE_CHECKSUM
+#define __EFSFUSE_CHECKSUM
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct efs_state;
+
+/**
+ * The offset within the first page of the image of the record locating
+ * the checksum table. The superblock only uses the start of the page.
+ */
+#define CHECKSUM_RECORD_OFFSET (PAGE_SIZE / 2)
+
+/**
+ * Identifies the record locating the checksum table.
+ */
+#define CHECKSUM_RECORD_MAGIC "EFSCRC32"
+
+/**
+ * The record, stored in the first page of the image, locating the table
+ * holding the checksum of every page.
+ */
+typedef struct checksum_record
+{
+	/**
+	 * Always \link CHECKSUM_RECORD_MAGIC \endlink, without a terminator.
+	 */
+	char magic[8];
+
+	/**
+	 * The first page of the table.
+	 */
+	uint64_t location;
+
+	/**
+	 * The number of pages the table occupies.
+	 */
+	uint64_t numPages;
+
+} ChecksumRecord;
+
+/**
+ * The CRC32C of every page of the image, held in memory and written back
+ * along with descriptors. A checksum of 0 means the page has none, either
+ * because it has not been written since it was allocated or because it
+ * was written before the table existed; such pages are not verified.
+ */
+typedef struct checksum_table
+{
+	/**
+	 * The checksum of each page of the image, indexed by page. NULL if the
+	 * image has no checksum table.
+	 */
+	uint32_t* sums;
+
+	/**
+	 * A flag for each page of the table, set when a checksum within it
+	 * has changed and it must be written back.
+	 */
+	uint8_t* dirty;
+
+	/**
+	 * The first page of the table in the image.
+	 */
+	uint64_t location;
+
+	/**
+	 * The number of pages the table occupies in the image.
+	 */
+	uint64_t numPages;
+
+} ChecksumTable;
+
+/**
+ * Computes the CRC32C of some data, using the SSE4.2 crc32 instruction
+ * where the processor has it.
+ *
+ * @param crc The CRC32C of any data preceding this data, or 0
+ * @param data The data to checksum
+ * @param length The number of bytes of data
+ *
+ * @returns The CRC32C of the preceding data followed by this data.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Computes the CRC32C of some data with tables, as crc32c does where the
+ * processor lacks SSE4.2. Lets the two be compared on any processor.
+ *
+ * @param crc The CRC32C of any data preceding this data, or 0
+ * @param data The data to checksum
+ * @param length The number of bytes of data
+ *
+ * @returns The CRC32C of the preceding data followed by this data.
+ */
+uint32_t crc32cTable(uint32_t crc, const void* data, size_t length);
+
+/**
+ * Checks whether crc32c uses the SSE4.2 crc32 instruction.
+ *
+ * @returns true if it does, false if it uses tables.
+ */
+bool crc32cAccelerated();
+
+/**
+ * Loads the checksum table of the image, or creates one if the image has
+ * none and create is set. Must be called after the free space table has
+ * been read.
+ *
+ * @param state The current filesystem state
+ * @param create Set to create a table if the image has none
+ *
+ * @returns true upon success, including if the image has no table and
+ * create is not set. false if the table could not be read or created.
+ */
+bool checksumOpen(struct efs_state* state, bool create);
+
+/**
+ * Deallocates the in-memory checksum table. Does not write it back.
+ *
+ * @param state The current filesystem state
+ */
+void checksumClose(struct efs_state* state);
+
+/**
+ * Checks whether the image has a checksum table.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true if it does, otherwise false.
+ */
+bool checksumEnabled(struct efs_state* state);
+
+/**
+ * Records the checksums of pages just written to the image. Pages only
+ * partly covered by data are read back from the image to be checksummed
+ * whole. Must be called with the lock of the file owning the pages held
+ * for writing.
+ *
+ * @param state The current filesystem state
+ * @param imageOffset The offset within the image the data was written at
+ * @param data The data written
+ * @param length The number of bytes written
+ *
+ * @returns true upon success, false if a partly covered page could not be
+ * read back, in which case its checksum is cleared.
+ */
+bool checksumUpdate(struct efs_state* state, uint64_t imageOffset,
+	const char* data, uint64_t length);
+
+/**
+ * Clears the checksums of pages whose contents are unknown, such as
+ * pages which have just been allocated.
+ *
+ * @param state The current filesystem state
+ * @param page The first page to clear
+ * @param numPages The number of pages to clear
+ */
+void checksumClear(struct efs_state* state, uint64_t page, uint64_t numPages);
+
+/**
+ * Copies the checksums of pages whose contents have been copied to other
+ * pages.
+ *
+ * @param state The current filesystem state
+ * @param from The first page copied from
+ * @param to The first page copied to
+ * @param numPages The number of pages copied
+ */
+void checksumCopy(struct efs_state* state, uint64_t from, uint64_t to,
+	uint64_t numPages);
+
+/**
+ * Verifies data just read from the image against the checksums of the
+ * pages it came from. Pages only partly covered by data are read whole
+ * from the image. Must be called with the lock of the file owning the
+ * pages held.
+ *
+ * @param state The current filesystem state
+ * @param imageOffset The offset within the image the data was read from
+ * @param data The data read
+ * @param length The number of bytes read
+ *
+ * @returns true if every page with a checksum matches it, otherwise
+ * false.
+ */
+bool checksumVerify(struct efs_state* state, uint64_t imageOffset,
+	const char* data, uint64_t length);
+
+/**
+ * Verifies whole pages read by the scrubber, and records the checksums of
+ * any which have none. Must be called with the lock of the file owning
+ * the pages held.
+ *
+ * @param state The current filesystem state
+ * @param page The first page read
+ * @param data The contents of the pages
+ * @param numPages The number of pages read
+ *
+ * @returns The number of pages which do not match their checksum.
+ */
+uint64_t checksumScrub(struct efs_state* state, uint64_t page,
+	const char* data, uint64_t numPages);
+
+/**
+ * Writes every page of the checksum table which has changed since it was
+ * last written.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if an I/O error occurred.
+ */
+bool checksumFlush(struct efs_state* state);
+
+#endif
@@ -0,0 +1,517 @@
+#include "compression.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/**
+ * The most units stored in a single compressed fragment, which keeps
+ * every offset in the header within 32 bits.
+ */
+#define COMPRESSION_MAX_UNITS 16384
+
+/**
+ * The units of a flush compressed by one thread: every stride'th unit,
+ * starting from first.
+ */
+typedef struct compression_job
+{
+	const char* data;
+	char* output;
+	size_t outputStride;
+	uint32_t* lengths;
+	uint64_t numUnits;
+	uint64_t first;
+	uint64_t stride;
+	int level;
+} CompressionJob;
+
+/**
+ * Compresses a single unit. Units which do not get smaller are copied as
+ * they are.
+ */
+static void compressUnit(const char* unit, char* output, size_t capacity,
+	uint32_t* length, int level)
+{
+	uLongf compressedLength = capacity;
+	if(compress2((Bytef*) output, &compressedLength, (const Bytef*) unit,
+			COMPRESSION_UNIT_SIZE, level) != Z_OK
+		|| compressedLength >= COMPRESSION_UNIT_SIZE)
+	{
+		memcpy(output, unit, COMPRESSION_UNIT_SIZE);
+		compressedLength = COMPRESSION_UNIT_SIZE;
+	}
+	*length = compressedLength;
+}
+
+static void* compressionThread(void* data)
+{
+	CompressionJob* job = data;
+	for(uint64_t unit = job->first; unit < job->numUnits; unit += job->stride)
+	{
+		compressUnit(job->data + unit * COMPRESSION_UNIT_SIZE,
+			job->output + unit * job->outputStride, job->outputStride,
+			&job->lengths[unit], job->level);
+	}
+	return NULL;
+}
+
+/**
+ * Compresses every unit of some data, spread across up to the configured
+ * number of threads. The calling thread compresses a share itself, and
+ * any share whose thread could not be created.
+ */
+static void compressUnits(Compression* compression, const char* data,
+	uint64_t numUnits, char* output, size_t outputStride, uint32_t* lengths)
+{
+	uint64_t numThreads = compression->threads > 0 ? compression->threads : 1;
+	if(numThreads > numUnits)
+	{
+		numThreads = numUnits;
+	}
+	CompressionJob jobs[numThreads];
+	pthread_t threads[numThreads];
+	bool started[numThreads];
+	for(uint64_t i = 0; i < numThreads; i++)
+	{
+		jobs[i] = (CompressionJob) { data, output, outputStride, lengths, numUnits,
+			i, numThreads, compression->level };
+		started[i] = i > 0 && pthread_create(&threads[i], NULL, compressionThread, &jobs[i]) == 0;
+	}
+	for(uint64_t i = 0; i < numThreads; i++)
+	{
+		if(!started[i])
+		{
+			compressionThread(&jobs[i]);
+		}
+	}
+	for(uint64_t i = 1; i < numThreads; i++)
+	{
+		if(started[i])
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+}
+
+uint64_t compressionWrite(EFSState* state, FileTableNode* file,
+	const char* data, uint64_t size)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t numUnits = size / COMPRESSION_UNIT_SIZE;
+	if(numUnits > COMPRESSION_MAX_UNITS)
+	{
+		numUnits = COMPRESSION_MAX_UNITS;
+	}
+	/*
+	 * Room is left for a fragment holding whatever follows the units,
+	 * since a compressed fragment is never grown.
+	 */
+	if(numUnits == 0 || descriptor->numFragments + 2 >= EFS_MAX_FRAGMENTS)
+	{
+		return 0;
+	}
+	size_t outputStride = compressBound(COMPRESSION_UNIT_SIZE);
+	char* output = malloc(outputStride * numUnits);
+	uint32_t* lengths = malloc(sizeof(uint32_t) * numUnits);
+	if(output == NULL || lengths == NULL)
+	{
+		free(output);
+		free(lengths);
+		return 0;
+	}
+	compressUnits(&state->compression, data, numUnits, output, outputStride, lengths);
+
+	uint64_t headerSize = sizeof(CompressedHeader) + sizeof(uint32_t) * (numUnits + 1);
+	uint64_t storedSize = headerSize;
+	for(uint64_t unit = 0; unit < numUnits; unit++)
+	{
+		storedSize += lengths[unit];
+	}
+	uint64_t pages = numUnits * COMPRESSION_UNIT_SIZE / PAGE_SIZE;
+	uint64_t physicalPages = (storedSize + PAGE_SIZE - 1) / PAGE_SIZE;
+	/*
+	 * Reads of a compressed fragment cost more than reads of plain pages,
+	 * so data is only stored compressed if that saves an eighth of it.
+	 */
+	char* stored = physicalPages * 8 <= pages * 7
+		? calloc(physicalPages, PAGE_SIZE) : NULL;
+	uint64_t location = stored != NULL ? allocatorReserve(state, descriptor, physicalPages) : 0;
+	if(location == 0)
+	{
+		atomic_fetch_add(&state->stats.compressionDeclined, 1);
+		free(stored);
+		free(output);
+		free(lengths);
+		return 0;
+	}
+	CompressedHeader* header = (CompressedHeader*) stored;
+	header->magic = COMPRESSION_MAGIC;
+	header->numUnits = numUnits;
+	uint64_t offset = headerSize;
+	for(uint64_t unit = 0; unit < numUnits; unit++)
+	{
+		header->offsets[unit] = offset;
+		memcpy(stored + offset, output + unit * outputStride, lengths[unit]);
+		offset += lengths[unit];
+	}
+	header->offsets[numUnits] = offset;
+	free(output);
+	free(lengths);
+
+	EFSFragmentDescriptor fragment;
+	fragmentSetCompressed(&fragment, location, pages, physicalPages);
+	bool written = imageWrite(state, stored, physicalPages * PAGE_SIZE, location * PAGE_SIZE);
+	if(written)
+	{
+		checksumUpdate(state, location * PAGE_SIZE, stored, physicalPages * PAGE_SIZE);
+	}
+	free(stored);
+	if(!written || !allocatorAppend(state, file, &fragment))
+	{
+		printf("\tFailed to write compressed data of inode %" PRIu64 ".\n", descriptor->fileID);
+		allocationGroupsRelease(&state->allocationGroups, location, physicalPages);
+		return 0;
+	}
+	atomic_fetch_add(&state->stats.compressedUnits, numUnits);
+	atomic_fetch_add(&state->stats.compressionBytesIn, pages * PAGE_SIZE);
+	atomic_fetch_add(&state->stats.compressionBytesOut, physicalPages * PAGE_SIZE);
+	return numUnits * COMPRESSION_UNIT_SIZE;
+}
+
+/**
+ * Mixes the location of a fragment and the index of one of its units into
+ * a hash, which picks both the shard and the bucket holding the unit.
+ */
+static uint64_t unitHash(uint64_t location, uint64_t unit)
+{
+	uint64_t hash = (location * 0x9E3779B97F4A7C15ULL) ^ (unit + 0x632BE59BD9B4E019ULL);
+	hash ^= hash >> 31;
+	hash *= 0xD6E8FEB86659FD93ULL;
+	return hash ^ (hash >> 32);
+}
+
+static CompressionShard* shardOf(Compression* compression, uint64_t hash)
+{
+	return &compression->shards[hash % COMPRESSION_CACHE_SHARDS];
+}
+
+static CachedUnit** bucketOf(CompressionShard* shard, uint64_t hash)
+{
+	return &shard->buckets[(hash / COMPRESSION_CACHE_SHARDS) & (shard->numBuckets - 1)];
+}
+
+/**
+ * Removes a unit from the list of units ordered by use.
+ */
+static void unlinkUnit(CompressionShard* shard, CachedUnit* unit)
+{
+	if(unit->older != NULL)
+	{
+		unit->older->newer = unit->newer;
+	}
+	else
+	{
+		shard->oldest = unit->newer;
+	}
+	if(unit->newer != NULL)
+	{
+		unit->newer->older = unit->older;
+	}
+	else
+	{
+		shard->newest = unit->older;
+	}
+}
+
+/**
+ * Adds a unit to the list of units ordered by use, as the most recently
+ * used.
+ */
+static void linkNewest(CompressionShard* shard, CachedUnit* unit)
+{
+	unit->older = shard->newest;
+	unit->newer = NULL;
+	if(shard->newest != NULL)
+	{
+		shard->newest->newer = unit;
+	}
+	else
+	{
+		shard->oldest = unit;
+	}
+	shard->newest = unit;
+}
+
+/**
+ * Removes a unit from its bucket. Must be called with the shard's lock
+ * held.
+ */
+static void removeUnit(CompressionShard* shard, CachedUnit* unit, uint64_t hash)
+{
+	CachedUnit** link = bucketOf(shard, hash);
+	while(*link != unit)
+	{
+		link = &(*link)->next;
+	}
+	*link = unit->next;
+	unlinkUnit(shard, unit);
+	shard->numUnits--;
+}
+
+/**
+ * Finds a unit in the cache and marks it as the most recently used. Must
+ * be called with the shard's lock held.
+ */
+static CachedUnit* findUnit(CompressionShard* shard, uint64_t hash,
+	uint64_t location, uint64_t index)
+{
+	for(CachedUnit* unit = *bucketOf(shard, hash); unit != NULL; unit = unit->next)
+	{
+		if(unit->location == location && unit->unit == index)
+		{
+			unlinkUnit(shard, unit);
+			linkNewest(shard, unit);
+			return unit;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads a unit of a compressed fragment from the image and decompresses
+ * it.
+ */
+static bool loadUnit(EFSState* state, const EFSFragmentDescriptor* fragment,
+	uint64_t index, char* data)
+{
+	uint64_t base = fragment->fragmentLocation * PAGE_SIZE;
+	uint64_t storedSize = fragmentPhysicalPages(fragment) * PAGE_SIZE;
+	uint32_t range[2];
+	if(!imageRead(state, (char*) range, sizeof(range),
+		base + offsetof(CompressedHeader, offsets) + index * sizeof(uint32_t)))
+	{
+		return false;
+	}
+	uint32_t length = range[1] - range[0];
+	if(range[1] <= range[0] || range[1] > storedSize || length > COMPRESSION_UNIT_SIZE)
+	{
+		printf("\tCompressed fragment at page %" PRIu64 " is corrupt.\n", fragment->fragmentLocation);
+		return false;
+	}
+	if(length == COMPRESSION_UNIT_SIZE)
+	{
+		/*
+		 * Compressed units are checked by zlib as they are decompressed,
+		 * but units stored as they are must be checked here.
+		 */
+		return imageRead(state, data, length, base + range[0])
+			&& checksumVerify(state, base + range[0], data, length);
+	}
+	char* compressed = malloc(length);
+	bool success = compressed != NULL && imageRead(state, compressed, length, base + range[0]);
+	uLongf decompressedLength = COMPRESSION_UNIT_SIZE;
+	if(success && (uncompress((Bytef*) data, &decompressedLength, (const Bytef*) compressed, length) != Z_OK
+		|| decompressedLength != COMPRESSION_UNIT_SIZE))
+	{
+		printf("\tCompressed fragment at page %" PRIu64 " is corrupt.\n", fragment->fragmentLocation);
+		success = false;
+	}
+	free(compressed);
+	return success;
+}
+
+/**
+ * Adds a decompressed unit to the cache, evicting the least recently used
+ * units of its shard to make room. If another reader added the same unit
+ * first, or the cache holds nothing, the unit is freed instead.
+ */
+static void insertUnit(CompressionShard* shard, uint64_t hash, CachedUnit* unit)
+{
+	pthread_mutex_lock(&shard->lock);
+	if(shard->capacity == 0 || findUnit(shard, hash, unit->location, unit->unit) != NULL)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		free(unit);
+		return;
+	}
+	while(shard->numUnits >= shard->capacity)
+	{
+		CachedUnit* oldest = shard->oldest;
+		removeUnit(shard, oldest, unitHash(oldest->location, oldest->unit));
+		free(oldest);
+	}
+	CachedUnit** bucket = bucketOf(shard, hash);
+	unit->next = *bucket;
+	*bucket = unit;
+	linkNewest(shard, unit);
+	shard->numUnits++;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+bool compressionRead(EFSState* state, const EFSFragmentDescriptor* fragment,
+	uint64_t offset, uint64_t size, char* buffer)
+{
+	Compression* compression = &state->compression;
+	uint64_t location = fragment->fragmentLocation;
+	uint64_t done = 0;
+	while(done < size)
+	{
+		uint64_t index = (offset + done) / COMPRESSION_UNIT_SIZE;
+		uint64_t unitOffset = (offset + done) % COMPRESSION_UNIT_SIZE;
+		uint64_t length = COMPRESSION_UNIT_SIZE - unitOffset;
+		if(length > size - done)
+		{
+			length = size - done;
+		}
+		uint64_t hash = unitHash(location, index);
+		CompressionShard* shard = shardOf(compression, hash);
+		pthread_mutex_lock(&shard->lock);
+		CachedUnit* unit = findUnit(shard, hash, location, index);
+		if(unit != NULL)
+		{
+			memcpy(buffer + done, unit->data + unitOffset, length);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		if(unit != NULL)
+		{
+			atomic_fetch_add(&state->stats.decompressCacheHits, 1);
+			done += length;
+			continue;
+		}
+
+		/*
+		 * The unit is decompressed without the shard's lock held, so
+		 * other readers of the shard are not held up. Two readers may
+		 * decompress the same unit, in which case only one copy is kept.
+		 */
+		unit = malloc(sizeof(CachedUnit) + COMPRESSION_UNIT_SIZE);
+		if(unit == NULL || !loadUnit(state, fragment, index, unit->data))
+		{
+			free(unit);
+			return false;
+		}
+		unit->location = location;
+		unit->unit = index;
+		memcpy(buffer + done, unit->data + unitOffset, length);
+		atomic_fetch_add(&state->stats.decompressCacheMisses, 1);
+		insertUnit(shard, hash, unit);
+		done += length;
+	}
+	return true;
+}
+
+bool compressionExpand(EFSState* state, FileTableNode* file, uint64_t index,
+	int* error)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	EFSFragmentDescriptor old = descriptor->fragments[index];
+	uint64_t pages = fragmentPages(&old);
+	char* data = malloc(pages * PAGE_SIZE);
+	if(data == NULL || !compressionRead(state, &old, 0, pages * PAGE_SIZE, data))
+	{
+		*error = data == NULL ? ENOMEM : EIO;
+		free(data);
+		return false;
+	}
+	uint64_t location = allocatorReserve(state, descriptor, pages);
+	if(location == 0)
+	{
+		printf("\tNo space to expand compressed data of inode %" PRIu64 ".\n", descriptor->fileID);
+		*error = ENOSPC;
+		free(data);
+		return false;
+	}
+	EFSFragmentDescriptor fragment = { location, pages };
+	bool written = imageWrite(state, data, pages * PAGE_SIZE, location * PAGE_SIZE)
+		&& checksumUpdate(state, location * PAGE_SIZE, data, pages * PAGE_SIZE);
+	free(data);
+	if(!written || !allocatorReplace(state, file, index, &fragment))
+	{
+		*error = written ? ENOMEM : EIO;
+		allocationGroupsRelease(&state->allocationGroups, location, pages);
+		return false;
+	}
+	atomic_fetch_add(&state->stats.compressionExpansions, 1);
+	return true;
+}
+
+void compressionForget(EFSState* state, uint64_t location)
+{
+	Compression* compression = &state->compression;
+	for(size_t i = 0; i < COMPRESSION_CACHE_SHARDS; i++)
+	{
+		CompressionShard* shard = &compression->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for(size_t bucket = 0; bucket < shard->numBuckets && shard->numUnits > 0; bucket++)
+		{
+			CachedUnit** link = &shard->buckets[bucket];
+			while(*link != NULL)
+			{
+				CachedUnit* unit = *link;
+				if(unit->location == location)
+				{
+					*link = unit->next;
+					unlinkUnit(shard, unit);
+					shard->numUnits--;
+					free(unit);
+				}
+				else
+				{
+					link = &unit->next;
+				}
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+bool compressionInit(EFSState* state, uint64_t cacheSize)
+{
+	Compression* compression = &state->compression;
+	size_t capacity = cacheSize / COMPRESSION_UNIT_SIZE / COMPRESSION_CACHE_SHARDS;
+	size_t numBuckets = 1;
+	while(numBuckets < capacity)
+	{
+		numBuckets *= 2;
+	}
+	bool success = true;
+	for(size_t i = 0; i < COMPRESSION_CACHE_SHARDS; i++)
+	{
+		CompressionShard* shard = &compression->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->buckets = calloc(numBuckets, sizeof(CachedUnit*));
+		shard->numBuckets = shard->buckets != NULL ? numBuckets : 0;
+		shard->newest = NULL;
+		shard->oldest = NULL;
+		shard->numUnits = 0;
+		shard->capacity = shard->buckets != NULL ? capacity : 0;
+		success = success && shard->buckets != NULL;
+	}
+	return success;
+}
+
+void compressionDestroy(EFSState* state)
+{
+	Compression* compression = &state->compression;
+	for(size_t i = 0; i < COMPRESSION_CACHE_SHARDS; i++)
+	{
+		CompressionShard* shard = &compression->shards[i];
+		while(shard->oldest != NULL)
+		{
+			CachedUnit* unit = shard->oldest;
+			shard->oldest = unit->newer;
+			free(unit);
+		}
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
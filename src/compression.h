@@ -0,0 +1,249 @@
+#ifndef __EFSFUSE_COMPRESSION
+#define __EFSFUSE_COMPRESSION
+
+#include <EFS/file_descriptor.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_table.h"
+
+struct efs_state;
+
+/**
+ * The number of bytes of a file compressed together. Reading any byte of
+ * a compressed fragment decompresses the whole unit holding it.
+ */
+#define COMPRESSION_UNIT_SIZE (64 * 1024)
+
+/**
+ * Written at the start of the first page of every compressed fragment.
+ */
+#define COMPRESSION_MAGIC 0x5A434645
+
+/**
+ * The number of independently locked parts the cache of decompressed
+ * units is split into.
+ */
+#define COMPRESSION_CACHE_SHARDS 16
+
+/**
+ * The header at the start of a compressed fragment. Units are stored one
+ * after another following the header. A unit whose stored length is
+ * \link COMPRESSION_UNIT_SIZE \endlink did not compress, and is stored as
+ * it is.
+ */
+typedef struct compressed_header
+{
+	/**
+	 * Always \link COMPRESSION_MAGIC \endlink.
+	 */
+	uint32_t magic;
+
+	/**
+	 * The number of units in the fragment.
+	 */
+	uint32_t numUnits;
+
+	/**
+	 * The offset of each unit from the start of the fragment, followed by
+	 * the offset of the end of the last unit.
+	 */
+	uint32_t offsets[];
+
+} CompressedHeader;
+
+/**
+ * A unit of a compressed fragment, held decompressed in memory.
+ */
+typedef struct cached_unit
+{
+	/**
+	 * The first page of the fragment the unit belongs to.
+	 */
+	uint64_t location;
+
+	/**
+	 * The index of the unit within its fragment.
+	 */
+	uint64_t unit;
+
+	/**
+	 * The next unit in the same bucket of the shard.
+	 */
+	struct cached_unit* next;
+
+	/**
+	 * The unit used just before this one, or NULL if this is the least
+	 * recently used.
+	 */
+	struct cached_unit* older;
+
+	/**
+	 * The unit used just after this one, or NULL if this is the most
+	 * recently used.
+	 */
+	struct cached_unit* newer;
+
+	/**
+	 * The decompressed bytes of the unit.
+	 */
+	char data[];
+
+} CachedUnit;
+
+/**
+ * One part of the cache of decompressed units. Each unit is held by the
+ * shard its location and index hash to.
+ */
+typedef struct compression_shard
+{
+	/**
+	 * Protects every field of the shard and the units it holds.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The buckets of the shard, each a chain of units.
+	 */
+	CachedUnit** buckets;
+
+	/**
+	 * The number of entries in buckets. Always a power of two.
+	 */
+	size_t numBuckets;
+
+	/**
+	 * The most recently used unit.
+	 */
+	CachedUnit* newest;
+
+	/**
+	 * The least recently used unit, which is the first to be evicted.
+	 */
+	CachedUnit* oldest;
+
+	/**
+	 * The number of units held.
+	 */
+	size_t numUnits;
+
+	/**
+	 * The number of units held before the least recently used is evicted.
+	 */
+	size_t capacity;
+
+} CompressionShard;
+
+/**
+ * Settings for compressing data as it is allocated, and the cache of
+ * decompressed units shared by every reader.
+ */
+typedef struct compression
+{
+	/**
+	 * Set to compress data when it is allocated. Compressed fragments are
+	 * read whether or not this is set.
+	 */
+	bool enabled;
+
+	/**
+	 * The zlib compression level, from 1 to 9.
+	 */
+	int level;
+
+	/**
+	 * The largest number of threads compressing the units of a single
+	 * flush.
+	 */
+	unsigned int threads;
+
+	/**
+	 * The parts of the cache of decompressed units.
+	 */
+	CompressionShard shards[COMPRESSION_CACHE_SHARDS];
+
+} Compression;
+
+/**
+ * Initializes the cache of decompressed units.
+ *
+ * @param state The current filesystem state
+ * @param cacheSize The number of bytes of decompressed data to keep
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool compressionInit(struct efs_state* state, uint64_t cacheSize);
+
+/**
+ * Deallocates the cache of decompressed units.
+ *
+ * @param state The current filesystem state
+ */
+void compressionDestroy(struct efs_state* state);
+
+/**
+ * Compresses whole units from the start of some data, and adds them to
+ * the end of a file as a single compressed fragment. Nothing is written
+ * if compression would not save enough space. Must be called with the
+ * file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file to add the data to
+ * @param data The data to compress, which must start at the first byte of
+ * the first page not allocated to the file
+ * @param size The number of bytes of data
+ *
+ * @returns The number of bytes from the start of data which were written,
+ * a multiple of \link COMPRESSION_UNIT_SIZE \endlink. 0 if nothing was.
+ */
+uint64_t compressionWrite(struct efs_state* state, FileTableNode* file,
+	const char* data, uint64_t size);
+
+/**
+ * Reads bytes from a compressed fragment, through the cache of
+ * decompressed units. Must be called with the lock of the file holding
+ * the fragment held.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment to read from
+ * @param offset The offset of the first byte within the fragment
+ * @param size The number of bytes to read. Must not extend past the end
+ * of the fragment.
+ * @param buffer The location to read into
+ *
+ * @returns true upon success, false if the fragment could not be read or
+ * is corrupt.
+ */
+bool compressionRead(struct efs_state* state,
+	const EFSFragmentDescriptor* fragment, uint64_t offset, uint64_t size,
+	char* buffer);
+
+/**
+ * Rewrites a compressed fragment of a file uncompressed, so that it can
+ * be written to. Must be called with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file holding the fragment
+ * @param index The index of the fragment within the file
+ * @param error Set upon failure to ENOSPC if there is no free region
+ * large enough, EIO if the fragment could not be read or written, or
+ * ENOMEM.
+ *
+ * @returns true upon success, false otherwise.
+ */
+bool compressionExpand(struct efs_state* state, FileTableNode* file,
+	uint64_t index, int* error);
+
+/**
+ * Drops every cached unit of a compressed fragment, which is about to be
+ * released.
+ *
+ * @param state The current filesystem state
+ * @param location The first page of the fragment
+ */
+void compressionForget(struct efs_state* state, uint64_t location);
+
+#endif
@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+
+#include "dedup.h"
+#include "allocation_groups.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "delayed_allocation.h"
+#include "efsstate.h"
+#include "image_io.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The number of buckets each table starts with.
+ */
+#define DEDUP_INITIAL_BUCKETS 1024
+
+/**
+ * The number of pages read at a time while extents are hashed and
+ * compared.
+ */
+#define DEDUP_CHUNK_PAGES 64
+
+static size_t locationBucket(Dedup* dedup, uint64_t location)
+{
+	return (location * 0x9E3779B97F4A7C15ULL >> 32) & (dedup->numBuckets - 1);
+}
+
+static size_t contentBucket(Dedup* dedup, uint32_t sum, uint64_t pages)
+{
+	return (sum ^ pages * 0x9E3779B1U) & (dedup->numBuckets - 1);
+}
+
+/**
+ * Finds the extent starting at a page. Must be called with the lock held.
+ */
+static DedupExtent* findExtent(Dedup* dedup, uint64_t location)
+{
+	DedupExtent* extent = dedup->byLocation[locationBucket(dedup, location)];
+	while(extent != NULL && extent->location != location)
+	{
+		extent = extent->nextByLocation;
+	}
+	return extent;
+}
+
+/**
+ * Doubles the number of buckets once the tables hold more extents than
+ * they have buckets. If the new buckets cannot be allocated, the tables
+ * keep working with longer chains.
+ */
+static void growBuckets(Dedup* dedup)
+{
+	size_t oldBuckets = dedup->numBuckets;
+	DedupExtent** byLocation = calloc(oldBuckets * 2, sizeof(DedupExtent*));
+	DedupExtent** byContent = calloc(oldBuckets * 2, sizeof(DedupExtent*));
+	if(byLocation == NULL || byContent == NULL)
+	{
+		free(byLocation);
+		free(byContent);
+		return;
+	}
+	DedupExtent** oldLocations = dedup->byLocation;
+	DedupExtent** oldContents = dedup->byContent;
+	dedup->byLocation = byLocation;
+	dedup->byContent = byContent;
+	dedup->numBuckets = oldBuckets * 2;
+	for(size_t i = 0; i < oldBuckets; i++)
+	{
+		DedupExtent* extent = oldLocations[i];
+		while(extent != NULL)
+		{
+			DedupExtent* next = extent->nextByLocation;
+			size_t bucket = locationBucket(dedup, extent->location);
+			extent->nextByLocation = byLocation[bucket];
+			byLocation[bucket] = extent;
+			extent = next;
+		}
+		extent = oldContents[i];
+		while(extent != NULL)
+		{
+			DedupExtent* next = extent->nextByContent;
+			size_t bucket = contentBucket(dedup, extent->sum, extent->pages);
+			extent->nextByContent = byContent[bucket];
+			byContent[bucket] = extent;
+			extent = next;
+		}
+	}
+	free(oldLocations);
+	free(oldContents);
+}
+
+/**
+ * Adds an extent to the table of locations. Must be called with the lock
+ * held.
+ */
+static DedupExtent* addExtent(Dedup* dedup, uint64_t location, uint64_t pages)
+{
+	DedupExtent* extent = calloc(1, sizeof(DedupExtent));
+	if(extent == NULL)
+	{
+		return NULL;
+	}
+	extent->location = location;
+	extent->pages = pages;
+	extent->references = 1;
+	size_t bucket = locationBucket(dedup, location);
+	extent->nextByLocation = dedup->byLocation[bucket];
+	dedup->byLocation[bucket] = extent;
+	__atomic_store_n(&dedup->numExtents, dedup->numExtents + 1, __ATOMIC_RELAXED);
+	if(dedup->numExtents > dedup->numBuckets)
+	{
+		growBuckets(dedup);
+	}
+	return extent;
+}
+
+/**
+ * Removes an extent from the index of contents. Must be called with the
+ * lock held.
+ */
+static void unindexExtent(Dedup* dedup, DedupExtent* extent)
+{
+	if(!extent->indexed)
+	{
+		return;
+	}
+	DedupExtent** link = &dedup->byContent[contentBucket(dedup, extent->sum, extent->pages)];
+	while(*link != extent)
+	{
+		link = &(*link)->nextByContent;
+	}
+	*link = extent->nextByContent;
+	extent->indexed = false;
+}
+
+/**
+ * Removes an extent from both tables and deallocates it. Must be called
+ * with the lock held.
+ */
+static void removeExtent(Dedup* dedup, DedupExtent* extent)
+{
+	unindexExtent(dedup, extent);
+	DedupExtent** link = &dedup->byLocation[locationBucket(dedup, extent->location)];
+	while(*link != extent)
+	{
+		link = &(*link)->nextByLocation;
+	}
+	*link = extent->nextByLocation;
+	__atomic_store_n(&dedup->numExtents, dedup->numExtents - 1, __ATOMIC_RELAXED);
+	free(extent);
+}
+
+/**
+ * Checks whether the table of locations is empty, without taking the
+ * lock, so that images without shared extents pay nothing for them.
+ */
+static bool isEmpty(Dedup* dedup)
+{
+	return __atomic_load_n(&dedup->numExtents, __ATOMIC_RELAXED) == 0;
+}
+
+bool dedupInit(EFSState* state)
+{
+	Dedup* dedup = &state->dedup;
+	pthread_mutex_init(&dedup->lock, NULL);
+	dedup->byLocation = calloc(DEDUP_INITIAL_BUCKETS, sizeof(DedupExtent*));
+	dedup->byContent = calloc(DEDUP_INITIAL_BUCKETS, sizeof(DedupExtent*));
+	dedup->numBuckets = DEDUP_INITIAL_BUCKETS;
+	dedup->numExtents = 0;
+	dedup->nextSerial = 1;
+	if(dedup->byLocation == NULL || dedup->byContent == NULL)
+	{
+		dedupDestroy(state);
+		return false;
+	}
+
+	/*
+	 * Every extent is counted, and those referred to by only one fragment
+	 * are then dropped again.
+	 */
+	for(FileTableNode* node = state->fileTable->head->next; node != NULL; node = node->next)
+	{
+		EFSCompactFileDescriptor* descriptor = node->fileDescriptor;
+		for(uint64_t i = 0; i < descriptor->numFragments; i++)
+		{
+			EFSFragmentDescriptor* fragment = &descriptor->fragments[i];
+			if(fragmentIsCompressed(fragment))
+			{
+				continue;
+			}
+			DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+			if(extent == NULL && addExtent(dedup, fragment->fragmentLocation, fragment->fragmentSize) == NULL)
+			{
+				dedupDestroy(state);
+				return false;
+			}
+			else if(extent != NULL)
+			{
+				extent->references++;
+				if(fragment->fragmentSize > extent->pages)
+				{
+					extent->pages = fragment->fragmentSize;
+				}
+			}
+		}
+	}
+	uint64_t shared = 0;
+	for(size_t i = 0; i < dedup->numBuckets; i++)
+	{
+		DedupExtent* extent = dedup->byLocation[i];
+		while(extent != NULL)
+		{
+			DedupExtent* next = extent->nextByLocation;
+			if(extent->references == 1)
+			{
+				removeExtent(dedup, extent);
+			}
+			else
+			{
+				atomic_fetch_add(&state->stats.dedupPagesSaved, (extent->references - 1) * extent->pages);
+				shared++;
+			}
+			extent = next;
+		}
+	}
+	for(FileTableNode* node = state->fileTable->head->next; node != NULL && shared > 0; node = node->next)
+	{
+		EFSCompactFileDescriptor* descriptor = node->fileDescriptor;
+		for(uint64_t i = 0; i < descriptor->numFragments && !node->deduplicated; i++)
+		{
+			node->deduplicated = !fragmentIsCompressed(&descriptor->fragments[i])
+				&& findExtent(dedup, descriptor->fragments[i].fragmentLocation) != NULL;
+		}
+	}
+	if(shared > 0)
+	{
+		printf("Found %" PRIu64 " extents shared between files.\n", shared);
+	}
+	return true;
+}
+
+void dedupDestroy(EFSState* state)
+{
+	Dedup* dedup = &state->dedup;
+	for(size_t i = 0; dedup->byLocation != NULL && i < dedup->numBuckets; i++)
+	{
+		DedupExtent* extent = dedup->byLocation[i];
+		while(extent != NULL)
+		{
+			DedupExtent* next = extent->nextByLocation;
+			free(extent);
+			extent = next;
+		}
+	}
+	free(dedup->byLocation);
+	free(dedup->byContent);
+	dedup->byLocation = NULL;
+	dedup->byContent = NULL;
+	dedup->numExtents = 0;
+}
+
+/**
+ * Finds an indexed extent other than the one at exclude with the given
+ * checksum and length.
+ *
+ * @returns true if one was found, in which case its location and serial
+ * are set.
+ */
+static bool findCandidate(Dedup* dedup, uint32_t sum, uint64_t pages,
+	uint64_t exclude, uint64_t* location, uint64_t* serial)
+{
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = dedup->byContent[contentBucket(dedup, sum, pages)];
+	while(extent != NULL
+		&& (extent->sum != sum || extent->pages != pages || extent->location == exclude))
+	{
+		extent = extent->nextByContent;
+	}
+	if(extent != NULL)
+	{
+		*location = extent->location;
+		*serial = extent->serial;
+	}
+	pthread_mutex_unlock(&dedup->lock);
+	return extent != NULL;
+}
+
+/**
+ * Takes a reference to an extent found by \link findCandidate \endlink,
+ * provided it has not been changed or removed since.
+ */
+static bool takeReference(EFSState* state, uint64_t location, uint64_t serial)
+{
+	Dedup* dedup = &state->dedup;
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = findExtent(dedup, location);
+	bool taken = extent != NULL && extent->indexed && extent->serial == serial;
+	if(taken)
+	{
+		extent->references++;
+		atomic_fetch_add(&state->stats.dedupPagesSaved, extent->pages);
+		atomic_fetch_add(&state->stats.dedupFragmentsShared, 1);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+	return taken;
+}
+
+/**
+ * Compares pages of the image with data in memory, or with other pages of
+ * the image if data is NULL.
+ */
+static bool compareExtent(EFSState* state, uint64_t location, const char* data,
+	uint64_t other, uint64_t pages)
+{
+	char* buffer = malloc(2 * DEDUP_CHUNK_PAGES * PAGE_SIZE);
+	bool equal = buffer != NULL;
+	for(uint64_t page = 0; equal && page < pages; page += DEDUP_CHUNK_PAGES)
+	{
+		uint64_t length = (pages - page < DEDUP_CHUNK_PAGES ? pages - page : DEDUP_CHUNK_PAGES) * PAGE_SIZE;
+		char* expected = buffer + DEDUP_CHUNK_PAGES * PAGE_SIZE;
+		if(data != NULL)
+		{
+			expected = (char*) data + page * PAGE_SIZE;
+		}
+		else if(!imageRead(state, expected, length, (other + page) * PAGE_SIZE))
+		{
+			equal = false;
+			break;
+		}
+		equal = imageRead(state, buffer, length, (location + page) * PAGE_SIZE)
+			&& memcmp(buffer, expected, length) == 0;
+	}
+	free(buffer);
+	return equal;
+}
+
+uint64_t dedupFind(EFSState* state, const char* data, uint64_t pages,
+	uint32_t sum)
+{
+	uint64_t location;
+	uint64_t serial;
+	if(!findCandidate(&state->dedup, sum, pages, 0, &location, &serial))
+	{
+		return 0;
+	}
+	/*
+	 * The candidate is compared without the lock held. It is removed
+	 * from the index before it is changed in place, so if it is still
+	 * indexed with the same serial afterwards, it still holds the data.
+	 */
+	if(!compareExtent(state, location, data, 0, pages))
+	{
+		atomic_fetch_add(&state->stats.dedupCollisions, 1);
+		return 0;
+	}
+	return takeReference(state, location, serial) ? location : 0;
+}
+
+void dedupIndex(EFSState* state, FileTableNode* file,
+	const EFSFragmentDescriptor* fragment, uint32_t sum)
+{
+	Dedup* dedup = &state->dedup;
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+	if(extent == NULL)
+	{
+		extent = addExtent(dedup, fragment->fragmentLocation, fragment->fragmentSize);
+	}
+	if(extent != NULL && !extent->indexed)
+	{
+		extent->sum = sum;
+		extent->serial = dedup->nextSerial++;
+		extent->indexed = true;
+		size_t bucket = contentBucket(dedup, sum, extent->pages);
+		extent->nextByContent = dedup->byContent[bucket];
+		dedup->byContent[bucket] = extent;
+		file->deduplicated = true;
+		atomic_fetch_add(&state->stats.dedupExtentsIndexed, 1);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+}
+
+bool dedupShared(EFSState* state, const EFSFragmentDescriptor* fragment)
+{
+	Dedup* dedup = &state->dedup;
+	if(isEmpty(dedup) || fragmentIsCompressed(fragment))
+	{
+		return false;
+	}
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+	bool shared = extent != NULL && extent->references > 1;
+	pthread_mutex_unlock(&dedup->lock);
+	return shared;
+}
+
+bool dedupShare(EFSState* state, const EFSFragmentDescriptor* fragment)
+{
+	Dedup* dedup = &state->dedup;
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+	if(extent == NULL)
+	{
+		extent = addExtent(dedup, fragment->fragmentLocation, fragment->fragmentSize);
+	}
+	if(extent != NULL)
+	{
+		extent->references++;
+		atomic_fetch_add(&state->stats.dedupPagesSaved, extent->pages);
+		atomic_fetch_add(&state->stats.dedupFragmentsShared, 1);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+	return extent != NULL;
+}
+
+bool dedupModify(EFSState* state, const EFSFragmentDescriptor* fragment)
+{
+	Dedup* dedup = &state->dedup;
+	if(isEmpty(dedup) || fragmentIsCompressed(fragment))
+	{
+		return true;
+	}
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+	bool unshared = extent == NULL || extent->references == 1;
+	uint64_t excess = 0;
+	if(extent != NULL && unshared)
+	{
+		/*
+		 * Pages past the end of a fragment truncated while it was shared
+		 * are no longer used by anything once the extent is forgotten.
+		 */
+		excess = extent->pages - fragment->fragmentSize;
+		removeExtent(dedup, extent);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+	if(excess > 0)
+	{
+		allocationGroupsRelease(&state->allocationGroups,
+			fragment->fragmentLocation + fragment->fragmentSize, excess);
+	}
+	return unshared;
+}
+
+bool dedupBreak(EFSState* state, FileTableNode* file, uint64_t index,
+	int* error)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	EFSFragmentDescriptor old = descriptor->fragments[index];
+	uint64_t pages = old.fragmentSize;
+	char* buffer = malloc(DEDUP_CHUNK_PAGES * PAGE_SIZE);
+	if(buffer == NULL)
+	{
+		*error = ENOMEM;
+		return false;
+	}
+	uint64_t location = allocatorReserve(state, descriptor, pages);
+	if(location == 0)
+	{
+		printf("\tNo space to copy shared data of inode %" PRIu64 ".\n", descriptor->fileID);
+		*error = ENOSPC;
+		free(buffer);
+		return false;
+	}
+	bool success = true;
+	for(uint64_t page = 0; success && page < pages; page += DEDUP_CHUNK_PAGES)
+	{
+		uint64_t length = (pages - page < DEDUP_CHUNK_PAGES ? pages - page : DEDUP_CHUNK_PAGES) * PAGE_SIZE;
+		success = imageRead(state, buffer, length, (old.fragmentLocation + page) * PAGE_SIZE)
+			&& imageWrite(state, buffer, length, (location + page) * PAGE_SIZE);
+	}
+	free(buffer);
+	EFSFragmentDescriptor fragment = { location, pages };
+	if(success)
+	{
+		checksumCopy(state, old.fragmentLocation, location, pages);
+	}
+	if(!success || !allocatorReplace(state, file, index, &fragment))
+	{
+		*error = success ? ENOMEM : EIO;
+		allocationGroupsRelease(&state->allocationGroups, location, pages);
+		return false;
+	}
+	atomic_fetch_add(&state->stats.dedupCopies, 1);
+	return true;
+}
+
+uint64_t dedupRelease(EFSState* state, const EFSFragmentDescriptor* fragment)
+{
+	Dedup* dedup = &state->dedup;
+	if(isEmpty(dedup))
+	{
+		return fragment->fragmentSize;
+	}
+	pthread_mutex_lock(&dedup->lock);
+	uint64_t pages = fragment->fragmentSize;
+	DedupExtent* extent = findExtent(dedup, fragment->fragmentLocation);
+	if(extent != NULL && extent->references > 1)
+	{
+		extent->references--;
+		atomic_fetch_sub(&state->stats.dedupPagesSaved, extent->pages);
+		pages = 0;
+	}
+	else if(extent != NULL)
+	{
+		/*
+		 * A fragment truncated while it was shared covers fewer pages
+		 * than the extent, so the extent's length is what is freed.
+		 */
+		pages = extent->pages;
+		removeExtent(dedup, extent);
+	}
+	pthread_mutex_unlock(&dedup->lock);
+	return pages;
+}
+
+/**
+ * Computes the CRC32C of pages of the image.
+ */
+static bool hashExtent(EFSState* state, uint64_t location, uint64_t pages,
+	uint32_t* sum)
+{
+	char* buffer = malloc(DEDUP_CHUNK_PAGES * PAGE_SIZE);
+	bool success = buffer != NULL;
+	uint32_t crc = 0;
+	for(uint64_t page = 0; success && page < pages; page += DEDUP_CHUNK_PAGES)
+	{
+		uint64_t length = (pages - page < DEDUP_CHUNK_PAGES ? pages - page : DEDUP_CHUNK_PAGES) * PAGE_SIZE;
+		success = imageRead(state, buffer, length, (location + page) * PAGE_SIZE);
+		crc = crc32c(crc, buffer, length);
+		atomic_fetch_add(&state->stats.dedupBytesScanned, length);
+	}
+	free(buffer);
+	*sum = crc;
+	return success;
+}
+
+/**
+ * The outcome of scanning one fragment of a file.
+ */
+typedef enum scan_result
+{
+	SCAN_DONE,
+	SCAN_SKIPPED,
+	SCAN_SHARED,
+} ScanResult;
+
+/**
+ * Shares or indexes one fragment of a file.
+ */
+static ScanResult scanFragment(EFSState* state, uint64_t inode, uint64_t index)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, inode);
+	if(file == NULL)
+	{
+		return SCAN_DONE;
+	}
+	pthread_rwlock_rdlock(&file->lock);
+	PendingData* pending = delayedAllocationGet(state, file);
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	if(pending == NULL || index >= descriptor->numFragments)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		return SCAN_DONE;
+	}
+	EFSFragmentDescriptor fragment = descriptor->fragments[index];
+	uint64_t generation = pending->generation;
+	uint64_t extentGeneration = file->extentGeneration;
+	pthread_rwlock_unlock(&file->lock);
+
+	Dedup* dedup = &state->dedup;
+	pthread_mutex_lock(&dedup->lock);
+	DedupExtent* tracked = findExtent(dedup, fragment.fragmentLocation);
+	bool skip = fragmentIsCompressed(&fragment)
+		|| (tracked != NULL && (tracked->indexed || tracked->pages != fragment.fragmentSize));
+	pthread_mutex_unlock(&dedup->lock);
+	uint32_t sum;
+	if(skip || !hashExtent(state, fragment.fragmentLocation, fragment.fragmentSize, &sum))
+	{
+		return SCAN_SKIPPED;
+	}
+	uint64_t location;
+	uint64_t serial;
+	bool match = findCandidate(dedup, sum, fragment.fragmentSize, fragment.fragmentLocation, &location, &serial);
+	if(match && !compareExtent(state, location, NULL, fragment.fragmentLocation, fragment.fragmentSize))
+	{
+		atomic_fetch_add(&state->stats.dedupCollisions, 1);
+		match = false;
+	}
+
+	ScanResult result = SCAN_SKIPPED;
+	pthread_rwlock_wrlock(&file->lock);
+	bool unchanged = __atomic_load_n(&file->table, __ATOMIC_ACQUIRE) != NULL
+		&& file->pending == pending
+		&& pending->generation == generation
+		&& file->extentGeneration == extentGeneration;
+	if(unchanged && match && takeReference(state, location, serial))
+	{
+		EFSFragmentDescriptor shared = { location, fragment.fragmentSize };
+		if(allocatorReplace(state, file, index, &shared))
+		{
+			file->deduplicated = true;
+			pending->generation++;
+			result = SCAN_SHARED;
+		}
+		else
+		{
+			dedupRelease(state, &shared);
+		}
+	}
+	else if(unchanged && !match)
+	{
+		dedupIndex(state, file, &fragment, sum);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return result;
+}
+
+uint64_t dedupScanFile(EFSState* state, uint64_t inode)
+{
+	uint64_t shared = 0;
+	ScanResult result;
+	for(uint64_t index = 0; (result = scanFragment(state, inode, index)) != SCAN_DONE; index++)
+	{
+		shared += result == SCAN_SHARED;
+	}
+	return shared;
+}
+
+static void* dedupThread(void* data)
+{
+	EFSState* state = data;
+	Dedup* dedup = &state->dedup;
+	struct sched_param parameters = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+
+	pthread_mutex_lock(&state->metadataLock);
+	size_t numFiles = 0;
+	uint64_t* inodes = malloc(sizeof(uint64_t) * (state->fileTable->size + 1));
+	for(FileTableNode* node = state->fileTable->head->next; inodes != NULL && node != NULL; node = node->next)
+	{
+		if(__atomic_load_n(&node->fileDescriptor->numFragments, __ATOMIC_RELAXED) > 0)
+		{
+			inodes[numFiles++] = node->fileDescriptor->fileID;
+		}
+	}
+	pthread_mutex_unlock(&state->metadataLock);
+
+	uint64_t shared = 0;
+	size_t scanned = 0;
+	for(; scanned < numFiles && __atomic_load_n(&dedup->running, __ATOMIC_ACQUIRE); scanned++)
+	{
+		shared += dedupScanFile(state, inodes[scanned]);
+	}
+	printf("Deduplication scan of %zu files shared %" PRIu64 " fragments.\n", scanned, shared);
+	free(inodes);
+	return NULL;
+}
+
+bool dedupStart(EFSState* state)
+{
+	Dedup* dedup = &state->dedup;
+	dedup->running = true;
+	if(pthread_create(&dedup->thread, NULL, dedupThread, state) != 0)
+	{
+		dedup->running = false;
+		return false;
+	}
+	return true;
+}
+
+void dedupStop(EFSState* state)
+{
+	Dedup* dedup = &state->dedup;
+	if(!dedup->running)
+	{
+		return;
+	}
+	__atomic_store_n(&dedup->running, false, __ATOMIC_RELEASE);
+	pthread_join(dedup->thread, NULL);
+}
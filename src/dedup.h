@@ -0,0 +1,261 @@
+#ifndef __EFSFUSE_DEDUP
+#define __EFSFUSE_DEDUP
+
+#include <EFS/file_descriptor.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct efs_state;
+struct file_table_node;
+
+/**
+ * An extent of the image which is shared by several fragments, or whose
+ * contents are indexed so that it can be shared by fragments written
+ * later. Every fragment sharing an extent covers all of its pages.
+ */
+typedef struct dedup_extent
+{
+	/**
+	 * The first page of the extent.
+	 */
+	uint64_t location;
+
+	/**
+	 * The number of pages in the extent.
+	 */
+	uint64_t pages;
+
+	/**
+	 * The number of fragments referring to the extent.
+	 */
+	uint64_t references;
+
+	/**
+	 * Distinguishes this extent from any other indexed at the same
+	 * location, so that a match found without the lock held can be
+	 * checked once it is retaken.
+	 */
+	uint64_t serial;
+
+	/**
+	 * The CRC32C of the contents of the extent, if it is indexed.
+	 */
+	uint32_t sum;
+
+	/**
+	 * Set if the extent can be found by its contents. Cleared before the
+	 * extent is changed in place.
+	 */
+	bool indexed;
+
+	/**
+	 * The next extent in the same bucket of the table of locations.
+	 */
+	struct dedup_extent* nextByLocation;
+
+	/**
+	 * The next extent in the same bucket of the table of contents.
+	 */
+	struct dedup_extent* nextByContent;
+
+} DedupExtent;
+
+/**
+ * The extents shared by several fragments, with their reference counts,
+ * and an index of extents by contents so that identical data can be
+ * stored once. References are not stored in the image. They are counted
+ * from the fragments of every file at mount, and the index is rebuilt by
+ * the background scan.
+ */
+typedef struct dedup
+{
+	/**
+	 * Set to share extents as they are written, and to scan existing
+	 * files for identical extents.
+	 */
+	bool enabled;
+
+	/**
+	 * Held while the tables are used. Taken after the lock of any file,
+	 * and never held while another lock is taken.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The buckets of the table of extents by location.
+	 */
+	DedupExtent** byLocation;
+
+	/**
+	 * The buckets of the table of indexed extents by contents.
+	 */
+	DedupExtent** byContent;
+
+	/**
+	 * The number of buckets in each table. Always a power of two.
+	 */
+	size_t numBuckets;
+
+	/**
+	 * The number of extents in the table of locations.
+	 */
+	size_t numExtents;
+
+	/**
+	 * The serial given to the next extent indexed.
+	 */
+	uint64_t nextSerial;
+
+	/**
+	 * The thread scanning existing files for identical extents.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Cleared to ask the scan thread to exit.
+	 */
+	bool running;
+
+} Dedup;
+
+/**
+ * Builds the table of shared extents by counting the fragments of every
+ * file referring to each extent. Must be called after the file table has
+ * been read, and before any file is changed.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool dedupInit(struct efs_state* state);
+
+/**
+ * Deallocates the table of shared extents.
+ *
+ * @param state The current filesystem state
+ */
+void dedupDestroy(struct efs_state* state);
+
+/**
+ * Starts a thread which scans every existing file once, sharing extents
+ * identical to ones already seen and indexing the rest.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if the thread could not be created.
+ */
+bool dedupStart(struct efs_state* state);
+
+/**
+ * Stops the scan thread, if it is still running.
+ *
+ * @param state The current filesystem state
+ */
+void dedupStop(struct efs_state* state);
+
+/**
+ * Finds an indexed extent holding exactly the specified data, and takes a
+ * reference to it. Candidates with the same checksum are compared byte
+ * for byte with the image.
+ *
+ * @param state The current filesystem state
+ * @param data The data to find, a whole number of pages
+ * @param pages The number of pages of data
+ * @param sum The CRC32C of the data
+ *
+ * @returns The first page of the extent, or 0 if no extent holds the data.
+ */
+uint64_t dedupFind(struct efs_state* state, const char* data, uint64_t pages,
+	uint32_t sum);
+
+/**
+ * Indexes the only fragment of a file by its contents, so that identical
+ * data written later can share it. Must be called with the file's lock
+ * held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file owning the fragment
+ * @param fragment The fragment, which must not be compressed
+ * @param sum The CRC32C of the fragment's data
+ */
+void dedupIndex(struct efs_state* state, struct file_table_node* file,
+	const EFSFragmentDescriptor* fragment, uint32_t sum);
+
+/**
+ * Checks whether a fragment shares its extent with another fragment.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment to check
+ *
+ * @returns true if it does, otherwise false.
+ */
+bool dedupShared(struct efs_state* state, const EFSFragmentDescriptor* fragment);
+
+/**
+ * Takes another reference to the extent of a fragment, so that a fragment
+ * of another file can refer to the same pages. Must be called with the
+ * lock of the file owning the fragment held for writing.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment to share, which must not be compressed
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool dedupShare(struct efs_state* state, const EFSFragmentDescriptor* fragment);
+
+/**
+ * Prepares a fragment to be changed in place, by removing it from the
+ * index so that no fragment written later shares it.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment about to be changed
+ *
+ * @returns true if the fragment can be changed in place, false if it is
+ * shared and must first be copied with \link dedupBreak \endlink.
+ */
+bool dedupModify(struct efs_state* state, const EFSFragmentDescriptor* fragment);
+
+/**
+ * Gives a fragment of a file its own copy of an extent it shares, so that
+ * the file can be changed without changing the others. Must be called
+ * with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file owning the fragment
+ * @param index The index of the fragment to copy
+ * @param error Set upon failure to ENOSPC if there is not enough free
+ * space, EIO if an I/O error occurred, or ENOMEM.
+ *
+ * @returns true upon success, false otherwise.
+ */
+bool dedupBreak(struct efs_state* state, struct file_table_node* file,
+	uint64_t index, int* error);
+
+/**
+ * Drops the reference of a fragment which is being released.
+ *
+ * @param state The current filesystem state
+ * @param fragment The fragment being released, which must not be
+ * compressed
+ *
+ * @returns The number of pages from the start of the fragment which
+ * should be returned to free space. 0 if other fragments still refer to
+ * them.
+ */
+uint64_t dedupRelease(struct efs_state* state, const EFSFragmentDescriptor* fragment);
+
+/**
+ * Shares every extent of a file identical to an extent already indexed,
+ * and indexes the rest. Extents are read without holding the file's lock,
+ * and the file is only changed if it has not been written meanwhile.
+ *
+ * @param state The current filesystem state
+ * @param inode The file to scan
+ *
+ * @returns The number of fragments of the file which were shared.
+ */
+uint64_t dedupScanFile(struct efs_state* state, uint64_t inode);
+
+#endif
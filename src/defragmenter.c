@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+
+#include "defragmenter.h"
+#include "allocation_groups.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "delayed_allocation.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "writeback.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The number of pages copied by each read and write while relocating a
+ * file.
+ */
+#define DEFRAG_CHUNK_PAGES 64
+
+/**
+ * A file found to have too many fragments during a pass.
+ */
+typedef struct defrag_candidate
+{
+	uint64_t inode;
+	uint64_t numFragments;
+} DefragCandidate;
+
+static bool isRunning(Defragmenter* defragmenter)
+{
+	return __atomic_load_n(&defragmenter->running, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Adds a number of milliseconds to the current time.
+ */
+static void deadlineAfter(struct timespec* deadline, uint64_t milliseconds)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += milliseconds / 1000;
+	deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+	if(deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * Sleeps for the specified time, or until the thread is asked to exit.
+ *
+ * @returns true if the thread should keep running.
+ */
+static bool defragmenterSleep(Defragmenter* defragmenter,
+	uint64_t milliseconds)
+{
+	struct timespec deadline;
+	deadlineAfter(&deadline, milliseconds);
+	pthread_mutex_lock(&defragmenter->lock);
+	while(defragmenter->running)
+	{
+		if(pthread_cond_timedwait(&defragmenter->wake, &defragmenter->lock, &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	bool running = defragmenter->running;
+	pthread_mutex_unlock(&defragmenter->lock);
+	return running;
+}
+
+/**
+ * Sleeps for long enough that copying the specified number of bytes since
+ * start does not exceed the configured bandwidth.
+ *
+ * @returns true if the thread should keep running.
+ */
+static bool throttle(Defragmenter* defragmenter, uint64_t bytes,
+	const struct timespec* start)
+{
+	if(defragmenter->bandwidth == 0)
+	{
+		return isRunning(defragmenter);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t elapsed = (now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+	uint64_t allowed = bytes / 1024 * 1000 / defragmenter->bandwidth;
+	if(allowed > elapsed)
+	{
+		return defragmenterSleep(defragmenter, allowed - elapsed);
+	}
+	return isRunning(defragmenter);
+}
+
+/**
+ * Copies every page of the specified fragments, in order, to a region
+ * starting at the given page.
+ */
+static bool copyFragments(EFSState* state, EFSFragmentDescriptor* fragments,
+	uint64_t numFragments, uint64_t location)
+{
+	Defragmenter* defragmenter = &state->defragmenter;
+	char* buffer = malloc(DEFRAG_CHUNK_PAGES * PAGE_SIZE);
+	if(buffer == NULL)
+	{
+		return false;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t copied = 0;
+	bool success = true;
+	for(uint64_t i = 0; success && i < numFragments; i++)
+	{
+		for(uint64_t page = 0; success && page < fragments[i].fragmentSize; page += DEFRAG_CHUNK_PAGES)
+		{
+			uint64_t pages = fragments[i].fragmentSize - page;
+			if(pages > DEFRAG_CHUNK_PAGES)
+			{
+				pages = DEFRAG_CHUNK_PAGES;
+			}
+			success = imageRead(state, buffer, pages * PAGE_SIZE,
+					(fragments[i].fragmentLocation + page) * PAGE_SIZE)
+				&& imageWrite(state, buffer, pages * PAGE_SIZE, location * PAGE_SIZE + copied)
+				&& throttle(defragmenter, copied + pages * PAGE_SIZE, &start);
+			copied += pages * PAGE_SIZE;
+			atomic_fetch_add(&state->stats.defragBytesCopied, pages * PAGE_SIZE);
+		}
+	}
+	free(buffer);
+	return success;
+}
+
+bool defragmenterRelocate(EFSState* state, uint64_t inode)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, inode);
+	if(file == NULL)
+	{
+		return false;
+	}
+	pthread_rwlock_rdlock(&file->lock);
+	PendingData* pending = delayedAllocationGet(state, file);
+	if(pending == NULL)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		return false;
+	}
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t numFragments = descriptor->numFragments;
+	uint64_t pages = allocatedPages(descriptor);
+	uint64_t generation = pending->generation;
+	EFSFragmentDescriptor* oldFragments = malloc(sizeof(EFSFragmentDescriptor) * numFragments);
+	/*
+	 * The new array keeps as many entries as the old count, so that a
+	 * concurrent reader of the old count stays within it.
+	 */
+	EFSFragmentDescriptor* newFragments = calloc(numFragments, sizeof(EFSFragmentDescriptor));
+	/*
+	 * Compressed fragments cannot be merged with their neighbours, and
+	 * moving a shared fragment would undo the sharing, so files holding
+	 * either are left as they are.
+	 */
+	bool movable = true;
+	for(uint64_t i = 0; i < numFragments; i++)
+	{
+		movable = movable && !fragmentIsCompressed(&descriptor->fragments[i])
+			&& !dedupShared(state, &descriptor->fragments[i]);
+	}
+	uint64_t location = 0;
+	if(numFragments > 1 && movable && oldFragments != NULL && newFragments != NULL)
+	{
+		memcpy(oldFragments, descriptor->fragments, sizeof(EFSFragmentDescriptor) * numFragments);
+		location = allocationGroupsAllocate(&state->allocationGroups,
+			allocationGroupOf(&state->allocationGroups, oldFragments[0].fragmentLocation), pages);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	if(location == 0)
+	{
+		free(oldFragments);
+		free(newFragments);
+		return false;
+	}
+
+	/*
+	 * The copy is made without holding any lock, so the file can still
+	 * be read and written. The new region must reach the disk before any
+	 * descriptor pointing to it can.
+	 */
+	bool copied = copyFragments(state, oldFragments, numFragments, location)
+		&& imageSync(state);
+
+	pthread_rwlock_wrlock(&file->lock);
+	bool unchanged = copied
+		&& __atomic_load_n(&file->table, __ATOMIC_ACQUIRE) != NULL
+		&& file->pending == pending
+		&& pending->generation == generation;
+	if(unchanged)
+	{
+		newFragments[0].fragmentLocation = location;
+		newFragments[0].fragmentSize = pages;
+		allocatorPublish(state, descriptor, newFragments, 1);
+		file->extentGeneration++;
+		pending->generation++;
+		uint64_t page = location;
+		for(uint64_t i = 0; i < numFragments; i++)
+		{
+			checksumCopy(state, oldFragments[i].fragmentLocation, page, oldFragments[i].fragmentSize);
+			page += oldFragments[i].fragmentSize;
+		}
+		for(uint64_t i = 0; i < numFragments; i++)
+		{
+			allocatorRelease(state, &oldFragments[i]);
+		}
+		if(file->descriptorNode != NULL)
+		{
+			writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+		}
+		atomic_fetch_sub(&state->stats.fragments, numFragments - 1);
+		atomic_fetch_add(&state->stats.defragFragmentsReclaimed, numFragments - 1);
+		atomic_fetch_add(&state->stats.defragFilesRelocated, 1);
+	}
+	else
+	{
+		allocationGroupsRelease(&state->allocationGroups, location, pages);
+		free(newFragments);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	free(oldFragments);
+	return unchanged;
+}
+
+static int compareCandidates(const void* a, const void* b)
+{
+	uint64_t first = ((const DefragCandidate*) a)->numFragments;
+	uint64_t second = ((const DefragCandidate*) b)->numFragments;
+	return first < second ? 1 : first > second ? -1 : 0;
+}
+
+/**
+ * Relocates every file with at least the threshold number of fragments,
+ * most fragmented first.
+ */
+static void defragmenterPass(EFSState* state)
+{
+	Defragmenter* defragmenter = &state->defragmenter;
+	pthread_mutex_lock(&state->metadataLock);
+	size_t numCandidates = 0;
+	DefragCandidate* candidates = malloc(sizeof(DefragCandidate) * (state->fileTable->size + 1));
+	if(candidates == NULL)
+	{
+		pthread_mutex_unlock(&state->metadataLock);
+		return;
+	}
+	for(FileTableNode* node = state->fileTable->head->next; node != NULL; node = node->next)
+	{
+		uint64_t numFragments = __atomic_load_n(&node->fileDescriptor->numFragments, __ATOMIC_RELAXED);
+		if(numFragments >= defragmenter->threshold)
+		{
+			candidates[numCandidates].inode = node->fileDescriptor->fileID;
+			candidates[numCandidates].numFragments = numFragments;
+			numCandidates++;
+		}
+	}
+	pthread_mutex_unlock(&state->metadataLock);
+
+	qsort(candidates, numCandidates, sizeof(DefragCandidate), compareCandidates);
+	atomic_store(&state->stats.defragFilesPending, numCandidates);
+	for(size_t i = 0; i < numCandidates && isRunning(defragmenter); i++)
+	{
+		if(!defragmenterRelocate(state, candidates[i].inode))
+		{
+			printf("\tCould not defragment inode %" PRIu64 ".\n", candidates[i].inode);
+		}
+		atomic_fetch_sub(&state->stats.defragFilesPending, 1);
+	}
+	atomic_store(&state->stats.defragFilesPending, 0);
+	atomic_fetch_add(&state->stats.defragPasses, 1);
+	free(candidates);
+}
+
+static void* defragmenterThread(void* data)
+{
+	EFSState* state = data;
+	Defragmenter* defragmenter = &state->defragmenter;
+	struct sched_param parameters = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+	while(defragmenterSleep(defragmenter, (uint64_t) defragmenter->interval * 1000))
+	{
+		defragmenterPass(state);
+	}
+	return NULL;
+}
+
+bool defragmenterStart(EFSState* state)
+{
+	Defragmenter* defragmenter = &state->defragmenter;
+	pthread_mutex_init(&defragmenter->lock, NULL);
+	pthread_cond_init(&defragmenter->wake, NULL);
+	if(defragmenter->threshold < 2)
+	{
+		defragmenter->threshold = 2;
+	}
+	defragmenter->running = true;
+	if(pthread_create(&defragmenter->thread, NULL, defragmenterThread, state) != 0)
+	{
+		defragmenter->running = false;
+		return false;
+	}
+	return true;
+}
+
+void defragmenterStop(EFSState* state)
+{
+	Defragmenter* defragmenter = &state->defragmenter;
+	if(!defragmenter->running)
+	{
+		return;
+	}
+	pthread_mutex_lock(&defragmenter->lock);
+	__atomic_store_n(&defragmenter->running, false, __ATOMIC_RELEASE);
+	pthread_cond_signal(&defragmenter->wake);
+	pthread_mutex_unlock(&defragmenter->lock);
+	pthread_join(defragmenter->thread, NULL);
+}
@@ -0,0 +1,92 @@
+#ifndef __EFSFUSE_DEFRAGMENTER
+#define __EFSFUSE_DEFRAGMENTER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct efs_state;
+
+/**
+ * State of the optional background thread that moves fragmented files
+ * into a single contiguous region of free space. The thread runs at idle
+ * priority, and limits the rate at which it copies data so that it does
+ * not compete with requests from the mount.
+ */
+typedef struct defragmenter
+{
+	/**
+	 * The background defragmenter thread.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Protects running, and is held while the thread sleeps.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Signalled to wake the thread early, so that it can exit.
+	 */
+	pthread_cond_t wake;
+
+	/**
+	 * Cleared to ask the defragmenter thread to exit.
+	 */
+	bool running;
+
+	/**
+	 * The time in seconds between passes over the file table.
+	 */
+	unsigned int interval;
+
+	/**
+	 * The number of fragments at which a file is relocated.
+	 */
+	unsigned int threshold;
+
+	/**
+	 * The maximum rate in kilobytes per second at which file data is
+	 * copied. 0 if the rate is not limited.
+	 */
+	unsigned int bandwidth;
+
+} Defragmenter;
+
+/**
+ * Starts the defragmenter thread, configured with the interval, threshold
+ * and bandwidth already stored in state->defragmenter.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if the thread could not be created.
+ */
+bool defragmenterStart(struct efs_state* state);
+
+/**
+ * Stops the defragmenter thread, waiting for any relocation in progress
+ * to be finished or abandoned. Does nothing if the thread was never
+ * started.
+ *
+ * @param state The current filesystem state
+ */
+void defragmenterStop(struct efs_state* state);
+
+/**
+ * Moves every fragment of a file into a single region of free space. The
+ * data is copied while the file remains readable and writable. If the
+ * file is modified during the copy, the new region is released and the
+ * file is left untouched. Otherwise its fragments are replaced in a single
+ * step, and the old fragments are released.
+ *
+ * @param state The current filesystem state
+ * @param inode The file to relocate
+ *
+ * @returns true if the file was relocated, false if it no longer exists,
+ * holds compressed fragments or fragments shared with other files, there
+ * is no free region large enough, it was modified during the copy, or an
+ * I/O error occurred.
+ */
+bool defragmenterRelocate(struct efs_state* state, uint64_t inode);
+
+#endif
@@ -0,0 +1,474 @@
+#include "delayed_allocation.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "compression.h"
+#include "dedup.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "writeback.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Adds or removes pending data from the list of files with pending data,
+ * according to whether it holds any bytes.
+ */
+static void updateListing(EFSState* state, PendingData* pending)
+{
+	DelayedAllocation* delayedAllocation = &state->delayedAllocation;
+	bool shouldList = pending->size > 0;
+	if(shouldList == pending->listed)
+	{
+		return;
+	}
+	pthread_mutex_lock(&delayedAllocation->lock);
+	if(shouldList)
+	{
+		pending->prev = NULL;
+		pending->next = delayedAllocation->head;
+		if(delayedAllocation->head != NULL)
+		{
+			delayedAllocation->head->prev = pending;
+		}
+		delayedAllocation->head = pending;
+	}
+	else
+	{
+		if(pending->prev != NULL)
+		{
+			pending->prev->next = pending->next;
+		}
+		else
+		{
+			delayedAllocation->head = pending->next;
+		}
+		if(pending->next != NULL)
+		{
+			pending->next->prev = pending->prev;
+		}
+	}
+	pending->listed = shouldList;
+	pthread_mutex_unlock(&delayedAllocation->lock);
+}
+
+/**
+ * Deallocates pending data once no reader can still hold it.
+ */
+static void destroyPendingData(void* data)
+{
+	PendingData* pending = data;
+	free(pending->data);
+	free(pending);
+}
+
+/**
+ * Returns the inline data of a file, or NULL if its data is not stored
+ * inline.
+ */
+static InlineData* inlineData(FileTableNode* file)
+{
+	if(file->descriptorNode == NULL)
+	{
+		return NULL;
+	}
+	return file->descriptorNode->inlineData[file->descriptorSlot];
+}
+
+/**
+ * Replaces the inline data of a file, or clears it if data is NULL, and
+ * marks its descriptor dirty so that the change is written back. The old
+ * data may still be being written back, so it is retired rather than
+ * freed. Must be called with the file's lock held for writing.
+ */
+static void replaceInline(EFSState* state, FileTableNode* file,
+	InlineData* data)
+{
+	InlineData* old = inlineData(file);
+	if(old == NULL && data == NULL)
+	{
+		return;
+	}
+	DescriptorTableNode* node = file->descriptorNode;
+	__atomic_store_n(&node->inlineData[file->descriptorSlot], data, __ATOMIC_RELEASE);
+	if(old != NULL)
+	{
+		epochRetire(&state->epoch, free, old);
+	}
+	if(old == NULL)
+	{
+		atomic_fetch_add(&state->stats.inlineFiles, 1);
+	}
+	else if(data == NULL)
+	{
+		atomic_fetch_sub(&state->stats.inlineFiles, 1);
+	}
+	writebackMarkDirty(state, node, file->descriptorSlot);
+}
+
+/**
+ * Stores the pending data of a file with no pages inline in its
+ * descriptor, if it holds the whole file and is within the inline limit.
+ * The pending data is then released, since the inline copy serves reads.
+ *
+ * @returns true if the data was stored inline, false if pages must be
+ * allocated for it instead.
+ */
+static bool storeInline(EFSState* state, PendingData* pending)
+{
+	FileTableNode* file = pending->file;
+	uint64_t size = pending->size;
+	if(file->descriptorNode == NULL || size != file->fileDescriptor->filesize
+		|| size > state->delayedAllocation.inlineLimit)
+	{
+		return false;
+	}
+	InlineData* data = NULL;
+	if(size > 0)
+	{
+		data = malloc(sizeof(InlineData) + size);
+		if(data == NULL)
+		{
+			return false;
+		}
+		data->size = size;
+		memcpy(data->data, pending->data, size);
+	}
+	replaceInline(state, file, data);
+	delayedAllocationShrink(state, pending, 0);
+	free(pending->data);
+	pending->data = NULL;
+	pending->capacity = 0;
+	return true;
+}
+
+PendingData* delayedAllocationGet(EFSState* state, FileTableNode* file)
+{
+	PendingData* pending = __atomic_load_n(&file->pending, __ATOMIC_ACQUIRE);
+	if(pending != NULL)
+	{
+		return pending;
+	}
+	pthread_mutex_lock(&state->delayedAllocation.lock);
+	pending = file->pending;
+	if(pending == NULL && __atomic_load_n(&file->table, __ATOMIC_ACQUIRE) != NULL)
+	{
+		pending = calloc(1, sizeof(PendingData));
+		if(pending != NULL)
+		{
+			pending->file = file;
+			__atomic_store_n(&file->pending, pending, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&state->delayedAllocation.lock);
+	return pending;
+}
+
+bool delayedAllocationUnpack(EFSState* state, PendingData* pending)
+{
+	FileTableNode* file = pending->file;
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	if(pending->size > 0 || descriptor->filesize == 0 || allocatedPages(descriptor) > 0)
+	{
+		return true;
+	}
+	/*
+	 * The inline copy is left in place, since it is still what the
+	 * descriptor on disk holds until the data is flushed again.
+	 */
+	InlineData* data = inlineData(file);
+	if(!delayedAllocationGrow(state, pending, descriptor->filesize))
+	{
+		return false;
+	}
+	if(data != NULL)
+	{
+		memcpy(pending->data, data->data,
+			data->size < pending->size ? data->size : pending->size);
+	}
+	return true;
+}
+
+void delayedAllocationRead(EFSState* state, PendingData* pending,
+	uint64_t offset, uint64_t size, char* buffer)
+{
+	const char* source = pending->data;
+	uint64_t available = pending->size;
+	if(available == 0)
+	{
+		InlineData* data = inlineData(pending->file);
+		if(data != NULL)
+		{
+			source = data->data;
+			available = data->size;
+			atomic_fetch_add(&state->stats.inlineReads, 1);
+		}
+	}
+	uint64_t copied = 0;
+	if(offset < available)
+	{
+		copied = available - offset < size ? available - offset : size;
+		memcpy(buffer, source + offset, copied);
+	}
+	memset(buffer + copied, 0, size - copied);
+}
+
+bool delayedAllocationGrow(EFSState* state, PendingData* pending,
+	uint64_t size)
+{
+	if(size > pending->capacity)
+	{
+		uint64_t capacity = pending->capacity > 0 ? pending->capacity : PAGE_SIZE;
+		while(capacity < size)
+		{
+			capacity *= 2;
+		}
+		char* data = realloc(pending->data, capacity);
+		if(data == NULL)
+		{
+			return false;
+		}
+		pending->data = data;
+		pending->capacity = capacity;
+	}
+	if(size > pending->size)
+	{
+		memset(pending->data + pending->size, 0, size - pending->size);
+		pending->size = size;
+		updateListing(state, pending);
+	}
+	return true;
+}
+
+void delayedAllocationShrink(EFSState* state, PendingData* pending,
+	uint64_t size)
+{
+	if(size < pending->size)
+	{
+		pending->size = size;
+		updateListing(state, pending);
+	}
+}
+
+/**
+ * Compresses the whole units at the start of the pending data of a file
+ * into a new fragment, if compression is enabled, and keeps the rest of
+ * the data pending.
+ *
+ * @returns true if any data was compressed.
+ */
+static bool compressPending(EFSState* state, PendingData* pending)
+{
+	if(!state->compression.enabled)
+	{
+		return false;
+	}
+	uint64_t compressed = compressionWrite(state, pending->file, pending->data, pending->size);
+	if(compressed == 0)
+	{
+		return false;
+	}
+	memmove(pending->data, pending->data + compressed, pending->size - compressed);
+	delayedAllocationShrink(state, pending, pending->size - compressed);
+	pending->generation++;
+	return true;
+}
+
+/**
+ * Shares an extent already holding exactly the pending data of a file
+ * which has no pages, instead of writing the data again.
+ *
+ * @returns true if the data was shared. Otherwise sum is set to the CRC32C
+ * of the data, so that the extent written for it can be indexed.
+ */
+static bool sharePending(EFSState* state, PendingData* pending, uint32_t* sum)
+{
+	uint64_t pages = (pending->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	memset(pending->data + pending->size, 0, pages * PAGE_SIZE - pending->size);
+	*sum = crc32c(0, pending->data, pages * PAGE_SIZE);
+	EFSFragmentDescriptor fragment = { dedupFind(state, pending->data, pages, *sum), pages };
+	if(fragment.fragmentLocation == 0)
+	{
+		return false;
+	}
+	if(!allocatorAppend(state, pending->file, &fragment))
+	{
+		allocatorRelease(state, &fragment);
+		return false;
+	}
+	pending->file->deduplicated = true;
+	pending->generation++;
+	delayedAllocationShrink(state, pending, 0);
+	return true;
+}
+
+bool delayedAllocationFlushLocked(EFSState* state, PendingData* pending,
+	uint64_t minimumPages)
+{
+	FileTableNode* file = pending->file;
+	uint64_t oldPages = allocatedPages(file->fileDescriptor);
+	if(oldPages == 0 && minimumPages == 0 && storeInline(state, pending))
+	{
+		return true;
+	}
+	/*
+	 * Only the whole data of a file is deduplicated as it is flushed, so
+	 * that identical files share a single extent.
+	 */
+	uint32_t sum = 0;
+	bool deduplicate = state->dedup.enabled && oldPages == 0 && minimumPages == 0
+		&& pending->size > 0;
+	if(deduplicate && sharePending(state, pending, &sum))
+	{
+		replaceInline(state, file, NULL);
+		return true;
+	}
+	/*
+	 * Preallocated pages are left uncompressed, since they are about to
+	 * be written.
+	 */
+	bool compressed = minimumPages == 0 && compressPending(state, pending);
+	uint64_t firstPage = allocatedPages(file->fileDescriptor);
+	uint64_t pages = (pending->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(pages < minimumPages)
+	{
+		pages = minimumPages;
+	}
+	if(pages == 0 && !compressed)
+	{
+		return true;
+	}
+	if(!allocatorExtend(state, file, pages))
+	{
+		return false;
+	}
+
+	/*
+	 * The new pages start at the first byte of pending data, but may be
+	 * split across several fragments if free space is fragmented. The
+	 * last page is written whole, cleared past the end of the data, so
+	 * that its checksum covers exactly what is on disk.
+	 */
+	uint64_t dataBytes = (pending->size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	if(dataBytes > pending->size)
+	{
+		memset(pending->data + pending->size, 0, dataBytes - pending->size);
+	}
+	uint64_t written = 0;
+	while(written < dataBytes)
+	{
+		uint64_t imageOffset;
+		uint64_t length;
+		allocatorMap(file->fileDescriptor, firstPage * PAGE_SIZE + written, &imageOffset, &length);
+		if(length > dataBytes - written)
+		{
+			length = dataBytes - written;
+		}
+		if(!imageWrite(state, pending->data + written, length, imageOffset))
+		{
+			printf("\tFailed to write pending data of inode %" PRIu64 ".\n", file->fileDescriptor->fileID);
+			allocatorTruncate(state, file, firstPage);
+			return false;
+		}
+		checksumUpdate(state, imageOffset, pending->data + written, length);
+		written += length;
+	}
+	pending->generation++;
+	atomic_fetch_add(&state->stats.delayedAllocations, 1);
+	delayedAllocationShrink(state, pending, 0);
+	if(deduplicate && !compressed && file->fileDescriptor->numFragments == 1)
+	{
+		dedupIndex(state, file, &file->fileDescriptor->fragments[0], sum);
+	}
+	if(oldPages == 0)
+	{
+		/*
+		 * Data stored inline has just been given pages along with the
+		 * rest of the file.
+		 */
+		replaceInline(state, file, NULL);
+	}
+	return true;
+}
+
+bool delayedAllocationFlush(EFSState* state, FileTableNode* file)
+{
+	bool success = true;
+	pthread_rwlock_wrlock(&file->lock);
+	PendingData* pending = __atomic_load_n(&file->pending, __ATOMIC_ACQUIRE);
+	if(pending != NULL)
+	{
+		success = delayedAllocationFlushLocked(state, pending, 0);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	return success;
+}
+
+bool delayedAllocationFlushAll(EFSState* state)
+{
+	DelayedAllocation* delayedAllocation = &state->delayedAllocation;
+	bool success = true;
+	EPOCH_READ_SECTION(&state->epoch);
+	for(;;)
+	{
+		/*
+		 * Flushing a file removes it from the list, so the list is
+		 * walked from the head until it is empty or only holds files
+		 * which could not be flushed. The list lock is dropped before
+		 * the file is locked, since writers to the file take them in
+		 * the opposite order.
+		 */
+		pthread_mutex_lock(&delayedAllocation->lock);
+		PendingData* pending = delayedAllocation->head;
+		while(pending != NULL && pending->failed)
+		{
+			pending = pending->next;
+		}
+		pthread_mutex_unlock(&delayedAllocation->lock);
+		if(pending == NULL)
+		{
+			break;
+		}
+		FileTableNode* file = pending->file;
+		pthread_rwlock_wrlock(&file->lock);
+		if(file->pending == pending
+			&& !delayedAllocationFlushLocked(state, pending, 0))
+		{
+			pending->failed = true;
+			success = false;
+		}
+		pthread_rwlock_unlock(&file->lock);
+	}
+	/*
+	 * Files which failed are retried by the next flush.
+	 */
+	pthread_mutex_lock(&delayedAllocation->lock);
+	for(PendingData* pending = delayedAllocation->head; pending != NULL; pending = pending->next)
+	{
+		pending->failed = false;
+	}
+	pthread_mutex_unlock(&delayedAllocation->lock);
+	return success;
+}
+
+void delayedAllocationDiscard(EFSState* state, FileTableNode* file)
+{
+	replaceInline(state, file, NULL);
+	/*
+	 * The file has already been removed from the file table, so once the
+	 * pointer is cleared under the list lock no new pending data can be
+	 * created for it.
+	 */
+	pthread_mutex_lock(&state->delayedAllocation.lock);
+	PendingData* pending = file->pending;
+	__atomic_store_n(&file->pending, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&state->delayedAllocation.lock);
+	if(pending == NULL)
+	{
+		return;
+	}
+	delayedAllocationShrink(state, pending, 0);
+	epochRetire(&state->epoch, destroyPendingData, pending);
+}
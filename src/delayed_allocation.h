@@ -0,0 +1,217 @@
+#ifndef __EFSFUSE_DELAYED_ALLOCATION
+#define __EFSFUSE_DELAYED_ALLOCATION
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "file_table.h"
+
+struct efs_state;
+
+/**
+ * Data written past the pages allocated to a file, which has not yet been
+ * given space in the filesystem. Pages are only allocated when the data
+ * is flushed, so that all of it can be placed in a single fragment. Only
+ * read or changed with the lock of the file held.
+ */
+typedef struct pending_data
+{
+	/**
+	 * The file this data belongs to.
+	 */
+	FileTableNode* file;
+
+	/**
+	 * The bytes of the file which lie past the pages allocated to it.
+	 * The first byte is the first byte of the first unallocated page.
+	 */
+	char* data;
+
+	/**
+	 * The number of bytes stored in data.
+	 */
+	uint64_t size;
+
+	/**
+	 * The number of bytes allocated for data.
+	 */
+	uint64_t capacity;
+
+	/**
+	 * Whether this is in the list of files with pending data.
+	 */
+	bool listed;
+
+	/**
+	 * Set while flushing every file if this file could not be flushed,
+	 * so that it is not retried until the next flush.
+	 */
+	bool failed;
+
+	/**
+	 * Incremented whenever the data, size or fragments of the file
+	 * change. Used to detect changes made while the file's lock was not
+	 * held.
+	 */
+	uint64_t generation;
+
+	/**
+	 * The previous file in the list of files with pending data.
+	 */
+	struct pending_data* prev;
+
+	/**
+	 * The next file in the list of files with pending data.
+	 */
+	struct pending_data* next;
+
+} PendingData;
+
+/**
+ * Tracks every file with data waiting to be allocated.
+ */
+typedef struct delayed_allocation
+{
+	/**
+	 * Protects the list of files with pending data.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The first file in the list of files with pending data.
+	 */
+	PendingData* head;
+
+	/**
+	 * The amount of pending data, in bytes, that causes a file to be
+	 * flushed as soon as it is written.
+	 */
+	uint64_t limit;
+
+	/**
+	 * The largest file, in bytes, whose data is stored inline in its
+	 * descriptor when flushed rather than given pages. 0 if data is never
+	 * stored inline.
+	 */
+	uint64_t inlineLimit;
+
+} DelayedAllocation;
+
+/**
+ * Returns the pending data of a file, creating it if the file has none.
+ * Must be called with the file's lock held.
+ *
+ * @param state The current filesystem state
+ * @param file The file to get pending data for
+ *
+ * @returns The pending data of the file, or NULL if it could not be
+ * allocated or the file has been removed.
+ */
+PendingData* delayedAllocationGet(struct efs_state* state, FileTableNode* file);
+
+/**
+ * Copies the inline data of a file into its pending data, if the file's
+ * data is stored inline and has not been copied already, so that it can
+ * be changed. Must be called with the file's lock held for writing before
+ * any byte past the allocated pages of the file is written.
+ *
+ * @param state The current filesystem state
+ * @param pending The pending data of the file
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool delayedAllocationUnpack(struct efs_state* state, PendingData* pending);
+
+/**
+ * Reads bytes of a file past its allocated pages, from its pending data
+ * or, if that has not been unpacked, from its inline data. Must be called
+ * with the file's lock held.
+ *
+ * @param state The current filesystem state
+ * @param pending The pending data of the file
+ * @param offset The offset of the first byte to read, from the first byte
+ * of the first unallocated page
+ * @param size The number of bytes to read
+ * @param buffer The location to read into
+ */
+void delayedAllocationRead(struct efs_state* state, PendingData* pending,
+	uint64_t offset, uint64_t size, char* buffer);
+
+/**
+ * Grows the pending data of a file to the specified size. New bytes are
+ * set to zero. Must be called with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param pending The pending data to grow
+ * @param size The new size of the pending data in bytes
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool delayedAllocationGrow(struct efs_state* state, PendingData* pending,
+	uint64_t size);
+
+/**
+ * Shrinks the pending data of a file to the specified size. Must be
+ * called with the file's lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param pending The pending data to shrink
+ * @param size The new size of the pending data in bytes
+ */
+void delayedAllocationShrink(struct efs_state* state, PendingData* pending,
+	uint64_t size);
+
+/**
+ * Allocates pages for all pending data of a file in a single fragment
+ * where possible, and writes the data into them. A file with no pages
+ * whose data fits within the inline limit is instead stored inline in its
+ * descriptor. If compression is enabled, whole units of data are first
+ * compressed into a fragment of their own, and only what follows them is
+ * given plain pages. Must be called with the file's lock held for
+ * writing.
+ *
+ * @param state The current filesystem state
+ * @param pending The pending data to flush
+ * @param minimumPages The minimum number of pages to allocate, even if
+ * less pending data than that is held. Used to preallocate space.
+ *
+ * @returns true upon success, false if space could not be allocated or an
+ * I/O error occurred. Upon failure the data which was not compressed
+ * remains pending.
+ */
+bool delayedAllocationFlushLocked(struct efs_state* state,
+	PendingData* pending, uint64_t minimumPages);
+
+/**
+ * Allocates pages for the pending data of a file, if it has any, and
+ * writes the data into them.
+ *
+ * @param state The current filesystem state
+ * @param file The file to flush
+ *
+ * @returns true upon success, false upon failure.
+ */
+bool delayedAllocationFlush(struct efs_state* state, FileTableNode* file);
+
+/**
+ * Flushes the pending data of every file.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if any file could not be flushed.
+ */
+bool delayedAllocationFlushAll(struct efs_state* state);
+
+/**
+ * Discards the pending and inline data of a file which is being deleted,
+ * and retires them to be deallocated once no reader can hold them. The file must already
+ * have been removed from the file table. Must be called with the file's
+ * lock held for writing.
+ *
+ * @param state The current filesystem state
+ * @param file The file being deleted
+ */
+void delayedAllocationDiscard(struct efs_state* state, FileTableNode* file);
+
+#endif
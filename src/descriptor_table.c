@@ -0,0 +1,150 @@
+#include "descriptor_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+DescriptorTable* constructDescriptorTable()
+{
+	DescriptorTable* table = malloc(sizeof(DescriptorTable));
+	DescriptorTableNode* head = calloc(1, sizeof(DescriptorTableNode));
+	table->head = head;
+	table->last = head;
+	table->size = 0;
+	table->withSpace = NULL;
+	head->table = table;
+	head->next = NULL;
+	return table;
+}
+
+DescriptorTableNode* descriptorTableInsert(DescriptorTable* table,
+	DescriptorTableNode* location, uint64_t nodeLocation)
+{
+	if(location->table == table && table != NULL)
+	{
+		DescriptorTableNode* newNode = calloc(1, sizeof(DescriptorTableNode));
+		if(newNode != NULL)
+		{
+			newNode->table = table;
+			newNode->next = location->next;
+			newNode->location = nodeLocation;
+			for(int i = 0; i < FT_NODE_SIZE / 64; i++)
+			{
+				newNode->free[i] = ~0ULL;
+			}
+			newNode->free[0] &= ~1ULL;
+			newNode->numFree = FT_NODE_SIZE - 1;
+			newNode->nextWithSpace = table->withSpace;
+			if(table->withSpace != NULL)
+			{
+				table->withSpace->prevWithSpace = newNode;
+			}
+			table->withSpace = newNode;
+			location->next = newNode;
+			table->size++;
+			if(table->last == location)
+			{
+				table->last = newNode;
+			}
+			return newNode;
+		}
+	}
+	return NULL;
+}
+
+bool descriptorTableNodeMarkDirty(DescriptorTableNode* node, unsigned int slot)
+{
+	uint64_t bit = 1ULL << (slot % 64);
+	if((node->dirty[slot / 64] & bit) == 0)
+	{
+		node->dirty[slot / 64] |= bit;
+		node->numDirty++;
+		return true;
+	}
+	return false;
+}
+
+void descriptorTableNodeStore(DescriptorTableNode* node, unsigned int slot,
+	EFSCompactFileDescriptor* descriptor)
+{
+	DescriptorTable* table = node->table;
+	uint64_t bit = 1ULL << (slot % 64);
+	bool wasFree = (node->free[slot / 64] & bit) != 0;
+	node->descriptors[slot] = descriptor;
+	if(descriptor != NULL && wasFree)
+	{
+		node->free[slot / 64] &= ~bit;
+		node->numFree--;
+		if(node->numFree == 0)
+		{
+			if(node->prevWithSpace != NULL)
+			{
+				node->prevWithSpace->nextWithSpace = node->nextWithSpace;
+			}
+			else
+			{
+				table->withSpace = node->nextWithSpace;
+			}
+			if(node->nextWithSpace != NULL)
+			{
+				node->nextWithSpace->prevWithSpace = node->prevWithSpace;
+			}
+			node->prevWithSpace = NULL;
+			node->nextWithSpace = NULL;
+		}
+	}
+	else if(descriptor == NULL && !wasFree)
+	{
+		node->free[slot / 64] |= bit;
+		node->numFree++;
+		if(node->numFree == 1)
+		{
+			node->prevWithSpace = NULL;
+			node->nextWithSpace = table->withSpace;
+			if(table->withSpace != NULL)
+			{
+				table->withSpace->prevWithSpace = node;
+			}
+			table->withSpace = node;
+		}
+	}
+}
+
+DescriptorTableNode* descriptorTableFindFreeSlot(DescriptorTable* table,
+	unsigned int* slot)
+{
+	DescriptorTableNode* node = table->withSpace;
+	if(node != NULL)
+	{
+		for(int i = 0; i < FT_NODE_SIZE / 64; i++)
+		{
+			if(node->free[i] != 0)
+			{
+				*slot = i * 64 + __builtin_ctzll(node->free[i]);
+				return node;
+			}
+		}
+	}
+	return NULL;
+}
+
+size_t descriptorTableNodeCount(DescriptorTableNode* node)
+{
+	return FT_NODE_SIZE - 1 - node->numFree;
+}
+
+void destroyDescriptorTable(DescriptorTable* table)
+{
+	DescriptorTableNode* prev = NULL;
+	DescriptorTableNode* next = table->head;
+	do
+	{
+		prev = next;
+		next = next->next;
+		for(int i = 0; i < FT_NODE_SIZE; i++)
+		{
+			free(prev->inlineData[i]);
+		}
+		free(prev);
+	} while(next != NULL);
+	free(table);
+}
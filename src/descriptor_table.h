@@ -0,0 +1,229 @@
+#ifndef __EFSFUSE_DESCRIPTOR_TABLE
+#define __EFSFUSE_DESCRIPTOR_TABLE
+
+#include <EFS/file_descriptor.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The number of pages in a descriptor node. The first page of each node
+ * stores the node header, and each remaining page stores one descriptor.
+ */
+#define FT_NODE_SIZE 256
+
+/**
+ * The data of a small file, stored in the unused space of its descriptor
+ * rather than in pages of its own. Never changed once created, so that it
+ * can be written back without holding the file's lock; it is replaced
+ * whole, and the old copy retired.
+ */
+typedef struct inline_data
+{
+	/**
+	 * The number of bytes in data.
+	 */
+	uint32_t size;
+
+	/**
+	 * The bytes of the file.
+	 */
+	char data[];
+
+} InlineData;
+
+/**
+ * An in-memory mirror of a single descriptor node on disk. Tracks which
+ * descriptor is stored in each slot of the node, and which slots have
+ * been modified in memory but not yet written back to disk.
+ */
+typedef struct descriptor_table_node
+{
+	/**
+	 * Pointer to the table this node is contained in. If this is
+	 * invalid, the node should not be used.
+	 */
+	struct descriptor_table* table;
+
+	/**
+	 * Pointer to the next node in the table. The table is kept in the
+	 * same order as the on-disk chain of descriptor nodes, so this also
+	 * determines the 'next' field of the node header on disk. NULL for
+	 * the last node in the table.
+	 */
+	struct descriptor_table_node* next;
+
+	/**
+	 * The page index of the first page (the header) of this node.
+	 */
+	uint64_t location;
+
+	/**
+	 * The descriptor stored in each slot of this node. Slot 0 is the
+	 * node header and is always NULL. Empty slots are NULL.
+	 */
+	EFSCompactFileDescriptor* descriptors[FT_NODE_SIZE];
+
+	/**
+	 * The inline data of the descriptor stored in each slot, or NULL if
+	 * the file's data is not stored inline. Only replaced with the lock
+	 * of the file held for writing.
+	 */
+	InlineData* inlineData[FT_NODE_SIZE];
+
+	/**
+	 * A bitmap of slots that must be written back to disk. Bit 0 refers
+	 * to the node header.
+	 */
+	uint64_t dirty[FT_NODE_SIZE / 64];
+
+	/**
+	 * The number of bits set in the dirty bitmap.
+	 */
+	size_t numDirty;
+
+	/**
+	 * A bitmap of slots whose timestamps have changed in memory since
+	 * they were last written back. Such a slot is written with the next
+	 * write of the slot for any other reason, an fsync of its file, or a
+	 * periodic flush of timestamps. Only accessed atomically.
+	 */
+	uint64_t lazy[FT_NODE_SIZE / 64];
+
+	/**
+	 * A bitmap of slots that do not contain a descriptor. Bit 0 refers
+	 * to the node header, and is never set.
+	 */
+	uint64_t free[FT_NODE_SIZE / 64];
+
+	/**
+	 * The number of bits set in the free bitmap.
+	 */
+	size_t numFree;
+
+	/**
+	 * The previous node in the table's list of nodes with free slots.
+	 * NULL if this is the first such node, or if this node is full.
+	 */
+	struct descriptor_table_node* prevWithSpace;
+
+	/**
+	 * The next node in the table's list of nodes with free slots. NULL
+	 * if this is the last such node, or if this node is full.
+	 */
+	struct descriptor_table_node* nextWithSpace;
+
+} DescriptorTableNode;
+
+/**
+ * A linked list of descriptor nodes, in the same order as they are
+ * chained together on disk.
+ */
+typedef struct descriptor_table
+{
+	/**
+	 * A dummy node that always appears at the beginning of the list. It
+	 * stores no useful data, and cannot be removed. It simplifies the
+	 * implementation of the list.
+	 */
+	DescriptorTableNode* head;
+
+	/**
+	 * The last node in the list.
+	 */
+	DescriptorTableNode* last;
+
+	/**
+	 * The number of nodes in the list (excluding the head).
+	 */
+	size_t size;
+
+	/**
+	 * The first node which has at least one free slot. Nodes with free
+	 * slots are linked together through nextWithSpace, in no particular
+	 * order. NULL if every node is full.
+	 */
+	DescriptorTableNode* withSpace;
+
+} DescriptorTable;
+
+/**
+ * Allocates and constructs an empty \link DescriptorTable \endlink.
+ *
+ * @returns A pointer to the new \link DescriptorTable \endlink, or a
+ * null pointer upon failure to allocate memory.
+ */
+DescriptorTable* constructDescriptorTable();
+
+/**
+ * Inserts a new node after the given location, with every slot marked as
+ * free. Use the list head as the location to insert an element to the
+ * beginning of the table.
+ *
+ * @param table The table to insert into
+ * @param location The node to insert after.
+ * @param nodeLocation The page index of the descriptor node on disk
+ *
+ * @returns A pointer to the new node. Returns null if a node could not
+ * be allocated or if the location given is invalid.
+ */
+DescriptorTableNode* descriptorTableInsert(DescriptorTable* table,
+	DescriptorTableNode* location, uint64_t nodeLocation);
+
+/**
+ * Marks a slot of the given node as needing to be written back to disk.
+ * Does not perform any locking.
+ *
+ * @param node The node containing the slot
+ * @param slot The index of the slot within the node
+ *
+ * @returns true if the slot was clean before this call, otherwise false.
+ */
+bool descriptorTableNodeMarkDirty(DescriptorTableNode* node, unsigned int slot);
+
+/**
+ * Stores a descriptor in a slot of the given node, or clears the slot if
+ * descriptor is null, and updates the free slot bitmap and the table's
+ * list of nodes with free slots accordingly. Does not perform any
+ * locking, and does not mark the slot as dirty.
+ *
+ * @param node The node containing the slot
+ * @param slot The index of the slot within the node. Must not be 0.
+ * @param descriptor The descriptor to store, or null to free the slot
+ */
+void descriptorTableNodeStore(DescriptorTableNode* node, unsigned int slot,
+	EFSCompactFileDescriptor* descriptor);
+
+/**
+ * Finds a free slot in constant time, using the table's list of nodes
+ * with free slots and the free slot bitmap of the first such node. The
+ * slot remains free until a descriptor is stored in it.
+ *
+ * @param table The table to search
+ * @param slot Set to the index of the free slot within the returned node
+ *
+ * @returns The node containing the free slot. NULL if every node is full.
+ */
+DescriptorTableNode* descriptorTableFindFreeSlot(DescriptorTable* table,
+	unsigned int* slot);
+
+/**
+ * Counts the number of occupied descriptor slots in the given node.
+ *
+ * @param node The node to count
+ *
+ * @returns The number of slots containing a descriptor
+ */
+size_t descriptorTableNodeCount(DescriptorTableNode* node);
+
+/**
+ * Deallocates the table and all nodes contained within it, along with the
+ * inline data of every slot. Note that this function does not deallocate
+ * the file descriptors themselves.
+ *
+ * @param table The table to deallocate
+ */
+void destroyDescriptorTable(DescriptorTable* table);
+
+#endif
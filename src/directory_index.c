@@ -0,0 +1,249 @@
+#include "directory_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+DirectoryIndex* constructDirectoryIndex(uint64_t inode)
+{
+	DirectoryIndex* index = calloc(1, sizeof(DirectoryIndex));
+	if(index == NULL)
+	{
+		return NULL;
+	}
+	index->inode = inode;
+	pthread_rwlock_init(&index->lock, NULL);
+	return index;
+}
+
+void destroyDirectoryIndex(DirectoryIndex* index)
+{
+	for(size_t i = 0; i < index->numBlocks; i++)
+	{
+		free(index->blocks[i]);
+	}
+	free(index->blocks);
+	pthread_rwlock_destroy(&index->lock);
+	free(index);
+}
+
+/**
+ * Finds the last block whose first entry is at or before a position, or
+ * the first block if there is none. Must not be called on an empty index.
+ */
+static size_t findBlock(DirectoryIndex* index, uint64_t position)
+{
+	size_t low = 0;
+	size_t high = index->numBlocks;
+	while(low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if(index->blocks[middle]->entries[0].position <= position)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low > 0 ? low - 1 : 0;
+}
+
+/**
+ * Finds the first entry of a block at or after a position.
+ *
+ * @returns Its index, or the number of entries if there is none.
+ */
+static size_t findEntry(DirectoryBlock* block, uint64_t position)
+{
+	size_t low = 0;
+	size_t high = block->numEntries;
+	while(low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if(block->entries[middle].position < position)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return low;
+}
+
+/**
+ * Adds an empty block to the list after the given index.
+ */
+static DirectoryBlock* insertBlock(DirectoryIndex* index, size_t at)
+{
+	if(index->numBlocks == index->capacity)
+	{
+		size_t capacity = index->capacity > 0 ? index->capacity * 2 : 4;
+		DirectoryBlock** blocks = realloc(index->blocks, sizeof(DirectoryBlock*) * capacity);
+		if(blocks == NULL)
+		{
+			return NULL;
+		}
+		index->blocks = blocks;
+		index->capacity = capacity;
+	}
+	DirectoryBlock* block = malloc(sizeof(DirectoryBlock));
+	if(block == NULL)
+	{
+		return NULL;
+	}
+	block->numEntries = 0;
+	memmove(&index->blocks[at + 1], &index->blocks[at], sizeof(DirectoryBlock*) * (index->numBlocks - at));
+	index->blocks[at] = block;
+	index->numBlocks++;
+	return block;
+}
+
+/**
+ * Works out the position of a new entry whose name has the given hash,
+ * and where to insert it.
+ *
+ * @returns false if every position for the hash is taken.
+ */
+static bool placeEntry(DirectoryIndex* index, uint32_t hash, uint64_t* position,
+	size_t* blockIndex, size_t* entryIndex)
+{
+	uint64_t base = directoryPositionOf(hash);
+	uint64_t limit = base + ((uint64_t) 1 << DIRECTORY_MINOR_BITS);
+	*position = base;
+	*blockIndex = 0;
+	*entryIndex = 0;
+	if(index->numBlocks == 0)
+	{
+		return true;
+	}
+	*blockIndex = findBlock(index, limit);
+	DirectoryBlock* block = index->blocks[*blockIndex];
+	*entryIndex = findEntry(block, limit);
+	const DirectoryEntry* previous = NULL;
+	if(*entryIndex > 0)
+	{
+		previous = &block->entries[*entryIndex - 1];
+	}
+	else if(*blockIndex > 0)
+	{
+		DirectoryBlock* before = index->blocks[*blockIndex - 1];
+		previous = &before->entries[before->numEntries - 1];
+	}
+	if(previous != NULL && previous->position >= base)
+	{
+		*position = previous->position + 1;
+	}
+	return *position < limit;
+}
+
+bool directoryIndexInsert(DirectoryIndex* index, uint32_t hash,
+	struct file_table_node* node, uint64_t* position)
+{
+	pthread_rwlock_wrlock(&index->lock);
+	size_t blockIndex;
+	size_t entryIndex;
+	bool success = placeEntry(index, hash, position, &blockIndex, &entryIndex);
+	DirectoryBlock* block = NULL;
+	if(success && index->numBlocks == 0)
+	{
+		block = insertBlock(index, 0);
+	}
+	else if(success)
+	{
+		block = index->blocks[blockIndex];
+		if(block->numEntries == DIRECTORY_BLOCK_ENTRIES)
+		{
+			/*
+			 * A full block is split in half, and the entry goes into
+			 * whichever half it falls in.
+			 */
+			DirectoryBlock* upper = insertBlock(index, blockIndex + 1);
+			if(upper != NULL)
+			{
+				size_t half = DIRECTORY_BLOCK_ENTRIES / 2;
+				memcpy(upper->entries, &block->entries[half], sizeof(DirectoryEntry) * half);
+				upper->numEntries = half;
+				block->numEntries = half;
+				if(entryIndex > half)
+				{
+					block = upper;
+					entryIndex -= half;
+				}
+			}
+			else
+			{
+				block = NULL;
+			}
+		}
+	}
+	if(block != NULL)
+	{
+		memmove(&block->entries[entryIndex + 1], &block->entries[entryIndex],
+			sizeof(DirectoryEntry) * (block->numEntries - entryIndex));
+		block->entries[entryIndex].position = *position;
+		block->entries[entryIndex].node = node;
+		block->numEntries++;
+		index->numEntries++;
+	}
+	pthread_rwlock_unlock(&index->lock);
+	return block != NULL;
+}
+
+bool directoryIndexRemove(DirectoryIndex* index, uint64_t position)
+{
+	pthread_rwlock_wrlock(&index->lock);
+	bool found = false;
+	if(index->numBlocks > 0)
+	{
+		size_t blockIndex = findBlock(index, position);
+		DirectoryBlock* block = index->blocks[blockIndex];
+		size_t entryIndex = findEntry(block, position);
+		found = entryIndex < block->numEntries && block->entries[entryIndex].position == position;
+		if(found)
+		{
+			block->numEntries--;
+			memmove(&block->entries[entryIndex], &block->entries[entryIndex + 1],
+				sizeof(DirectoryEntry) * (block->numEntries - entryIndex));
+			index->numEntries--;
+			if(block->numEntries == 0)
+			{
+				free(block);
+				index->numBlocks--;
+				memmove(&index->blocks[blockIndex], &index->blocks[blockIndex + 1],
+					sizeof(DirectoryBlock*) * (index->numBlocks - blockIndex));
+			}
+		}
+	}
+	pthread_rwlock_unlock(&index->lock);
+	return found;
+}
+
+size_t directoryIndexList(DirectoryIndex* index, uint64_t position,
+	DirectoryEntry* entries, size_t max)
+{
+	pthread_rwlock_rdlock(&index->lock);
+	size_t count = 0;
+	if(index->numBlocks > 0)
+	{
+		size_t blockIndex = findBlock(index, position);
+		size_t entryIndex = findEntry(index->blocks[blockIndex], position);
+		while(count < max && blockIndex < index->numBlocks)
+		{
+			DirectoryBlock* block = index->blocks[blockIndex];
+			size_t length = block->numEntries - entryIndex;
+			if(length > max - count)
+			{
+				length = max - count;
+			}
+			memcpy(&entries[count], &block->entries[entryIndex], sizeof(DirectoryEntry) * length);
+			count += length;
+			blockIndex++;
+			entryIndex = 0;
+		}
+	}
+	pthread_rwlock_unlock(&index->lock);
+	return count;
+}
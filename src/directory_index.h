@@ -0,0 +1,171 @@
+#ifndef __EFSFUSE_DIRECTORY_INDEX
+#define __EFSFUSE_DIRECTORY_INDEX
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct file_table_node;
+
+/**
+ * The number of entries each block of an index holds at most. A full
+ * block is split in two.
+ */
+#define DIRECTORY_BLOCK_ENTRIES 256
+
+/**
+ * The number of low bits of a position which tell apart entries whose
+ * names have the same hash. The name hash fills the bits above them.
+ */
+#define DIRECTORY_MINOR_BITS 30
+
+/**
+ * An entry of a directory, at a position derived from the hash of its
+ * name. Positions are unique within a directory and never change while
+ * the entry exists, so a reader can resume a listing from any position.
+ */
+typedef struct directory_entry
+{
+	/**
+	 * The hash of the entry's name, shifted up by
+	 * \link DIRECTORY_MINOR_BITS \endlink, plus a number telling it apart
+	 * from other entries with the same hash.
+	 */
+	uint64_t position;
+
+	/**
+	 * The node of the file.
+	 */
+	struct file_table_node* node;
+
+} DirectoryEntry;
+
+/**
+ * A run of consecutive entries of an index, sorted by position.
+ */
+typedef struct directory_block
+{
+	/**
+	 * The number of entries in use.
+	 */
+	size_t numEntries;
+
+	/**
+	 * The entries, sorted by position.
+	 */
+	DirectoryEntry entries[DIRECTORY_BLOCK_ENTRIES];
+
+} DirectoryBlock;
+
+/**
+ * The entries of one directory, sorted by position in a list of blocks,
+ * so that an entry is found with two binary searches and inserting one
+ * moves at most a block of entries and the list of blocks.
+ */
+typedef struct directory_index
+{
+	/**
+	 * The inode of the directory.
+	 */
+	uint64_t inode;
+
+	/**
+	 * Held for reading while entries are listed, and for writing while
+	 * they are added or removed. Only taken with the file table's lock of
+	 * indexes held, which keeps the index from being destroyed.
+	 */
+	pthread_rwlock_t lock;
+
+	/**
+	 * The blocks, sorted by the positions of their entries. None of them
+	 * is empty.
+	 */
+	DirectoryBlock** blocks;
+
+	/**
+	 * The number of blocks in use.
+	 */
+	size_t numBlocks;
+
+	/**
+	 * The number of block pointers allocated for blocks.
+	 */
+	size_t capacity;
+
+	/**
+	 * The number of entries in every block.
+	 */
+	size_t numEntries;
+
+	/**
+	 * The next index in the same bucket of the file table's indexes.
+	 */
+	struct directory_index* next;
+
+} DirectoryIndex;
+
+/**
+ * Allocates an index with no entries.
+ *
+ * @param inode The inode of the directory
+ *
+ * @returns The index, or NULL if memory could not be allocated.
+ */
+DirectoryIndex* constructDirectoryIndex(uint64_t inode);
+
+/**
+ * Deallocates an index. No other thread may be using it.
+ *
+ * @param index The index to deallocate
+ */
+void destroyDirectoryIndex(DirectoryIndex* index);
+
+/**
+ * Adds an entry, after every existing entry whose name has the same
+ * hash.
+ *
+ * @param index The index of the directory
+ * @param hash The hash of the entry's name
+ * @param node The node of the file
+ * @param position Receives the position of the new entry
+ *
+ * @returns true upon success, false if memory could not be allocated or
+ * every position for the hash is taken.
+ */
+bool directoryIndexInsert(DirectoryIndex* index, uint32_t hash,
+	struct file_table_node* node, uint64_t* position);
+
+/**
+ * Removes the entry at a position.
+ *
+ * @param index The index of the directory
+ * @param position The position of the entry
+ *
+ * @returns true if the index held an entry at the position, otherwise
+ * false.
+ */
+bool directoryIndexRemove(DirectoryIndex* index, uint64_t position);
+
+/**
+ * Copies the entries at or after a position, in order of position.
+ *
+ * @param index The index of the directory
+ * @param position The position to start from
+ * @param entries Receives the entries
+ * @param max The number of entries that fit in entries
+ *
+ * @returns The number of entries copied.
+ */
+size_t directoryIndexList(DirectoryIndex* index, uint64_t position,
+	DirectoryEntry* entries, size_t max);
+
+/**
+ * The first position an entry whose name has the given hash can have.
+ */
+static inline uint64_t directoryPositionOf(uint32_t hash)
+{
+	return (uint64_t) hash << DIRECTORY_MINOR_BITS;
+}
+
+#endif
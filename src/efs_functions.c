@@ -0,0 +1,1075 @@
+#define FUSE_USE_VERSION 312
+
+#include "efs_functions.h"
+#include "allocation_groups.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "compression.h"
+#include "dedup.h"
+#include "delayed_allocation.h"
+#include "descriptor_table.h"
+#include "image_io.h"
+#include "open_file.h"
+#include "util.h"
+#include "writeback.h"
+
+#include <errno.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The number of bytes copied at a time by copyFileRange.
+ */
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * The number of fragments whose data transferData gathers into a single
+ * request to the image.
+ */
+#define TRANSFER_BATCH 16
+
+/**
+ * The time in seconds after which a read moves the access time of a
+ * file even though the file has not been modified since it was last
+ * read.
+ */
+#define RELATIME_WINDOW 86400
+
+/**
+ * Allocates a new descriptor node from free space, clears it on disk, and
+ * links it onto the end of the chain of descriptor nodes. Must be called
+ * with the metadata lock held.
+ */
+static DescriptorTableNode* allocateDescriptorNode(EFSState* state)
+{
+	uint64_t location = allocationGroupsAllocate(&state->allocationGroups, 0, FT_NODE_SIZE);
+	if(location == 0)
+	{
+		printf("\tNo space for a new descriptor node.\n");
+		return NULL;
+	}
+	/*
+	 * Every slot of the new node must read as empty before the node is
+	 * linked into the chain, so the whole node is cleared immediately
+	 * rather than through the writeback thread.
+	 */
+	char* zeroes = calloc(FT_NODE_SIZE, PAGE_SIZE);
+	bool cleared = zeroes != NULL
+		&& imageWrite(state, zeroes, PAGE_SIZE * FT_NODE_SIZE, PAGE_SIZE * location);
+	free(zeroes);
+	DescriptorTable* table = state->descriptorTable;
+	DescriptorTableNode* previous = table->last;
+	DescriptorTableNode* node = cleared
+		? descriptorTableInsert(table, previous, location) : NULL;
+	if(node == NULL)
+	{
+		allocationGroupsRelease(&state->allocationGroups, location, FT_NODE_SIZE);
+		return NULL;
+	}
+	printf("\tAllocated descriptor node at page %" PRIu64 ".\n", location);
+	if(previous == table->head)
+	{
+		state->fileDescriptorList = location;
+		state->superblockDirty = true;
+	}
+	else
+	{
+		writebackMarkDirty(state, previous, 0);
+	}
+	writebackMarkDirty(state, node, 0);
+	return node;
+}
+
+/**
+ * Releases the fragments and descriptor slot of a file, and removes it
+ * from the file table. Must be called with the file's lock held for
+ * writing, followed by the metadata lock.
+ */
+static bool removeFile(EFSState* state, FileTableNode* file)
+{
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	if(descriptor->fileID == FUSE_ROOT_ID)
+	{
+		return false;
+	}
+	/*
+	 * The node is unlinked first, so that no new pending data can be
+	 * created for it once the existing data is discarded.
+	 */
+	fileTableRemove(state->fileTable, file);
+	delayedAllocationDiscard(state, file);
+	for(uint64_t i = 0; i < descriptor->numFragments; i++)
+	{
+		allocatorRelease(state, &descriptor->fragments[i]);
+	}
+	atomic_fetch_sub(&state->stats.fragments, descriptor->numFragments);
+	atomic_fetch_sub(&state->stats.files, 1);
+	if(file->descriptorNode != NULL)
+	{
+		descriptorTableNodeStore(file->descriptorNode, file->descriptorSlot, NULL);
+		writebackMarkRemoved(state, file->descriptorNode, file->descriptorSlot,
+			descriptor->parentID);
+	}
+	/*
+	 * Readers may still hold the node or descriptor, so they are freed
+	 * once every current reader has finished.
+	 */
+	epochRetire(&state->epoch, destroyFileTableNode, file);
+	epochRetire(&state->epoch, destroyFileDescriptor, descriptor);
+	return true;
+}
+
+FileTableNode* createFile(EFSState* state, uint64_t parent, const char* name)
+{
+	EFSCompactFileDescriptor* descriptor = calloc(1, sizeof(EFSCompactFileDescriptor));
+	char* filename = namePoolIntern(&state->namePool, name);
+	if(descriptor == NULL || filename == NULL)
+	{
+		free(descriptor);
+		internedNameRelease(filename);
+		return NULL;
+	}
+	descriptor->filename = filename;
+	descriptor->parentID = parent;
+	descriptor->isFile = 1;
+	descriptor->lastAccessed = time(NULL);
+	descriptor->lastModified = descriptor->lastAccessed;
+
+	pthread_mutex_lock(&state->metadataLock);
+	unsigned int slot = 1;
+	DescriptorTableNode* node = descriptorTableFindFreeSlot(state->descriptorTable, &slot);
+	if(node == NULL)
+	{
+		node = allocateDescriptorNode(state);
+		slot = 1;
+	}
+	FileTableNode* file = NULL;
+	if(state->nextFileID <= FUSE_ROOT_ID)
+	{
+		state->nextFileID = FUSE_ROOT_ID + 1;
+	}
+	if(node != NULL)
+	{
+		descriptor->fileID = state->nextFileID;
+		file = fileTableInsert(state->fileTable, state->fileTable->last, descriptor);
+	}
+	if(file != NULL)
+	{
+		state->nextFileID++;
+		atomic_fetch_add(&state->stats.files, 1);
+		file->descriptorNode = node;
+		file->descriptorSlot = slot;
+		descriptorTableNodeStore(node, slot, descriptor);
+		writebackMarkDirty(state, node, slot);
+		writebackMarkDirty(state, node, 0);
+	}
+	pthread_mutex_unlock(&state->metadataLock);
+
+	if(file == NULL)
+	{
+		internedNameRelease(filename);
+		free(descriptor);
+	}
+	return file;
+}
+
+bool deleteLockedFile(EFSState* state, FileTableNode* file)
+{
+	pthread_mutex_lock(&state->metadataLock);
+	bool success = __atomic_load_n(&file->table, __ATOMIC_ACQUIRE) != NULL
+		&& removeFile(state, file);
+	pthread_mutex_unlock(&state->metadataLock);
+	return success;
+}
+
+bool deleteFile(EFSState* state, uint64_t inode)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, inode);
+	if(file == NULL)
+	{
+		return false;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	bool success = deleteLockedFile(state, file);
+	pthread_rwlock_unlock(&file->lock);
+	return success;
+}
+
+bool deleteFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, descriptor->fileID);
+	if(file == NULL || file->fileDescriptor != descriptor)
+	{
+		return false;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	bool success = deleteLockedFile(state, file);
+	pthread_rwlock_unlock(&file->lock);
+	return success;
+}
+
+EFSCompactFileDescriptor* readDescriptor(EFSState* state, uint64_t inode)
+{
+	FileTableNode* file = fileTableSearchInode(state->fileTable, inode);
+	return file != NULL ? file->fileDescriptor : NULL;
+}
+
+/**
+ * Builds a copy of a descriptor owned by the file table, with its name
+ * interned and its fragments copied.
+ */
+static EFSCompactFileDescriptor* copyDescriptor(EFSState* state,
+	const EFSCompactFileDescriptor* descriptor)
+{
+	EFSCompactFileDescriptor* copy = malloc(sizeof(EFSCompactFileDescriptor));
+	if(copy == NULL)
+	{
+		return NULL;
+	}
+	memcpy(copy, descriptor, sizeof(EFSCompactFileDescriptor));
+	copy->filename = namePoolIntern(&state->namePool, descriptor->filename);
+	copy->fragments = malloc(sizeof(EFSFragmentDescriptor) * descriptor->numFragments);
+	if(copy->filename == NULL || (copy->fragments == NULL && descriptor->numFragments > 0))
+	{
+		internedNameRelease(copy->filename);
+		free(copy->fragments);
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->fragments, descriptor->fragments,
+		sizeof(EFSFragmentDescriptor) * descriptor->numFragments);
+	return copy;
+}
+
+bool updateDescriptor(EFSState* state, EFSCompactFileDescriptor* descriptor)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, descriptor->fileID);
+	if(file == NULL || file->descriptorNode == NULL)
+	{
+		return false;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	EFSCompactFileDescriptor* old = file->fileDescriptor;
+	EFSCompactFileDescriptor* current = old;
+	if(old != descriptor)
+	{
+		/*
+		 * Only the descriptor held in the file table is written back.
+		 * Readers without the lock may be using it, so a complete copy
+		 * of the provided one replaces it, and it is retired.
+		 */
+		current = copyDescriptor(state, descriptor);
+		if(current == NULL)
+		{
+			pthread_rwlock_unlock(&file->lock);
+			return false;
+		}
+		__atomic_store_n(&file->fileDescriptor, current, __ATOMIC_RELEASE);
+		epochRetire(&state->epoch, destroyFileDescriptor, old);
+		file->extentGeneration++;
+	}
+	/*
+	 * The record still holds the old parent and name hash, which tell
+	 * whether the file has to move within the directory index.
+	 */
+	bool moved = file->record->parent != current->parentID
+		|| file->record->nameHash != internedName(current->filename)->hash
+		|| old->filename != current->filename;
+	fileRecordUpdate(file);
+	if(moved)
+	{
+		pthread_mutex_lock(&state->metadataLock);
+		fileTableMove(state->fileTable, file);
+		pthread_mutex_unlock(&state->metadataLock);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	return true;
+}
+
+/**
+ * Locks a file and finds its pending data, for writing if write is set or
+ * for reading otherwise. Data stored inline is copied into the pending
+ * data of files locked for writing, so that it can be changed. Returns
+ * NULL without holding the lock if the file has been removed, if
+ * descriptor is set and is no longer the file's descriptor, or if its
+ * pending data could not be allocated. Must be called from inside a
+ * read-side section.
+ */
+static PendingData* lockNode(EFSState* state, FileTableNode* file,
+	EFSCompactFileDescriptor* descriptor, bool write)
+{
+	if(write)
+	{
+		pthread_rwlock_wrlock(&file->lock);
+	}
+	else
+	{
+		pthread_rwlock_rdlock(&file->lock);
+	}
+	/*
+	 * The descriptor is only checked once the file is locked, since
+	 * updateDescriptor may replace it until then.
+	 */
+	PendingData* pending = descriptor == NULL || file->fileDescriptor == descriptor
+		? delayedAllocationGet(state, file) : NULL;
+	if(pending == NULL || (write && !delayedAllocationUnpack(state, pending)))
+	{
+		pthread_rwlock_unlock(&file->lock);
+		return NULL;
+	}
+	return pending;
+}
+
+/**
+ * Finds the file of a descriptor, and locks it as lockNode does. Returns
+ * NULL without holding the lock if the file does not exist, or in any
+ * case lockNode does.
+ */
+static PendingData* lockFile(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, bool write)
+{
+	FileTableNode* file = fileTableSearchInode(state->fileTable, descriptor->fileID);
+	if(file == NULL)
+	{
+		return NULL;
+	}
+	return lockNode(state, file, descriptor, write);
+}
+
+static void unlockFile(PendingData* pending)
+{
+	pthread_rwlock_unlock(&pending->file->lock);
+}
+
+/**
+ * Transfers a batch of ranges gathered by transferData. Data read is
+ * verified against the checksums of its pages, and the checksums of pages
+ * written are updated.
+ */
+static bool transferVectors(EFSState* state, const ImageVector* vectors,
+	size_t count, bool write)
+{
+	if(!(write ? imageWritev(state, vectors, count) : imageReadv(state, vectors, count)))
+	{
+		return false;
+	}
+	bool success = true;
+	for(size_t i = 0; i < count; i++)
+	{
+		success = (write
+			? checksumUpdate(state, vectors[i].offset, vectors[i].buffer, vectors[i].size)
+			: checksumVerify(state, vectors[i].offset, vectors[i].buffer, vectors[i].size))
+			&& success;
+	}
+	return success;
+}
+
+/**
+ * Reads or writes the bytes of a file between offset and offset + size,
+ * which must lie within the file. Bytes in allocated pages are read from
+ * or written to the image; the rest are held in the pending data. Bytes
+ * in compressed fragments are read through the cache of decompressed
+ * units, and written by first expanding the fragment. Bytes in fragments
+ * shared with other files are written by first copying the fragment. Must
+ * be called with the file's lock held, for writing if write is set. Upon
+ * failure, error is set to the errno describing it.
+ */
+static bool transferData(EFSState* state, PendingData* pending,
+	uint64_t offset, uint64_t size, char* buffer, bool write, int* error)
+{
+	EFSCompactFileDescriptor* descriptor = pending->file->fileDescriptor;
+	uint64_t allocatedBytes = allocatedPages(descriptor) * PAGE_SIZE;
+	uint64_t done = 0;
+	if(write)
+	{
+		pending->generation++;
+	}
+
+	/*
+	 * The ranges of every fragment touched are gathered and transferred
+	 * as one request, so that the io_uring engine can submit them
+	 * together.
+	 */
+	ImageVector vectors[TRANSFER_BATCH];
+	size_t numVectors = 0;
+	while(done < size)
+	{
+		uint64_t position = offset + done;
+		uint64_t length = size - done;
+		if(position < allocatedBytes)
+		{
+			uint64_t index;
+			uint64_t fragmentOffset;
+			allocatorFind(descriptor, position, &index, &fragmentOffset);
+			EFSFragmentDescriptor* fragment = &descriptor->fragments[index];
+			uint64_t fragmentLength = fragmentPages(fragment) * PAGE_SIZE - fragmentOffset;
+			if(length > fragmentLength)
+			{
+				length = fragmentLength;
+			}
+			if(fragmentIsCompressed(fragment) && write)
+			{
+				/*
+				 * Compressed data cannot be changed in place, so the
+				 * fragment is rewritten uncompressed and the same range
+				 * is tried again.
+				 */
+				if(!compressionExpand(state, pending->file, index, error))
+				{
+					return false;
+				}
+				continue;
+			}
+			else if(write && pending->file->deduplicated && !dedupModify(state, fragment))
+			{
+				/*
+				 * Other files share the fragment, so the file is given
+				 * its own copy before it is changed.
+				 */
+				if(!dedupBreak(state, pending->file, index, error))
+				{
+					return false;
+				}
+				continue;
+			}
+			else if(fragmentIsCompressed(fragment))
+			{
+				if(!compressionRead(state, fragment, fragmentOffset, length, buffer + done))
+				{
+					*error = EIO;
+					return false;
+				}
+				done += length;
+				continue;
+			}
+			vectors[numVectors].buffer = buffer + done;
+			vectors[numVectors].size = length;
+			vectors[numVectors].offset = fragment->fragmentLocation * PAGE_SIZE + fragmentOffset;
+			numVectors++;
+			if(numVectors == TRANSFER_BATCH)
+			{
+				if(!transferVectors(state, vectors, numVectors, write))
+				{
+					*error = EIO;
+					return false;
+				}
+				numVectors = 0;
+			}
+		}
+		else if(write)
+		{
+			memcpy(pending->data + (position - allocatedBytes), buffer + done, length);
+		}
+		else
+		{
+			delayedAllocationRead(state, pending, position - allocatedBytes, length, buffer + done);
+		}
+		done += length;
+	}
+	if(numVectors > 0 && !transferVectors(state, vectors, numVectors, write))
+	{
+		*error = EIO;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Changes the size of a file. Bytes past the allocated pages of the file
+ * are kept in its pending data, so growing a file never allocates pages
+ * by itself. Must be called with the file's lock held for writing.
+ *
+ * If zero is set, bytes between the old and new size are cleared.
+ * Otherwise the caller must overwrite them. Upon failure, error is set to
+ * the errno describing it.
+ */
+static bool resizeLocked(EFSState* state, PendingData* pending,
+	uint64_t newSize, bool zero, int* error)
+{
+	FileTableNode* file = pending->file;
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t allocatedBytes = allocatedPages(descriptor) * PAGE_SIZE;
+	uint64_t oldSize = descriptor->filesize;
+	if(newSize == oldSize)
+	{
+		return true;
+	}
+	if(newSize > oldSize)
+	{
+		if(newSize > allocatedBytes
+			&& !delayedAllocationGrow(state, pending, newSize - allocatedBytes))
+		{
+			*error = ENOMEM;
+			return false;
+		}
+		if(zero && oldSize < allocatedBytes)
+		{
+			/*
+			 * Pages preallocated past the end of the file may hold stale
+			 * data, which must not become visible.
+			 */
+			uint64_t end = newSize < allocatedBytes ? newSize : allocatedBytes;
+			char* zeroes = calloc(1, end - oldSize);
+			if(zeroes == NULL)
+			{
+				*error = ENOMEM;
+			}
+			bool cleared = zeroes != NULL
+				&& transferData(state, pending, oldSize, end - oldSize, zeroes, true, error);
+			free(zeroes);
+			if(!cleared)
+			{
+				delayedAllocationShrink(state, pending,
+					oldSize > allocatedBytes ? oldSize - allocatedBytes : 0);
+				return false;
+			}
+		}
+	}
+	else if(newSize < allocatedBytes)
+	{
+		delayedAllocationShrink(state, pending, 0);
+		allocatorTruncate(state, file, (newSize + PAGE_SIZE - 1) / PAGE_SIZE);
+	}
+	else
+	{
+		delayedAllocationShrink(state, pending, newSize - allocatedBytes);
+	}
+	descriptor->filesize = newSize;
+	fileRecordUpdate(file);
+	pending->generation++;
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(state, file->descriptorNode, file->descriptorSlot);
+	}
+	return true;
+}
+
+/**
+ * Allocates pages for the pending data of a file once it exceeds the
+ * configured limit.
+ */
+static void flushIfOverLimit(EFSState* state, PendingData* pending)
+{
+	if(pending->size >= state->delayedAllocation.limit)
+	{
+		delayedAllocationFlush(state, pending->file);
+	}
+}
+
+uint64_t readFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	char* buffer)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, false);
+	if(pending == NULL)
+	{
+		return 0;
+	}
+	uint64_t filesize = descriptor->filesize;
+	if(offset >= filesize)
+	{
+		size = 0;
+	}
+	else if(size > filesize - offset)
+	{
+		size = filesize - offset;
+	}
+	int error;
+	if(!transferData(state, pending, offset, size, buffer, false, &error))
+	{
+		printf("\tFailed to read inode %" PRIu64 ".\n", descriptor->fileID);
+		size = 0;
+	}
+	unlockFile(pending);
+	return size;
+}
+
+uint64_t readFileByHandle(EFSState* state, OpenFile* handle,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	char* buffer)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, false);
+	if(pending == NULL)
+	{
+		return 0;
+	}
+	uint64_t filesize = descriptor->filesize;
+	if(offset >= filesize)
+	{
+		size = 0;
+	}
+	else if(size > filesize - offset)
+	{
+		size = filesize - offset;
+	}
+	pthread_mutex_lock(&handle->lock);
+	bool served = size == 0 || openFileRead(state, handle, pending->file,
+		pending->generation, offset, size, buffer);
+	pthread_mutex_unlock(&handle->lock);
+	int error;
+	if(!served && !transferData(state, pending, offset, size, buffer, false, &error))
+	{
+		printf("\tFailed to read inode %" PRIu64 ".\n", descriptor->fileID);
+		size = 0;
+	}
+	unlockFile(pending);
+	return size;
+}
+
+uint64_t readFile(EFSState* state, uint64_t inode, uint64_t offset,
+	uint64_t size, char* buffer)
+{
+	EFSCompactFileDescriptor* descriptor = readDescriptor(state, inode);
+	if(descriptor == NULL)
+	{
+		return 0;
+	}
+	return readFileByDescriptor(state, descriptor, offset, size, buffer);
+}
+
+uint64_t updateFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	const char* buffer)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, true);
+	if(pending == NULL)
+	{
+		return 0;
+	}
+	uint64_t filesize = descriptor->filesize;
+	if(offset >= filesize)
+	{
+		size = 0;
+	}
+	else if(size > filesize - offset)
+	{
+		size = filesize - offset;
+	}
+	int error;
+	if(!transferData(state, pending, offset, size, (char*) buffer, true, &error))
+	{
+		printf("\tFailed to write inode %" PRIu64 ".\n", descriptor->fileID);
+		size = 0;
+	}
+	unlockFile(pending);
+	return size;
+}
+
+uint64_t updateFile(EFSState* state, uint64_t inode, uint64_t offset,
+	uint64_t size, const char* buffer)
+{
+	EFSCompactFileDescriptor* descriptor = readDescriptor(state, inode);
+	if(descriptor == NULL)
+	{
+		return 0;
+	}
+	return updateFileByDescriptor(state, descriptor, offset, size, buffer);
+}
+
+bool appendFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t size, const char* buffer)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, true);
+	if(pending == NULL)
+	{
+		return false;
+	}
+	uint64_t oldSize = descriptor->filesize;
+	int error;
+	bool success = resizeLocked(state, pending, oldSize + size, false, &error);
+	if(success && !transferData(state, pending, oldSize, size, (char*) buffer, true, &error))
+	{
+		printf("\tFailed to append to inode %" PRIu64 ".\n", descriptor->fileID);
+		resizeLocked(state, pending, oldSize, false, &error);
+		success = false;
+	}
+	unlockFile(pending);
+	flushIfOverLimit(state, pending);
+	return success;
+}
+
+bool appendFile(EFSState* state, uint64_t inode, uint64_t size,
+	const char* buffer)
+{
+	EFSCompactFileDescriptor* descriptor = readDescriptor(state, inode);
+	if(descriptor == NULL)
+	{
+		return false;
+	}
+	return appendFileByDescriptor(state, descriptor, size, buffer);
+}
+
+/**
+ * Writes to a file locked for writing, as writeFileByDescriptor does.
+ */
+static uint64_t writeLocked(EFSState* state, PendingData* pending,
+	uint64_t offset, uint64_t size, const char* buffer, int* error)
+{
+	EFSCompactFileDescriptor* descriptor = pending->file->fileDescriptor;
+	/*
+	 * The file stays locked from the overwrite to the append, so that two
+	 * writes to the same tail cannot interleave.
+	 */
+	uint64_t written = 0;
+	*error = 0;
+	if(offset <= descriptor->filesize || resizeLocked(state, pending, offset, true, error))
+	{
+		uint64_t oldSize = descriptor->filesize;
+		uint64_t overlap = oldSize - offset;
+		if(overlap > size)
+		{
+			overlap = size;
+		}
+		if(overlap > 0 && !transferData(state, pending, offset, overlap, (char*) buffer, true, error))
+		{
+			printf("\tFailed to write inode %" PRIu64 ".\n", descriptor->fileID);
+		}
+		else if(size > overlap)
+		{
+			/*
+			 * Appended data is held in memory until it is flushed, so that
+			 * all of it can be given a single fragment.
+			 */
+			written = overlap;
+			if(resizeLocked(state, pending, offset + size, false, error)
+				&& transferData(state, pending, oldSize, size - overlap, (char*) buffer + overlap, true, error))
+			{
+				written = size;
+			}
+			else
+			{
+				printf("\tFailed to append to inode %" PRIu64 ".\n", descriptor->fileID);
+				int ignored;
+				resizeLocked(state, pending, oldSize, false, &ignored);
+			}
+		}
+		else
+		{
+			written = size;
+		}
+	}
+	return written;
+}
+
+uint64_t writeFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	const char* buffer, int* error)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, true);
+	if(pending == NULL)
+	{
+		*error = ENOENT;
+		return 0;
+	}
+	uint64_t written = writeLocked(state, pending, offset, size, buffer, error);
+	unlockFile(pending);
+	flushIfOverLimit(state, pending);
+	return written;
+}
+
+uint64_t writeFileByNode(EFSState* state, FileTableNode* file,
+	uint64_t offset, uint64_t size, const char* buffer, int* error)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockNode(state, file, NULL, true);
+	if(pending == NULL)
+	{
+		*error = ENOENT;
+		return 0;
+	}
+	uint64_t written = writeLocked(state, pending, offset, size, buffer, error);
+	unlockFile(pending);
+	flushIfOverLimit(state, pending);
+	return written;
+}
+
+/**
+ * Shares whole fragments of the source with the destination instead of
+ * copying their data, by appending them to the destination and taking a
+ * reference to their extents. They are copied once either file changes
+ * them. Fragments can only be appended, so this is done only while the
+ * destination ends at destinationOffset on a page boundary with nothing
+ * pending, and only for fragments starting at sourceOffset or later which
+ * lie within the range, or which end the source.
+ *
+ * @returns The number of bytes shared.
+ */
+static uint64_t shareFragments(EFSState* state, EFSCompactFileDescriptor* source,
+	uint64_t sourceOffset, EFSCompactFileDescriptor* destination,
+	uint64_t destinationOffset, uint64_t length)
+{
+	if(source == destination || sourceOffset % PAGE_SIZE != 0
+		|| destinationOffset % PAGE_SIZE != 0)
+	{
+		return 0;
+	}
+	EPOCH_READ_SECTION(&state->epoch);
+	/*
+	 * Both files are changed, so both are locked for writing, in order of
+	 * inode so that opposite copies cannot deadlock.
+	 */
+	bool sourceFirst = source->fileID < destination->fileID;
+	PendingData* first = lockFile(state, sourceFirst ? source : destination, true);
+	if(first == NULL)
+	{
+		return 0;
+	}
+	PendingData* second = lockFile(state, sourceFirst ? destination : source, true);
+	if(second == NULL)
+	{
+		unlockFile(first);
+		return 0;
+	}
+	PendingData* from = sourceFirst ? first : second;
+	PendingData* to = sourceFirst ? second : first;
+	uint64_t end = sourceOffset + length;
+	uint64_t shared = 0;
+	if(to->size == 0 && destination->filesize == destinationOffset
+		&& allocatedPages(destination) * PAGE_SIZE == destinationOffset)
+	{
+		uint64_t position = 0;
+		for(uint64_t i = 0; i < source->numFragments && position < end
+			&& position <= sourceOffset + shared; i++)
+		{
+			EFSFragmentDescriptor fragment = source->fragments[i];
+			uint64_t bytes = fragmentPages(&fragment) * PAGE_SIZE;
+			if(position < sourceOffset)
+			{
+				position += bytes;
+				continue;
+			}
+			if(fragmentIsCompressed(&fragment)
+				|| (position + bytes > end && end < source->filesize)
+				|| !dedupShare(state, &fragment))
+			{
+				break;
+			}
+			if(!allocatorAppend(state, to->file, &fragment))
+			{
+				dedupRelease(state, &fragment);
+				break;
+			}
+			shared += position + bytes < end ? bytes : end - position;
+			position += bytes;
+		}
+	}
+	if(shared > 0)
+	{
+		from->file->deduplicated = true;
+		to->file->deduplicated = true;
+		int error;
+		resizeLocked(state, to, destinationOffset + shared, false, &error);
+	}
+	unlockFile(second);
+	unlockFile(first);
+	return shared;
+}
+
+uint64_t copyFileRange(EFSState* state, EFSCompactFileDescriptor* source,
+	uint64_t sourceOffset, EFSCompactFileDescriptor* destination,
+	uint64_t destinationOffset, uint64_t length, int* error)
+{
+	*error = 0;
+	if(sourceOffset >= source->filesize)
+	{
+		return 0;
+	}
+	if(length > source->filesize - sourceOffset)
+	{
+		length = source->filesize - sourceOffset;
+	}
+	uint64_t copied = shareFragments(state, source, sourceOffset,
+		destination, destinationOffset, length);
+	if(copied == length)
+	{
+		atomic_fetch_add(&state->stats.bytesCopiedInImage, copied);
+		return copied;
+	}
+	/*
+	 * Small copies are left to delayed allocation like any other write.
+	 * Failing to preallocate is not fatal, since the data can still be
+	 * written to whatever space is available as it is copied.
+	 */
+	if(length - copied >= COPY_CHUNK_SIZE
+		&& !preallocateFile(state, destination, destinationOffset + copied, length - copied, true))
+	{
+		printf("\tCould not preallocate %" PRIu64 " bytes for inode %" PRIu64 ".\n",
+			length - copied, destination->fileID);
+	}
+	char* buffer = malloc(COPY_CHUNK_SIZE);
+	if(buffer == NULL)
+	{
+		*error = ENOMEM;
+	}
+	while(buffer != NULL && copied < length)
+	{
+		uint64_t chunk = length - copied < COPY_CHUNK_SIZE ? length - copied : COPY_CHUNK_SIZE;
+		uint64_t read = readFileByDescriptor(state, source, sourceOffset + copied, chunk, buffer);
+		if(read == 0)
+		{
+			/*
+			 * The range lies within the source, so reading nothing means
+			 * the data could not be read or did not match its checksums.
+			 */
+			*error = EIO;
+			break;
+		}
+		uint64_t written = writeFileByDescriptor(state, destination,
+			destinationOffset + copied, read, buffer, error);
+		copied += written;
+		if(written < read)
+		{
+			break;
+		}
+		else if(read < chunk)
+		{
+			break;
+		}
+	}
+	free(buffer);
+	atomic_fetch_add(&state->stats.bytesCopiedInImage, copied);
+	return copied;
+}
+
+bool resizeFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t newSize)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, true);
+	if(pending == NULL)
+	{
+		return false;
+	}
+	int error;
+	bool success = resizeLocked(state, pending, newSize, true, &error);
+	unlockFile(pending);
+	flushIfOverLimit(state, pending);
+	return success;
+}
+
+bool resizeFile(EFSState* state, uint64_t inode, uint64_t newSize)
+{
+	EFSCompactFileDescriptor* descriptor = readDescriptor(state, inode);
+	if(descriptor == NULL)
+	{
+		return false;
+	}
+	return resizeFileByDescriptor(state, descriptor, newSize);
+}
+
+bool preallocateFile(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	uint64_t offset, uint64_t length, bool keepSize)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	PendingData* pending = lockFile(state, descriptor, true);
+	if(pending == NULL)
+	{
+		return false;
+	}
+	uint64_t end = offset + length;
+	uint64_t pages = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint64_t allocated = allocatedPages(descriptor);
+	bool success = true;
+	if(pages > allocated)
+	{
+		/*
+		 * Pending data always starts at the first unallocated page, so it
+		 * is flushed together with the preallocation. This places both in
+		 * the same fragment where possible.
+		 */
+		success = delayedAllocationFlushLocked(state, pending, pages - allocated);
+	}
+	if(success && !keepSize && end > descriptor->filesize)
+	{
+		int error;
+		success = resizeLocked(state, pending, end, true, &error);
+	}
+	unlockFile(pending);
+	return success;
+}
+
+/**
+ * Sets one of the timestamps of a file to the current time, and leaves
+ * it to be written back lazily.
+ */
+static void touchFile(EFSState* state, FileTableNode* file, uint64_t now,
+	bool modified)
+{
+	/*
+	 * The descriptor is only loaded once the file is locked, since
+	 * updateDescriptor may replace it until then.
+	 */
+	pthread_rwlock_wrlock(&file->lock);
+	if(__atomic_load_n(&file->table, __ATOMIC_ACQUIRE) == NULL)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		return;
+	}
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	if(modified)
+	{
+		descriptor->lastModified = now;
+	}
+	else
+	{
+		descriptor->lastAccessed = now;
+	}
+	fileRecordUpdate(file);
+	pthread_rwlock_unlock(&file->lock);
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkTimes(state, file->descriptorNode, file->descriptorSlot);
+	}
+}
+
+void markFileAccessed(EFSState* state, FileTableNode* file)
+{
+	if(state->options.noatime)
+	{
+		return;
+	}
+
+	/*
+	 * As with relatime, reads only move the access time past the last
+	 * modification, or once it is a day old, so a file read over and over
+	 * is only touched once and its lock is not taken.
+	 */
+	EFSCompactFileDescriptor* descriptor = __atomic_load_n(&file->fileDescriptor, __ATOMIC_ACQUIRE);
+	uint64_t now = time(NULL);
+	uint64_t accessed = __atomic_load_n(&descriptor->lastAccessed, __ATOMIC_RELAXED);
+	uint64_t modified = __atomic_load_n(&descriptor->lastModified, __ATOMIC_RELAXED);
+	if(accessed > modified && (int64_t) (now - accessed) < RELATIME_WINDOW)
+	{
+		return;
+	}
+	touchFile(state, file, now, false);
+}
+
+void markFileModified(EFSState* state, FileTableNode* file)
+{
+	/*
+	 * Timestamps only have a resolution of a second, so only the first
+	 * write to a file in each second changes anything.
+	 */
+	uint64_t now = time(NULL);
+	EFSCompactFileDescriptor* descriptor = __atomic_load_n(&file->fileDescriptor, __ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&descriptor->lastModified, __ATOMIC_RELAXED) == now)
+	{
+		return;
+	}
+	touchFile(state, file, now, true);
+}
@@ -6,15 +6,34 @@
 
 #include <EFS/file_descriptor.h>
 
+#include "efsstate.h"
+#include "file_table.h"
+#include "open_file.h"
+
+/*
+ * C has no overloading, so the variants of each function which take a
+ * descriptor rather than an inode are suffixed with ByDescriptor.
+ */
+
 /**
  * Create a new empty file with the specified parent, and write its descriptor to
- * disk.
+ * disk. The descriptor is stored in a free slot found in constant time; a new
+ * descriptor node is only allocated from free space when every existing node is
+ * full.
+ * 
+ * The new file has no permissions. The caller should fill these in, then
+ * mark the descriptor as dirty so that they are written back.
+ * 
+ * Fails if there is not enough space in the filesystem for a new descriptor
+ * node, or if an I/O error occured.
  * 
+ * @param state The current filesystem state
  * @param parent The parent of the new file
+ * @param name The name of the new file, which is interned
  * 
- * @returns The inode of the new file
+ * @returns The node in the file table for the new file. NULL upon failure.
  */
-uint64_t createFile(uint64_t parent);
+FileTableNode* createFile(EFSState* state, uint64_t parent, const char* name);
 
 /**
  * Free all space allocated to the specified inode, and clear its file
@@ -24,11 +43,28 @@ uint64_t createFile(uint64_t parent);
  * Fails if the inode does not exist, the inode corresponds to the root 
  * directory, or if an I/O error occured.
  * 
+ * @param state The current filesystem state
  * @param inode The inode to delete
  * 
  * @returns True upon success, false upon failure.
  */
-bool deleteFile(uint64_t inode);
+bool deleteFile(EFSState* state, uint64_t inode);
+
+/**
+ * Free all space allocated to a file whose lock the caller already holds
+ * for writing, and clear its file descriptor. Used when the caller must
+ * check the file, such as a directory being empty, and delete it without
+ * anything changing in between.
+ * 
+ * Fails if the file has already been removed, or corresponds to the root
+ * directory.
+ * 
+ * @param state The current filesystem state
+ * @param file The node in the file table of the file to delete
+ * 
+ * @returns True upon success, false upon failure.
+ */
+bool deleteLockedFile(EFSState* state, FileTableNode* file);
 
 /**
  * Free all space allocated to the specified inode, and clear its file
@@ -38,21 +74,24 @@ bool deleteFile(uint64_t inode);
  * Fails if the descriptor on disk does not match the provided descriptor, the 
  * inode corresponds to the root directory, or if an I/O error occured.
  * 
+ * @param state The current filesystem state
  * @param descriptor The inode to delete
  * 
  * @returns True upon success, false upon failure.
  */
-bool deleteFile(EFSCompactFileDescriptor* descriptor);
+bool deleteFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor);
 
 /**
  * Reads the file descriptor with the specified inode. Fails if the specified inode
  * does not exist, or if an I/O error occurs.
  * 
+ * @param state The current filesystem state
  * @param inode The inode to load the file descriptor of
  * 
  * @returns A pointer to the file descriptor. NULL upon failure.
  */
-EFSCompactFileDescriptor* readDescriptor(uint64_t inode);
+EFSCompactFileDescriptor* readDescriptor(EFSState* state, uint64_t inode);
 
 /**
  * Overwrites a file descriptor on disk with the one specified. Uses the fileID
@@ -60,16 +99,19 @@ EFSCompactFileDescriptor* readDescriptor(uint64_t inode);
  * overwrite. Fails if descriptor->fileID does not match any descriptor on disk,
  * or if an I/O error occurs.
  * 
+ * Unless it is the one held in the file table, the provided descriptor is
+ * copied, and remains owned by the caller. Moving or renaming the file
+ * updates the directory it is listed in.
+ * 
+ * @param state The current filesystem state
  * @param descriptor The descriptor to write onto disk. descriptor->fileID
  * specifies which desciptor on disk is to be overwritten.
  * 
  * @returns True upon success, false upopn failure.
  */
-bool updateDescriptor(EFSCompactFileDescriptor* descriptor);
+bool updateDescriptor(EFSState* state, EFSCompactFileDescriptor* descriptor);
 
 /**
- * @file efs_functions.cpp
- * 
  * Read up to the specified number of bytes from a file, starting at the specified
  * offset. Buffer is assumed to be allocated to sufficient size beforehand. 
  * 
@@ -79,6 +121,7 @@ bool updateDescriptor(EFSCompactFileDescriptor* descriptor);
  * If an I/O error occurs, the function returns 0 and the contents of buffer are 
  * undefined.
  * 
+ * @param state The current filesystem state
  * @param descriptor The inode from which to read.
  * @param offset The offset to start reading from.
  * @param size The maximum number of bytes to read.
@@ -86,8 +129,28 @@ bool updateDescriptor(EFSCompactFileDescriptor* descriptor);
  * 
  * @returns The number of bytes actually read. 0 upon I/O error.
  */
-uint64_t readFile(EFSCompactFileDescriptor* descriptor, uint64_t offset, 
-	uint64_t size, char* buffer);
+uint64_t readFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	char* buffer);
+
+/**
+ * Read up to the specified number of bytes from a file through an open
+ * handle. Behaves like readFileByDescriptor, but maps offsets through the
+ * handle's cached extent map and serves sequential reads from the
+ * handle's readahead data.
+ * 
+ * @param state The current filesystem state
+ * @param handle The handle the file is being read through
+ * @param descriptor The descriptor of the file to read from
+ * @param offset The offset to start reading from.
+ * @param size The maximum number of bytes to read.
+ * @param buffer The location to read into
+ * 
+ * @returns The number of bytes actually read. 0 upon I/O error.
+ */
+uint64_t readFileByHandle(EFSState* state, OpenFile* handle,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	char* buffer);
 
 /**
  * Read up to the specified number of bytes from a file, starting at the specified
@@ -100,6 +163,7 @@ uint64_t readFile(EFSCompactFileDescriptor* descriptor, uint64_t offset,
  * undefined. If the file does not exist, returns 0 and does not modify the
  * provided buffer.
  * 
+ * @param state The current filesystem state
  * @param inode The inode from which to read.
  * @param offset The offset to start reading from.
  * @param size The maximum number of bytes to read.
@@ -107,7 +171,8 @@ uint64_t readFile(EFSCompactFileDescriptor* descriptor, uint64_t offset,
  * 
  * @returns The number of bytes actually read. 0 upon I/O error.
  */
-uint64_t readFile(uint64_t inode, uint64_t offset, uint64_t size, char* buffer);
+uint64_t readFile(EFSState* state, uint64_t inode, uint64_t offset,
+	uint64_t size, char* buffer);
 
 /**
  * Overwrite the region in the provided inode starting at offset and spanning
@@ -120,6 +185,7 @@ uint64_t readFile(uint64_t inode, uint64_t offset, uint64_t size, char* buffer);
  * reached. To test this, the caller should always compare this function's 
  * return value with size.
  * 
+ * @param state The current filesystem state
  * @param inode The inode to update.
  * @param offset The position to start writing inside the specified inode.
  * @param size The number of bytes to write
@@ -127,8 +193,8 @@ uint64_t readFile(uint64_t inode, uint64_t offset, uint64_t size, char* buffer);
  * 
  * @returns The number of bytes actually written. 0 upon I/O error.
  */
-uint64_t updateFile(uint64_t inode, uint64_t offset, uint64_t size, 
-	const char* buffer);
+uint64_t updateFile(EFSState* state, uint64_t inode, uint64_t offset,
+	uint64_t size, const char* buffer);
 
 /**
  * Overwrite the region in the provided inode starting at offset and spanning
@@ -141,6 +207,7 @@ uint64_t updateFile(uint64_t inode, uint64_t offset, uint64_t size,
  * reached. To test this, the caller should always compare this function's 
  * return value with size.
  * 
+ * @param state The current filesystem state
  * @param descriptor The inode to update.
  * @param offset The position to start writing inside the specified inode.
  * @param size The number of bytes to write
@@ -148,8 +215,85 @@ uint64_t updateFile(uint64_t inode, uint64_t offset, uint64_t size,
  * 
  * @returns The number of bytes actually written. 0 upon I/O error.
  */
-uint64_t updateFile(EFSCompactFileDescriptor* descriptor, uint64_t offset, 
-	uint64_t size, const char* buffer);
+uint64_t updateFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	const char* buffer);
+
+/**
+ * Write size bytes from buffer into the specified inode, starting at offset.
+ * Bytes inside the file are overwritten in place, and the rest are appended.
+ * If offset lies past the end of the file, the gap is filled with zeroes.
+ * 
+ * Only imformation regarding filesize and fragmentation will be updated inside 
+ * the descriptor. Last accessed and last modified dates should be updated after 
+ * the file is released. 
+ * 
+ * Fails if an I/O error occurs, if there is not enough space in the filesystem, 
+ * if the file cannot be fragmented further, or if the file does not exist. If
+ * some bytes were overwritten before the failure, their number is returned.
+ * 
+ * @param state The current filesystem state
+ * @param descriptor The inode to write to
+ * @param offset The position to start writing inside the specified inode.
+ * @param size The number of bytes to write
+ * @param buffer The data to write
+ * @param error Set to the errno describing why the write stopped short:
+ * ENOENT if the file does not exist, EIO if an I/O error occurred, ENOSPC
+ * if there is not enough space, or ENOMEM. Set to 0 if it did not.
+ * 
+ * @returns The number of bytes actually written. 0 upon failure.
+ */
+uint64_t writeFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t offset, uint64_t size,
+	const char* buffer, int* error);
+
+/**
+ * Write size bytes from buffer into the specified file, as
+ * writeFileByDescriptor does. The descriptor written to is the one the
+ * file holds once it is locked, so the write is not lost to a concurrent
+ * replacement of the descriptor. Must be called from inside a read-side
+ * section.
+ * 
+ * @param state The current filesystem state
+ * @param file The file to write to
+ * @param offset The position to start writing inside the file
+ * @param size The number of bytes to write
+ * @param buffer The data to write
+ * @param error Set as by writeFileByDescriptor
+ * 
+ * @returns The number of bytes actually written. 0 upon failure.
+ */
+uint64_t writeFileByNode(EFSState* state, FileTableNode* file,
+	uint64_t offset, uint64_t size, const char* buffer, int* error);
+
+/**
+ * Copy up to length bytes from one file to another without passing the data
+ * through the kernel. Whole fragments appended to the end of the destination
+ * are shared with the source rather than copied, and are only copied once
+ * either file changes them. For large copies, space for the rest of the
+ * destination range is allocated before copying starts, so that it occupies
+ * as few fragments as possible.
+ * The two ranges must not overlap if both refer to the same file.
+ * 
+ * If EOF of the source is reached, the function stops and returns the number
+ * of bytes that could be copied.
+ * 
+ * @param state The current filesystem state
+ * @param source The inode to copy from
+ * @param sourceOffset The position to start reading from
+ * @param destination The inode to copy to
+ * @param destinationOffset The position to start writing to
+ * @param length The maximum number of bytes to copy
+ * @param error Set to the errno describing why the copy stopped short:
+ * EIO if the source could not be read, the error of writeFileByDescriptor
+ * if the destination could not be written, or ENOMEM. Set to 0 if it did
+ * not.
+ * 
+ * @returns The number of bytes actually copied. 0 upon failure.
+ */
+uint64_t copyFileRange(EFSState* state, EFSCompactFileDescriptor* source,
+	uint64_t sourceOffset, EFSCompactFileDescriptor* destination,
+	uint64_t destinationOffset, uint64_t length, int* error);
 
 /**
  * Append the specified data the the end of the specified inode, and update its
@@ -163,13 +307,15 @@ uint64_t updateFile(EFSCompactFileDescriptor* descriptor, uint64_t offset,
  * Fails if an I/O error occurs, if there is not enough space in the filesystem, 
  * if the file cannot be fragmented further, or if the file does not exist.
  * 
+ * @param state The current filesystem state
  * @param inode The inode to append data to
  * @param size The number of bytes to append
  * @param buffer The data to append to the inode
  * 
  * @returns True upon success, false upon failure.
  */
-bool appendFile(uint64_t inode, uint64_t size, const char* buffer);
+bool appendFile(EFSState* state, uint64_t inode, uint64_t size,
+	const char* buffer);
 
 /**
  * Append the specified data the the end of the specified inode, and update its
@@ -183,14 +329,15 @@ bool appendFile(uint64_t inode, uint64_t size, const char* buffer);
  * Fails if an I/O error occurs, if there is not enough space in the filesystem, 
  * if the file cannot be fragmented further, or if the file does not exist.
  * 
+ * @param state The current filesystem state
  * @param descriptor The inode to append data to
  * @param size The number of bytes to append
  * @param buffer The data to append to the inode
  * 
  * @returns True upon success, false upon failure.
  */
-bool appendFile(EFSCompactFileDescriptor* descriptor, uint64_t size, 
-	const char* buffer);
+bool appendFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t size, const char* buffer);
 
 /**
  * Adjusts the filesize of the specified inode. Allocates or deallocates blocks at
@@ -200,12 +347,13 @@ bool appendFile(EFSCompactFileDescriptor* descriptor, uint64_t size,
  * Fails if an I/O error occurs, if there is not enough space in the filesystem, 
  * if the file could not be fragmented further., or if the file does not exis.
  * 
+ * @param state The current filesystem state
  * @param inode The inode to resize
  * @param newSize The new size of the inode in bytes
  * 
  * @returns True upon success, false upon failure.
  */
-bool resizeFile(uint64_t inode, uint64_t newSize);
+bool resizeFile(EFSState* state, uint64_t inode, uint64_t newSize);
 
 /**
  * Adjusts the filesize of the specified inode. Allocates or deallocates blocks at
@@ -215,11 +363,56 @@ bool resizeFile(uint64_t inode, uint64_t newSize);
  * Fails if an I/O error occurs, if there is not enough space in the filesystem, 
  * if the file could not be fragmented further, or if the file does not exist.
  * 
+ * @param state The current filesystem state
  * @param descriptor The inode to resize
  * @param newSize The new size of the inode in bytes
  * 
  * @returns True upon success, false upon failure.
  */
-bool resizeFile(EFSCompactFileDescriptor* descriptor, uint64_t newSize);
+bool resizeFileByDescriptor(EFSState* state,
+	EFSCompactFileDescriptor* descriptor, uint64_t newSize);
+
+/**
+ * Allocates pages to the specified file so that every byte up to offset +
+ * length is backed by space in the filesystem. Any data still waiting for
+ * delayed allocation is given space at the same time, in a single fragment
+ * where possible. Unless keepSize is set, the file is then extended to
+ * offset + length bytes if it is smaller.
+ * 
+ * Fails if an I/O error occurs, if there is not enough space in the filesystem,
+ * if the file could not be fragmented further, or if the file does not exist.
+ * 
+ * @param state The current filesystem state
+ * @param descriptor The inode to allocate space to
+ * @param offset The start of the region to allocate, in bytes
+ * @param length The length of the region to allocate, in bytes
+ * @param keepSize If set, the size of the file is not changed
+ * 
+ * @returns True upon success, false upon failure.
+ */
+bool preallocateFile(EFSState* state, EFSCompactFileDescriptor* descriptor,
+	uint64_t offset, uint64_t length, bool keepSize);
+
+/**
+ * Updates the access time of a file after it has been read, unless
+ * access times are disabled. Like relatime, the time only moves if the
+ * file was modified since it was last read or was last read a day ago.
+ * The new time is kept in memory and written back lazily, so reads never
+ * cause descriptor writes of their own.
+ * 
+ * @param state The current filesystem state
+ * @param file The file that was read
+ */
+void markFileAccessed(EFSState* state, FileTableNode* file);
+
+/**
+ * Updates the modification time of a file after it has been written to.
+ * The new time is kept in memory and written back lazily, along with
+ * whatever else the write changed in the descriptor.
+ * 
+ * @param state The current filesystem state
+ * @param file The file that was written to
+ */
+void markFileModified(EFSState* state, FileTableNode* file);
 
 #endif
@@ -0,0 +1,1178 @@
+/**
+ * Checks an EFS image for inconsistencies without mounting it.
+ *
+ * The descriptor and free space chains are walked first, so that the
+ * parsers shared with efsfuse are only run on chains which end. Files are
+ * then checked by several threads at once, each collecting the extents of
+ * the image its files occupy. Every extent, including those of the
+ * metadata and free space, is sorted by a parallel merge sort and swept in
+ * order, so that any two extents which overlap are found in one pass.
+ */
+
+#define FUSE_USE_VERSION 312
+
+#include <fuse3/fuse_lowlevel.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <EFS/superblock.h>
+#include <EFS/file_descriptor.h>
+#include <EFS/file_descriptor_node.h>
+#include <EFS/free_space_node.h>
+
+#include "allocator.h"
+#include "checksum.h"
+#include "compression.h"
+#include "efsstate.h"
+#include "file_table.h"
+#include "image_io.h"
+#include "util.h"
+
+/**
+ * The number of pages read at a time while data is verified against its
+ * checksums.
+ */
+#define EFSCK_CHUNK_PAGES 256
+
+/**
+ * The number of extents each thread takes at a time while data is
+ * verified.
+ */
+#define EFSCK_VERIFY_BATCH 64
+
+/**
+ * What an extent of the image holds.
+ */
+typedef enum extent_kind
+{
+	EXTENT_SUPERBLOCK,
+	EXTENT_DESCRIPTORS,
+	EXTENT_CHECKSUMS,
+	EXTENT_FREE,
+	EXTENT_FRAGMENT
+} ExtentKind;
+
+/**
+ * A range of pages of the image, and what occupies it.
+ */
+typedef struct check_extent
+{
+	/**
+	 * The first page of the extent.
+	 */
+	uint64_t location;
+
+	/**
+	 * The number of pages in the extent.
+	 */
+	uint64_t pages;
+
+	/**
+	 * The inode of the file holding the extent, if it is a fragment.
+	 */
+	uint64_t inode;
+
+	/**
+	 * The index of the fragment within its file, if it is a fragment.
+	 */
+	uint32_t index;
+
+	/**
+	 * What the extent holds.
+	 */
+	uint8_t kind;
+
+	/**
+	 * Set if the extent is a compressed fragment, which may not be shared.
+	 */
+	bool compressed;
+
+} CheckExtent;
+
+/**
+ * A growable array of extents.
+ */
+typedef struct extent_list
+{
+	CheckExtent* extents;
+	size_t count;
+	size_t capacity;
+} ExtentList;
+
+/**
+ * Everything a check needs, shared by its threads.
+ */
+typedef struct check
+{
+	/**
+	 * The filesystem state the image was read into.
+	 */
+	EFSState* state;
+
+	/**
+	 * The node of every file, sorted by inode.
+	 */
+	FileTableNode** files;
+
+	/**
+	 * The number of entries in files.
+	 */
+	size_t numFiles;
+
+	/**
+	 * The number of threads files are checked by.
+	 */
+	unsigned int numThreads;
+
+	/**
+	 * The extents found by each thread, followed by those of the metadata
+	 * and free space.
+	 */
+	ExtentList* lists;
+
+	/**
+	 * Every extent, sorted by location, once the files have been checked.
+	 */
+	CheckExtent* extents;
+
+	/**
+	 * The number of entries in extents.
+	 */
+	size_t numExtents;
+
+	/**
+	 * The next extent to be verified against its checksums.
+	 */
+	atomic_size_t nextVerify;
+
+	/**
+	 * The number of inconsistencies found.
+	 */
+	atomic_uint_fast64_t errors;
+
+	/**
+	 * The number of oddities found which lose no data.
+	 */
+	atomic_uint_fast64_t warnings;
+
+	/**
+	 * The number of pages read while data was verified.
+	 */
+	atomic_uint_fast64_t pagesVerified;
+
+	/**
+	 * Keeps reports from different threads from being interleaved.
+	 */
+	pthread_mutex_t outputLock;
+
+} Check;
+
+/**
+ * Prints an inconsistency, or an oddity if error is not set, and counts
+ * it.
+ */
+static void report(Check* check, bool error, const char* format, ...)
+{
+	va_list arguments;
+	va_start(arguments, format);
+	pthread_mutex_lock(&check->outputLock);
+	printf(error ? "error: " : "warning: ");
+	vprintf(format, arguments);
+	printf("\n");
+	pthread_mutex_unlock(&check->outputLock);
+	va_end(arguments);
+	atomic_fetch_add(error ? &check->errors : &check->warnings, 1);
+}
+
+static bool addExtent(ExtentList* list, uint64_t location, uint64_t pages,
+	ExtentKind kind, uint64_t inode, uint32_t index, bool compressed)
+{
+	if(list->count == list->capacity)
+	{
+		size_t capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+		CheckExtent* extents = realloc(list->extents, sizeof(CheckExtent) * capacity);
+		if(extents == NULL)
+		{
+			return false;
+		}
+		list->extents = extents;
+		list->capacity = capacity;
+	}
+	list->extents[list->count++] = (CheckExtent) { location, pages, inode, index, kind, compressed };
+	return true;
+}
+
+static const char* kindName(uint8_t kind)
+{
+	switch(kind)
+	{
+		case EXTENT_SUPERBLOCK:
+			return "the superblock";
+		case EXTENT_DESCRIPTORS:
+			return "the descriptor node";
+		case EXTENT_CHECKSUMS:
+			return "the checksum table";
+		case EXTENT_FREE:
+			return "the free region";
+		default:
+			return "fragment";
+	}
+}
+
+/**
+ * Describes an extent for a report.
+ */
+static void describeExtent(const CheckExtent* extent, char* text, size_t size)
+{
+	if(extent->kind == EXTENT_FRAGMENT)
+	{
+		snprintf(text, size, "fragment %" PRIu32 " of inode %" PRIu64 " (pages %" PRIu64 "-%" PRIu64 ")",
+			extent->index, extent->inode, extent->location, extent->location + extent->pages - 1);
+	}
+	else
+	{
+		snprintf(text, size, "%s (pages %" PRIu64 "-%" PRIu64 ")", kindName(extent->kind),
+			extent->location, extent->location + extent->pages - 1);
+	}
+}
+
+/**
+ * Orders extents by location, longest first, so that the extent shared by
+ * several fragments is met at its full length before the shorter
+ * fragments sharing it.
+ */
+static int compareExtents(const void* first, const void* second)
+{
+	const CheckExtent* a = first;
+	const CheckExtent* b = second;
+	if(a->location != b->location)
+	{
+		return a->location < b->location ? -1 : 1;
+	}
+	if(a->pages != b->pages)
+	{
+		return a->pages > b->pages ? -1 : 1;
+	}
+	return (int) a->kind - (int) b->kind;
+}
+
+static int compareFiles(const void* first, const void* second)
+{
+	uint64_t a = (*(FileTableNode* const*) first)->fileDescriptor->fileID;
+	uint64_t b = (*(FileTableNode* const*) second)->fileDescriptor->fileID;
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/**
+ * Finds a file by inode in the sorted array of files.
+ *
+ * @returns Its index, or the number of files if there is no such file.
+ */
+static size_t findFileIndex(Check* check, uint64_t inode)
+{
+	size_t low = 0;
+	size_t high = check->numFiles;
+	while(low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		uint64_t found = check->files[middle]->fileDescriptor->fileID;
+		if(found == inode)
+		{
+			return middle;
+		}
+		else if(found < inode)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	return check->numFiles;
+}
+
+static FileTableNode* findFile(Check* check, uint64_t inode)
+{
+	size_t index = findFileIndex(check, inode);
+	return index < check->numFiles ? check->files[index] : NULL;
+}
+
+/**
+ * Walks the chain of descriptor nodes, checking that every node lies
+ * within the image and that the chain ends. Records the extent of each
+ * node, and the count of descriptors its header claims.
+ */
+static bool walkDescriptorChain(Check* check, uint64_t** counts, size_t* numNodes)
+{
+	EFSState* state = check->state;
+	uint64_t size = state->filesystemSize;
+	uint64_t* visited = calloc((size + 63) / 64, sizeof(uint64_t));
+	EFSFileDescriptorNode* node = malloc(sizeof(EFSFileDescriptorNode));
+	ExtentList* list = &check->lists[check->numThreads];
+	size_t capacity = 0;
+	*counts = NULL;
+	*numNodes = 0;
+	bool success = visited != NULL && node != NULL;
+	uint64_t previous = 0;
+	for(uint64_t next = state->fileDescriptorList; success && next != 0; next = node->next)
+	{
+		if(next >= size || size - next < FT_NODE_SIZE)
+		{
+			report(check, true, "descriptor node at page %" PRIu64 ", linked from page %" PRIu64 ", lies past the end of the image",
+				next, previous);
+			success = false;
+		}
+		else if(visited[next / 64] & (1ULL << (next % 64)))
+		{
+			report(check, true, "the chain of descriptor nodes loops back to page %" PRIu64 " from page %" PRIu64,
+				next, previous);
+			success = false;
+		}
+		else if(!imageRead(state, node, PAGE_SIZE, next * PAGE_SIZE))
+		{
+			report(check, true, "could not read the descriptor node at page %" PRIu64, next);
+			success = false;
+		}
+		else
+		{
+			visited[next / 64] |= 1ULL << (next % 64);
+			if(*numNodes == capacity)
+			{
+				capacity = capacity > 0 ? capacity * 2 : 64;
+				uint64_t* grown = realloc(*counts, sizeof(uint64_t) * capacity);
+				success = grown != NULL;
+				*counts = grown != NULL ? grown : *counts;
+			}
+			if(success)
+			{
+				(*counts)[(*numNodes)++] = node->numFileDescriptors;
+				success = addExtent(list, next, FT_NODE_SIZE, EXTENT_DESCRIPTORS, 0, 0, false);
+			}
+			previous = next;
+		}
+	}
+	free(node);
+	free(visited);
+	return success;
+}
+
+/**
+ * Walks the chain of free regions, checking that every region lies within
+ * the image and that the regions are sorted, which also ensures the chain
+ * ends. Records the extent of each region.
+ */
+static bool walkFreeChain(Check* check, uint64_t* freePages)
+{
+	EFSState* state = check->state;
+	uint64_t size = state->filesystemSize;
+	EFSFreeSpaceNode* node = malloc(sizeof(EFSFreeSpaceNode));
+	ExtentList* list = &check->lists[check->numThreads];
+	bool success = node != NULL;
+	uint64_t previous = 0;
+	*freePages = 0;
+	for(uint64_t next = state->freeRegionList; success && next != 0; next = node->next)
+	{
+		if(next >= size)
+		{
+			report(check, true, "free region at page %" PRIu64 ", linked from page %" PRIu64 ", lies past the end of the image",
+				next, previous);
+			success = false;
+		}
+		else if(next <= previous)
+		{
+			report(check, true, "free region at page %" PRIu64 " follows the region at page %" PRIu64 ", so the free list is not sorted",
+				next, previous);
+			success = false;
+		}
+		else if(!imageRead(state, node, PAGE_SIZE, next * PAGE_SIZE))
+		{
+			report(check, true, "could not read the free region at page %" PRIu64, next);
+			success = false;
+		}
+		else
+		{
+			if(node->size == 0 || node->size > size - next)
+			{
+				report(check, true, "free region at page %" PRIu64 " holds %" PRIu64 " pages, past the end of the image",
+					next, node->size);
+				success = false;
+			}
+			else
+			{
+				*freePages += node->size;
+				success = addExtent(list, next, node->size, EXTENT_FREE, 0, 0, false);
+			}
+			previous = next;
+		}
+	}
+	free(node);
+	return success;
+}
+
+/**
+ * Checks the header of a compressed fragment against the fragment.
+ */
+static void checkCompressedHeader(Check* check, EFSCompactFileDescriptor* file,
+	uint64_t index, char* buffer)
+{
+	EFSFragmentDescriptor* fragment = &file->fragments[index];
+	uint64_t physical = fragmentPhysicalPages(fragment);
+	uint64_t maxPages = physical < EFSCK_CHUNK_PAGES ? physical : EFSCK_CHUNK_PAGES;
+	CompressedHeader* header = (CompressedHeader*) buffer;
+	uint64_t headerSize = 0;
+	bool read = imageRead(check->state, buffer, PAGE_SIZE, fragment->fragmentLocation * PAGE_SIZE);
+	if(read && header->magic == COMPRESSION_MAGIC)
+	{
+		/*
+		 * The header of a fragment with many units spans several pages.
+		 */
+		headerSize = sizeof(CompressedHeader) + sizeof(uint32_t) * ((uint64_t) header->numUnits + 1);
+		uint64_t headerPages = (headerSize + PAGE_SIZE - 1) / PAGE_SIZE;
+		if(headerPages > 1 && headerPages <= maxPages)
+		{
+			read = imageRead(check->state, buffer, headerPages * PAGE_SIZE, fragment->fragmentLocation * PAGE_SIZE);
+		}
+	}
+	if(!read)
+	{
+		report(check, true, "could not read the header of compressed fragment %" PRIu64 " of inode %" PRIu64,
+			index, file->fileID);
+		return;
+	}
+	else if(header->magic != COMPRESSION_MAGIC)
+	{
+		report(check, true, "compressed fragment %" PRIu64 " of inode %" PRIu64 " at page %" PRIu64 " has no compression header",
+			index, file->fileID, fragment->fragmentLocation);
+		return;
+	}
+	else if(headerSize > maxPages * PAGE_SIZE)
+	{
+		report(check, true, "compressed fragment %" PRIu64 " of inode %" PRIu64 " claims %" PRIu32 " units, more than fit in its %" PRIu64 " pages",
+			index, file->fileID, header->numUnits, physical);
+		return;
+	}
+	else if((uint64_t) header->numUnits * COMPRESSION_UNIT_SIZE < fragmentPages(fragment) * PAGE_SIZE)
+	{
+		report(check, true, "compressed fragment %" PRIu64 " of inode %" PRIu64 " covers %" PRIu64 " pages, but holds %" PRIu32 " units",
+			index, file->fileID, fragmentPages(fragment), header->numUnits);
+	}
+	uint64_t previous = headerSize;
+	for(uint64_t unit = 0; unit <= header->numUnits; unit++)
+	{
+		uint64_t offset = header->offsets[unit];
+		if(offset < previous || offset - previous > COMPRESSION_UNIT_SIZE
+			|| offset > physical * PAGE_SIZE || (unit == 0 && offset != headerSize))
+		{
+			report(check, true, "unit %" PRIu64 " of compressed fragment %" PRIu64 " of inode %" PRIu64 " has a bad offset %" PRIu64,
+				unit, index, file->fileID, offset);
+			return;
+		}
+		previous = offset;
+	}
+}
+
+/**
+ * Checks the fragments of a file, recording their extents.
+ */
+static void checkFragments(Check* check, FileTableNode* node, ExtentList* list,
+	char* buffer)
+{
+	EFSCompactFileDescriptor* file = node->fileDescriptor;
+	uint64_t size = check->state->filesystemSize;
+	uint64_t covered = 0;
+	for(uint64_t i = 0; i < file->numFragments; i++)
+	{
+		EFSFragmentDescriptor* fragment = &file->fragments[i];
+		uint64_t location = fragment->fragmentLocation;
+		uint64_t pages = fragmentPages(fragment);
+		uint64_t physical = fragmentPhysicalPages(fragment);
+		bool compressed = fragmentIsCompressed(fragment);
+		covered += pages;
+		if(pages == 0 || physical == 0)
+		{
+			report(check, true, "fragment %" PRIu64 " of inode %" PRIu64 " at page %" PRIu64 " is empty",
+				i, file->fileID, location);
+		}
+		else if(location >= size || physical > size - location)
+		{
+			report(check, true, "fragment %" PRIu64 " of inode %" PRIu64 " at pages %" PRIu64 "-%" PRIu64 " lies past the end of the image",
+				i, file->fileID, location, location + physical - 1);
+		}
+		else if(compressed && physical > pages)
+		{
+			report(check, true, "compressed fragment %" PRIu64 " of inode %" PRIu64 " occupies %" PRIu64 " pages but only covers %" PRIu64,
+				i, file->fileID, physical, pages);
+		}
+		else
+		{
+			if(compressed)
+			{
+				checkCompressedHeader(check, file, i, buffer);
+			}
+			if(!addExtent(list, location, physical, EXTENT_FRAGMENT, file->fileID, i, compressed))
+			{
+				report(check, true, "out of memory recording the fragments of inode %" PRIu64, file->fileID);
+			}
+		}
+	}
+	if(covered * PAGE_SIZE < file->filesize)
+	{
+		if(file->numFragments > 0)
+		{
+			report(check, true, "inode %" PRIu64 " is %" PRIu64 " bytes, but its fragments only hold %" PRIu64,
+				file->fileID, file->filesize, covered * PAGE_SIZE);
+		}
+		else if(node->descriptorNode == NULL || node->descriptorNode->inlineData[node->descriptorSlot] == NULL)
+		{
+			report(check, true, "inode %" PRIu64 " is %" PRIu64 " bytes, but has neither fragments nor inline data",
+				file->fileID, file->filesize);
+		}
+	}
+}
+
+/**
+ * Checks that the parent of a file exists and is a directory, and that no
+ * other file in it has the same name.
+ */
+static void checkParent(Check* check, FileTableNode* node)
+{
+	EFSCompactFileDescriptor* file = node->fileDescriptor;
+	if(file->fileID == FUSE_ROOT_ID)
+	{
+		if(file->isFile != 0)
+		{
+			report(check, true, "the root, inode %d, is not a directory", FUSE_ROOT_ID);
+		}
+		return;
+	}
+	FileTableNode* parent = findFile(check, file->parentID);
+	if(parent == NULL)
+	{
+		report(check, true, "inode %" PRIu64 " (%s) is in directory %" PRIu64 ", which does not exist",
+			file->fileID, file->filename, file->parentID);
+		return;
+	}
+	else if(parent->fileDescriptor->isFile != 0)
+	{
+		report(check, true, "inode %" PRIu64 " (%s) is in inode %" PRIu64 ", which is not a directory",
+			file->fileID, file->filename, file->parentID);
+	}
+	FileTableNode* named = fileTableFindChild(check->state->fileTable, file->parentID, file->filename);
+	if(named != NULL && named != node)
+	{
+		report(check, true, "inodes %" PRIu64 " and %" PRIu64 " are both named %s in directory %" PRIu64,
+			named->fileDescriptor->fileID, file->fileID, file->filename, file->parentID);
+	}
+}
+
+typedef struct check_job
+{
+	Check* check;
+	unsigned int thread;
+} CheckJob;
+
+/**
+ * Checks one share of the files, then sorts the extents it found.
+ */
+static void* checkFiles(void* argument)
+{
+	CheckJob* job = argument;
+	Check* check = job->check;
+	ExtentList* list = &check->lists[job->thread];
+	char* buffer = malloc(EFSCK_CHUNK_PAGES * PAGE_SIZE);
+	if(buffer == NULL)
+	{
+		report(check, true, "out of memory checking files");
+		return NULL;
+	}
+	size_t first = check->numFiles * job->thread / check->numThreads;
+	size_t last = check->numFiles * (job->thread + 1) / check->numThreads;
+	for(size_t i = first; i < last; i++)
+	{
+		checkParent(check, check->files[i]);
+		checkFragments(check, check->files[i], list, buffer);
+	}
+	free(buffer);
+	qsort(list->extents, list->count, sizeof(CheckExtent), compareExtents);
+	return NULL;
+}
+
+/**
+ * Checks that every file can be reached from the root by following parent
+ * links. Each file is reported once, at the top of the chain that fails to
+ * reach the root.
+ */
+static bool checkReachable(Check* check)
+{
+	uint8_t* status = calloc(check->numFiles, 1);
+	size_t* path = malloc(sizeof(size_t) * (check->numFiles + 1));
+	if(status == NULL || path == NULL)
+	{
+		free(status);
+		free(path);
+		return false;
+	}
+	enum { UNKNOWN, VISITING, REACHABLE, UNREACHABLE };
+	for(size_t start = 0; start < check->numFiles; start++)
+	{
+		size_t length = 0;
+		size_t current = start;
+		uint8_t result = UNKNOWN;
+		while(result == UNKNOWN)
+		{
+			EFSCompactFileDescriptor* file = check->files[current]->fileDescriptor;
+			if(status[current] == REACHABLE || status[current] == UNREACHABLE)
+			{
+				result = status[current];
+				continue;
+			}
+			else if(status[current] == VISITING)
+			{
+				report(check, true, "inode %" PRIu64 " (%s) is its own ancestor", file->fileID, file->filename);
+				result = UNREACHABLE;
+				continue;
+			}
+			status[current] = VISITING;
+			path[length++] = current;
+			if(file->fileID == FUSE_ROOT_ID)
+			{
+				result = REACHABLE;
+				continue;
+			}
+			current = findFileIndex(check, file->parentID);
+			if(current == check->numFiles)
+			{
+				/*
+				 * A missing parent has already been reported.
+				 */
+				result = UNREACHABLE;
+			}
+		}
+		while(length > 0)
+		{
+			status[path[--length]] = result;
+		}
+	}
+	free(status);
+	free(path);
+	return true;
+}
+
+typedef struct merge_job
+{
+	CheckExtent* from;
+	CheckExtent* to;
+	size_t start;
+	size_t middle;
+	size_t end;
+} MergeJob;
+
+static void* mergeRuns(void* argument)
+{
+	MergeJob* job = argument;
+	size_t left = job->start;
+	size_t right = job->middle;
+	for(size_t out = job->start; out < job->end; out++)
+	{
+		if(right >= job->end || (left < job->middle && compareExtents(&job->from[left], &job->from[right]) <= 0))
+		{
+			job->to[out] = job->from[left++];
+		}
+		else
+		{
+			job->to[out] = job->from[right++];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Joins the sorted lists of every thread into one sorted array, merging
+ * pairs of runs in parallel until one run is left.
+ */
+static bool mergeExtents(Check* check)
+{
+	size_t numRuns = check->numThreads + 1;
+	size_t* bounds = malloc(sizeof(size_t) * (numRuns + 1));
+	size_t total = 0;
+	for(size_t i = 0; i < numRuns; i++)
+	{
+		total += check->lists[i].count;
+	}
+	CheckExtent* from = malloc(sizeof(CheckExtent) * (total > 0 ? total : 1));
+	CheckExtent* to = malloc(sizeof(CheckExtent) * (total > 0 ? total : 1));
+	MergeJob* jobs = malloc(sizeof(MergeJob) * numRuns);
+	pthread_t* threads = malloc(sizeof(pthread_t) * numRuns);
+	if(bounds == NULL || from == NULL || to == NULL || jobs == NULL || threads == NULL)
+	{
+		free(bounds);
+		free(from);
+		free(to);
+		free(jobs);
+		free(threads);
+		return false;
+	}
+	bounds[0] = 0;
+	for(size_t i = 0; i < numRuns; i++)
+	{
+		memcpy(from + bounds[i], check->lists[i].extents, sizeof(CheckExtent) * check->lists[i].count);
+		bounds[i + 1] = bounds[i] + check->lists[i].count;
+		free(check->lists[i].extents);
+		check->lists[i].extents = NULL;
+	}
+	while(numRuns > 1)
+	{
+		size_t numJobs = 0;
+		for(size_t i = 0; i < numRuns; i += 2)
+		{
+			size_t end = i + 2 <= numRuns ? bounds[i + 2] : bounds[i + 1];
+			size_t middle = i + 2 <= numRuns ? bounds[i + 1] : end;
+			jobs[numJobs] = (MergeJob) { from, to, bounds[i], middle, end };
+			if(pthread_create(&threads[numJobs], NULL, mergeRuns, &jobs[numJobs]) != 0)
+			{
+				mergeRuns(&jobs[numJobs]);
+				threads[numJobs] = 0;
+			}
+			numJobs++;
+		}
+		for(size_t i = 0; i < numJobs; i++)
+		{
+			if(threads[i] != 0)
+			{
+				pthread_join(threads[i], NULL);
+			}
+			bounds[i + 1] = jobs[i].end;
+		}
+		numRuns = numJobs;
+		CheckExtent* swap = from;
+		from = to;
+		to = swap;
+	}
+	free(to);
+	free(bounds);
+	free(jobs);
+	free(threads);
+	check->extents = from;
+	check->numExtents = total;
+	return true;
+}
+
+/**
+ * Sweeps the sorted extents, reporting any two that overlap other than
+ * fragments sharing an extent, and counting the pages nothing occupies.
+ */
+static void sweepExtents(Check* check, uint64_t* usedPages, uint64_t* lostPages,
+	uint64_t* sharedExtents)
+{
+	uint64_t size = check->state->filesystemSize;
+	const CheckExtent* widest = NULL;
+	uint64_t end = 0;
+	*usedPages = 0;
+	*lostPages = 0;
+	*sharedExtents = 0;
+	uint64_t lostRuns = 0;
+	uint64_t countedAt = 0;
+	for(size_t i = 0; i <= check->numExtents; i++)
+	{
+		const CheckExtent* extent = i < check->numExtents ? &check->extents[i] : NULL;
+		uint64_t location = extent != NULL ? extent->location : size;
+		if(location > end)
+		{
+			/*
+			 * Lost pages are reported as runs, since a crash can lose
+			 * whole reservations.
+			 */
+			if(lostRuns++ < 32)
+			{
+				report(check, false, "pages %" PRIu64 "-%" PRIu64 " are neither free nor used", end, location - 1);
+			}
+			*lostPages += location - end;
+		}
+		if(extent == NULL)
+		{
+			break;
+		}
+		if(widest != NULL && extent->location < end)
+		{
+			bool shared = extent->kind == EXTENT_FRAGMENT && widest->kind == EXTENT_FRAGMENT
+				&& extent->location == widest->location && !extent->compressed && !widest->compressed;
+			if(shared && extent->location != countedAt)
+			{
+				(*sharedExtents)++;
+				countedAt = extent->location;
+			}
+			else
+			{
+				char first[128];
+				char second[128];
+				describeExtent(widest, first, sizeof(first));
+				describeExtent(extent, second, sizeof(second));
+				report(check, true, "%s overlaps %s", second, first);
+			}
+		}
+		if(extent->location + extent->pages > end)
+		{
+			*usedPages += extent->location + extent->pages - (extent->location > end ? extent->location : end);
+			end = extent->location + extent->pages;
+			widest = extent;
+		}
+	}
+	if(lostRuns > 32)
+	{
+		report(check, false, "%" PRIu64 " more runs of pages are neither free nor used", lostRuns - 32);
+	}
+}
+
+/**
+ * Verifies the pages of fragments against their checksums, taking batches
+ * of extents from the sorted array.
+ */
+static void* verifyData(void* argument)
+{
+	Check* check = argument;
+	EFSState* state = check->state;
+	uint32_t* sums = state->checksums.sums;
+	char* buffer = malloc(EFSCK_CHUNK_PAGES * PAGE_SIZE);
+	if(buffer == NULL)
+	{
+		report(check, true, "out of memory verifying data");
+		return NULL;
+	}
+	size_t first;
+	while((first = atomic_fetch_add(&check->nextVerify, EFSCK_VERIFY_BATCH)) < check->numExtents)
+	{
+		size_t last = first + EFSCK_VERIFY_BATCH < check->numExtents ? first + EFSCK_VERIFY_BATCH : check->numExtents;
+		for(size_t i = first; i < last; i++)
+		{
+			CheckExtent* extent = &check->extents[i];
+			/*
+			 * Fragments sharing an extent are sorted longest first, so
+			 * only the first of them is read.
+			 */
+			if(extent->kind != EXTENT_FRAGMENT
+				|| (i > 0 && check->extents[i - 1].kind == EXTENT_FRAGMENT && check->extents[i - 1].location == extent->location))
+			{
+				continue;
+			}
+			for(uint64_t page = 0; page < extent->pages; page += EFSCK_CHUNK_PAGES)
+			{
+				uint64_t count = extent->pages - page < EFSCK_CHUNK_PAGES ? extent->pages - page : EFSCK_CHUNK_PAGES;
+				uint64_t location = extent->location + page;
+				if(!imageRead(state, buffer, count * PAGE_SIZE, location * PAGE_SIZE))
+				{
+					report(check, true, "could not read pages %" PRIu64 "-%" PRIu64 " of inode %" PRIu64,
+						location, location + count - 1, extent->inode);
+					continue;
+				}
+				for(uint64_t j = 0; j < count; j++)
+				{
+					uint32_t expected = sums[location + j];
+					if(expected != 0 && crc32c(0, buffer + j * PAGE_SIZE, PAGE_SIZE) != expected)
+					{
+						report(check, true, "page %" PRIu64 " of fragment %" PRIu32 " of inode %" PRIu64 " does not match its checksum",
+							location + j, extent->index, extent->inode);
+					}
+				}
+				atomic_fetch_add(&check->pagesVerified, count);
+			}
+		}
+	}
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Checks the record locating the checksum table, and records the extent
+ * of the table.
+ */
+static bool checkChecksumTable(Check* check)
+{
+	EFSState* state = check->state;
+	ChecksumRecord record;
+	if(!imageRead(state, &record, sizeof(record), CHECKSUM_RECORD_OFFSET))
+	{
+		report(check, true, "could not read the checksum record");
+		return false;
+	}
+	if(memcmp(record.magic, CHECKSUM_RECORD_MAGIC, sizeof(record.magic)) != 0)
+	{
+		return true;
+	}
+	uint64_t size = state->filesystemSize;
+	if(record.location == 0 || record.location >= size || record.numPages > size - record.location)
+	{
+		report(check, true, "the checksum table at pages %" PRIu64 "-%" PRIu64 " lies past the end of the image",
+			record.location, record.location + record.numPages - 1);
+		return true;
+	}
+	else if(!checksumOpen(state, false))
+	{
+		report(check, true, "could not load the checksum table");
+	}
+	return addExtent(&check->lists[check->numThreads], record.location, record.numPages,
+		EXTENT_CHECKSUMS, 0, 0, false);
+}
+
+/**
+ * Opens the members of the image and reads its superblock.
+ */
+static bool openImage(EFSState* state, const char* members)
+{
+	char* paths = strdup(members);
+	if(paths == NULL)
+	{
+		return false;
+	}
+	char* position = NULL;
+	for(char* path = strtok_r(paths, ",", &position); path != NULL; path = strtok_r(NULL, ",", &position))
+	{
+		if(!imageStripeAddMember(state, path))
+		{
+			perror(path);
+			free(paths);
+			return false;
+		}
+	}
+	free(paths);
+	if(state->stripe.numMembers == 0)
+	{
+		return false;
+	}
+	EFSSuperblock superblock;
+	if(!imageTransferRange(state->stripe.members[0].fd, (char*) &superblock, sizeof(superblock), 0, false)
+		|| memcmp(superblock.magicNumber, EFS_MAGIC_NUMBER, 16) != 0)
+	{
+		printf("%s does not contain a valid filesystem.\n", members);
+		return false;
+	}
+	state->fileDescriptorList = superblock.fileDescriptorTable;
+	state->freeRegionList = superblock.freeSpaceTable;
+	state->filesystemSize = superblock.filesystemSize;
+	printf("The image holds %" PRIu64 " pages.\n", state->filesystemSize);
+	/*
+	 * An image which is not yet striped is refused rather than striped,
+	 * since nothing is written while it is checked.
+	 */
+	return imageStripeOpen(state, 0);
+}
+
+static double elapsed(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void printUsage()
+{
+	printf("Usage: efsck [-j THREADS] [-c] FILESYSTEM[,FILESYSTEM...]\n");
+	printf("Checks an EFS image for inconsistencies without changing it.\n");
+	printf("    -j THREADS  threads checking files and data (default: online CPUs)\n");
+	printf("    -c          also verify the data of every file against the checksum table\n");
+	printf("Exits with 0 if the image is consistent, 1 if it is not, or 2 if it could not be checked.\n");
+}
+
+/**
+ * Usage:
+ * 		efsck [-j THREADS] [-c] FILESYSTEM[,FILESYSTEM...]
+ */
+int main(int argc, char** args)
+{
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int numThreads = processors > 0 ? processors : 1;
+	bool verify = false;
+	int option;
+	while((option = getopt(argc, args, "j:ch")) != -1)
+	{
+		switch(option)
+		{
+			case 'j':
+				numThreads = atoi(optarg) > 0 ? atoi(optarg) : 1;
+				break;
+			case 'c':
+				verify = true;
+				break;
+			default:
+				printUsage();
+				return option == 'h' ? 0 : 2;
+		}
+	}
+	if(optind != argc - 1)
+	{
+		printUsage();
+		return 2;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	EFSState* state = calloc(1, sizeof(EFSState));
+	Check check = { 0 };
+	check.state = state;
+	check.numThreads = numThreads;
+	check.lists = calloc(numThreads + 1, sizeof(ExtentList));
+	pthread_mutex_init(&check.outputLock, NULL);
+	if(state == NULL || check.lists == NULL)
+	{
+		printf("Out of memory.\n");
+		return 2;
+	}
+	pthread_mutex_init(&state->metadataLock, NULL);
+	epochInit(&state->epoch);
+	namePoolInit(&state->namePool, &state->stats);
+	state->options.allocGroups = 1;
+	if(!openImage(state, args[optind]))
+	{
+		return 2;
+	}
+
+	uint64_t* counts = NULL;
+	size_t numNodes = 0;
+	uint64_t freePages = 0;
+	bool chainsSound = addExtent(&check.lists[numThreads], 0, 1, EXTENT_SUPERBLOCK, 0, 0, false);
+	chainsSound = walkDescriptorChain(&check, &counts, &numNodes) && chainsSound;
+	chainsSound = walkFreeChain(&check, &freePages) && chainsSound;
+	if(!chainsSound)
+	{
+		printf("The chains of descriptor nodes and free regions must be repaired before files can be checked.\n");
+		return 1;
+	}
+	if(readFileTable(state) == NULL || !readFreeSpaceTable(state))
+	{
+		printf("Failed to read the file and free space tables.\n");
+		return 2;
+	}
+	printf("Read %zu descriptor nodes, %zu files and %" PRIu64 " free pages in %.2f s.\n",
+		numNodes, state->fileTable->size, freePages, elapsed(&start));
+
+	size_t nodeIndex = 0;
+	for(DescriptorTableNode* node = state->descriptorTable->head->next; node != NULL; node = node->next, nodeIndex++)
+	{
+		size_t count = descriptorTableNodeCount(node);
+		if(nodeIndex < numNodes && counts[nodeIndex] != count)
+		{
+			report(&check, false, "descriptor node at page %" PRIu64 " claims %" PRIu64 " descriptors, but holds %zu",
+				node->location, counts[nodeIndex], count);
+		}
+	}
+	free(counts);
+	if(allocationGroupsFreePages(&state->allocationGroups) != freePages)
+	{
+		report(&check, true, "the free regions hold %" PRIu64 " pages, but %" PRIu64 " were loaded",
+			freePages, allocationGroupsFreePages(&state->allocationGroups));
+	}
+	if(!checkChecksumTable(&check))
+	{
+		return 2;
+	}
+
+	check.numFiles = state->fileTable->size;
+	check.files = malloc(sizeof(FileTableNode*) * (check.numFiles > 0 ? check.numFiles : 1));
+	if(check.files == NULL)
+	{
+		printf("Out of memory.\n");
+		return 2;
+	}
+	size_t numFiles = 0;
+	for(FileTableNode* node = state->fileTable->head->next; node != NULL && numFiles < check.numFiles; node = node->next)
+	{
+		check.files[numFiles++] = node;
+	}
+	qsort(check.files, check.numFiles, sizeof(FileTableNode*), compareFiles);
+	for(size_t i = 1; i < check.numFiles; i++)
+	{
+		if(check.files[i]->fileDescriptor->fileID == check.files[i - 1]->fileDescriptor->fileID)
+		{
+			report(&check, true, "inode %" PRIu64 " is stored in both descriptor node %" PRIu64 " slot %u and node %" PRIu64 " slot %u",
+				check.files[i]->fileDescriptor->fileID,
+				check.files[i - 1]->descriptorNode->location, check.files[i - 1]->descriptorSlot,
+				check.files[i]->descriptorNode->location, check.files[i]->descriptorSlot);
+		}
+	}
+	if(findFile(&check, FUSE_ROOT_ID) == NULL)
+	{
+		report(&check, true, "the root, inode %d, does not exist", FUSE_ROOT_ID);
+	}
+
+	pthread_t* threads = malloc(sizeof(pthread_t) * numThreads);
+	CheckJob* jobs = malloc(sizeof(CheckJob) * numThreads);
+	if(threads == NULL || jobs == NULL)
+	{
+		printf("Out of memory.\n");
+		return 2;
+	}
+	for(unsigned int i = 0; i < numThreads; i++)
+	{
+		jobs[i] = (CheckJob) { &check, i };
+		if(pthread_create(&threads[i], NULL, checkFiles, &jobs[i]) != 0)
+		{
+			checkFiles(&jobs[i]);
+			threads[i] = 0;
+		}
+	}
+	ExtentList* metadata = &check.lists[numThreads];
+	qsort(metadata->extents, metadata->count, sizeof(CheckExtent), compareExtents);
+	bool reachable = checkReachable(&check);
+	for(unsigned int i = 0; i < numThreads; i++)
+	{
+		if(threads[i] != 0)
+		{
+			pthread_join(threads[i], NULL);
+		}
+	}
+	if(!reachable || !mergeExtents(&check))
+	{
+		printf("Out of memory.\n");
+		return 2;
+	}
+	printf("Checked files and sorted %zu extents in %.2f s.\n", check.numExtents, elapsed(&start));
+
+	uint64_t usedPages;
+	uint64_t lostPages;
+	uint64_t sharedExtents;
+	sweepExtents(&check, &usedPages, &lostPages, &sharedExtents);
+
+	if(verify && !checksumEnabled(state))
+	{
+		report(&check, false, "the image has no checksum table, so data was not verified");
+	}
+	else if(verify)
+	{
+		for(unsigned int i = 0; i < numThreads; i++)
+		{
+			if(pthread_create(&threads[i], NULL, verifyData, &check) != 0)
+			{
+				verifyData(&check);
+				threads[i] = 0;
+			}
+		}
+		for(unsigned int i = 0; i < numThreads; i++)
+		{
+			if(threads[i] != 0)
+			{
+				pthread_join(threads[i], NULL);
+			}
+		}
+		printf("Verified %" PRIu64 " pages against their checksums.\n", (uint64_t) check.pagesVerified);
+	}
+
+	printf("%zu files, %zu extents, %" PRIu64 " shared, %" PRIu64 " pages used, %" PRIu64 " free, %" PRIu64 " lost.\n",
+		check.numFiles, check.numExtents, sharedExtents, usedPages - freePages, freePages, lostPages);
+	printf("%" PRIu64 " errors and %" PRIu64 " warnings found by %u threads in %.2f s.\n",
+		(uint64_t) check.errors, (uint64_t) check.warnings, numThreads, elapsed(&start));
+	free(threads);
+	free(jobs);
+	free(check.files);
+	free(check.extents);
+	free(check.lists);
+	checksumClose(state);
+	return check.errors > 0 ? 1 : 0;
+}
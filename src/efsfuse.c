@@ -2,15 +2,15 @@
  * @author Nathanial Giddings
  */
 
-#define FUSE_USE_VERSION 31
-
-#define FT_NODE_SIZE 256
+#define FUSE_USE_VERSION 312
 
 #include <fuse3/fuse_lowlevel.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include <EFS/superblock.h>
 #include <EFS/file_descriptor.h>
@@ -19,19 +19,34 @@
 #include "efsstate.h"
 #include "file_table.h"
 #include "fs_operations.h"
+#include "image_io.h"
 #include "util.h"
+#include "trace.h"
+#include "worker_pool.h"
+#include "writeback.h"
 
 static struct fuse_lowlevel_ops operations = {
 	.open		= efsOpen,
+	.create		= efsCreate,
+	.mkdir		= efsMkdir,
+	.unlink		= efsUnlink,
+	.rmdir		= efsRmdir,
 	.opendir	= efsOpenDir,
 	.readdir	= efsReadDir,
 	.releasedir	= efsReleaseDir,
 	.statfs		= efsStatFs,
     .getattr	= efsGetAttr,
+    .setattr	= efsSetAttr,
     .release	= efsRelease,
     .read		= efsRead,
+    .write		= efsWrite,
+    .fallocate	= efsFallocate,
+    .copy_file_range	= efsCopyFileRange,
     .getxattr	= efsGetXattr,
+    .listxattr	= efsListXattr,
     .fsyncdir	= efsSyncDir,
+    .fsync		= efsSync,
+    .flush		= efsFlush,
     .poll		= efsPoll,
     .access		= efsAccess,
     .getlk		= efsGetLock,
@@ -39,13 +54,77 @@ static struct fuse_lowlevel_ops operations = {
     //.readdirplus= efsReadDirPlus,
 };
 
+#define EFS_OPTION(template, field) { template, offsetof(EFSOptions, field), 1 }
+
+static const struct fuse_opt efsOptions[] = {
+	EFS_OPTION("writeback_interval=%u", writebackInterval),
+	EFS_OPTION("writeback_threshold=%u", writebackThreshold),
+	EFS_OPTION("fsync_window=%u", fsyncWindow),
+	EFS_OPTION("lazytime_interval=%u", lazytimeInterval),
+	EFS_OPTION("noatime", noatime),
+	EFS_OPTION("delalloc_limit=%u", delallocLimit),
+	EFS_OPTION("inline_max=%u", inlineMax),
+	EFS_OPTION("compress", compress),
+	EFS_OPTION("compress_level=%u", compressLevel),
+	EFS_OPTION("compress_cache=%u", compressCache),
+	EFS_OPTION("compress_threads=%u", compressThreads),
+	EFS_OPTION("defrag", defrag),
+	EFS_OPTION("defrag_interval=%u", defragInterval),
+	EFS_OPTION("defrag_threshold=%u", defragThreshold),
+	EFS_OPTION("defrag_bandwidth=%u", defragBandwidth),
+	EFS_OPTION("checksum", checksum),
+	EFS_OPTION("scrub", scrub),
+	EFS_OPTION("scrub_interval=%u", scrubInterval),
+	EFS_OPTION("scrub_bandwidth=%u", scrubBandwidth),
+	EFS_OPTION("dedup", dedup),
+	EFS_OPTION("alloc_groups=%u", allocGroups),
+	EFS_OPTION("stripe_unit=%u", stripeUnit),
+	EFS_OPTION("direct", direct),
+	EFS_OPTION("direct_cache=%u", directCache),
+	EFS_OPTION("io_uring", ioUring),
+	EFS_OPTION("io_uring_depth=%u", ioUringDepth),
+	EFS_OPTION("pin_workers", pinWorkers),
+	EFS_OPTION("trace=%s", trace),
+	FUSE_OPT_END
+};
+
 /**
  * Prints instructions on using the program. Called when the program
  * gets invalid arguments.
  */
 void printUsage()
 {
-	printf("Usage: efsfuse [OPTIONS] MOUNTPOINT FILESYSTEM\n");
+	printf("Usage: efsfuse [OPTIONS] MOUNTPOINT FILESYSTEM[,FILESYSTEM...]\n");
+	printf("Several FILESYSTEM files separated by commas hold one image striped across them.\n");
+	printf("EFS options:\n");
+	printf("    -o writeback_interval=MS  maximum time a modified descriptor stays in memory (default 5000)\n");
+	printf("    -o writeback_threshold=N  modified descriptor pages that trigger an early writeback (default 1024)\n");
+	printf("    -o fsync_window=US        time concurrent fsyncs wait to share one sync of the image (default 200)\n");
+	printf("    -o lazytime_interval=S    maximum time a timestamp changed only in memory waits to be written (default 43200)\n");
+	printf("    -o noatime                never update access times on reads\n");
+	printf("    -o delalloc_limit=KB      data held in memory per file before space is allocated (default 8192)\n");
+	printf("    -o inline_max=BYTES       largest file stored inline in its descriptor, 0 to disable (default %d)\n", (int) EFS_INLINE_CAPACITY);
+	printf("    -o compress               compress file data as it is allocated\n");
+	printf("    -o compress_level=N       zlib level data is compressed at, 1 to 9 (default 1)\n");
+	printf("    -o compress_cache=MB      decompressed data kept for reads of compressed files (default 64)\n");
+	printf("    -o compress_threads=N     threads compressing each flush (default: online CPUs)\n");
+	printf("    -o defrag                 relocate fragmented files in the background\n");
+	printf("    -o defrag_interval=S      time between defragmenter passes (default 60)\n");
+	printf("    -o defrag_threshold=N     fragments at which a file is relocated (default 8)\n");
+	printf("    -o defrag_bandwidth=KB/S  maximum rate the defragmenter copies data, 0 for no limit (default 4096)\n");
+	printf("    -o checksum               checksum every page, creating a checksum table if the image has none\n");
+	printf("    -o scrub                  verify every page against its checksum in the background\n");
+	printf("    -o scrub_interval=S       time between scrubber passes (default 86400)\n");
+	printf("    -o scrub_bandwidth=KB/S   maximum rate the scrubber reads data, 0 for no limit (default 4096)\n");
+	printf("    -o dedup                  share extents holding identical data between files\n");
+	printf("    -o alloc_groups=N         allocation groups free space is split into (default: online CPUs)\n");
+	printf("    -o stripe_unit=KB         data stored in each member in turn when first striping an image (default 256)\n");
+	printf("    -o direct                 access the image with O_DIRECT, bypassing the host page cache\n");
+	printf("    -o direct_cache=MB        image pages cached for small reads with direct access (default 64)\n");
+	printf("    -o io_uring               access the image through io_uring, if built with IO_URING=1\n");
+	printf("    -o io_uring_depth=N       submission queue entries of the io_uring (default 256)\n");
+	printf("    -o pin_workers            run one worker pinned to each CPU instead of a thread pool\n");
+	printf("    -o trace=FILE             record every operation to FILE, for replay with efsreplay\n");
 	fuse_cmdline_help();
 	fuse_lowlevel_help();
 }
@@ -59,10 +138,25 @@ int parseArguments(int argc, char** args, EFSState* fsState)
 	}
 	else
 	{
-		fsState->filesystemStream = fopen(args[argc - 1], "r+");
+		char* paths = strdup(args[argc - 1]);
+		if(paths == NULL)
+		{
+			return -1;
+		}
+		char* position = NULL;
+		for(char* path = strtok_r(paths, ",", &position); path != NULL; path = strtok_r(NULL, ",", &position))
+		{
+			if(!imageStripeAddMember(fsState, path))
+			{
+				perror("Failed to open provided filesystem");
+				free(paths);
+				return -1;
+			}
+		}
+		free(paths);
 		if(fsState->filesystemStream == NULL)
 		{
-			perror("Failed to open provided filesystem");
+			printUsage();
 			return -1;
 		}
 	}
@@ -71,11 +165,34 @@ int parseArguments(int argc, char** args, EFSState* fsState)
 
 /**
  * Usage:
- * 		efsfuse [OPTIONS] MOUNTPOINT FILESYSTEM
+ * 		efsfuse [OPTIONS] MOUNTPOINT FILESYSTEM[,FILESYSTEM...]
  */
 int main(int argc, char** args)
 {
-	EFSState* fsState = malloc(sizeof(EFSState));
+	EFSState* fsState = calloc(1, sizeof(EFSState));
+	pthread_mutex_init(&fsState->metadataLock, NULL);
+	epochInit(&fsState->epoch);
+	fsState->options.writebackInterval = 5000;
+	fsState->options.writebackThreshold = 1024;
+	fsState->options.fsyncWindow = 200;
+	fsState->options.lazytimeInterval = 43200;
+	fsState->options.delallocLimit = 8192;
+	fsState->options.inlineMax = EFS_INLINE_CAPACITY;
+	fsState->options.defragInterval = 60;
+	fsState->options.defragThreshold = 8;
+	fsState->options.defragBandwidth = 4096;
+	fsState->options.scrubInterval = 86400;
+	fsState->options.scrubBandwidth = 4096;
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	fsState->options.allocGroups = processors > 0 ? processors : 1;
+	fsState->options.compressLevel = 1;
+	fsState->options.compressCache = 64;
+	fsState->options.compressThreads = processors > 0 ? processors : 1;
+	fsState->options.stripeUnit = 256;
+	fsState->options.directCache = 64;
+	fsState->options.ioUringDepth = 256;
+	pthread_mutex_init(&fsState->delayedAllocation.lock, NULL);
+	namePoolInit(&fsState->namePool, &fsState->stats);
 	if(parseArguments(argc, args, fsState) != 0)
 	{
 		printf("bye");
@@ -87,6 +204,11 @@ int main(int argc, char** args)
 	struct fuse_session* session;
 	struct fuse_cmdline_opts options;
 	
+	if(fuse_opt_parse(&fuseArgs, &fsState->options, efsOptions, NULL) != 0)
+	{
+		printf("Failed to parse EFS options.\n");
+		return -1;
+	}
 	if(fuse_parse_cmdline(&fuseArgs, &options) != 0)
 	{
 		printf("Failed to parse command line.\n");
@@ -109,6 +231,14 @@ int main(int argc, char** args)
 		return 0;
 	}
 		
+	if(fsState->options.trace != NULL
+		&& !traceStart(fsState, fsState->options.trace, &operations))
+	{
+		free(options.mountpoint);
+		fuse_opt_free_args(&fuseArgs);
+		return -1;
+	}
+	
 	bool err = false;
 	session = fuse_session_new(&fuseArgs, &operations, sizeof(operations), (void*) fsState);
 	if(session != NULL)
@@ -123,25 +253,116 @@ int main(int argc, char** args)
 				fsState->fileDescriptorList = superblock->fileDescriptorTable;
 				fsState->freeRegionList = superblock->freeSpaceTable;
 				fsState->filesystemSize = superblock->filesystemSize;
-				if(fuse_session_mount(session, options.mountpoint) == 0)
+				if(!imageStripeOpen(fsState, fsState->options.stripeUnit))
 				{
+					printf("Failed to open the members of the image.\n");
+					err = true;
+				}
+				else if(fuse_session_mount(session, options.mountpoint) == 0)
+				{
+					if(fsState->options.direct
+						&& !imageDirectOpen(fsState, (uint64_t) fsState->options.directCache * 1024 * 1024))
+					{
+						printf("Using buffered image I/O.\n");
+					}
 					printf("Reading file table: %d\n", readFileTable(fsState));
-					printf("Reading free space table: %d\n", readFreeSpaceTable(fsState));
-					fsState->openFiles = constructFileTable();
-					if(fsState->fileTable != NULL)
+					bool freeSpaceRead = readFreeSpaceTable(fsState);
+					printf("Reading free space table: %d\n", freeSpaceRead);
+					if(fsState->fileTable != NULL && freeSpaceRead)
 					{
 						printf("Mounted sucessfully! Filesystem has %d files.\n", fsState->fileTable->size);
 						fuse_daemonize(options.foreground);
-						if(options.singlethread)
+						/*
+						 * Background threads must be started after
+						 * daemonizing, since they do not survive a fork.
+						 */
+						fsState->writeback.interval = fsState->options.writebackInterval;
+						fsState->writeback.threshold = fsState->options.writebackThreshold;
+						fsState->writeback.syncWindow = fsState->options.fsyncWindow;
+						fsState->writeback.timesInterval = fsState->options.lazytimeInterval;
+						fsState->delayedAllocation.limit = (uint64_t) fsState->options.delallocLimit * 1024;
+						fsState->delayedAllocation.inlineLimit = fsState->options.inlineMax < EFS_INLINE_CAPACITY
+							? fsState->options.inlineMax : EFS_INLINE_CAPACITY;
+						fsState->defragmenter.interval = fsState->options.defragInterval;
+						fsState->defragmenter.threshold = fsState->options.defragThreshold;
+						fsState->defragmenter.bandwidth = fsState->options.defragBandwidth;
+						fsState->compression.enabled = fsState->options.compress;
+						fsState->compression.level = fsState->options.compressLevel < 1 ? 1
+							: (fsState->options.compressLevel > 9 ? 9 : fsState->options.compressLevel);
+						fsState->compression.threads = fsState->options.compressThreads;
+						fsState->scrubber.interval = fsState->options.scrubInterval;
+						fsState->scrubber.bandwidth = fsState->options.scrubBandwidth;
+						fsState->dedup.enabled = fsState->options.dedup;
+						imageIoStart(fsState);
+						if(!checksumOpen(fsState, fsState->options.checksum))
+						{
+							printf("Failed to open the checksum table.\n");
+							err = true;
+						}
+						else if(!dedupInit(fsState))
+						{
+							printf("Failed to count the extents shared between files.\n");
+							err = true;
+						}
+						else if(!compressionInit(fsState, (uint64_t) fsState->options.compressCache * 1024 * 1024))
+						{
+							printf("Failed to allocate the decompressed data cache.\n");
+							err = true;
+						}
+						else if(!writebackStart(fsState))
+						{
+							printf("Failed to start writeback thread.\n");
+							err = true;
+						}
+						else if(fsState->options.defrag && !defragmenterStart(fsState))
+						{
+							printf("Failed to start defragmenter thread.\n");
+							err = true;
+						}
+						else if(fsState->options.dedup && !dedupStart(fsState))
+						{
+							printf("Failed to start deduplication scan thread.\n");
+							err = true;
+						}
+						else if(fsState->options.scrub && !checksumEnabled(fsState))
+						{
+							printf("Cannot scrub an image without a checksum table, mount with -o checksum.\n");
+							err = true;
+						}
+						else if(fsState->options.scrub && !scrubberStart(fsState))
+						{
+							printf("Failed to start scrubber thread.\n");
+							err = true;
+						}
+						else if(options.singlethread)
 						{
 							printf("Running singlethreaded session...\n");
 							err = fuse_session_loop(session) == 0 ? 0 : 1;
 						}
+						else if(fsState->options.pinWorkers)
+						{
+							err = workerPoolRun(fsState, session) == 0 ? 0 : 1;
+						}
 						else
 						{
-							printf("Running multithreaded session...\n");
-							err = fuse_session_loop_mt_31(session, options.clone_fd) == 0 ? 0 : 1;
+							printf("Running multithreaded session with at most %u threads...\n", options.max_threads);
+							struct fuse_loop_config* loopConfig = fuse_loop_cfg_create();
+							fuse_loop_cfg_set_clone_fd(loopConfig, options.clone_fd);
+							fuse_loop_cfg_set_max_threads(loopConfig, options.max_threads);
+							fuse_loop_cfg_set_idle_threads(loopConfig, options.max_idle_threads);
+							err = fuse_session_loop_mt(session, loopConfig) == 0 ? 0 : 1;
+							fuse_loop_cfg_destroy(loopConfig);
 						}
+						scrubberStop(fsState);
+						dedupStop(fsState);
+						defragmenterStop(fsState);
+						writebackStop(fsState);
+						compressionDestroy(fsState);
+						dedupDestroy(fsState);
+						checksumClose(fsState);
+						imageIoStop(fsState);
+						imageDirectClose(fsState);
+						epochDestroy(&fsState->epoch);
 					}
 					else
 					{
@@ -176,6 +397,8 @@ int main(int argc, char** args)
 		err = true;
 	}
 	
+	traceStop(fsState);
+	free(fsState->options.trace);
 	free(options.mountpoint);
 	fuse_opt_free_args(&fuseArgs);
 	if(err)
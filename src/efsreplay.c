@@ -0,0 +1,931 @@
+/**
+ * Summarises and replays traces of the operations dispatched to efsfuse,
+ * recorded with `-o trace=FILE`.
+ *
+ * Without a mountpoint, the time efsfuse took for each kind of operation
+ * is summarised. With one, the operations are issued again in the order
+ * they were dispatched, as the system calls which cause them, against the
+ * filesystem mounted there. Files and directories are found by the paths
+ * their inodes were looked up or created under, starting from the root at
+ * the mountpoint, and each handle efsfuse gave out is replaced by a file
+ * descriptor of the replay's own. The kernel's caches sit between the
+ * replay and the filesystem, so an operation replayed may be answered by
+ * the kernel without reaching it.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/**
+ * Set on the key of an open directory, which efsfuse gives no handle, so
+ * that it is keyed by its inode instead.
+ */
+#define REPLAY_DIRECTORY_KEY (1ULL << 63)
+
+/**
+ * The flags of an open which are passed on when it is replayed. Flags
+ * which only concern the kernel are dropped.
+ */
+#define REPLAY_OPEN_FLAGS (O_ACCMODE | O_APPEND | O_TRUNC | O_SYNC | O_DSYNC)
+
+/**
+ * An operation read from a trace.
+ */
+typedef struct replay_record
+{
+	TraceRecord record;
+
+	uint64_t args[TRACE_MAX_ARGS];
+
+	/**
+	 * The name the operation was given, or NULL if it has none.
+	 */
+	char* name;
+
+	/**
+	 * The position of the record in the trace, so that records dispatched
+	 * at the same time keep their order when sorted.
+	 */
+	size_t index;
+
+} ReplayRecord;
+
+/**
+ * What is known of an inode or handle of the traced filesystem.
+ */
+typedef struct replay_entry
+{
+	/**
+	 * The inode, or the handle, this is for. 0 if the entry is unused.
+	 */
+	uint64_t key;
+
+	/**
+	 * The path the inode was last found at.
+	 */
+	char* path;
+
+	/**
+	 * The descriptor standing in for the handle, or -1 if it is closed.
+	 */
+	int fd;
+
+	/**
+	 * The number of times the handle has been opened and not released.
+	 */
+	unsigned int refs;
+
+} ReplayEntry;
+
+/**
+ * A hash table of entries keyed by inode or handle.
+ */
+typedef struct replay_map
+{
+	ReplayEntry* entries;
+
+	/**
+	 * The number of entries, always a power of two.
+	 */
+	size_t capacity;
+
+	/**
+	 * The number of entries in use.
+	 */
+	size_t size;
+
+} ReplayMap;
+
+/**
+ * The times taken by one kind of operation.
+ */
+typedef struct replay_stats
+{
+	/**
+	 * The time in nanoseconds each operation took.
+	 */
+	uint64_t* durations;
+
+	size_t count;
+
+	size_t capacity;
+
+	/**
+	 * The number of operations which failed when replayed.
+	 */
+	size_t errors;
+
+	/**
+	 * The number of operations which could not be replayed.
+	 */
+	size_t skipped;
+
+} ReplayStats;
+
+/**
+ * The state of a replay against a mounted filesystem.
+ */
+typedef struct replay
+{
+	/**
+	 * The path of every inode seen.
+	 */
+	ReplayMap inodes;
+
+	/**
+	 * The descriptor of every handle open.
+	 */
+	ReplayMap handles;
+
+	/**
+	 * Data read into and written from.
+	 */
+	char* buffer;
+
+	size_t bufferSize;
+
+} Replay;
+
+static const char* opNames[TRACE_NUM_OPS] = {
+	[TRACE_LOOKUP] = "lookup",
+	[TRACE_GETATTR] = "getattr",
+	[TRACE_SETATTR] = "setattr",
+	[TRACE_OPEN] = "open",
+	[TRACE_CREATE] = "create",
+	[TRACE_MKDIR] = "mkdir",
+	[TRACE_UNLINK] = "unlink",
+	[TRACE_RMDIR] = "rmdir",
+	[TRACE_OPENDIR] = "opendir",
+	[TRACE_READDIR] = "readdir",
+	[TRACE_RELEASEDIR] = "releasedir",
+	[TRACE_STATFS] = "statfs",
+	[TRACE_RELEASE] = "release",
+	[TRACE_READ] = "read",
+	[TRACE_WRITE] = "write",
+	[TRACE_FALLOCATE] = "fallocate",
+	[TRACE_COPY_FILE_RANGE] = "copy_file_range",
+	[TRACE_GETXATTR] = "getxattr",
+	[TRACE_LISTXATTR] = "listxattr",
+	[TRACE_FSYNCDIR] = "fsyncdir",
+	[TRACE_FSYNC] = "fsync",
+	[TRACE_FLUSH] = "flush",
+	[TRACE_POLL] = "poll",
+	[TRACE_ACCESS] = "access",
+	[TRACE_GETLK] = "getlk"
+};
+
+static uint64_t now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+static bool mapInit(ReplayMap* map)
+{
+	map->capacity = 1024;
+	map->size = 0;
+	map->entries = calloc(map->capacity, sizeof(ReplayEntry));
+	return map->entries != NULL;
+}
+
+static ReplayEntry* mapSlot(ReplayEntry* entries, size_t capacity, uint64_t key)
+{
+	size_t index = (key * 0x9E3779B97F4A7C15ULL >> 20) & (capacity - 1);
+	while(entries[index].key != 0 && entries[index].key != key)
+	{
+		index = (index + 1) & (capacity - 1);
+	}
+	return &entries[index];
+}
+
+/**
+ * Finds the entry of a key.
+ *
+ * @returns The entry, or NULL if the key has none.
+ */
+static ReplayEntry* mapFind(ReplayMap* map, uint64_t key)
+{
+	ReplayEntry* entry = mapSlot(map->entries, map->capacity, key);
+	return entry->key == key ? entry : NULL;
+}
+
+/**
+ * Finds the entry of a key, adding an empty one if it has none.
+ *
+ * @returns The entry, or NULL upon failure to allocate memory.
+ */
+static ReplayEntry* mapInsert(ReplayMap* map, uint64_t key)
+{
+	ReplayEntry* entry = mapFind(map, key);
+	if(entry != NULL)
+	{
+		return entry;
+	}
+	if((map->size + 1) * 4 > map->capacity * 3)
+	{
+		size_t capacity = map->capacity * 2;
+		ReplayEntry* entries = calloc(capacity, sizeof(ReplayEntry));
+		if(entries == NULL)
+		{
+			return NULL;
+		}
+		for(size_t i = 0; i < map->capacity; i++)
+		{
+			if(map->entries[i].key != 0)
+			{
+				*mapSlot(entries, capacity, map->entries[i].key) = map->entries[i];
+			}
+		}
+		free(map->entries);
+		map->entries = entries;
+		map->capacity = capacity;
+	}
+	entry = mapSlot(map->entries, map->capacity, key);
+	entry->key = key;
+	entry->path = NULL;
+	entry->fd = -1;
+	entry->refs = 0;
+	map->size++;
+	return entry;
+}
+
+static void mapDestroy(ReplayMap* map)
+{
+	for(size_t i = 0; i < map->capacity; i++)
+	{
+		free(map->entries[i].path);
+		if(map->entries[i].fd >= 0)
+		{
+			close(map->entries[i].fd);
+		}
+	}
+	free(map->entries);
+}
+
+static bool statsAdd(ReplayStats* stats, uint64_t duration)
+{
+	if(stats->count == stats->capacity)
+	{
+		size_t capacity = stats->capacity > 0 ? stats->capacity * 2 : 256;
+		uint64_t* durations = realloc(stats->durations, capacity * sizeof(uint64_t));
+		if(durations == NULL)
+		{
+			return false;
+		}
+		stats->durations = durations;
+		stats->capacity = capacity;
+	}
+	stats->durations[stats->count++] = duration;
+	return true;
+}
+
+static int compareDurations(const void* first, const void* second)
+{
+	uint64_t a = *(const uint64_t*) first;
+	uint64_t b = *(const uint64_t*) second;
+	return a < b ? -1 : a > b;
+}
+
+static int compareRecords(const void* first, const void* second)
+{
+	const ReplayRecord* a = first;
+	const ReplayRecord* b = second;
+	if(a->record.time != b->record.time)
+	{
+		return a->record.time < b->record.time ? -1 : 1;
+	}
+	return a->index < b->index ? -1 : a->index > b->index;
+}
+
+/**
+ * Prints the count and the distribution of the times of each kind of
+ * operation, in microseconds.
+ */
+static void printStats(ReplayStats* stats, bool replayed)
+{
+	printf("%-16s %10s %10s %10s %10s %10s", "operation", "count", "mean us", "p50 us", "p99 us", "max us");
+	printf(replayed ? " %8s %8s\n" : "\n", "errors", "skipped");
+	for(int op = 1; op < TRACE_NUM_OPS; op++)
+	{
+		ReplayStats* stat = &stats[op];
+		if(stat->count == 0 && stat->skipped == 0)
+		{
+			continue;
+		}
+		if(stat->count > 0)
+		{
+			qsort(stat->durations, stat->count, sizeof(uint64_t), compareDurations);
+		}
+		uint64_t total = 0;
+		for(size_t i = 0; i < stat->count; i++)
+		{
+			total += stat->durations[i];
+		}
+		double mean = stat->count > 0 ? total / 1e3 / stat->count : 0;
+		double median = stat->count > 0 ? stat->durations[(stat->count * 50 + 99) / 100 - 1] / 1e3 : 0;
+		double tail = stat->count > 0 ? stat->durations[(stat->count * 99 + 99) / 100 - 1] / 1e3 : 0;
+		double maximum = stat->count > 0 ? stat->durations[stat->count - 1] / 1e3 : 0;
+		printf("%-16s %10zu %10.1f %10.1f %10.1f %10.1f", opNames[op], stat->count, mean, median, tail, maximum);
+		if(replayed)
+		{
+			printf(" %8zu %8zu", stat->errors, stat->skipped);
+		}
+		printf("\n");
+	}
+}
+
+/**
+ * Reads every record of a trace, sorted by the time each was dispatched.
+ *
+ * @returns The records, or NULL if the trace could not be read.
+ */
+static ReplayRecord* readTrace(const char* path, TraceHeader* header, size_t* numRecords)
+{
+	FILE* stream = fopen(path, "rb");
+	if(stream == NULL)
+	{
+		printf("Failed to open %s: %s.\n", path, strerror(errno));
+		return NULL;
+	}
+	if(fread(header, sizeof(TraceHeader), 1, stream) != 1
+		|| memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0)
+	{
+		printf("%s is not a trace.\n", path);
+		fclose(stream);
+		return NULL;
+	}
+	if(header->version != TRACE_VERSION || header->recordSize < sizeof(TraceRecord))
+	{
+		printf("%s is a trace of version %" PRIu32 ", but only version %d can be read.\n",
+			path, header->version, TRACE_VERSION);
+		fclose(stream);
+		return NULL;
+	}
+
+	size_t capacity = 4096;
+	size_t count = 0;
+	ReplayRecord* records = malloc(capacity * sizeof(ReplayRecord));
+	bool failed = records == NULL;
+	while(!failed)
+	{
+		if(count == capacity)
+		{
+			ReplayRecord* grown = realloc(records, capacity * 2 * sizeof(ReplayRecord));
+			if(grown == NULL)
+			{
+				printf("Out of memory.\n");
+				failed = true;
+				break;
+			}
+			records = grown;
+			capacity *= 2;
+		}
+		ReplayRecord* record = &records[count];
+		memset(record, 0, sizeof(ReplayRecord));
+		if(fread(&record->record, sizeof(TraceRecord), 1, stream) != 1)
+		{
+			break;
+		}
+		bool valid = fseek(stream, header->recordSize - sizeof(TraceRecord), SEEK_CUR) == 0
+			&& record->record.op > 0 && record->record.op < TRACE_NUM_OPS
+			&& record->record.numArgs <= TRACE_MAX_ARGS
+			&& fread(record->args, sizeof(uint64_t), record->record.numArgs, stream) == record->record.numArgs;
+		if(valid && record->record.nameLength > 0)
+		{
+			record->name = malloc(record->record.nameLength + 1);
+			valid = record->name != NULL
+				&& fread(record->name, 1, record->record.nameLength, stream) == record->record.nameLength;
+			if(record->name != NULL)
+			{
+				record->name[record->record.nameLength] = '\0';
+			}
+		}
+		if(!valid)
+		{
+			/*
+			 * A trace cut short, as by a crash, is replayed up to its last
+			 * whole record.
+			 */
+			printf("Record %zu is incomplete or corrupt, ignoring the rest of the trace.\n", count);
+			free(record->name);
+			break;
+		}
+		record->index = count++;
+	}
+	fclose(stream);
+	if(failed)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			free(records[i].name);
+		}
+		free(records);
+		return NULL;
+	}
+	qsort(records, count, sizeof(ReplayRecord), compareRecords);
+	*numRecords = count;
+	return records;
+}
+
+static void printRecord(const ReplayRecord* record)
+{
+	printf("%14.6f %5u %-16s", record->record.time / 1e9, record->record.thread, opNames[record->record.op]);
+	for(unsigned int i = 0; i < record->record.numArgs; i++)
+	{
+		printf(" %" PRIu64, record->args[i]);
+	}
+	if(record->name != NULL)
+	{
+		printf(" \"%s\"", record->name);
+	}
+	printf(" (%.1f us)\n", record->record.duration / 1e3);
+}
+
+static char* joinPath(const char* parent, const char* name)
+{
+	size_t length = strlen(parent) + strlen(name) + 2;
+	char* path = malloc(length);
+	if(path != NULL)
+	{
+		snprintf(path, length, "%s/%s", parent, name);
+	}
+	return path;
+}
+
+/**
+ * Records the path an inode was found or created at.
+ */
+static void setPath(Replay* replay, uint64_t inode, char* path)
+{
+	ReplayEntry* entry = inode != 0 ? mapInsert(&replay->inodes, inode) : NULL;
+	if(entry == NULL)
+	{
+		free(path);
+		return;
+	}
+	free(entry->path);
+	entry->path = path;
+}
+
+static const char* getPath(Replay* replay, uint64_t inode)
+{
+	ReplayEntry* entry = mapFind(&replay->inodes, inode);
+	return entry != NULL ? entry->path : NULL;
+}
+
+static uint64_t handleKey(uint64_t inode, uint64_t handle)
+{
+	return handle != 0 ? handle : inode | REPLAY_DIRECTORY_KEY;
+}
+
+/**
+ * Makes a descriptor stand in for a handle. A handle already open, as
+ * every directory of the same inode is, keeps its first descriptor.
+ */
+static void openHandle(Replay* replay, uint64_t key, int fd)
+{
+	ReplayEntry* entry = mapInsert(&replay->handles, key);
+	if(entry == NULL || entry->fd >= 0)
+	{
+		close(fd);
+	}
+	if(entry != NULL)
+	{
+		entry->fd = entry->fd >= 0 ? entry->fd : fd;
+		entry->refs++;
+	}
+}
+
+static int getHandle(Replay* replay, uint64_t key)
+{
+	ReplayEntry* entry = mapFind(&replay->handles, key);
+	return entry != NULL ? entry->fd : -1;
+}
+
+static int releaseHandle(Replay* replay, uint64_t key)
+{
+	ReplayEntry* entry = mapFind(&replay->handles, key);
+	if(entry == NULL || entry->fd < 0)
+	{
+		return -1;
+	}
+	if(--entry->refs > 0)
+	{
+		return 0;
+	}
+	int result = close(entry->fd);
+	entry->fd = -1;
+	return result;
+}
+
+static bool reserveBuffer(Replay* replay, size_t size)
+{
+	if(size <= replay->bufferSize)
+	{
+		return true;
+	}
+	char* buffer = realloc(replay->buffer, size);
+	if(buffer == NULL)
+	{
+		return false;
+	}
+	/*
+	 * Data written is filled with a sequence which neither compresses nor
+	 * repeats within the buffer.
+	 */
+	uint64_t state = 0x2545F4914F6CDD1DULL ^ size;
+	for(size_t i = replay->bufferSize; i < size; i++)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buffer[i] = (char) state;
+	}
+	replay->buffer = buffer;
+	replay->bufferSize = size;
+	return true;
+}
+
+/**
+ * Issues the system call which causes an operation.
+ *
+ * @returns 0 upon success, -1 if the call failed, or 1 if the operation
+ * could not be replayed.
+ */
+static int replayRecord(Replay* replay, const ReplayRecord* record)
+{
+	const uint64_t* args = record->args;
+	if(record->record.numArgs < 1)
+	{
+		return 1;
+	}
+	const char* path = getPath(replay, args[0]);
+	switch(record->record.op)
+	{
+		case TRACE_LOOKUP:
+		case TRACE_CREATE:
+		case TRACE_MKDIR:
+		case TRACE_UNLINK:
+		case TRACE_RMDIR:
+		{
+			if(path == NULL || record->name == NULL)
+			{
+				return 1;
+			}
+			char* child = joinPath(path, record->name);
+			if(child == NULL)
+			{
+				return 1;
+			}
+			int result = -1;
+			struct stat attributes;
+			if(record->record.op == TRACE_LOOKUP && record->record.numArgs >= 2)
+			{
+				result = lstat(child, &attributes);
+				setPath(replay, args[1], child);
+				child = NULL;
+			}
+			else if(record->record.op == TRACE_CREATE && record->record.numArgs >= 5)
+			{
+				int fd = open(child, (args[2] & REPLAY_OPEN_FLAGS) | O_CREAT, (mode_t) args[1] & 07777);
+				if(fd >= 0)
+				{
+					openHandle(replay, handleKey(args[3], args[4]), fd);
+					result = 0;
+				}
+				setPath(replay, args[3], child);
+				child = NULL;
+			}
+			else if(record->record.op == TRACE_MKDIR && record->record.numArgs >= 3)
+			{
+				result = mkdir(child, (mode_t) args[1] & 07777);
+				setPath(replay, args[2], child);
+				child = NULL;
+			}
+			else if(record->record.op == TRACE_UNLINK)
+			{
+				result = unlink(child);
+			}
+			else if(record->record.op == TRACE_RMDIR)
+			{
+				result = rmdir(child);
+			}
+			free(child);
+			return result;
+		}
+		case TRACE_GETATTR:
+		{
+			struct stat attributes;
+			return path != NULL ? lstat(path, &attributes) : 1;
+		}
+		case TRACE_SETATTR:
+		{
+			if(path == NULL || record->record.numArgs < 8)
+			{
+				return 1;
+			}
+			int toSet = args[1];
+			int result = 0;
+			if(toSet & FUSE_SET_ATTR_MODE)
+			{
+				result |= chmod(path, (mode_t) args[3] & 07777);
+			}
+			if(toSet & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+			{
+				result |= lchown(path, toSet & FUSE_SET_ATTR_UID ? (uid_t) args[4] : (uid_t) -1,
+					toSet & FUSE_SET_ATTR_GID ? (gid_t) args[5] : (gid_t) -1);
+			}
+			if(toSet & FUSE_SET_ATTR_SIZE)
+			{
+				result |= truncate(path, (off_t) args[2]);
+			}
+			if(toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+			{
+				struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, UTIME_OMIT } };
+				if(toSet & FUSE_SET_ATTR_ATIME)
+				{
+					times[0] = toSet & FUSE_SET_ATTR_ATIME_NOW
+						? (struct timespec) { 0, UTIME_NOW } : (struct timespec) { (time_t) args[6], 0 };
+				}
+				if(toSet & FUSE_SET_ATTR_MTIME)
+				{
+					times[1] = toSet & FUSE_SET_ATTR_MTIME_NOW
+						? (struct timespec) { 0, UTIME_NOW } : (struct timespec) { (time_t) args[7], 0 };
+				}
+				result |= utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+			}
+			return result;
+		}
+		case TRACE_OPEN:
+		case TRACE_OPENDIR:
+		{
+			if(path == NULL || record->record.numArgs < 3)
+			{
+				return 1;
+			}
+			int flags = record->record.op == TRACE_OPEN
+				? (int) args[1] & REPLAY_OPEN_FLAGS : O_RDONLY | O_DIRECTORY;
+			int fd = open(path, flags);
+			if(fd < 0)
+			{
+				return -1;
+			}
+			openHandle(replay, handleKey(args[0], args[2]), fd);
+			return 0;
+		}
+		case TRACE_RELEASE:
+		case TRACE_RELEASEDIR:
+			return record->record.numArgs >= 2 ? releaseHandle(replay, handleKey(args[0], args[1])) : 1;
+		case TRACE_STATFS:
+		{
+			struct statvfs attributes;
+			return path != NULL ? statvfs(path, &attributes) : 1;
+		}
+		case TRACE_READDIR:
+		case TRACE_READ:
+		case TRACE_WRITE:
+		{
+			int fd = record->record.numArgs >= 4 ? getHandle(replay, handleKey(args[0], args[1])) : -1;
+			if(fd < 0 || !reserveBuffer(replay, args[2]))
+			{
+				return 1;
+			}
+			if(record->record.op == TRACE_READ)
+			{
+				return pread(fd, replay->buffer, args[2], (off_t) args[3]) >= 0 ? 0 : -1;
+			}
+			else if(record->record.op == TRACE_WRITE)
+			{
+				return pwrite(fd, replay->buffer, args[2], (off_t) args[3]) >= 0 ? 0 : -1;
+			}
+			if(lseek(fd, (off_t) args[3], SEEK_SET) < 0)
+			{
+				return -1;
+			}
+			return syscall(SYS_getdents64, fd, replay->buffer, args[2]) >= 0 ? 0 : -1;
+		}
+		case TRACE_FALLOCATE:
+		{
+			int fd = record->record.numArgs >= 5 ? getHandle(replay, handleKey(args[0], args[1])) : -1;
+			return fd >= 0 ? fallocate(fd, (int) args[2], (off_t) args[3], (off_t) args[4]) : 1;
+		}
+		case TRACE_COPY_FILE_RANGE:
+		{
+			if(record->record.numArgs < 8)
+			{
+				return 1;
+			}
+			int fdIn = getHandle(replay, handleKey(args[0], args[1]));
+			int fdOut = getHandle(replay, handleKey(args[3], args[4]));
+			if(fdIn < 0 || fdOut < 0)
+			{
+				return 1;
+			}
+			off_t offsetIn = args[2];
+			off_t offsetOut = args[5];
+			return copy_file_range(fdIn, &offsetIn, fdOut, &offsetOut, args[6], (unsigned int) args[7]) >= 0 ? 0 : -1;
+		}
+		case TRACE_GETXATTR:
+		case TRACE_LISTXATTR:
+		{
+			if(path == NULL || record->record.numArgs < 2 || !reserveBuffer(replay, args[1])
+				|| (record->record.op == TRACE_GETXATTR && record->name == NULL))
+			{
+				return 1;
+			}
+			ssize_t result = record->record.op == TRACE_GETXATTR
+				? lgetxattr(path, record->name, replay->buffer, args[1])
+				: llistxattr(path, replay->buffer, args[1]);
+			return result >= 0 ? 0 : -1;
+		}
+		case TRACE_FSYNC:
+		case TRACE_FSYNCDIR:
+		{
+			int fd = record->record.numArgs >= 3 ? getHandle(replay, handleKey(args[0], args[1])) : -1;
+			if(fd < 0)
+			{
+				return 1;
+			}
+			return args[2] ? fdatasync(fd) : fsync(fd);
+		}
+		case TRACE_ACCESS:
+			return path != NULL && record->record.numArgs >= 2 ? access(path, (int) args[1]) : 1;
+		default:
+			/*
+			 * Flushes are sent by the kernel as descriptors are closed, and
+			 * polls and lock tests have no call which causes only them.
+			 */
+			return 1;
+	}
+}
+
+/**
+ * Issues every operation of a trace against the filesystem mounted at the
+ * given path, one at a time.
+ *
+ * @param speed How many times faster than recorded operations are issued,
+ * or 0 to issue each as soon as the one before has finished
+ */
+static bool replayTrace(ReplayRecord* records, size_t numRecords,
+	const char* mountpoint, double speed, ReplayStats* stats)
+{
+	Replay replay = { 0 };
+	if(!mapInit(&replay.inodes) || !mapInit(&replay.handles))
+	{
+		printf("Out of memory.\n");
+		return false;
+	}
+	setPath(&replay, FUSE_ROOT_ID, strdup(mountpoint));
+
+	uint64_t start = now();
+	for(size_t i = 0; i < numRecords; i++)
+	{
+		ReplayRecord* record = &records[i];
+		if(speed > 0)
+		{
+			uint64_t due = start + (uint64_t) (record->record.time / speed);
+			struct timespec wake = { due / 1000000000ULL, due % 1000000000ULL };
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+		}
+		uint64_t issued = now();
+		int result = replayRecord(&replay, record);
+		uint64_t duration = now() - issued;
+		ReplayStats* stat = &stats[record->record.op];
+		if(result > 0)
+		{
+			stat->skipped++;
+			continue;
+		}
+		stat->errors += result < 0;
+		if(!statsAdd(stat, duration))
+		{
+			printf("Out of memory.\n");
+			return false;
+		}
+	}
+	double elapsed = (now() - start) / 1e9;
+
+	size_t replayed = 0;
+	for(int op = 1; op < TRACE_NUM_OPS; op++)
+	{
+		replayed += stats[op].count;
+	}
+	printStats(stats, true);
+	printf("Replayed %zu of %zu operations in %.3f s, %.0f operations/s.\n",
+		replayed, numRecords, elapsed, elapsed > 0 ? replayed / elapsed : 0);
+	mapDestroy(&replay.inodes);
+	mapDestroy(&replay.handles);
+	free(replay.buffer);
+	return true;
+}
+
+static void printUsage()
+{
+	printf("Usage: efsreplay [-s SPEED] [-v] TRACE [MOUNTPOINT]\n");
+	printf("Summarises a trace recorded by efsfuse with -o trace=TRACE, or replays it against\n");
+	printf("the filesystem mounted at MOUNTPOINT, which should hold what it did when recording began.\n");
+	printf("    -s SPEED  replay SPEED times faster than recorded, 0 for as fast as possible (default 1)\n");
+	printf("    -v        print every operation of the trace\n");
+}
+
+/**
+ * Usage:
+ * 		efsreplay [-s SPEED] [-v] TRACE [MOUNTPOINT]
+ */
+int main(int argc, char** args)
+{
+	double speed = 1;
+	bool verbose = false;
+	int option;
+	while((option = getopt(argc, args, "s:vh")) != -1)
+	{
+		switch(option)
+		{
+			case 's':
+				speed = atof(optarg) > 0 ? atof(optarg) : 0;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				printUsage();
+				return option == 'h' ? 0 : 2;
+		}
+	}
+	if(optind != argc - 1 && optind != argc - 2)
+	{
+		printUsage();
+		return 2;
+	}
+
+	TraceHeader header;
+	size_t numRecords = 0;
+	ReplayRecord* records = readTrace(args[optind], &header, &numRecords);
+	if(records == NULL)
+	{
+		return 2;
+	}
+	uint64_t length = numRecords > 0 ? records[numRecords - 1].record.time : 0;
+	unsigned int threads = 0;
+	for(size_t i = 0; i < numRecords; i++)
+	{
+		threads = records[i].record.thread > threads ? records[i].record.thread : threads;
+	}
+	time_t started = header.started / 1000000000ULL;
+	printf("%zu operations over %.3f s on %u threads, recorded %s", numRecords,
+		length / 1e9, threads, ctime(&started));
+	if(verbose)
+	{
+		for(size_t i = 0; i < numRecords; i++)
+		{
+			printRecord(&records[i]);
+		}
+	}
+
+	ReplayStats stats[TRACE_NUM_OPS] = { 0 };
+	bool success = true;
+	if(optind == argc - 1)
+	{
+		for(size_t i = 0; i < numRecords; i++)
+		{
+			if(!statsAdd(&stats[records[i].record.op], records[i].record.duration))
+			{
+				printf("Out of memory.\n");
+				return 2;
+			}
+		}
+		printStats(stats, false);
+	}
+	else
+	{
+		success = replayTrace(records, numRecords, args[optind + 1], speed, stats);
+	}
+
+	for(int op = 0; op < TRACE_NUM_OPS; op++)
+	{
+		free(stats[op].durations);
+	}
+	for(size_t i = 0; i < numRecords; i++)
+	{
+		free(records[i].name);
+	}
+	free(records);
+	return success ? 0 : 1;
+}
@@ -1,10 +1,195 @@
 #ifndef __EFS_STATE
 #define __EFS_STATE
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 
+#include "allocation_groups.h"
+#include "checksum.h"
+#include "compression.h"
+#include "dedup.h"
+#include "defragmenter.h"
+#include "delayed_allocation.h"
+#include "descriptor_table.h"
+#include "epoch.h"
 #include "file_table.h"
-#include "free_space_table.h"
+#include "image_direct.h"
+#include "image_stripe.h"
+#include "name_pool.h"
+#include "scrubber.h"
+#include "stats.h"
+#include "trace.h"
+#include "writeback.h"
+
+struct image_ring;
+
+/**
+ * Options that control the behaviour of the filesystem, parsed from the
+ * -o arguments given on the command line.
+ */
+typedef struct efs_options
+{
+	/**
+	 * The maximum time in milliseconds a modified descriptor may stay in
+	 * memory before it is written back to disk.
+	 */
+	unsigned int writebackInterval;
+	
+	/**
+	 * The number of modified descriptor pages that causes them to be
+	 * written back before the writeback interval has passed.
+	 */
+	unsigned int writebackThreshold;
+	
+	/**
+	 * The time in microseconds an fsync waits for concurrent fsyncs to
+	 * share a single sync of the image.
+	 */
+	unsigned int fsyncWindow;
+	
+	/**
+	 * The maximum time in seconds a timestamp changed only in memory may
+	 * wait before it is written back.
+	 */
+	unsigned int lazytimeInterval;
+	
+	/**
+	 * Set to never update the access time of a file when it is read.
+	 */
+	int noatime;
+	
+	/**
+	 * The amount of data in kilobytes that may be written to a file
+	 * before space is allocated for it.
+	 */
+	unsigned int delallocLimit;
+	
+	/**
+	 * The largest file in bytes whose data is stored inline in its
+	 * descriptor. Limited to what fits in a descriptor; 0 to never store
+	 * data inline.
+	 */
+	unsigned int inlineMax;
+	
+	/**
+	 * Set to compress data as it is allocated.
+	 */
+	int compress;
+	
+	/**
+	 * The zlib level data is compressed at, from 1 to 9.
+	 */
+	unsigned int compressLevel;
+	
+	/**
+	 * The amount of decompressed data in megabytes kept in memory for
+	 * reads of compressed fragments.
+	 */
+	unsigned int compressCache;
+	
+	/**
+	 * The number of threads compressing the data of a single flush.
+	 * Defaults to the number of online processors.
+	 */
+	unsigned int compressThreads;
+	
+	/**
+	 * Set to run the background defragmenter.
+	 */
+	int defrag;
+	
+	/**
+	 * The time in seconds between passes of the defragmenter.
+	 */
+	unsigned int defragInterval;
+	
+	/**
+	 * The number of fragments at which the defragmenter relocates a
+	 * file.
+	 */
+	unsigned int defragThreshold;
+	
+	/**
+	 * The maximum rate in kilobytes per second at which the defragmenter
+	 * copies data. 0 if unlimited.
+	 */
+	unsigned int defragBandwidth;
+
+	/**
+	 * Set to create a checksum table if the image has none. An image which
+	 * already has one is always verified.
+	 */
+	int checksum;
+
+	/**
+	 * Set to run the background scrubber.
+	 */
+	int scrub;
+
+	/**
+	 * The time in seconds between passes of the scrubber.
+	 */
+	unsigned int scrubInterval;
+
+	/**
+	 * The maximum rate in kilobytes per second at which the scrubber reads
+	 * data. 0 if unlimited.
+	 */
+	unsigned int scrubBandwidth;
+
+	/**
+	 * Set to share extents holding identical data between files.
+	 */
+	int dedup;
+	
+	/**
+	 * The number of allocation groups free space is split into. Defaults
+	 * to the number of online processors.
+	 */
+	unsigned int allocGroups;
+	
+	/**
+	 * The number of kilobytes stored in one member of a striped image
+	 * before moving on to the next. Only used when an image is first
+	 * striped; afterwards the unit is read from the image.
+	 */
+	unsigned int stripeUnit;
+	
+	/**
+	 * Set to access the image directly, bypassing the host's page cache.
+	 */
+	int direct;
+	
+	/**
+	 * The number of megabytes of image pages cached with direct access.
+	 */
+	unsigned int directCache;
+	
+	/**
+	 * Set to access the image through io_uring, if the program was built
+	 * with it.
+	 */
+	int ioUring;
+	
+	/**
+	 * The number of submission queue entries of the io_uring.
+	 */
+	unsigned int ioUringDepth;
+	
+	/**
+	 * Set to process requests with one worker pinned to each CPU, rather
+	 * than libfuse's pool of threads.
+	 */
+	int pinWorkers;
+	
+	/**
+	 * The file every operation is recorded to, or NULL if operations are
+	 * not recorded.
+	 */
+	char* trace;
+	
+} EFSOptions;
 
 /**
  * Private data that must persist between calls to the filesystem.
@@ -13,10 +198,17 @@ typedef struct efs_state
 {
 	/**
 	 * The stream used to read and write data to the filesystem. Must not
-	 * be null while the filesystem is mounted.
+	 * be null while the filesystem is mounted. The first member of the
+	 * image if it is striped.
 	 */
 	FILE* filesystemStream;
 	
+	/**
+	 * The files the image is held in, and how its pages are spread across
+	 * them.
+	 */
+	ImageStripe stripe;
+	
 	/**
 	 * The first page of the first chunk of file descriptors. Descriptors
 	 * are stored in an unrolled linked list. The list is not sorted, so
@@ -43,16 +235,117 @@ typedef struct efs_state
 	FileTable* fileTable;
 	
 	/**
-	 * A linked list containing the location and size of every region of free
-	 * space in the filesystem.
+	 * The location and size of every region of free space in the
+	 * filesystem, split into groups which can be allocated from
+	 * concurrently.
+	 */
+	AllocationGroups allocationGroups;
+	
+	/**
+	 * A linked list mirroring the descriptor nodes on disk. Records
+	 * which slot each descriptor is stored in, and which slots have been
+	 * modified but not yet written back.
+	 */
+	DescriptorTable* descriptorTable;
+	
+	/**
+	 * Allows the file table and descriptors to be read without holding
+	 * any lock. Nodes and descriptors removed from the file table are
+	 * retired here rather than freed.
+	 */
+	EpochDomain epoch;
+	
+	/**
+	 * Held while files are added to or removed from the file table, or
+	 * while the descriptor table or superblock pointers are modified.
+	 * Must be taken after the lock of any file, and before the lock of
+	 * any allocation group.
+	 */
+	pthread_mutex_t metadataLock;
+	
+	/**
+	 * The inode that will be given to the next file created. One greater
+	 * than the largest inode in the filesystem.
+	 */
+	uint64_t nextFileID;
+	
+	/**
+	 * Set when fileDescriptorList or freeRegionList have changed, and
+	 * the superblock must be rewritten.
+	 */
+	bool superblockDirty;
+	
+	/**
+	 * State of the thread which writes modified descriptors back to
+	 * disk.
+	 */
+	Writeback writeback;
+	
+	/**
+	 * Data written to files which has not yet been allocated space.
+	 */
+	DelayedAllocation delayedAllocation;
+	
+	/**
+	 * State of the background defragmenter thread, if enabled.
+	 */
+	Defragmenter defragmenter;
+	
+	/**
+	 * Every distinct filename, shared by the descriptors of files with
+	 * that name.
+	 */
+	NamePool namePool;
+	
+	/**
+	 * Settings for compressing data, and the cache of decompressed data
+	 * read from compressed fragments.
+	 */
+	Compression compression;
+
+	/**
+	 * The checksum of every page of the image, if the image has a checksum
+	 * table.
+	 */
+	ChecksumTable checksums;
+
+	/**
+	 * State of the background scrubber thread, if enabled.
+	 */
+	Scrubber scrubber;
+
+	/**
+	 * The extents shared between files, and the index of extents by
+	 * contents if deduplication is enabled.
+	 */
+	Dedup dedup;
+	
+	/**
+	 * The buffers and cache of image pages used with direct access.
+	 */
+	ImageDirect imageDirect;
+	
+	/**
+	 * The io_uring the image is accessed through, or NULL if the image is
+	 * accessed with ordinary system calls.
+	 */
+	struct image_ring* imageRing;
+	
+	/**
+	 * Counters exposed through the statistics extended attributes.
+	 */
+	EFSStats stats;
+	
+	/**
+	 * The recorder of the operations dispatched to the filesystem, if
+	 * enabled.
 	 */
-	FreeSpaceTable* freeSpaceTable;
+	Trace trace;
 	
 	/**
-	 * A linked list containing descriptors for each file currently being
-	 * written to.
+	 * Options given on the command line.
 	 */
-	FileTable* openFiles;
+	EFSOptions options;
 	
 } EFSState;
 
@@ -0,0 +1,216 @@
+#include "epoch.h"
+
+#include <stdlib.h>
+
+/**
+ * The record of the calling thread, or null if it has not read from a
+ * domain yet. Only one domain exists per process.
+ */
+static __thread EpochThread* localThread = NULL;
+
+/**
+ * The depth of nested read-side sections entered by the calling thread
+ * while it had no record.
+ */
+static __thread unsigned int unprotectedNesting = 0;
+
+/**
+ * Releases the record of an exiting thread for reuse.
+ */
+static void releaseThread(void* data)
+{
+	EpochThread* thread = data;
+	atomic_store(&thread->epoch, 0);
+	atomic_store(&thread->inUse, false);
+}
+
+/**
+ * Finds or allocates a record for the calling thread.
+ */
+static EpochThread* registerThread(EpochDomain* domain)
+{
+	EpochThread* thread = atomic_load(&domain->threads);
+	for(; thread != NULL; thread = thread->next)
+	{
+		bool expected = false;
+		if(atomic_compare_exchange_strong(&thread->inUse, &expected, true))
+		{
+			break;
+		}
+	}
+	if(thread == NULL)
+	{
+		if(posix_memalign((void**) &thread, 64, sizeof(EpochThread)) != 0)
+		{
+			return NULL;
+		}
+		atomic_init(&thread->epoch, 0);
+		atomic_init(&thread->inUse, true);
+		thread->next = atomic_load(&domain->threads);
+		while(!atomic_compare_exchange_weak(&domain->threads, &thread->next, thread))
+		{
+		}
+	}
+	thread->nesting = 0;
+	pthread_setspecific(domain->key, thread);
+	localThread = thread;
+	return thread;
+}
+
+bool epochInit(EpochDomain* domain)
+{
+	atomic_init(&domain->global, 1);
+	atomic_init(&domain->threads, NULL);
+	atomic_init(&domain->unprotectedReaders, 0);
+	domain->retired = NULL;
+	domain->numRetired = 0;
+	return pthread_mutex_init(&domain->lock, NULL) == 0
+		&& pthread_key_create(&domain->key, releaseThread) == 0;
+}
+
+EpochDomain* epochEnter(EpochDomain* domain)
+{
+	EpochThread* thread = localThread;
+	if(thread == NULL && unprotectedNesting == 0)
+	{
+		thread = registerThread(domain);
+	}
+	if(thread == NULL)
+	{
+		/*
+		 * Without a record the reader cannot announce its epoch, so
+		 * nothing may be freed until it has finished.
+		 */
+		if(unprotectedNesting++ == 0)
+		{
+			atomic_fetch_add(&domain->unprotectedReaders, 1);
+		}
+		return domain;
+	}
+	if(thread->nesting++ == 0)
+	{
+		atomic_store_explicit(&thread->epoch,
+			atomic_load_explicit(&domain->global, memory_order_relaxed),
+			memory_order_relaxed);
+		/*
+		 * The announcement must be visible before any shared pointer is
+		 * read, or a writer could miss this reader.
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+	return domain;
+}
+
+void epochExit(EpochDomain* domain)
+{
+	EpochThread* thread = localThread;
+	if(unprotectedNesting > 0)
+	{
+		if(--unprotectedNesting == 0)
+		{
+			atomic_fetch_sub(&domain->unprotectedReaders, 1);
+		}
+		return;
+	}
+	if(--thread->nesting == 0)
+	{
+		atomic_store_explicit(&thread->epoch, 0, memory_order_release);
+	}
+}
+
+void epochRetire(EpochDomain* domain, void (*destroy)(void*), void* pointer)
+{
+	EpochRetired* retired = malloc(sizeof(EpochRetired));
+	if(retired == NULL)
+	{
+		/*
+		 * Leaking the object is safer than freeing it while it may still
+		 * be read.
+		 */
+		return;
+	}
+	retired->destroy = destroy;
+	retired->pointer = pointer;
+	retired->epoch = atomic_load(&domain->global);
+	pthread_mutex_lock(&domain->lock);
+	retired->next = domain->retired;
+	domain->retired = retired;
+	bool reclaim = ++domain->numRetired >= EPOCH_RECLAIM_THRESHOLD;
+	pthread_mutex_unlock(&domain->lock);
+	if(reclaim)
+	{
+		epochReclaim(domain);
+	}
+}
+
+void epochReclaim(EpochDomain* domain)
+{
+	pthread_mutex_lock(&domain->lock);
+	uint64_t oldest = atomic_fetch_add(&domain->global, 1) + 1;
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load(&domain->unprotectedReaders) > 0)
+	{
+		oldest = 0;
+	}
+	for(EpochThread* thread = atomic_load(&domain->threads); thread != NULL; thread = thread->next)
+	{
+		uint64_t epoch = atomic_load(&thread->epoch);
+		if(epoch != 0 && epoch < oldest)
+		{
+			oldest = epoch;
+		}
+	}
+	/*
+	 * A reader which entered in epoch E may hold any object retired in
+	 * epoch E or later, so only objects retired before the oldest active
+	 * epoch are safe to free.
+	 */
+	EpochRetired* freeable = NULL;
+	EpochRetired** link = &domain->retired;
+	while(*link != NULL)
+	{
+		EpochRetired* retired = *link;
+		if(retired->epoch < oldest)
+		{
+			*link = retired->next;
+			retired->next = freeable;
+			freeable = retired;
+			domain->numRetired--;
+		}
+		else
+		{
+			link = &retired->next;
+		}
+	}
+	pthread_mutex_unlock(&domain->lock);
+	while(freeable != NULL)
+	{
+		EpochRetired* next = freeable->next;
+		freeable->destroy(freeable->pointer);
+		free(freeable);
+		freeable = next;
+	}
+}
+
+void epochDestroy(EpochDomain* domain)
+{
+	while(domain->retired != NULL)
+	{
+		EpochRetired* next = domain->retired->next;
+		domain->retired->destroy(domain->retired->pointer);
+		free(domain->retired);
+		domain->retired = next;
+	}
+	domain->numRetired = 0;
+	pthread_key_delete(domain->key);
+	EpochThread* thread = atomic_load(&domain->threads);
+	while(thread != NULL)
+	{
+		EpochThread* next = thread->next;
+		free(thread);
+		thread = next;
+	}
+	atomic_store(&domain->threads, NULL);
+	localThread = NULL;
+	pthread_mutex_destroy(&domain->lock);
+}
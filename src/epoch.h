@@ -0,0 +1,190 @@
+#ifndef __EFSFUSE_EPOCH
+#define __EFSFUSE_EPOCH
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The number of retired objects that causes a reclamation attempt.
+ */
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+/**
+ * The state of one thread that reads shared metadata. Each record is
+ * aligned to its own cache line, so that entering and leaving a read-side
+ * section only ever writes to memory owned by the reading thread.
+ */
+typedef struct epoch_thread
+{
+	/**
+	 * The global epoch observed when the thread entered its current
+	 * read-side section, or 0 if it is not in one.
+	 */
+	atomic_uint_fast64_t epoch;
+
+	/**
+	 * The depth of nested read-side sections. Only accessed by the owning
+	 * thread.
+	 */
+	unsigned int nesting;
+
+	/**
+	 * Set while a thread owns this record. Cleared when the thread exits,
+	 * so that the record can be reused.
+	 */
+	atomic_bool inUse;
+
+	/**
+	 * The next record in the list of every record.
+	 */
+	struct epoch_thread* next;
+
+} __attribute__((aligned(64))) EpochThread;
+
+/**
+ * An object removed from shared metadata, which cannot be freed until
+ * every reader that might still see it has finished.
+ */
+typedef struct epoch_retired
+{
+	/**
+	 * Called to free the object.
+	 */
+	void (*destroy)(void*);
+
+	/**
+	 * The object to free.
+	 */
+	void* pointer;
+
+	/**
+	 * The global epoch when the object was retired.
+	 */
+	uint64_t epoch;
+
+	/**
+	 * The next retired object.
+	 */
+	struct epoch_retired* next;
+
+} EpochRetired;
+
+/**
+ * Epoch-based reclamation for metadata which is read without locks.
+ * Readers announce the epoch in which they start reading; writers unlink
+ * objects, then retire them instead of freeing them. A retired object is
+ * freed once every reader has moved past the epoch it was retired in.
+ */
+typedef struct epoch_domain
+{
+	/**
+	 * The current global epoch. Starts at 1, so that 0 can mean that a
+	 * thread is not reading.
+	 */
+	atomic_uint_fast64_t global;
+
+	/**
+	 * The records of every thread that has ever read metadata. Records
+	 * are only ever added to the front of the list.
+	 */
+	_Atomic(EpochThread*) threads;
+
+	/**
+	 * The number of threads reading without a record, because one could
+	 * not be allocated. Nothing is freed while this is non-zero.
+	 */
+	atomic_uint unprotectedReaders;
+
+	/**
+	 * Protects retired and numRetired, and serializes reclamation.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Objects waiting to be freed, newest first.
+	 */
+	EpochRetired* retired;
+
+	/**
+	 * The number of objects in retired.
+	 */
+	size_t numRetired;
+
+	/**
+	 * Used to release the record of a thread when it exits.
+	 */
+	pthread_key_t key;
+
+} EpochDomain;
+
+/**
+ * Initializes an epoch domain.
+ *
+ * @param domain The domain to initialize
+ *
+ * @returns true upon success, false upon failure.
+ */
+bool epochInit(EpochDomain* domain);
+
+/**
+ * Enters a read-side section. Objects reachable from shared metadata will
+ * not be freed until the matching call to epochExit. Sections may be
+ * nested.
+ *
+ * @param domain The domain to read from
+ *
+ * @returns domain, for use with EPOCH_READ_SECTION.
+ */
+EpochDomain* epochEnter(EpochDomain* domain);
+
+/**
+ * Leaves a read-side section entered with epochEnter.
+ *
+ * @param domain The domain being read from
+ */
+void epochExit(EpochDomain* domain);
+
+/**
+ * Schedules an object to be freed once no reader can hold a reference
+ * to it. The object must already have been unlinked from every shared
+ * structure.
+ *
+ * @param domain The domain the object was reachable from
+ * @param destroy Called to free the object
+ * @param pointer The object to free
+ */
+void epochRetire(EpochDomain* domain, void (*destroy)(void*), void* pointer);
+
+/**
+ * Advances the global epoch and frees every retired object that no
+ * reader can still hold.
+ *
+ * @param domain The domain to reclaim objects from
+ */
+void epochReclaim(EpochDomain* domain);
+
+/**
+ * Frees every retired object and thread record. No thread may be
+ * reading from the domain.
+ *
+ * @param domain The domain to destroy
+ */
+void epochDestroy(EpochDomain* domain);
+
+static inline void epochExitGuard(EpochDomain** domain)
+{
+	epochExit(*domain);
+}
+
+/**
+ * Enters a read-side section which lasts until the end of the enclosing
+ * block, however the block is left.
+ */
+#define EPOCH_READ_SECTION(domain) \
+	EpochDomain* epochSection __attribute__((cleanup(epochExitGuard))) \
+		= epochEnter(domain)
+
+#endif
@@ -1,48 +1,434 @@
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "file_table.h"
 
 FileTable* constructFileTable()
 {
-	FileTable* table = malloc(sizeof(FileTable));
+	FileTable* table = calloc(1, sizeof(FileTable));
 	FileTableNode* head = malloc(sizeof(FileTableNode));
 	head->fileDescriptor = NULL;
 	head->next = NULL;
 	head->table = table;
+	head->descriptorNode = NULL;
+	head->descriptorSlot = 0;
+	head->pending = NULL;
+	head->extentGeneration = 0;
+	head->deduplicated = false;
+	head->record = NULL;
+	head->directoryPosition = 0;
+	head->nextInode = NULL;
+	pthread_rwlock_init(&head->lock, NULL);
+	pthread_rwlock_init(&table->directoriesLock, NULL);
+	pthread_rwlock_init(&table->inodesLock, NULL);
 	table->head = head;
 	table->last = head;
 	table->size = 0;
 	return table;
 }
 
+/**
+ * Finds the chunk holding the record with the given index, and the index
+ * of the record within it.
+ */
+static void recordPosition(size_t index, unsigned int* chunk, size_t* offset)
+{
+	*chunk = 63 - __builtin_clzll(index / FILE_RECORD_BASE + 1);
+	*offset = index - FILE_RECORD_BASE * (((size_t) 1 << *chunk) - 1);
+}
+
+static size_t inodeBucket(FileTable* table, uint64_t inode)
+{
+	return ((inode * 0x9E3779B97F4A7C15ULL) >> 32) & (table->numInodeBuckets - 1);
+}
+
 FileTableNode* fileTableSearchInode(FileTable* table, uint64_t inode)
 {
-	if(table != NULL)
+	FileTableNode* node = NULL;
+	if(table != NULL && inode != 0)
+	{
+		pthread_rwlock_rdlock(&table->inodesLock);
+		if(table->numInodeBuckets > 0)
+		{
+			node = table->inodes[inodeBucket(table, inode)];
+		}
+		while(node != NULL && node->record->inode != inode)
+		{
+			node = node->nextInode;
+		}
+		pthread_rwlock_unlock(&table->inodesLock);
+	}
+	return node;
+}
+
+/**
+ * Adds a node to the index of inodes, doubling the number of buckets once
+ * there are as many nodes as buckets.
+ */
+static bool indexInode(FileTable* table, FileTableNode* node)
+{
+	pthread_rwlock_wrlock(&table->inodesLock);
+	if(table->size + 1 > table->numInodeBuckets)
+	{
+		size_t numBuckets = table->numInodeBuckets > 0 ? table->numInodeBuckets * 2 : 64;
+		FileTableNode** buckets = calloc(numBuckets, sizeof(FileTableNode*));
+		if(buckets == NULL)
+		{
+			pthread_rwlock_unlock(&table->inodesLock);
+			return false;
+		}
+		FileTableNode** old = table->inodes;
+		size_t numOldBuckets = table->numInodeBuckets;
+		table->inodes = buckets;
+		table->numInodeBuckets = numBuckets;
+		for(size_t i = 0; i < numOldBuckets; i++)
+		{
+			while(old[i] != NULL)
+			{
+				FileTableNode* moved = old[i];
+				old[i] = moved->nextInode;
+				size_t bucket = inodeBucket(table, moved->record->inode);
+				moved->nextInode = buckets[bucket];
+				buckets[bucket] = moved;
+			}
+		}
+		free(old);
+	}
+	size_t bucket = inodeBucket(table, node->record->inode);
+	node->nextInode = table->inodes[bucket];
+	table->inodes[bucket] = node;
+	pthread_rwlock_unlock(&table->inodesLock);
+	return true;
+}
+
+/**
+ * Removes a node from the index of inodes.
+ */
+static void unindexInode(FileTable* table, FileTableNode* node)
+{
+	pthread_rwlock_wrlock(&table->inodesLock);
+	FileTableNode** link = &table->inodes[inodeBucket(table, node->record->inode)];
+	while(*link != NULL && *link != node)
+	{
+		link = &(*link)->nextInode;
+	}
+	if(*link != NULL)
+	{
+		*link = node->nextInode;
+	}
+	pthread_rwlock_unlock(&table->inodesLock);
+}
+
+static size_t directoryBucket(FileTable* table, uint64_t inode)
+{
+	return ((inode * 0x9E3779B97F4A7C15ULL) >> 32) & (table->numDirectoryBuckets - 1);
+}
+
+/**
+ * Finds the index of a directory. Must be called with the lock of indexes
+ * held.
+ */
+static DirectoryIndex* findDirectory(FileTable* table, uint64_t inode)
+{
+	if(table->numDirectoryBuckets == 0)
+	{
+		return NULL;
+	}
+	DirectoryIndex* index = table->directories[directoryBucket(table, inode)];
+	while(index != NULL && index->inode != inode)
+	{
+		index = index->next;
+	}
+	return index;
+}
+
+/**
+ * Adds an index, doubling the number of buckets once there are as many
+ * indexes as buckets. Must be called with the lock of indexes held for
+ * writing.
+ */
+static bool addDirectory(FileTable* table, DirectoryIndex* index)
+{
+	if(table->numDirectories >= table->numDirectoryBuckets)
+	{
+		size_t numBuckets = table->numDirectoryBuckets > 0 ? table->numDirectoryBuckets * 2 : 64;
+		DirectoryIndex** buckets = calloc(numBuckets, sizeof(DirectoryIndex*));
+		if(buckets == NULL)
+		{
+			return false;
+		}
+		DirectoryIndex** old = table->directories;
+		size_t numOldBuckets = table->numDirectoryBuckets;
+		table->directories = buckets;
+		table->numDirectoryBuckets = numBuckets;
+		for(size_t i = 0; i < numOldBuckets; i++)
+		{
+			while(old[i] != NULL)
+			{
+				DirectoryIndex* moved = old[i];
+				old[i] = moved->next;
+				size_t bucket = directoryBucket(table, moved->inode);
+				moved->next = buckets[bucket];
+				buckets[bucket] = moved;
+			}
+		}
+		free(old);
+	}
+	size_t bucket = directoryBucket(table, index->inode);
+	index->next = table->directories[bucket];
+	table->directories[bucket] = index;
+	table->numDirectories++;
+	return true;
+}
+
+/**
+ * Removes and deallocates the index of a directory, if it has one.
+ */
+static void dropDirectory(FileTable* table, uint64_t inode)
+{
+	pthread_rwlock_wrlock(&table->directoriesLock);
+	DirectoryIndex** link = NULL;
+	if(table->numDirectoryBuckets > 0)
+	{
+		link = &table->directories[directoryBucket(table, inode)];
+		while(*link != NULL && (*link)->inode != inode)
+		{
+			link = &(*link)->next;
+		}
+	}
+	DirectoryIndex* index = link != NULL ? *link : NULL;
+	if(index != NULL)
+	{
+		*link = index->next;
+		table->numDirectories--;
+	}
+	pthread_rwlock_unlock(&table->directoriesLock);
+	/*
+	 * Indexes are only used with the lock of indexes held, so no reader
+	 * can still be using this one.
+	 */
+	if(index != NULL)
+	{
+		destroyDirectoryIndex(index);
+	}
+}
+
+/**
+ * Adds an entry for a file to the index of its directory, creating the
+ * index if the directory has none.
+ */
+static bool indexChild(FileTable* table, FileTableNode* node)
+{
+	uint64_t parent = node->fileDescriptor->parentID;
+	uint32_t hash = node->record->nameHash;
+	pthread_rwlock_rdlock(&table->directoriesLock);
+	DirectoryIndex* index = findDirectory(table, parent);
+	bool success = index != NULL && directoryIndexInsert(index, hash, node, &node->directoryPosition);
+	pthread_rwlock_unlock(&table->directoriesLock);
+	if(index != NULL)
+	{
+		return success;
+	}
+
+	DirectoryIndex* created = constructDirectoryIndex(parent);
+	if(created == NULL)
+	{
+		return false;
+	}
+	pthread_rwlock_wrlock(&table->directoriesLock);
+	index = findDirectory(table, parent);
+	if(index == NULL && addDirectory(table, created))
+	{
+		index = created;
+		created = NULL;
+	}
+	success = index != NULL && directoryIndexInsert(index, hash, node, &node->directoryPosition);
+	pthread_rwlock_unlock(&table->directoriesLock);
+	if(created != NULL)
+	{
+		destroyDirectoryIndex(created);
+	}
+	return success;
+}
+
+/**
+ * Removes the entry of a file from the index of the directory its record
+ * names.
+ */
+static void unindexChild(FileTable* table, FileTableNode* node)
+{
+	pthread_rwlock_rdlock(&table->directoriesLock);
+	DirectoryIndex* index = findDirectory(table, node->record->parent);
+	if(index != NULL)
+	{
+		directoryIndexRemove(index, node->directoryPosition);
+	}
+	pthread_rwlock_unlock(&table->directoriesLock);
+}
+
+size_t fileTableListChildren(FileTable* table, uint64_t parent,
+	uint64_t position, DirectoryEntry* entries, size_t max)
+{
+	pthread_rwlock_rdlock(&table->directoriesLock);
+	DirectoryIndex* index = findDirectory(table, parent);
+	size_t count = index != NULL ? directoryIndexList(index, position, entries, max) : 0;
+	pthread_rwlock_unlock(&table->directoriesLock);
+	return count;
+}
+
+FileTableNode* fileTableFindChild(FileTable* table, uint64_t parent,
+	const char* name)
+{
+	size_t length = strlen(name);
+	uint32_t hash = nameHash(name, length);
+	uint64_t position = directoryPositionOf(hash);
+	DirectoryEntry entries[16];
+	size_t count = sizeof(entries) / sizeof(DirectoryEntry);
+	while(count == sizeof(entries) / sizeof(DirectoryEntry))
 	{
-		FileTableNode* node = table->head;
-		while(node->next != NULL)
+		count = fileTableListChildren(table, parent, position, entries, count);
+		for(size_t i = 0; i < count; i++)
 		{
-			node = node->next;
-			if(node->fileDescriptor->fileID == inode)
+			if(entries[i].position >> DIRECTORY_MINOR_BITS != hash)
+			{
+				return NULL;
+			}
+			else if(__atomic_load_n(&entries[i].node->table, __ATOMIC_ACQUIRE) != table)
+			{
+				continue;
+			}
+			EFSCompactFileDescriptor* descriptor =
+				__atomic_load_n(&entries[i].node->fileDescriptor, __ATOMIC_ACQUIRE);
+			InternedName* interned = internedName(descriptor->filename);
+			if(interned->length == length && memcmp(interned->text, name, length) == 0)
 			{
-				return node;
+				return entries[i].node;
 			}
 		}
+		if(count > 0)
+		{
+			position = entries[count - 1].position + 1;
+		}
 	}
 	return NULL;
 }
 
+/**
+ * Packs the file type and the nine permission flags of a descriptor into
+ * the bits of a mode.
+ */
+static uint32_t packMode(EFSCompactFileDescriptor* descriptor)
+{
+	return (descriptor->isLink == 1 ? S_IFLNK
+			: (descriptor->isFile == 1 ? S_IFREG : S_IFDIR))
+		| (descriptor->ownerRead == 1 ? S_IRUSR : 0)
+		| (descriptor->ownerWrite == 1 ? S_IWUSR : 0)
+		| (descriptor->ownerExecute == 1 ? S_IXUSR : 0)
+		| (descriptor->groupRead == 1 ? S_IRGRP : 0)
+		| (descriptor->groupWrite == 1 ? S_IWGRP : 0)
+		| (descriptor->groupExecute == 1 ? S_IXGRP : 0)
+		| (descriptor->othersRead == 1 ? S_IROTH : 0)
+		| (descriptor->othersWrite == 1 ? S_IWOTH : 0)
+		| (descriptor->othersExecute == 1 ? S_IXOTH : 0);
+}
+
+void fileRecordUpdate(FileTableNode* node)
+{
+	EFSCompactFileDescriptor* descriptor = node->fileDescriptor;
+	FileRecord* record = node->record;
+	record->size = descriptor->filesize;
+	record->accessed = descriptor->lastAccessed;
+	record->modified = descriptor->lastModified;
+	record->mode = packMode(descriptor);
+	record->uid = descriptor->ownerUUID;
+	record->gid = descriptor->groupUUID;
+	__atomic_store_n(&record->nameHash,
+		internedName(descriptor->filename)->hash, __ATOMIC_RELAXED);
+}
+
+/**
+ * Takes a record for a new file, reusing the record of a removed file if
+ * there is one. Sets fresh if the record has never been used, in which
+ * case numRecords must be advanced once the record is filled.
+ */
+static FileRecord* allocateRecord(FileTable* table, bool* fresh)
+{
+	if(table->numFreeRecords > 0)
+	{
+		*fresh = false;
+		return table->freeRecords[--table->numFreeRecords];
+	}
+	unsigned int chunk;
+	size_t offset;
+	recordPosition(table->numRecords, &chunk, &offset);
+	if(chunk >= FILE_RECORD_CHUNKS)
+	{
+		return NULL;
+	}
+	if(table->chunks[chunk] == NULL)
+	{
+		size_t size = sizeof(FileRecord) * ((size_t) FILE_RECORD_BASE << chunk);
+		FileRecord* records = aligned_alloc(sizeof(FileRecord), size);
+		if(records == NULL)
+		{
+			return NULL;
+		}
+		memset(records, 0, size);
+		__atomic_store_n(&table->chunks[chunk], records, __ATOMIC_RELEASE);
+	}
+	*fresh = true;
+	return &table->chunks[chunk][offset];
+}
+
 FileTableNode* fileTableInsert(FileTable* table, FileTableNode* location, EFSCompactFileDescriptor* data)
 {
 	if(location->table == table && table != NULL)
 	{
 		FileTableNode* newNode = malloc(sizeof(FileTableNode));
-		if(newNode != NULL)
+		bool fresh = false;
+		FileRecord* record = newNode != NULL ? allocateRecord(table, &fresh) : NULL;
+		if(record != NULL)
 		{
 			newNode->table = table;
 			newNode->next = location->next;
 			newNode->fileDescriptor = data;
-			location->next = newNode;
+			newNode->descriptorNode = NULL;
+			newNode->descriptorSlot = 0;
+			newNode->pending = NULL;
+			newNode->extentGeneration = 0;
+			newNode->deduplicated = false;
+			newNode->record = record;
+			pthread_rwlock_init(&newNode->lock, NULL);
+			fileRecordUpdate(newNode);
+			__atomic_store_n(&record->parent, data->parentID, __ATOMIC_RELAXED);
+			__atomic_store_n(&record->inode, data->fileID, __ATOMIC_RELAXED);
+			bool indexed = indexChild(table, newNode);
+			if(!indexed || !indexInode(table, newNode))
+			{
+				if(indexed)
+				{
+					unindexChild(table, newNode);
+				}
+				__atomic_store_n(&record->inode, 0, __ATOMIC_RELAXED);
+				if(!fresh)
+				{
+					table->freeRecords[table->numFreeRecords++] = record;
+				}
+				pthread_rwlock_destroy(&newNode->lock);
+				free(newNode);
+				return NULL;
+			}
+			__atomic_store_n(&record->node, newNode, __ATOMIC_RELEASE);
+			if(fresh)
+			{
+				__atomic_store_n(&table->numRecords, table->numRecords + 1, __ATOMIC_RELEASE);
+			}
+			/*
+			 * The node must be fully initialized before readers can
+			 * reach it.
+			 */
+			__atomic_store_n(&location->next, newNode, __ATOMIC_RELEASE);
 			table->size++;
 			if(table->last == location)
 			{
@@ -50,10 +436,33 @@ FileTableNode* fileTableInsert(FileTable* table, FileTableNode* location, EFSCom
 			}
 			return newNode;
 		}
+		free(newNode);
 	}
 	return NULL;
 }
 
+/**
+ * Clears the record of a removed file and keeps it for reuse. If it cannot
+ * be kept, it is simply never used again.
+ */
+static void releaseRecord(FileTable* table, FileRecord* record)
+{
+	__atomic_store_n(&record->node, NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&record->inode, 0, __ATOMIC_RELAXED);
+	if(table->numFreeRecords == table->freeRecordsCapacity)
+	{
+		size_t capacity = table->freeRecordsCapacity > 0 ? table->freeRecordsCapacity * 2 : 16;
+		FileRecord** freeRecords = realloc(table->freeRecords, sizeof(FileRecord*) * capacity);
+		if(freeRecords == NULL)
+		{
+			return;
+		}
+		table->freeRecords = freeRecords;
+		table->freeRecordsCapacity = capacity;
+	}
+	table->freeRecords[table->numFreeRecords++] = record;
+}
+
 bool fileTableRemove(FileTable* table, FileTableNode* node)
 {
 	if(node->table == table && node != table->head && table != NULL)
@@ -65,22 +474,46 @@ bool fileTableRemove(FileTable* table, FileTableNode* node)
 			prev = next;
 			next = next->next;
 		} while(next != node && next != NULL);
-		
+
 		if(next == node)
 		{
-			prev->next = next->next;
+			/*
+			 * The removed node keeps its own next pointer, so readers
+			 * already on it can carry on through the list.
+			 */
+			__atomic_store_n(&prev->next, next->next, __ATOMIC_RELEASE);
+			unindexInode(table, node);
+			__atomic_store_n(&node->table, NULL, __ATOMIC_RELEASE);
+			unindexChild(table, node);
+			if(node->fileDescriptor->isFile == 0)
+			{
+				dropDirectory(table, node->fileDescriptor->fileID);
+			}
+			releaseRecord(table, node->record);
 			if(node == table->last)
 			{
 				table->last = prev;
 			}
 			table->size--;
-			free(node);
 			return true;
 		}
 	}
 	return false;
 }
 
+bool fileTableMove(FileTable* table, FileTableNode* node)
+{
+	unindexChild(table, node);
+	__atomic_store_n(&node->record->parent, node->fileDescriptor->parentID, __ATOMIC_RELAXED);
+	return indexChild(table, node);
+}
+
+void destroyFileTableNode(void* node)
+{
+	pthread_rwlock_destroy(&((FileTableNode*) node)->lock);
+	free(node);
+}
+
 void destroyFileTable(FileTable* table)
 {
 	FileTableNode* prev = NULL;
@@ -89,7 +522,25 @@ void destroyFileTable(FileTable* table)
 	{
 		prev = next;
 		next = next->next;
-		free(prev);
+		destroyFileTableNode(prev);
 	} while(next != NULL);
+	for(unsigned int chunk = 0; chunk < FILE_RECORD_CHUNKS; chunk++)
+	{
+		free(table->chunks[chunk]);
+	}
+	free(table->freeRecords);
+	for(size_t i = 0; i < table->numDirectoryBuckets; i++)
+	{
+		while(table->directories[i] != NULL)
+		{
+			DirectoryIndex* index = table->directories[i];
+			table->directories[i] = index->next;
+			destroyDirectoryIndex(index);
+		}
+	}
+	free(table->directories);
+	pthread_rwlock_destroy(&table->directoriesLock);
+	free(table->inodes);
+	pthread_rwlock_destroy(&table->inodesLock);
 	free(table);
 }
@@ -3,7 +3,91 @@
 
 #include <EFS/file_descriptor.h>
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "descriptor_table.h"
+#include "directory_index.h"
+#include "name_pool.h"
+
+struct pending_data;
+struct file_table_node;
+
+/**
+ * The number of records in the first chunk of a table's records. Each
+ * further chunk is twice the size of the one before it.
+ */
+#define FILE_RECORD_BASE 64
+
+/**
+ * The number of chunks of records a table can have, enough for far more
+ * files than an image can hold.
+ */
+#define FILE_RECORD_CHUNKS 32
+
+/**
+ * The attributes of a file that getattr, lookup and directory scans read,
+ * packed into a single cache line. Records are stored densely in chunks
+ * owned by the table, so a scan for the children of a directory reads
+ * one cache line per file instead of following a node and a descriptor. The descriptor remains the authoritative copy; the record
+ * is refreshed from it by \link fileRecordUpdate \endlink.
+ */
+typedef struct file_record
+{
+	/**
+	 * The inode of the file, or 0 if the record is not in use.
+	 */
+	uint64_t inode;
+	
+	/**
+	 * The inode of the directory containing the file.
+	 */
+	uint64_t parent;
+	
+	/**
+	 * The size of the file in bytes.
+	 */
+	uint64_t size;
+	
+	/**
+	 * The time the file was last accessed.
+	 */
+	uint64_t accessed;
+	
+	/**
+	 * The time the file was last modified.
+	 */
+	uint64_t modified;
+	
+	/**
+	 * The type and permission bits of the file, as in st_mode.
+	 */
+	uint32_t mode;
+	
+	/**
+	 * The owner of the file.
+	 */
+	uint32_t uid;
+	
+	/**
+	 * The group of the file.
+	 */
+	uint32_t gid;
+	
+	/**
+	 * The hash of the file's name, so that a directory can be searched
+	 * for a name without reading the name of every entry.
+	 */
+	uint32_t nameHash;
+	
+	/**
+	 * The node of the file, or NULL if the record is not in use.
+	 */
+	struct file_table_node* node;
+	
+} __attribute__((aligned(64))) FileRecord;
 
 /**
  * A single node in a linked list of file descriptors. Each node stores
@@ -28,6 +112,63 @@ typedef struct file_table_node
 	 */
 	struct file_table* table;
 	
+	/**
+	 * The descriptor node on disk which stores this file descriptor.
+	 * NULL if this node does not refer to a descriptor stored on disk.
+	 */
+	DescriptorTableNode* descriptorNode;
+	
+	/**
+	 * The index of the slot within descriptorNode which stores this file
+	 * descriptor.
+	 */
+	unsigned int descriptorSlot;
+	
+	/**
+	 * Data written to the file which has not yet been allocated space,
+	 * or null if no data has ever been pending.
+	 */
+	struct pending_data* pending;
+	
+	/**
+	 * Incremented whenever the fragments of the file change, so that
+	 * open handles caching them know to rebuild their extent maps.
+	 */
+	uint64_t extentGeneration;
+	
+	/**
+	 * Set once any fragment of the file has shared an extent or been
+	 * indexed for deduplication, so that writes to files which never have
+	 * do not look their fragments up. Only changed with the lock held for
+	 * writing.
+	 */
+	bool deduplicated;
+	
+	/**
+	 * The packed attributes of this file. Never moves while the node is
+	 * in its table.
+	 */
+	FileRecord* record;
+	
+	/**
+	 * The position of the file's entry in the index of its directory.
+	 */
+	uint64_t directoryPosition;
+	
+	/**
+	 * The next node in the same bucket of the table's index of inodes.
+	 */
+	struct file_table_node* nextInode;
+	
+	/**
+	 * Held for reading while the file's data or attributes are read, and
+	 * for writing while they are changed. For a directory, also held for
+	 * writing while entries are added to or removed from it. Locks of
+	 * directories are taken before the locks of their children, and
+	 * every file lock is taken before the metadata lock.
+	 */
+	pthread_rwlock_t lock;
+	
 } FileTableNode;
 
 /**
@@ -52,6 +193,75 @@ typedef struct file_table
 	 */
 	size_t size;
 	
+	/**
+	 * The chunks of records of the files in this table. Chunk i holds
+	 * FILE_RECORD_BASE << i records, and is allocated once every earlier
+	 * chunk is full. Chunks never move, so records can be changed in
+	 * place while other threads scan them.
+	 */
+	FileRecord* chunks[FILE_RECORD_CHUNKS];
+	
+	/**
+	 * The number of records that have ever been used. Scans stop here.
+	 */
+	size_t numRecords;
+	
+	/**
+	 * Records of removed files, ready to be reused.
+	 */
+	FileRecord** freeRecords;
+	
+	/**
+	 * The number of entries in freeRecords.
+	 */
+	size_t numFreeRecords;
+	
+	/**
+	 * The number of entries allocated for freeRecords.
+	 */
+	size_t freeRecordsCapacity;
+	
+	/**
+	 * The indexes of the directories with entries in this table, chained
+	 * in buckets by inode. A directory has an index once a file has been
+	 * added to it.
+	 */
+	DirectoryIndex** directories;
+	
+	/**
+	 * The number of entries in directories. Always a power of two, or 0
+	 * before the first index is added.
+	 */
+	size_t numDirectoryBuckets;
+	
+	/**
+	 * The number of indexes in directories.
+	 */
+	size_t numDirectories;
+	
+	/**
+	 * Held for reading while an index is used, and for writing while one
+	 * is added or removed.
+	 */
+	pthread_rwlock_t directoriesLock;
+	
+	/**
+	 * The nodes of the table, chained in buckets by inode.
+	 */
+	FileTableNode** inodes;
+	
+	/**
+	 * The number of entries in inodes. Always a power of two, or 0 before
+	 * the first node is added.
+	 */
+	size_t numInodeBuckets;
+	
+	/**
+	 * Held for reading while inodes is searched, and for writing while
+	 * nodes are added to or removed from it.
+	 */
+	pthread_rwlock_t inodesLock;
+	
 } FileTable;
 
 /**
@@ -63,7 +273,9 @@ typedef struct file_table
 FileTable* constructFileTable();
 
 /**
- * Searches the table for a file descriptor with the specified inode.
+ * Searches the table for a file descriptor with the specified inode, in
+ * the table's index of inodes. May be called without holding the
+ * metadata lock, from inside a read-side section.
  * 
  * @param table The table to search
  * @param inode The inode to search for
@@ -74,8 +286,9 @@ FileTable* constructFileTable();
 FileTableNode* fileTableSearchInode(FileTable* table, uint64_t inode);
 
 /**
- * Inserts a new node after the given location. Use the list head as the
- * location to insert an element to the beginning of the table.
+ * Inserts a new node after the given location, and adds an entry for it
+ * to the index of its directory. Use the list head as the location to
+ * insert an element to the beginning of the table.
  * 
  * @param table The table to insert into
  * @param location The node to insert after.
@@ -87,8 +300,12 @@ FileTableNode* fileTableSearchInode(FileTable* table, uint64_t inode);
 FileTableNode* fileTableInsert(FileTable* table, FileTableNode* location, EFSCompactFileDescriptor* data);
 
 /**
- * Removes the provided node from the table. Deallocates the node, but
- * NOT the file descriptor contained in it.
+ * Removes the provided node from the table and from the index of its
+ * directory, drops the node's own index if it is a directory, and clears
+ * its table pointer so that it is known to be invalid. Does NOT deallocate the node
+ * or the file descriptor contained in it, since readers may still be
+ * traversing it. The caller should retire the node through the epoch
+ * domain of the filesystem, or free it directly if the table is private.
  * 
  * @param table The table to remove from
  * @param node The node to remove
@@ -98,6 +315,85 @@ FileTableNode* fileTableInsert(FileTable* table, FileTableNode* location, EFSCom
  */
 bool fileTableRemove(FileTable* table, FileTableNode* node);
 
+/**
+ * Copies the entries of a directory at or after a position, in order of
+ * position. A listing resumed from one past the position of the last
+ * entry copied sees every entry that existed throughout, however many
+ * are added or removed in between. May be called without holding the
+ * metadata lock, from inside a read-side section.
+ * 
+ * @param table The table to search
+ * @param parent The inode of the directory
+ * @param position The position to start from, initially 0
+ * @param entries Receives the entries
+ * @param max The number of entries that fit in entries
+ * 
+ * @returns The number of entries copied, fewer than max only if there
+ * are no more.
+ */
+size_t fileTableListChildren(FileTable* table, uint64_t parent,
+	uint64_t position, DirectoryEntry* entries, size_t max);
+
+/**
+ * Finds the file with the given name in a directory, by looking up the
+ * hash of the name in the directory's index and comparing the names of
+ * the entries with that hash. May be called without holding the metadata
+ * lock, from inside a read-side section.
+ * 
+ * @param table The table to search
+ * @param parent The inode of the directory
+ * @param name The name to search for
+ * 
+ * @returns The node of the file, or null if the directory has no file
+ * with that name.
+ */
+FileTableNode* fileTableFindChild(FileTable* table, uint64_t parent,
+	const char* name);
+
+/**
+ * Moves the entry of a file to the directory and name now held in its
+ * descriptor. Must be called with the metadata lock held, after the
+ * file's record has been refreshed.
+ * 
+ * @param table The table containing the file
+ * @param node The node of the file
+ * 
+ * @returns true upon success, false if memory could not be allocated, in
+ * which case the file is left out of every directory.
+ */
+bool fileTableMove(FileTable* table, FileTableNode* node);
+
+/**
+ * Refreshes the record of a file from its descriptor. Must be called after
+ * any attribute held in the record is changed, with the file's lock held
+ * for writing.
+ * 
+ * @param node The node of the file
+ */
+void fileRecordUpdate(FileTableNode* node);
+
+/**
+ * Returns the node after the given node. Readers traversing the table
+ * without holding the metadata lock must use this, so that they see
+ * every node fully initialized.
+ * 
+ * @param node The current node
+ * 
+ * @returns The next node, or null if node is the last.
+ */
+static inline FileTableNode* fileTableNext(FileTableNode* node)
+{
+	return __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Deallocates a single node removed from a table. Does not deallocate the
+ * file descriptor contained in it. Suitable for passing to epochRetire.
+ * 
+ * @param node The node to deallocate
+ */
+void destroyFileTableNode(void* node);
+
 /**
  * Deallocates the table and all nodes contained within it. Note that
  * this function does not deallocate the file descriptors themselves.
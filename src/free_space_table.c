@@ -9,10 +9,13 @@ FreeSpaceTable* constructFreeSpaceTable()
 	table->head = head;
 	table->last = head;
 	table->size = 0;
+	table->headDirty = false;
+	table->freePages = 0;
 	head->table = table;
 	head->next = NULL;
 	head->location = 0;
 	head->size = 0;
+	head->dirty = false;
 	return table;
 }
 
@@ -28,8 +31,10 @@ FreeSpaceTableNode* freeSpaceTableInsert(FreeSpaceTable* table,
 			newNode->next = location->next;
 			newNode->location = dataLocation;
 			newNode->size = dataSize;
+			newNode->dirty = false;
 			location->next = newNode;
 			table->size++;
+			__atomic_add_fetch(&table->freePages, dataSize, __ATOMIC_RELAXED);
 			if(table->last == location)
 			{
 				table->last = newNode;
@@ -60,6 +65,7 @@ bool freeSpaceTableRemove(FreeSpaceTable* table, FreeSpaceTableNode* node)
 				table->last = prev;
 			}
 			table->size--;
+			__atomic_sub_fetch(&table->freePages, node->size, __ATOMIC_RELAXED);
 			free(node);
 			return true;
 		}
@@ -67,6 +73,164 @@ bool freeSpaceTableRemove(FreeSpaceTable* table, FreeSpaceTableNode* node)
 	return false;
 }
 
+/**
+ * Marks the header of the region preceding a changed region as dirty,
+ * since its pointer to the next region may have changed. If the changed
+ * region is the first, the superblock must be rewritten instead.
+ */
+static void markPredecessorDirty(FreeSpaceTable* table, 
+	FreeSpaceTableNode* predecessor)
+{
+	if(predecessor == table->head)
+	{
+		table->headDirty = true;
+	}
+	else
+	{
+		predecessor->dirty = true;
+	}
+}
+
+uint64_t freeSpaceTableAllocate(FreeSpaceTable* table, uint64_t size)
+{
+	FreeSpaceTableNode* prev = table->head;
+	while(prev->next != NULL)
+	{
+		FreeSpaceTableNode* node = prev->next;
+		if(node->size >= size)
+		{
+			uint64_t location = node->location;
+			if(node->size == size)
+			{
+				freeSpaceTableRemove(table, node);
+			}
+			else
+			{
+				node->location += size;
+				node->size -= size;
+				node->dirty = true;
+				__atomic_sub_fetch(&table->freePages, size, __ATOMIC_RELAXED);
+			}
+			markPredecessorDirty(table, prev);
+			return location;
+		}
+		prev = node;
+	}
+	return 0;
+}
+
+bool freeSpaceTableAllocateAt(FreeSpaceTable* table, uint64_t location,
+	uint64_t size)
+{
+	FreeSpaceTableNode* prev = table->head;
+	while(prev->next != NULL && prev->next->location < location)
+	{
+		prev = prev->next;
+	}
+	FreeSpaceTableNode* node = prev->next;
+	if(node == NULL || node->location != location || node->size < size)
+	{
+		return false;
+	}
+	if(node->size == size)
+	{
+		freeSpaceTableRemove(table, node);
+	}
+	else
+	{
+		node->location += size;
+		node->size -= size;
+		node->dirty = true;
+		__atomic_sub_fetch(&table->freePages, size, __ATOMIC_RELAXED);
+	}
+	markPredecessorDirty(table, prev);
+	return true;
+}
+
+uint64_t freeSpaceTableAllocateLargest(FreeSpaceTable* table, 
+	uint64_t maxSize, uint64_t* size)
+{
+	FreeSpaceTableNode* largest = NULL;
+	FreeSpaceTableNode* node = table->head;
+	while(node->next != NULL)
+	{
+		node = node->next;
+		if(largest == NULL || node->size > largest->size)
+		{
+			largest = node;
+		}
+	}
+	if(largest == NULL)
+	{
+		*size = 0;
+		return 0;
+	}
+	uint64_t location = largest->location;
+	*size = largest->size < maxSize ? largest->size : maxSize;
+	freeSpaceTableAllocateAt(table, location, *size);
+	return location;
+}
+
+uint64_t freeSpaceTableLargest(FreeSpaceTable* table)
+{
+	uint64_t largest = 0;
+	FreeSpaceTableNode* node = table->head;
+	while(node->next != NULL)
+	{
+		node = node->next;
+		if(node->size > largest)
+		{
+			largest = node->size;
+		}
+	}
+	return largest;
+}
+
+bool freeSpaceTableRelease(FreeSpaceTable* table, uint64_t location,
+	uint64_t size)
+{
+	FreeSpaceTableNode* prev = table->head;
+	while(prev->next != NULL && prev->next->location < location)
+	{
+		prev = prev->next;
+	}
+	FreeSpaceTableNode* next = prev->next;
+	bool mergePrev = prev != table->head && prev->location + prev->size == location;
+	bool mergeNext = next != NULL && location + size == next->location;
+	if(mergePrev && mergeNext)
+	{
+		prev->size += size + next->size;
+		prev->dirty = true;
+		__atomic_add_fetch(&table->freePages, size + next->size, __ATOMIC_RELAXED);
+		freeSpaceTableRemove(table, next);
+	}
+	else if(mergePrev)
+	{
+		prev->size += size;
+		prev->dirty = true;
+		__atomic_add_fetch(&table->freePages, size, __ATOMIC_RELAXED);
+	}
+	else if(mergeNext)
+	{
+		next->location = location;
+		next->size += size;
+		next->dirty = true;
+		__atomic_add_fetch(&table->freePages, size, __ATOMIC_RELAXED);
+		markPredecessorDirty(table, prev);
+	}
+	else
+	{
+		FreeSpaceTableNode* node = freeSpaceTableInsert(table, prev, location, size);
+		if(node == NULL)
+		{
+			return false;
+		}
+		node->dirty = true;
+		markPredecessorDirty(table, prev);
+	}
+	return true;
+}
+
 void destroyFreeSpaceTable(FreeSpaceTable* table)
 {
 	FreeSpaceTableNode* prev = NULL;
@@ -34,6 +34,12 @@ typedef struct free_space_table_node
 	 */
 	uint64_t size;
 	
+	/**
+	 * Set when the location, size or successor of this region has
+	 * changed, and the header of the region on disk must be rewritten.
+	 */
+	bool dirty;
+	
 } FreeSpaceTableNode;
 
 /**
@@ -60,6 +66,18 @@ typedef struct free_space_table
 	 */
 	size_t size;
 	
+	/**
+	 * Set when the first region in the table has changed, and the
+	 * pointer to it in the superblock must be rewritten.
+	 */
+	bool headDirty;
+	
+	/**
+	 * The total number of free pages in every region. Maintained by
+	 * writers, so that statfs can read it without walking the table.
+	 */
+	uint64_t freePages;
+	
 } FreeSpaceTable;
 
 /**
@@ -96,6 +114,72 @@ FreeSpaceTableNode* freeSpaceTableInsert(FreeSpaceTable* table,
  */
 bool freeSpaceTableRemove(FreeSpaceTable* table, FreeSpaceTableNode* node);
 
+/**
+ * Allocates a contiguous region of the specified size from the first
+ * region of free space large enough to hold it. Marks every region whose
+ * header on disk must change as dirty.
+ * 
+ * @param table The table to allocate from
+ * @param size The number of pages to allocate
+ * 
+ * @returns The page index of the allocated region. 0 if no region of
+ * free space is large enough.
+ */
+uint64_t freeSpaceTableAllocate(FreeSpaceTable* table, uint64_t size);
+
+/**
+ * Allocates a region of the specified size starting at exactly the given
+ * page index, if that page begins a region of free space large enough to
+ * hold it. Used to extend an existing allocation in place.
+ * 
+ * @param table The table to allocate from
+ * @param location The page index the allocated region must start at
+ * @param size The number of pages to allocate
+ * 
+ * @returns true upon success, false if the pages are not free.
+ */
+bool freeSpaceTableAllocateAt(FreeSpaceTable* table, uint64_t location,
+	uint64_t size);
+
+/**
+ * Allocates as much as possible of the specified size from the largest
+ * region of free space. Used when no single region is large enough.
+ * 
+ * @param table The table to allocate from
+ * @param maxSize The maximum number of pages to allocate
+ * @param size Set to the number of pages actually allocated
+ * 
+ * @returns The page index of the allocated region. 0 if there is no free
+ * space.
+ */
+uint64_t freeSpaceTableAllocateLargest(FreeSpaceTable* table, 
+	uint64_t maxSize, uint64_t* size);
+
+/**
+ * Finds the size of the largest region of free space, without allocating
+ * anything.
+ * 
+ * @param table The table to search
+ * 
+ * @returns The size in pages of the largest region. 0 if there is no free
+ * space.
+ */
+uint64_t freeSpaceTableLargest(FreeSpaceTable* table);
+
+/**
+ * Returns a region to the table, merging it with any adjacent regions of
+ * free space. The table is kept sorted by page index. Marks every region
+ * whose header on disk must change as dirty.
+ * 
+ * @param table The table to return the region to
+ * @param location The page index of the region
+ * @param size The size of the region in pages
+ * 
+ * @returns true upon success, false if a node could not be allocated.
+ */
+bool freeSpaceTableRelease(FreeSpaceTable* table, uint64_t location,
+	uint64_t size);
+
 /**
  * Deallocates the table and all nodes contained within it.
  * 
@@ -1,20 +1,37 @@
 #include "fs_operations.h"
+#include "efs_functions.h"
 #include "efsstate.h"
+#include "epoch.h"
 #include "file_table.h"
+#include "open_file.h"
+#include "scratch.h"
+#include "stats.h"
 #include "util.h"
+#include "delayed_allocation.h"
+#include "writeback.h"
 
 #include <fuse3/fuse_lowlevel.h>
 #include <fuse3/fuse_common.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/statvfs.h> 
+#include <time.h>
+
+/**
+ * The number of directory entries copied from an index at a time while a
+ * directory is read.
+ */
+#define READDIR_BATCH 64
 
 void efsOpen(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	FileTableNode* fileToOpen = fileTableSearchInode(fsState->fileTable, inode);
 	if(fileToOpen == NULL)
 	{
@@ -26,23 +43,258 @@ void efsOpen(fuse_req_t request, fuse_ino_t inode,
 		fuse_reply_err(request, EISDIR);
 		return;
 	}
-	else if(fileTableSearchInode(fsState->openFiles, inode) != NULL)
+	OpenFile* handle = openFileCreate(inode, fileInfo->flags);
+	if(handle == NULL)
 	{
-		fuse_reply_err(request, EACCES);
+		fuse_reply_err(request, ENOMEM);
+		return;
 	}
-	
-	if(fileInfo->flags & 3 == O_WRONLY || fileInfo->flags & 3 == O_WRONLY)
+	atomic_fetch_add(&fsState->stats.openHandles, 1);
+	fileInfo->fh = (uint64_t) handle;
+	if(fuse_reply_open(request, fileInfo) != 0)
 	{
-		fileTableInsert(fsState->openFiles, fsState->openFiles->last, fileToOpen->fileDescriptor);
+		/*
+		 * The kernel never saw the handle, so it will not be released.
+		 */
+		openFileDestroy(handle);
+		atomic_fetch_sub(&fsState->stats.openHandles, 1);
+		return;
 	}
-	fuse_reply_open(request, fileInfo);
 	printf("\tOpened successfully\n");
 }
 
+/**
+ * Finds the entry with the given name in the given directory.
+ * 
+ * @returns The node in the file table for the entry. NULL if the directory
+ * has no such entry.
+ */
+static FileTableNode* findDirectoryEntry(EFSState* fsState, fuse_ino_t parent,
+	const char* name)
+{
+	return fileTableFindChild(fsState->fileTable, parent, name);
+}
+
+/**
+ * Creates a new file or directory in the given directory, owned by the 
+ * caller of the request. Replies to the request with an error upon failure.
+ * 
+ * @returns The node in the file table for the new entry. NULL upon failure.
+ */
+static FileTableNode* createDirectoryEntry(fuse_req_t request, 
+	fuse_ino_t parent, const char* name, mode_t mode)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* parentNode = fileTableSearchInode(fsState->fileTable, parent);
+	if(parentNode == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return NULL;
+	}
+	else if(parentNode->fileDescriptor->isFile != 0)
+	{
+		fuse_reply_err(request, ENOTDIR);
+		return NULL;
+	}
+	else if(strlen(name) > EFS_MAX_FILENAME)
+	{
+		fuse_reply_err(request, ENAMETOOLONG);
+		return NULL;
+	}
+	/*
+	 * The directory is locked until the new entry is complete, so that
+	 * two entries with the same name cannot both be created.
+	 */
+	pthread_rwlock_wrlock(&parentNode->lock);
+	if(__atomic_load_n(&parentNode->table, __ATOMIC_ACQUIRE) == NULL)
+	{
+		pthread_rwlock_unlock(&parentNode->lock);
+		fuse_reply_err(request, ENOENT);
+		return NULL;
+	}
+	else if(findDirectoryEntry(fsState, parent, name) != NULL)
+	{
+		pthread_rwlock_unlock(&parentNode->lock);
+		fuse_reply_err(request, EEXIST);
+		return NULL;
+	}
+	FileTableNode* file = createFile(fsState, parent, name);
+	if(file == NULL)
+	{
+		pthread_rwlock_unlock(&parentNode->lock);
+		fuse_reply_err(request, ENOSPC);
+		return NULL;
+	}
+	const struct fuse_ctx* context = fuse_req_ctx(request);
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	descriptor->isFile = S_ISDIR(mode) ? 0 : 1;
+	descriptor->ownerUUID = context->uid;
+	descriptor->groupUUID = context->gid;
+	setFilePermissions(descriptor, mode);
+	fileRecordUpdate(file);
+	writebackMarkDirty(fsState, file->descriptorNode, file->descriptorSlot);
+	pthread_rwlock_unlock(&parentNode->lock);
+	printf("\tCreated inode %" PRIu64 " named %s in %" PRIu64 "\n", descriptor->fileID, name, (uint64_t) parent);
+	return file;
+}
+
+static void genDirectoryEntry(FileTableNode* file, 
+	struct fuse_entry_param* directoryEntry)
+{
+	memset(directoryEntry, 0, sizeof(struct fuse_entry_param));
+	directoryEntry->ino = file->fileDescriptor->fileID;
+	directoryEntry->generation = 1;
+	directoryEntry->attr_timeout = 10000.0;
+	directoryEntry->entry_timeout = 10000.0;
+	pthread_rwlock_rdlock(&file->lock);
+	genFileAttributes(file->record, &directoryEntry->attr);
+	pthread_rwlock_unlock(&file->lock);
+}
+
 void efsCreate(fuse_req_t request, fuse_ino_t parent, const char* name,
 	mode_t mode, struct fuse_file_info* fileInfo)
 {
-	
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	/*
+	 * The handle is allocated first, so that failing to allocate it cannot
+	 * leave behind an entry the kernel was never told about. Its inode is
+	 * only known once the entry exists.
+	 */
+	OpenFile* handle = openFileCreate(0, fileInfo->flags);
+	if(handle == NULL)
+	{
+		fuse_reply_err(request, ENOMEM);
+		return;
+	}
+	FileTableNode* file = createDirectoryEntry(request, parent, name, mode);
+	if(file == NULL)
+	{
+		openFileDestroy(handle);
+	}
+	else
+	{
+		handle->inode = file->fileDescriptor->fileID;
+		atomic_fetch_add(&fsState->stats.openHandles, 1);
+		fileInfo->fh = (uint64_t) handle;
+		struct fuse_entry_param directoryEntry;
+		genDirectoryEntry(file, &directoryEntry);
+		if(fuse_reply_create(request, &directoryEntry, fileInfo) != 0)
+		{
+			openFileDestroy(handle);
+			atomic_fetch_sub(&fsState->stats.openHandles, 1);
+		}
+	}
+}
+
+void efsMkdir(fuse_req_t request, fuse_ino_t parent, const char* name,
+	mode_t mode)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = createDirectoryEntry(request, parent, name, mode | S_IFDIR);
+	if(file != NULL)
+	{
+		struct fuse_entry_param directoryEntry;
+		genDirectoryEntry(file, &directoryEntry);
+		fuse_reply_entry(request, &directoryEntry);
+	}
+}
+
+/**
+ * Finds a directory and locks it for writing, so that entries cannot be
+ * added to or removed from it. Replies to the request with an error upon
+ * failure.
+ * 
+ * @returns The node in the file table for the directory. NULL upon failure.
+ */
+static FileTableNode* lockDirectory(fuse_req_t request, fuse_ino_t inode)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	FileTableNode* directory = fileTableSearchInode(fsState->fileTable, inode);
+	if(directory == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return NULL;
+	}
+	pthread_rwlock_wrlock(&directory->lock);
+	if(__atomic_load_n(&directory->table, __ATOMIC_ACQUIRE) == NULL)
+	{
+		pthread_rwlock_unlock(&directory->lock);
+		fuse_reply_err(request, ENOENT);
+		return NULL;
+	}
+	return directory;
+}
+
+void efsUnlink(fuse_req_t request, fuse_ino_t parent, const char* name)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* directory = lockDirectory(request, parent);
+	if(directory == NULL)
+	{
+		return;
+	}
+	FileTableNode* file = findDirectoryEntry(fsState, parent, name);
+	if(file == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+	}
+	else if(file->fileDescriptor->isFile == 0)
+	{
+		fuse_reply_err(request, EISDIR);
+	}
+	else
+	{
+		pthread_rwlock_wrlock(&file->lock);
+		bool deleted = deleteLockedFile(fsState, file);
+		pthread_rwlock_unlock(&file->lock);
+		fuse_reply_err(request, deleted ? 0 : EIO);
+	}
+	pthread_rwlock_unlock(&directory->lock);
+}
+
+void efsRmdir(fuse_req_t request, fuse_ino_t parent, const char* name)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* directory = lockDirectory(request, parent);
+	if(directory == NULL)
+	{
+		return;
+	}
+	FileTableNode* file = findDirectoryEntry(fsState, parent, name);
+	if(file == NULL)
+	{
+		pthread_rwlock_unlock(&directory->lock);
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	else if(file->fileDescriptor->isFile != 0)
+	{
+		pthread_rwlock_unlock(&directory->lock);
+		fuse_reply_err(request, ENOTDIR);
+		return;
+	}
+	/*
+	 * The directory being removed is locked while it is checked for
+	 * entries, so that none can be created in it before it is gone.
+	 */
+	pthread_rwlock_wrlock(&file->lock);
+	DirectoryEntry entry;
+	if(fileTableListChildren(fsState->fileTable, file->fileDescriptor->fileID, 0, &entry, 1) > 0)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		pthread_rwlock_unlock(&directory->lock);
+		fuse_reply_err(request, ENOTEMPTY);
+		return;
+	}
+	bool deleted = deleteLockedFile(fsState, file);
+	pthread_rwlock_unlock(&file->lock);
+	pthread_rwlock_unlock(&directory->lock);
+	fuse_reply_err(request, deleted ? 0 : EBUSY);
 }
 
 void efsPoll(fuse_req_t request, fuse_ino_t inode, 
@@ -56,6 +308,7 @@ void efsRead(fuse_req_t request, fuse_ino_t inode, size_t size,
 	off_t offset, struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	FileTableNode* fileToOpen = fileTableSearchInode(fsState->fileTable, inode);
 	if(fileToOpen == NULL)
 	{
@@ -69,31 +322,144 @@ void efsRead(fuse_req_t request, fuse_ino_t inode, size_t size,
 		fuse_reply_err(request, EISDIR);
 		return;
 	}
-	else if(fileToOpen->fileDescriptor->numFragments > 1)
+	else if(offset >= fileToOpen->fileDescriptor->filesize)
+	{
+		printf("\tTried to read beyond end of file. Returning no data.\n");
+		fuse_reply_buf(request, NULL, 0);
+		return;
+	}
+	char* buffer = scratchAlloc(size);
+	if(buffer == NULL)
+	{
+		fuse_reply_err(request, ENOMEM);
+		return;
+	}
+	OpenFile* handle = (OpenFile*) fileInfo->fh;
+	uint64_t bytesRead = handle != NULL
+		? readFileByHandle(fsState, handle, fileToOpen->fileDescriptor, offset, size, buffer)
+		: readFileByDescriptor(fsState, fileToOpen->fileDescriptor, offset, size, buffer);
+	if(bytesRead == 0 && size > 0)
+	{
+		fuse_reply_err(request, EIO);
+	}
+	else
+	{
+		fuse_reply_buf(request, buffer, bytesRead);
+		markFileAccessed(fsState, fileToOpen);
+	}
+	scratchReset();
+}
+
+void efsWrite(fuse_req_t request, fuse_ino_t inode, const char* buffer,
+	size_t size, off_t offset, struct fuse_file_info* fileInfo)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
+	if(file == NULL)
 	{
-		printf("\tFragmented files not yet supported!\n");
 		fuse_reply_err(request, ENOENT);
 		return;
 	}
-	else if(offset >= fileToOpen->fileDescriptor->filesize)
+	else if(file->fileDescriptor->isFile != 1)
 	{
-		printf("\tTried to read beyond end of file. Returning no data.\n");
-		fuse_reply_buf(request, NULL, 0);
+		fuse_reply_err(request, EISDIR);
+		return;
+	}
+	int error;
+	uint64_t written = writeFileByNode(fsState, file, offset, size, buffer, &error);
+	if(written == 0 && size > 0)
+	{
+		fuse_reply_err(request, error);
+		return;
+	}
+	markFileModified(fsState, file);
+	fuse_reply_write(request, written);
+}
+
+void efsCopyFileRange(fuse_req_t request, fuse_ino_t inodeIn,
+	off_t offsetIn, struct fuse_file_info* fileInfoIn, fuse_ino_t inodeOut,
+	off_t offsetOut, struct fuse_file_info* fileInfoOut, size_t length,
+	int flags)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* source = fileTableSearchInode(fsState->fileTable, inodeIn);
+	FileTableNode* destination = fileTableSearchInode(fsState->fileTable, inodeOut);
+	if(source == NULL || destination == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	else if(source->fileDescriptor->isFile != 1 || destination->fileDescriptor->isFile != 1)
+	{
+		fuse_reply_err(request, EISDIR);
+		return;
+	}
+	else if(flags != 0 || offsetIn < 0 || offsetOut < 0
+		|| (inodeIn == inodeOut && offsetIn < offsetOut + (off_t) length
+			&& offsetOut < offsetIn + (off_t) length))
+	{
+		fuse_reply_err(request, EINVAL);
+		return;
+	}
+	int error;
+	uint64_t copied = copyFileRange(fsState, source->fileDescriptor, offsetIn,
+		destination->fileDescriptor, offsetOut, length, &error);
+	if(copied == 0 && error != 0)
+	{
+		fuse_reply_err(request, error);
+		return;
+	}
+	if(copied > 0)
+	{
+		markFileAccessed(fsState, source);
+		markFileModified(fsState, destination);
+	}
+	fuse_reply_write(request, copied);
+}
+
+void efsFallocate(fuse_req_t request, fuse_ino_t inode, int mode,
+	off_t offset, off_t length, struct fuse_file_info* fileInfo)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
+	if(file == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	else if(file->fileDescriptor->isFile != 1)
+	{
+		fuse_reply_err(request, EISDIR);
+		return;
+	}
+	else if(mode & ~FALLOC_FL_KEEP_SIZE)
+	{
+		printf("\tOnly preallocation is supported by fallocate.\n");
+		fuse_reply_err(request, EOPNOTSUPP);
+		return;
+	}
+	else if(offset < 0 || length <= 0)
+	{
+		fuse_reply_err(request, EINVAL);
+		return;
+	}
+	bool keepSize = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+	if(!preallocateFile(fsState, file->fileDescriptor, offset, length, keepSize))
+	{
+		fuse_reply_err(request, ENOSPC);
 		return;
 	}
-	fseek(fsState->filesystemStream, fileToOpen->fileDescriptor->fragments[0].fragmentLocation * PAGE_SIZE + offset, SEEK_SET);
-	size_t bytesToRead = offset + size <= fileToOpen->fileDescriptor->filesize ? size : fileToOpen->fileDescriptor->filesize - offset;
-	printf("\tReading %d bytes at position %X.\n", bytesToRead, fileToOpen->fileDescriptor->fragments[0].fragmentLocation * PAGE_SIZE + offset);
-	char* buffer = malloc(bytesToRead);
-	fread(buffer, bytesToRead, 1, fsState->filesystemStream);
-	fuse_reply_buf(request, buffer, bytesToRead);
-	free(buffer);
+	fuse_reply_err(request, 0);
 }
 
 void efsOpenDir(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	FileTableNode* fileToOpen = fileTableSearchInode(fsState->fileTable, inode);
 	if(fileToOpen == NULL)
 	{
@@ -112,27 +478,19 @@ void efsOpenDir(fuse_req_t request, fuse_ino_t inode,
 		fuse_reply_err(request, EROFS);
 		return;
 	}
-	FileTable* directoryEntries = constructFileTable();
-	FileTableNode* node = fsState->fileTable->head;
-	while(node->next != NULL)
-	{
-		node = node->next;
-		printf("\tchecking inode %d\n", node->fileDescriptor->fileID);
-		if(node->fileDescriptor->parentID == inode)
-		{
-			printf("\t inode %d is child of %d\n", node->fileDescriptor->fileID, inode);
-			fileTableInsert(directoryEntries, directoryEntries->last, node->fileDescriptor);
-		}
-	}
-	printf("\tconstructed table of %d directory entries @ %d\n", directoryEntries->size, directoryEntries);
-	fileInfo->fh = (uint64_t) directoryEntries;
-	printf("\t%d\n", fuse_reply_open(request, fileInfo));
+	/*
+	 * Entries are listed straight from the directory's index, so there is
+	 * no state to keep for the open directory.
+	 */
+	fileInfo->fh = 0;
+	fuse_reply_open(request, fileInfo);
 }
 
 void efsReadDir(fuse_req_t request, fuse_ino_t inode, size_t size, 
 	off_t offset, struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	FileTableNode* fileToOpen = fileTableSearchInode(fsState->fileTable, inode);
 	
 	if(fileToOpen == NULL)
@@ -148,54 +506,65 @@ void efsReadDir(fuse_req_t request, fuse_ino_t inode, size_t size,
 		return;
 	}
 	
-	FileTable* stream = (FileTable*) fileInfo->fh;
-	FileTableNode* streamPosition = (FileTableNode*) offset;
+	/*
+	 * The cookie of each entry is one past its position in the directory's
+	 * index, so the listing resumes with the entries at or after the offset
+	 * and 0 starts from the beginning.
+	 */
 	printf("\treading dir at offset %d size %d\n", offset, size);
-	if(offset == -1)
+	char* buffer = scratchAlloc(size);
+	if(buffer == NULL)
 	{
-		fuse_reply_buf(request, NULL, 0);
+		fuse_reply_err(request, ENOMEM);
 		return;
 	}
-	else if(offset == 0)
+	size_t currentBufferSize = 0;
+	DirectoryEntry entries[READDIR_BATCH];
+	uint64_t position = offset;
+	size_t count = READDIR_BATCH;
+	bool full = false;
+	while(!full && count == READDIR_BATCH)
 	{
-		if(stream->head->table != stream)
+		count = fileTableListChildren(fsState->fileTable, inode, position, entries, READDIR_BATCH);
+		for(size_t i = 0; i < count && !full; i++)
 		{
-			printf("Tried to readdir with bad fh %d\n", fileInfo->fh);
-			fuse_reply_err(request, EBADF);
-			return;
+			FileTableNode* node = entries[i].node;
+			/*
+			 * The record of a file removed since it was listed may
+			 * already belong to another file, so such entries are
+			 * skipped, as efsLookup does.
+			 */
+			struct stat st;
+			pthread_rwlock_rdlock(&node->lock);
+			bool present = __atomic_load_n(&node->table, __ATOMIC_ACQUIRE) == fsState->fileTable;
+			if(present)
+			{
+				genFileAttributes(node->record, &st);
+			}
+			pthread_rwlock_unlock(&node->lock);
+			if(!present)
+			{
+				continue;
+			}
+			size_t spaceNeededForEntry = fuse_add_direntry(request,
+				NULL, 0, node->fileDescriptor->filename, NULL, 0);
+			full = currentBufferSize + spaceNeededForEntry > size;
+			if(!full)
+			{
+				fuse_add_direntry(request, buffer + currentBufferSize,
+					spaceNeededForEntry, node->fileDescriptor->filename,
+					&st, (off_t) (entries[i].position + 1));
+				currentBufferSize += spaceNeededForEntry;
+			}
 		}
-		streamPosition = stream->head;
-	}
-	else if(streamPosition->table != stream)
-	{
-		fuse_reply_err(request, EBADF);
-		return;
-	}
-	char* buffer = NULL;
-	size_t currentBufferSize = 0;
-	while(streamPosition->next != NULL)
-	{
-		streamPosition = streamPosition->next;
-		printf("\tdescriptor for inode %d found\n", streamPosition->fileDescriptor->fileID);
-		size_t spaceNeededForEntry = fuse_add_direntry(request, 
-			NULL, 0, streamPosition->fileDescriptor->filename, NULL, 0);
-		if(currentBufferSize + spaceNeededForEntry > size)
+		if(count > 0)
 		{
-			break;
+			position = entries[count - 1].position + 1;
 		}
-		buffer = realloc(buffer, currentBufferSize + spaceNeededForEntry);
-		struct stat st;
-		genFileAttributes(streamPosition->fileDescriptor, &st);
-		fuse_add_direntry(request, buffer + currentBufferSize, 
-			spaceNeededForEntry, streamPosition->fileDescriptor->filename,
-			&st, (off_t) streamPosition);
-		currentBufferSize += spaceNeededForEntry;
 	}
 	fuse_reply_buf(request, buffer, currentBufferSize);
-	if(buffer != NULL)
-	{
-		free(buffer);
-	}
+	scratchReset();
+	markFileAccessed(fsState, fileToOpen);
 }
 
 void efsReadDirPlus(fuse_req_t request, fuse_ino_t inode, size_t size, 
@@ -208,17 +577,7 @@ void efsReadDirPlus(fuse_req_t request, fuse_ino_t inode, size_t size,
 void efsReleaseDir(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo)
 {
-	if(((FileTable*) fileInfo->fh)->head->table == ((FileTable*) fileInfo->fh))
-	{
-		destroyFileTable((FileTable*) fileInfo->fh);
-		fuse_reply_err(request, 0);
-		return;
-	}
-	else
-	{
-		fuse_reply_err(request, EBADF);
-		return;
-	}
+	fuse_reply_err(request, 0);
 }
 
 void efsStatFs(fuse_req_t request, fuse_ino_t inode)
@@ -226,14 +585,8 @@ void efsStatFs(fuse_req_t request, fuse_ino_t inode)
 	struct statvfs fsStats;
 	memset(&fsStats, 0, sizeof(fsStats));
 	EFSState* fsState = fuse_req_userdata(request);
-	uint64_t freeBlocks = 0;
-	FreeSpaceTableNode* node = fsState->freeSpaceTable->head;
-	while(node->next != NULL)
-	{
-		node = node->next;
-		printf("Checking free space node @ %d\n", node);
-		freeBlocks += node->size;
-	}
+	EPOCH_READ_SECTION(&fsState->epoch);
+	uint64_t freeBlocks = allocationGroupsFreePages(&fsState->allocationGroups);
 	
 	fsStats.f_bsize = PAGE_SIZE;
 	fsStats.f_frsize = PAGE_SIZE;
@@ -248,6 +601,7 @@ void efsStatFs(fuse_req_t request, fuse_ino_t inode)
 void efsLookup(fuse_req_t request, fuse_ino_t parent, const char* name)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	struct fuse_entry_param directoryEntry;
 	memset(&directoryEntry, 0, sizeof(directoryEntry));
 	if(strcmp(name, ".") == 0)
@@ -275,20 +629,20 @@ void efsLookup(fuse_req_t request, fuse_ino_t parent, const char* name)
 	else
 	{
 		printf("\tSearching for file %s\n", name);
-		FileTableNode* node = fsState->fileTable->head;
-		while(node->next != NULL)
+		FileTableNode* node = findDirectoryEntry(fsState, parent, name);
+		if(node != NULL)
 		{
-			node = node->next;
-			printf("\tRead node with name %s, inode %d, and parent %d\n", node->fileDescriptor->filename, node->fileDescriptor->fileID, node->fileDescriptor->parentID);
-			if(strcmp(node->fileDescriptor->filename, name) == 0 && node->fileDescriptor->parentID == parent)
+			pthread_rwlock_rdlock(&node->lock);
+			if(__atomic_load_n(&node->table, __ATOMIC_ACQUIRE) != NULL)
 			{
 				printf("\t This node has a matching parent and name.\n");
 				directoryEntry.ino = node->fileDescriptor->fileID;
 				directoryEntry.generation = 1;
 				directoryEntry.attr_timeout = 10000.0;
 				directoryEntry.entry_timeout = 10000.0;
-				genFileAttributes(node->fileDescriptor, &directoryEntry.attr);
+				genFileAttributes(node->record, &directoryEntry.attr);
 			}
+			pthread_rwlock_unlock(&node->lock);
 		}
 	}
 	fuse_reply_entry(request, &directoryEntry);
@@ -298,17 +652,108 @@ void efsGetAttr(fuse_req_t request, fuse_ino_t inode,
 	struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
 	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
 	if(file != NULL)
 	{
 		struct stat fileAttributes;
-		genFileAttributes(file->fileDescriptor, &fileAttributes);
-		fuse_reply_attr(request, &fileAttributes, 3600.0);
-		return;
+		pthread_rwlock_rdlock(&file->lock);
+		bool found = __atomic_load_n(&file->table, __ATOMIC_ACQUIRE) != NULL;
+		if(found)
+		{
+			genFileAttributes(file->record, &fileAttributes);
+		}
+		pthread_rwlock_unlock(&file->lock);
+		if(found)
+		{
+			fuse_reply_attr(request, &fileAttributes, 3600.0);
+			return;
+		}
 	}
 	fuse_reply_err(request, ENOENT);
 }
 
+void efsSetAttr(fuse_req_t request, fuse_ino_t inode, 
+	struct stat* attributes, int toSet, struct fuse_file_info* fileInfo)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
+	if(file == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	else if(toSet & FUSE_SET_ATTR_SIZE)
+	{
+		if(file->fileDescriptor->isFile != 1)
+		{
+			fuse_reply_err(request, EISDIR);
+			return;
+		}
+		if(!resizeFileByDescriptor(fsState, file->fileDescriptor, attributes->st_size))
+		{
+			fuse_reply_err(request, ENOSPC);
+			return;
+		}
+	}
+	
+	/*
+	 * The descriptor is only loaded once the file is locked, since
+	 * updateDescriptor may replace it until then.
+	 */
+	pthread_rwlock_wrlock(&file->lock);
+	if(__atomic_load_n(&file->table, __ATOMIC_ACQUIRE) == NULL)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	if(toSet & FUSE_SET_ATTR_SIZE)
+	{
+		descriptor->lastModified = time(NULL);
+	}
+	if(toSet & FUSE_SET_ATTR_MODE)
+	{
+		setFilePermissions(descriptor, attributes->st_mode);
+	}
+	if(toSet & FUSE_SET_ATTR_UID)
+	{
+		descriptor->ownerUUID = attributes->st_uid;
+	}
+	if(toSet & FUSE_SET_ATTR_GID)
+	{
+		descriptor->groupUUID = attributes->st_gid;
+	}
+	if(toSet & FUSE_SET_ATTR_ATIME_NOW)
+	{
+		descriptor->lastAccessed = time(NULL);
+	}
+	else if(toSet & FUSE_SET_ATTR_ATIME)
+	{
+		descriptor->lastAccessed = attributes->st_atime;
+	}
+	if(toSet & FUSE_SET_ATTR_MTIME_NOW)
+	{
+		descriptor->lastModified = time(NULL);
+	}
+	else if(toSet & FUSE_SET_ATTR_MTIME)
+	{
+		descriptor->lastModified = attributes->st_mtime;
+	}
+	if(file->descriptorNode != NULL)
+	{
+		writebackMarkDirty(fsState, file->descriptorNode, file->descriptorSlot);
+	}
+	
+	fileRecordUpdate(file);
+	struct stat fileAttributes;
+	genFileAttributes(file->record, &fileAttributes);
+	pthread_rwlock_unlock(&file->lock);
+	fuse_reply_attr(request, &fileAttributes, 3600.0);
+}
+
 void efsAccess(fuse_req_t request, fuse_ino_t inode, int mask)
 {
 	fuse_reply_err(request, /*ENOSYS*/0);
@@ -324,29 +769,147 @@ void efsGetLock(fuse_req_t request, fuse_ino_t inode,
 void efsGetXattr(fuse_req_t request, fuse_ino_t inode, const char* name,
 	size_t size)
 {
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	char value[32];
+	size_t length;
+	if(inode == FUSE_ROOT_ID 
+		&& statsFormat(&fsState->stats, name, value, sizeof(value), &length))
+	{
+		if(size == 0)
+		{
+			fuse_reply_xattr(request, length);
+		}
+		else if(size < length)
+		{
+			fuse_reply_err(request, ERANGE);
+		}
+		else
+		{
+			fuse_reply_buf(request, value, length);
+		}
+		return;
+	}
 	printf("Getxattr called on inode %d. NOT SUPPORTED.\n", inode);
 	fuse_reply_err(request, EOPNOTSUPP);
 }
 
+void efsListXattr(fuse_req_t request, fuse_ino_t inode, size_t size)
+{
+	if(inode != FUSE_ROOT_ID)
+	{
+		if(size == 0)
+		{
+			fuse_reply_xattr(request, 0);
+		}
+		else
+		{
+			fuse_reply_buf(request, NULL, 0);
+		}
+		return;
+	}
+	EFSState* fsState = fuse_req_userdata(request);
+	size_t length = statsList(&fsState->stats, NULL, 0);
+	if(size == 0)
+	{
+		fuse_reply_xattr(request, length);
+	}
+	else if(size < length)
+	{
+		fuse_reply_err(request, ERANGE);
+	}
+	else
+	{
+		char* buffer = malloc(length);
+		statsList(&fsState->stats, buffer, length);
+		fuse_reply_buf(request, buffer, length);
+		free(buffer);
+	}
+}
+
 void efsSyncDir(fuse_req_t request, fuse_ino_t inode, int datasync,
 	struct fuse_file_info* fileInfo)
 {
-	printf("Syncdir called on inode %d. NOT YET IMPLEMENTED\n", inode);
-	fuse_reply_err(request, ENOSYS);
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* directory = fileTableSearchInode(fsState->fileTable, inode);
+	if(directory == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	/*
+	 * The entries of a directory are the descriptors of its children, so
+	 * those must be written back along with the directory itself.
+	 */
+	if(!writebackFlushFile(fsState, directory, true) 
+		|| !writebackSyncImage(fsState))
+	{
+		fuse_reply_err(request, EIO);
+		return;
+	}
+	fuse_reply_err(request, 0);
 }
 
-void efsRelease(fuse_req_t request, fuse_ino_t inode, 
+void efsSync(fuse_req_t request, fuse_ino_t inode, int datasync,
 	struct fuse_file_info* fileInfo)
 {
 	EFSState* fsState = fuse_req_userdata(request);
-	FileTableNode* node = fileTableSearchInode(fsState->openFiles, inode);
-	if(node != NULL)
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
+	if(file == NULL)
 	{
-		fileTableRemove(fsState->openFiles, node);
-		fuse_reply_err(request, 0);
+		fuse_reply_err(request, ENOENT);
+		return;
 	}
-	else
+	if(!delayedAllocationFlush(fsState, file)
+		|| !writebackFlushFile(fsState, file, false) 
+		|| !writebackSyncImage(fsState))
+	{
+		fuse_reply_err(request, EIO);
+		return;
+	}
+	fuse_reply_err(request, 0);
+}
+
+void efsFlush(fuse_req_t request, fuse_ino_t inode, 
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	EPOCH_READ_SECTION(&fsState->epoch);
+	FileTableNode* file = fileTableSearchInode(fsState->fileTable, inode);
+	if(file == NULL)
+	{
+		fuse_reply_err(request, ENOENT);
+		return;
+	}
+	/*
+	 * Closing a file does not guarantee durability, so the file's data
+	 * and descriptor are written back but the image is not synced.
+	 */
+	if(!delayedAllocationFlush(fsState, file))
+	{
+		fuse_reply_err(request, ENOSPC);
+		return;
+	}
+	fuse_reply_err(request, writebackFlushFile(fsState, file, false) ? 0 : EIO);
+}
+
+void efsRelease(fuse_req_t request, fuse_ino_t inode, 
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* fsState = fuse_req_userdata(request);
+	OpenFile* handle = (OpenFile*) fileInfo->fh;
+	if(handle == NULL || handle->inode != inode)
 	{
 		fuse_reply_err(request, EBADF);
+		return;
 	}
+	/*
+	 * The kernel sends no further requests on a handle once it has been
+	 * released, so it can be freed immediately.
+	 */
+	openFileDestroy(handle);
+	atomic_fetch_sub(&fsState->stats.openHandles, 1);
+	fuse_reply_err(request, 0);
 }
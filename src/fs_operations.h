@@ -1,7 +1,7 @@
 #ifndef __EFS_FSOPS
 #define __EFS_FSOPS
 
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
 #include <fuse3/fuse_lowlevel.h>
 
@@ -11,12 +11,30 @@ void efsOpen(fuse_req_t request, fuse_ino_t inode,
 void efsCreate(fuse_req_t request, fuse_ino_t parent, const char* name,
 	mode_t mode, struct fuse_file_info* fileInfo);
 	
+void efsMkdir(fuse_req_t request, fuse_ino_t parent, const char* name,
+	mode_t mode);
+
+void efsUnlink(fuse_req_t request, fuse_ino_t parent, const char* name);
+
+void efsRmdir(fuse_req_t request, fuse_ino_t parent, const char* name);
+	
 void efsPoll(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo, struct fuse_pollhandle* pollHandle);
 
 void efsRead(fuse_req_t request, fuse_ino_t inode, size_t size, 
 	off_t offset, struct fuse_file_info* fileInfo);
 
+void efsWrite(fuse_req_t request, fuse_ino_t inode, const char* buffer,
+	size_t size, off_t offset, struct fuse_file_info* fileInfo);
+
+void efsCopyFileRange(fuse_req_t request, fuse_ino_t inodeIn,
+	off_t offsetIn, struct fuse_file_info* fileInfoIn, fuse_ino_t inodeOut,
+	off_t offsetOut, struct fuse_file_info* fileInfoOut, size_t length,
+	int flags);
+
+void efsFallocate(fuse_req_t request, fuse_ino_t inode, int mode,
+	off_t offset, off_t length, struct fuse_file_info* fileInfo);
+
 void efsRelease(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo);
 
@@ -39,6 +57,9 @@ void efsLookup(fuse_req_t request, fuse_ino_t parent, const char* name);
 void efsGetAttr(fuse_req_t request, fuse_ino_t inode, 
 	struct fuse_file_info* fileInfo);
 
+void efsSetAttr(fuse_req_t request, fuse_ino_t inode, 
+	struct stat* attributes, int toSet, struct fuse_file_info* fileInfo);
+
 void efsAccess(fuse_req_t request, fuse_ino_t inode, int mask);
 
 void efsGetLock(fuse_req_t request, fuse_ino_t inode,
@@ -47,7 +68,15 @@ void efsGetLock(fuse_req_t request, fuse_ino_t inode,
 void efsGetXattr(fuse_req_t request, fuse_ino_t inode, const char* name,
 	size_t size);
 	
+void efsListXattr(fuse_req_t request, fuse_ino_t inode, size_t size);
+	
 void efsSyncDir(fuse_req_t request, fuse_ino_t inode, int datasync,
 	struct fuse_file_info* fileInfo);
 
+void efsSync(fuse_req_t request, fuse_ino_t inode, int datasync,
+	struct fuse_file_info* fileInfo);
+
+void efsFlush(fuse_req_t request, fuse_ino_t inode, 
+	struct fuse_file_info* fileInfo);
+
 #endif
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+
+#include "image_direct.h"
+#include "efsstate.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Mixes the index of a page into a hash, which picks both the shard and
+ * the bucket holding the page.
+ */
+static uint64_t pageHash(uint64_t page)
+{
+	uint64_t hash = page * 0x9E3779B97F4A7C15ULL;
+	hash ^= hash >> 31;
+	hash *= 0xD6E8FEB86659FD93ULL;
+	return hash ^ (hash >> 32);
+}
+
+static ImageDirectShard* shardOf(ImageDirect* direct, uint64_t hash)
+{
+	return &direct->shards[hash % IMAGE_DIRECT_SHARDS];
+}
+
+static CachedPage** bucketOf(ImageDirectShard* shard, uint64_t hash)
+{
+	return &shard->buckets[(hash / IMAGE_DIRECT_SHARDS) & (shard->numBuckets - 1)];
+}
+
+/**
+ * Removes a page from the list of pages ordered by use.
+ */
+static void unlinkPage(ImageDirectShard* shard, CachedPage* entry)
+{
+	if(entry->older != NULL)
+	{
+		entry->older->newer = entry->newer;
+	}
+	else
+	{
+		shard->oldest = entry->newer;
+	}
+	if(entry->newer != NULL)
+	{
+		entry->newer->older = entry->older;
+	}
+	else
+	{
+		shard->newest = entry->older;
+	}
+}
+
+/**
+ * Adds a page to the list of pages ordered by use, as the most recently
+ * used.
+ */
+static void linkNewest(ImageDirectShard* shard, CachedPage* entry)
+{
+	entry->older = shard->newest;
+	entry->newer = NULL;
+	if(shard->newest != NULL)
+	{
+		shard->newest->newer = entry;
+	}
+	else
+	{
+		shard->oldest = entry;
+	}
+	shard->newest = entry;
+}
+
+/**
+ * Finds a page in its bucket. Must be called with the shard's lock held.
+ *
+ * @returns The link pointing to the page, or NULL if it is not cached.
+ */
+static CachedPage** findPage(ImageDirectShard* shard, uint64_t hash,
+	uint64_t page)
+{
+	for(CachedPage** link = bucketOf(shard, hash); *link != NULL; link = &(*link)->next)
+	{
+		if((*link)->page == page)
+		{
+			return link;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Moves a page from its bucket and the list ordered by use to the unused
+ * entries. Must be called with the shard's lock held.
+ */
+static void removePage(ImageDirectShard* shard, CachedPage** link)
+{
+	CachedPage* entry = *link;
+	*link = entry->next;
+	unlinkPage(shard, entry);
+	entry->next = shard->unused;
+	shard->unused = entry;
+}
+
+bool imageDirectCacheGet(EFSState* state, uint64_t page, char* data,
+	uint64_t* generation)
+{
+	uint64_t hash = pageHash(page);
+	ImageDirectShard* shard = shardOf(&state->imageDirect, hash);
+	pthread_mutex_lock(&shard->lock);
+	CachedPage** link = shard->capacity > 0 ? findPage(shard, hash, page) : NULL;
+	if(link != NULL)
+	{
+		memcpy(data, (*link)->data, PAGE_SIZE);
+		unlinkPage(shard, *link);
+		linkNewest(shard, *link);
+	}
+	*generation = shard->generation;
+	pthread_mutex_unlock(&shard->lock);
+	atomic_fetch_add(link != NULL ? &state->stats.imageCacheHits : &state->stats.imageCacheMisses, 1);
+	return link != NULL;
+}
+
+void imageDirectCachePut(EFSState* state, uint64_t page, const char* data,
+	uint64_t generation)
+{
+	uint64_t hash = pageHash(page);
+	ImageDirectShard* shard = shardOf(&state->imageDirect, hash);
+	pthread_mutex_lock(&shard->lock);
+	if(shard->capacity == 0 || shard->generation != generation || findPage(shard, hash, page) != NULL)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return;
+	}
+	if(shard->unused == NULL)
+	{
+		CachedPage* oldest = shard->oldest;
+		removePage(shard, findPage(shard, pageHash(oldest->page), oldest->page));
+	}
+	CachedPage* entry = shard->unused;
+	shard->unused = entry->next;
+	entry->page = page;
+	memcpy(entry->data, data, PAGE_SIZE);
+	CachedPage** bucket = bucketOf(shard, hash);
+	entry->next = *bucket;
+	*bucket = entry;
+	linkNewest(shard, entry);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void imageDirectCacheInvalidate(EFSState* state, uint64_t page,
+	uint64_t numPages)
+{
+	ImageDirect* direct = &state->imageDirect;
+	if(direct->shards[0].capacity == 0)
+	{
+		return;
+	}
+	for(uint64_t i = 0; i < numPages; i++)
+	{
+		uint64_t hash = pageHash(page + i);
+		ImageDirectShard* shard = shardOf(direct, hash);
+		pthread_mutex_lock(&shard->lock);
+		shard->generation++;
+		CachedPage** link = findPage(shard, hash, page + i);
+		if(link != NULL)
+		{
+			removePage(shard, link);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+char* imageDirectBuffer(EFSState* state)
+{
+	ImageDirect* direct = &state->imageDirect;
+	char* buffer = NULL;
+	pthread_mutex_lock(&direct->poolLock);
+	if(direct->poolSize > 0)
+	{
+		buffer = direct->pool[--direct->poolSize];
+	}
+	pthread_mutex_unlock(&direct->poolLock);
+	if(buffer == NULL && posix_memalign((void**) &buffer, PAGE_SIZE, IMAGE_DIRECT_BUFFER_PAGES * PAGE_SIZE) != 0)
+	{
+		return NULL;
+	}
+	return buffer;
+}
+
+void imageDirectRelease(EFSState* state, char* buffer)
+{
+	ImageDirect* direct = &state->imageDirect;
+	pthread_mutex_lock(&direct->poolLock);
+	if(direct->poolSize < IMAGE_DIRECT_POOL_SIZE)
+	{
+		direct->pool[direct->poolSize++] = buffer;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&direct->poolLock);
+	free(buffer);
+}
+
+/**
+ * Allocates the entries and storage of a shard, all of them unused.
+ */
+static bool initShard(ImageDirectShard* shard, size_t capacity)
+{
+	pthread_mutex_init(&shard->lock, NULL);
+	shard->numBuckets = 1;
+	while(shard->numBuckets < capacity)
+	{
+		shard->numBuckets *= 2;
+	}
+	shard->buckets = calloc(shard->numBuckets, sizeof(CachedPage*));
+	shard->entries = calloc(capacity, sizeof(CachedPage));
+	shard->storage = malloc(capacity * PAGE_SIZE);
+	if(shard->buckets == NULL || (capacity > 0 && (shard->entries == NULL || shard->storage == NULL)))
+	{
+		return false;
+	}
+	for(size_t i = 0; i < capacity; i++)
+	{
+		shard->entries[i].data = shard->storage + i * PAGE_SIZE;
+		shard->entries[i].next = shard->unused;
+		shard->unused = &shard->entries[i];
+	}
+	shard->capacity = capacity;
+	return true;
+}
+
+/**
+ * Sets or clears direct access on every member of the image.
+ */
+static bool setDirect(ImageStripe* stripe, unsigned int numMembers, bool direct)
+{
+	for(unsigned int i = 0; i < numMembers; i++)
+	{
+		int flags = fcntl(stripe->members[i].fd, F_GETFL);
+		if(flags < 0 || fcntl(stripe->members[i].fd, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT) != 0)
+		{
+			setDirect(stripe, i, !direct);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool imageDirectOpen(EFSState* state, uint64_t cacheSize)
+{
+	ImageDirect* direct = &state->imageDirect;
+	ImageStripe* stripe = &state->stripe;
+	pthread_mutex_init(&direct->poolLock, NULL);
+	bool success = true;
+	for(size_t i = 0; i < IMAGE_DIRECT_SHARDS; i++)
+	{
+		success = initShard(&direct->shards[i], cacheSize / PAGE_SIZE / IMAGE_DIRECT_SHARDS) && success;
+	}
+	if(!success)
+	{
+		imageDirectClose(state);
+		return false;
+	}
+
+	/*
+	 * Writes made through the stream before now are flushed, so none of
+	 * them can reach the image after a direct write of the same page.
+	 */
+	fflush(state->filesystemStream);
+	if(!setDirect(stripe, stripe->numMembers, true))
+	{
+		printf("The image does not support direct access.\n");
+		imageDirectClose(state);
+		return false;
+	}
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		posix_fadvise(stripe->members[i].fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	direct->enabled = true;
+	printf("Direct image access, caching %zu KB of image pages.\n",
+		direct->shards[0].capacity * IMAGE_DIRECT_SHARDS * PAGE_SIZE / 1024);
+	return true;
+}
+
+void imageDirectClose(EFSState* state)
+{
+	ImageDirect* direct = &state->imageDirect;
+	for(size_t i = 0; i < IMAGE_DIRECT_SHARDS; i++)
+	{
+		ImageDirectShard* shard = &direct->shards[i];
+		free(shard->buckets);
+		free(shard->entries);
+		free(shard->storage);
+		pthread_mutex_destroy(&shard->lock);
+		memset(shard, 0, sizeof(ImageDirectShard));
+	}
+	while(direct->poolSize > 0)
+	{
+		free(direct->pool[--direct->poolSize]);
+	}
+	direct->enabled = false;
+}
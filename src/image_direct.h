@@ -0,0 +1,246 @@
+#ifndef __EFSFUSE_IMAGE_DIRECT
+#define __EFSFUSE_IMAGE_DIRECT
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct efs_state;
+
+/**
+ * The number of independently locked parts the cache of image pages is
+ * split into.
+ */
+#define IMAGE_DIRECT_SHARDS 16
+
+/**
+ * The number of pages in each pooled buffer. Transfers are split into
+ * runs of at most this many pages.
+ */
+#define IMAGE_DIRECT_BUFFER_PAGES 64
+
+/**
+ * The number of buffers kept in the pool once they are released. Further
+ * buffers are allocated as needed and freed once released.
+ */
+#define IMAGE_DIRECT_POOL_SIZE 64
+
+/**
+ * The largest range read through the cache of image pages. Larger reads
+ * are mostly of file data, which the kernel already caches, so they are
+ * neither looked up nor kept.
+ */
+#define IMAGE_DIRECT_CACHE_LIMIT (128 * 1024)
+
+/**
+ * A page of the image held in the cache.
+ */
+typedef struct cached_page
+{
+	/**
+	 * The index of the page within the image.
+	 */
+	uint64_t page;
+
+	/**
+	 * The next page in the same bucket of the shard.
+	 */
+	struct cached_page* next;
+
+	/**
+	 * The page used just before this one, or NULL if this is the least
+	 * recently used.
+	 */
+	struct cached_page* older;
+
+	/**
+	 * The page used just after this one, or NULL if this is the most
+	 * recently used.
+	 */
+	struct cached_page* newer;
+
+	/**
+	 * The contents of the page, within the shard's storage.
+	 */
+	char* data;
+
+} CachedPage;
+
+/**
+ * One part of the cache of image pages. Each page is held by the shard
+ * its index hashes to. Entries and their storage are allocated once, and
+ * reused as pages are evicted.
+ */
+typedef struct image_direct_shard
+{
+	/**
+	 * Protects every field of the shard and the pages it holds.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The buckets of the shard, each a chain of pages.
+	 */
+	CachedPage** buckets;
+
+	/**
+	 * The number of entries in buckets. Always a power of two.
+	 */
+	size_t numBuckets;
+
+	/**
+	 * The most recently used page.
+	 */
+	CachedPage* newest;
+
+	/**
+	 * The least recently used page, which is the first to be evicted.
+	 */
+	CachedPage* oldest;
+
+	/**
+	 * Entries not holding a page, linked through next.
+	 */
+	CachedPage* unused;
+
+	/**
+	 * Every entry of the shard.
+	 */
+	CachedPage* entries;
+
+	/**
+	 * The storage for the contents of every entry.
+	 */
+	char* storage;
+
+	/**
+	 * The number of entries, and so the most pages the shard holds.
+	 */
+	size_t capacity;
+
+	/**
+	 * Incremented whenever a page of the shard is written, so a page read
+	 * from the image while it was being written is not kept.
+	 */
+	uint64_t generation;
+
+} ImageDirectShard;
+
+/**
+ * State of direct access to the image, which bypasses the host's page
+ * cache. Transfers go through page aligned buffers taken from a pool, and
+ * small reads are served from a cache of image pages of a fixed size.
+ */
+typedef struct image_direct
+{
+	/**
+	 * Set once every member of the image has been opened for direct
+	 * access.
+	 */
+	bool enabled;
+
+	/**
+	 * The parts of the cache of image pages.
+	 */
+	ImageDirectShard shards[IMAGE_DIRECT_SHARDS];
+
+	/**
+	 * Protects the pool of buffers.
+	 */
+	pthread_mutex_t poolLock;
+
+	/**
+	 * Buffers of \link IMAGE_DIRECT_BUFFER_PAGES \endlink pages not in
+	 * use.
+	 */
+	char* pool[IMAGE_DIRECT_POOL_SIZE];
+
+	/**
+	 * The number of buffers in the pool.
+	 */
+	size_t poolSize;
+
+} ImageDirect;
+
+/**
+ * Switches every member of the image to direct access, and allocates the
+ * cache of image pages. What the host has already cached of the image is
+ * dropped. Must be called before any other thread accesses the image.
+ *
+ * @param state The current filesystem state
+ * @param cacheSize The number of bytes of image pages to keep
+ *
+ * @returns true upon success, false if the image does not support direct
+ * access or memory could not be allocated, in which case it is left as
+ * it was.
+ */
+bool imageDirectOpen(struct efs_state* state, uint64_t cacheSize);
+
+/**
+ * Deallocates the cache and the pool of buffers.
+ *
+ * @param state The current filesystem state
+ */
+void imageDirectClose(struct efs_state* state);
+
+/**
+ * Copies a page from the cache.
+ *
+ * @param state The current filesystem state
+ * @param page The index of the page within the image
+ * @param data Receives the contents of the page
+ * @param generation Receives the generation of the page's shard if the
+ * page is not cached, to be given to \link imageDirectCachePut \endlink
+ * once it has been read.
+ *
+ * @returns true if the page was cached, otherwise false.
+ */
+bool imageDirectCacheGet(struct efs_state* state, uint64_t page, char* data,
+	uint64_t* generation);
+
+/**
+ * Adds a page read from the image to the cache, evicting the least
+ * recently used page of its shard. Nothing is added if the page has been
+ * written since its generation was taken.
+ *
+ * @param state The current filesystem state
+ * @param page The index of the page within the image
+ * @param data The contents of the page
+ * @param generation The generation returned by
+ * \link imageDirectCacheGet \endlink before the page was read
+ */
+void imageDirectCachePut(struct efs_state* state, uint64_t page,
+	const char* data, uint64_t generation);
+
+/**
+ * Drops pages which are being written from the cache. Must be called both
+ * before and after the pages are written, so that neither an earlier copy
+ * nor one read during the write is kept.
+ *
+ * @param state The current filesystem state
+ * @param page The first page being written
+ * @param numPages The number of pages being written
+ */
+void imageDirectCacheInvalidate(struct efs_state* state, uint64_t page,
+	uint64_t numPages);
+
+/**
+ * Takes a page aligned buffer of \link IMAGE_DIRECT_BUFFER_PAGES \endlink
+ * pages from the pool, allocating one if the pool is empty.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns The buffer, or NULL if memory could not be allocated.
+ */
+char* imageDirectBuffer(struct efs_state* state);
+
+/**
+ * Returns a buffer to the pool, or frees it if the pool is full.
+ *
+ * @param state The current filesystem state
+ * @param buffer A buffer taken with \link imageDirectBuffer \endlink
+ */
+void imageDirectRelease(struct efs_state* state, char* buffer);
+
+#endif
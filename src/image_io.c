@@ -0,0 +1,378 @@
+#include "image_io.h"
+#include "scratch.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef EFS_IO_URING
+#include "image_ring.h"
+#endif
+
+bool imageTransferRange(int fd, char* buffer, size_t size, uint64_t offset,
+	bool write)
+{
+	size_t done = 0;
+	while(done < size)
+	{
+		ssize_t result = write
+			? pwrite(fd, buffer + done, size - done, offset + done)
+			: pread(fd, buffer + done, size - done, offset + done);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else if(result <= 0)
+		{
+			return false;
+		}
+		done += result;
+	}
+	return true;
+}
+
+/**
+ * Transfers ranges of the image with whichever engine is in use, without
+ * going through the buffers of direct access.
+ */
+static bool transferImage(EFSState* state, const ImageVector* vectors,
+	size_t count, bool write)
+{
+#ifdef EFS_IO_URING
+	if(state->imageRing != NULL)
+	{
+		return imageRingTransfer(state, state->imageRing, vectors, count, write);
+	}
+#endif
+	if(state->stripe.numMembers > 1)
+	{
+		return imageStripeTransfer(state, vectors, count, write);
+	}
+	int fd = fileno(state->filesystemStream);
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!imageTransferRange(fd, vectors[i].buffer, vectors[i].size, vectors[i].offset, write))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * A run of whole pages of the image transferred through a pooled buffer,
+ * on behalf of part of one of the caller's ranges.
+ */
+typedef struct direct_chunk
+{
+	/**
+	 * The pooled buffer holding the pages.
+	 */
+	char* buffer;
+
+	/**
+	 * The caller's part of the range.
+	 */
+	char* data;
+
+	/**
+	 * The number of bytes of the caller's range within the chunk.
+	 */
+	size_t size;
+
+	/**
+	 * The offset of the caller's range within the buffer.
+	 */
+	size_t within;
+
+	/**
+	 * The first page of the chunk.
+	 */
+	uint64_t page;
+
+	/**
+	 * The number of pages in the chunk.
+	 */
+	uint64_t numPages;
+
+	/**
+	 * Set if the chunk is read through the cache of image pages.
+	 */
+	bool cached;
+
+	/**
+	 * Set for each page found in the cache.
+	 */
+	bool hit[IMAGE_DIRECT_BUFFER_PAGES];
+
+	/**
+	 * The generation of each page not found in the cache.
+	 */
+	uint64_t generations[IMAGE_DIRECT_BUFFER_PAGES];
+
+} DirectChunk;
+
+/**
+ * Splits ranges of the image into chunks of whole pages.
+ *
+ * @returns The number of chunks.
+ */
+static size_t splitChunks(const ImageVector* vectors, size_t count,
+	DirectChunk* chunks)
+{
+	size_t numChunks = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		uint64_t offset = vectors[i].offset;
+		uint64_t end = offset + vectors[i].size;
+		while(offset < end)
+		{
+			uint64_t page = offset / PAGE_SIZE;
+			uint64_t chunkEnd = (page + IMAGE_DIRECT_BUFFER_PAGES) * PAGE_SIZE;
+			if(chunkEnd > end)
+			{
+				chunkEnd = end;
+			}
+			if(chunks != NULL)
+			{
+				DirectChunk* chunk = &chunks[numChunks];
+				chunk->data = (char*) vectors[i].buffer + (offset - vectors[i].offset);
+				chunk->size = chunkEnd - offset;
+				chunk->within = offset % PAGE_SIZE;
+				chunk->page = page;
+				chunk->numPages = (chunkEnd + PAGE_SIZE - 1) / PAGE_SIZE - page;
+				chunk->cached = vectors[i].size <= IMAGE_DIRECT_CACHE_LIMIT;
+				chunk->buffer = NULL;
+			}
+			numChunks++;
+			offset = chunkEnd;
+		}
+	}
+	return numChunks;
+}
+
+/**
+ * Reads the chunks, taking what pages it can from the cache of image
+ * pages. Only the pages from the first to the last not in the cache are
+ * read from the image.
+ */
+static bool readChunks(EFSState* state, DirectChunk* chunks, size_t numChunks,
+	ImageVector* vectors)
+{
+	size_t count = 0;
+	for(size_t i = 0; i < numChunks; i++)
+	{
+		DirectChunk* chunk = &chunks[i];
+		uint64_t first = chunk->numPages;
+		uint64_t last = 0;
+		for(uint64_t j = 0; j < chunk->numPages; j++)
+		{
+			chunk->hit[j] = chunk->cached && imageDirectCacheGet(state, chunk->page + j,
+				chunk->buffer + j * PAGE_SIZE, &chunk->generations[j]);
+			if(!chunk->hit[j])
+			{
+				first = first < j ? first : j;
+				last = j;
+			}
+		}
+		if(first < chunk->numPages)
+		{
+			vectors[count].buffer = chunk->buffer + first * PAGE_SIZE;
+			vectors[count].size = (last - first + 1) * PAGE_SIZE;
+			vectors[count].offset = (chunk->page + first) * PAGE_SIZE;
+			count++;
+		}
+	}
+	if(!transferImage(state, vectors, count, false))
+	{
+		return false;
+	}
+	for(size_t i = 0; i < numChunks; i++)
+	{
+		DirectChunk* chunk = &chunks[i];
+		memcpy(chunk->data, chunk->buffer + chunk->within, chunk->size);
+		for(uint64_t j = 0; chunk->cached && j < chunk->numPages; j++)
+		{
+			if(!chunk->hit[j])
+			{
+				imageDirectCachePut(state, chunk->page + j, chunk->buffer + j * PAGE_SIZE,
+					chunk->generations[j]);
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Writes the chunks. Pages only partly covered by the caller's ranges are
+ * read first, so the rest of them is written back unchanged.
+ */
+static bool writeChunks(EFSState* state, DirectChunk* chunks, size_t numChunks,
+	ImageVector* vectors)
+{
+	size_t count = 0;
+	for(size_t i = 0; i < numChunks; i++)
+	{
+		DirectChunk* chunk = &chunks[i];
+		uint64_t lastPage = chunk->numPages - 1;
+		if(chunk->within != 0 || (lastPage == 0 && chunk->size < PAGE_SIZE))
+		{
+			vectors[count].buffer = chunk->buffer;
+			vectors[count].size = PAGE_SIZE;
+			vectors[count].offset = chunk->page * PAGE_SIZE;
+			count++;
+		}
+		if(lastPage > 0 && (chunk->within + chunk->size) % PAGE_SIZE != 0)
+		{
+			vectors[count].buffer = chunk->buffer + lastPage * PAGE_SIZE;
+			vectors[count].size = PAGE_SIZE;
+			vectors[count].offset = (chunk->page + lastPage) * PAGE_SIZE;
+			count++;
+		}
+	}
+	if(count > 0)
+	{
+		atomic_fetch_add(&state->stats.imageReadModifyWrites, count);
+		if(!transferImage(state, vectors, count, false))
+		{
+			return false;
+		}
+	}
+	for(size_t i = 0; i < numChunks; i++)
+	{
+		DirectChunk* chunk = &chunks[i];
+		memcpy(chunk->buffer + chunk->within, chunk->data, chunk->size);
+		vectors[i].buffer = chunk->buffer;
+		vectors[i].size = chunk->numPages * PAGE_SIZE;
+		vectors[i].offset = chunk->page * PAGE_SIZE;
+		imageDirectCacheInvalidate(state, chunk->page, chunk->numPages);
+	}
+	bool success = transferImage(state, vectors, numChunks, true);
+	for(size_t i = 0; i < numChunks; i++)
+	{
+		imageDirectCacheInvalidate(state, chunks[i].page, chunks[i].numPages);
+	}
+	return success;
+}
+
+/**
+ * Transfers ranges of an image opened for direct access, through page
+ * aligned buffers taken from the pool.
+ */
+static bool transferDirect(EFSState* state, const ImageVector* vectors,
+	size_t count, bool write)
+{
+	size_t numChunks = splitChunks(vectors, count, NULL);
+	if(numChunks == 0)
+	{
+		return true;
+	}
+	ScratchMark mark = scratchSave();
+	DirectChunk* chunks = scratchAlloc(sizeof(DirectChunk) * numChunks);
+	ImageVector* directVectors = scratchAlloc(sizeof(ImageVector) * numChunks * 2);
+	if(chunks == NULL || directVectors == NULL)
+	{
+		scratchRestore(mark);
+		return false;
+	}
+	splitChunks(vectors, count, chunks);
+	bool success = true;
+	for(size_t i = 0; success && i < numChunks; i++)
+	{
+		chunks[i].buffer = imageDirectBuffer(state);
+		success = chunks[i].buffer != NULL;
+	}
+	if(success)
+	{
+		success = write
+			? writeChunks(state, chunks, numChunks, directVectors)
+			: readChunks(state, chunks, numChunks, directVectors);
+	}
+	for(size_t i = 0; i < numChunks && chunks[i].buffer != NULL; i++)
+	{
+		imageDirectRelease(state, chunks[i].buffer);
+	}
+	scratchRestore(mark);
+	return success;
+}
+
+static bool transfer(EFSState* state, const ImageVector* vectors, size_t count,
+	bool write)
+{
+	if(state->imageDirect.enabled)
+	{
+		return transferDirect(state, vectors, count, write);
+	}
+	return transferImage(state, vectors, count, write);
+}
+
+bool imageRead(EFSState* state, void* buffer, size_t size, uint64_t offset)
+{
+	ImageVector vector = { buffer, size, offset };
+	return transfer(state, &vector, 1, false);
+}
+
+bool imageWrite(EFSState* state, const void* buffer, size_t size,
+	uint64_t offset)
+{
+	ImageVector vector = { (void*) buffer, size, offset };
+	return transfer(state, &vector, 1, true);
+}
+
+bool imageReadv(EFSState* state, const ImageVector* vectors, size_t count)
+{
+	return transfer(state, vectors, count, false);
+}
+
+bool imageWritev(EFSState* state, const ImageVector* vectors, size_t count)
+{
+	return transfer(state, vectors, count, true);
+}
+
+bool imageSync(EFSState* state)
+{
+	if(state->stripe.numMembers > 1)
+	{
+		return imageStripeSync(state);
+	}
+	return fdatasync(fileno(state->filesystemStream)) == 0;
+}
+
+void imageIoStart(EFSState* state)
+{
+	if(state->options.ioUring)
+	{
+#ifdef EFS_IO_URING
+		/*
+		 * The ring keeps every member of a striped image busy by itself,
+		 * so member threads are only started without it.
+		 */
+		state->imageRing = imageRingStart(state, state->options.ioUringDepth);
+		if(state->imageRing != NULL)
+		{
+			return;
+		}
+		printf("io_uring is unavailable, using synchronous image I/O.\n");
+#else
+		printf("Built without io_uring support, using synchronous image I/O.\n");
+#endif
+	}
+	if(state->stripe.numMembers > 1 && !imageStripeStart(state))
+	{
+		printf("Could not start member threads, striped members are accessed one at a time.\n");
+	}
+}
+
+void imageIoStop(EFSState* state)
+{
+	imageStripeStop(state);
+#ifdef EFS_IO_URING
+	if(state->imageRing != NULL)
+	{
+		imageRingStop(state->imageRing);
+		state->imageRing = NULL;
+	}
+#endif
+}
@@ -0,0 +1,131 @@
+#ifndef __EFSFUSE_IMAGE_IO
+#define __EFSFUSE_IMAGE_IO
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "efsstate.h"
+
+/**
+ * One contiguous range of the image to transfer, as part of a single
+ * request covering several ranges.
+ */
+typedef struct image_vector
+{
+	/**
+	 * The location to read into or write from.
+	 */
+	void* buffer;
+	
+	/**
+	 * The number of bytes to transfer.
+	 */
+	size_t size;
+	
+	/**
+	 * The byte offset within the image.
+	 */
+	uint64_t offset;
+	
+} ImageVector;
+
+/**
+ * Reads or writes one range of a file with ordinary system calls,
+ * retrying until all of it has been transferred.
+ *
+ * @param fd The file to transfer
+ * @param buffer The location to read into or write from
+ * @param size The number of bytes to transfer
+ * @param offset The byte offset within the file
+ * @param write Set to write, clear to read
+ *
+ * @returns true if all of the range was transferred, otherwise false.
+ */
+bool imageTransferRange(int fd, char* buffer, size_t size, uint64_t offset,
+	bool write);
+
+/**
+ * Reads data from the filesystem image at the given byte offset. Unlike
+ * the filesystem stream, this does not use a shared file position, so it
+ * is safe to call from several threads at once.
+ *
+ * @param state The current filesystem state
+ * @param buffer The location to read into
+ * @param size The number of bytes to read
+ * @param offset The byte offset within the image to read from
+ *
+ * @returns true if all of the requested data was read, otherwise false.
+ */
+bool imageRead(EFSState* state, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * Writes data to the filesystem image at the given byte offset. Safe to
+ * call from several threads at once, provided the regions written do not
+ * overlap. With direct access, regions written at once must not share a
+ * page, since a partly written page is read and written whole.
+ *
+ * @param state The current filesystem state
+ * @param buffer The data to write
+ * @param size The number of bytes to write
+ * @param offset The byte offset within the image to write to
+ *
+ * @returns true if all of the provided data was written, otherwise false.
+ */
+bool imageWrite(EFSState* state, const void* buffer, size_t size,
+	uint64_t offset);
+
+/**
+ * Reads several ranges of the image as one request. With the io_uring
+ * engine the ranges are submitted together. Otherwise they are read one
+ * after another, except that the parts of a striped image held by
+ * different members are read in parallel.
+ *
+ * @param state The current filesystem state
+ * @param vectors The ranges to read
+ * @param count The number of entries in vectors
+ *
+ * @returns true if every range was read in full, otherwise false.
+ */
+bool imageReadv(EFSState* state, const ImageVector* vectors, size_t count);
+
+/**
+ * Writes several ranges of the image as one request. The ranges must not
+ * overlap.
+ *
+ * @param state The current filesystem state
+ * @param vectors The ranges to write
+ * @param count The number of entries in vectors
+ *
+ * @returns true if every range was written in full, otherwise false.
+ */
+bool imageWritev(EFSState* state, const ImageVector* vectors, size_t count);
+
+/**
+ * Flushes all data written to the filesystem image to stable storage.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if an I/O error occurred.
+ */
+bool imageSync(EFSState* state);
+
+/**
+ * Starts the io_uring engine if it was requested and the program was
+ * built with it. Otherwise, or if the ring cannot be created, the image
+ * is accessed with ordinary system calls, by a thread for each member if
+ * the image is striped.
+ *
+ * @param state The current filesystem state
+ */
+void imageIoStart(EFSState* state);
+
+/**
+ * Stops the io_uring engine or the member threads, if they were started.
+ * Must be called once no other thread accesses the image.
+ *
+ * @param state The current filesystem state
+ */
+void imageIoStop(EFSState* state);
+
+#endif
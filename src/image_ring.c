@@ -0,0 +1,365 @@
+#include "image_ring.h"
+#include "efsstate.h"
+#include "scratch.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * The number of registered buffers, at most. Fewer are used for shallow
+ * rings.
+ */
+#define IMAGE_RING_MAX_FIXED 64
+
+/**
+ * Reaps completions until the ring is stopped. Operations staged through
+ * a registered buffer are copied out and the buffer returned here, so the
+ * waiting caller only has to check the result.
+ */
+static void* completionThread(void* data)
+{
+	ImageRing* ring = data;
+	for(;;)
+	{
+		struct io_uring_cqe* cqe;
+		int result = io_uring_wait_cqe(&ring->ring, &cqe);
+		if(result == -EINTR)
+		{
+			continue;
+		}
+		else if(result < 0)
+		{
+			printf("Failed to reap image I/O completions: %s\n", strerror(-result));
+			break;
+		}
+		ImageRingOp* op = io_uring_cqe_get_data(cqe);
+		result = cqe->res;
+		io_uring_cqe_seen(&ring->ring, cqe);
+		if(op == NULL)
+		{
+			break;
+		}
+		op->result = result;
+		if(op->fixed >= 0)
+		{
+			if(!op->request->write && result > 0)
+			{
+				memcpy(op->buffer, ring->fixedBuffers + (size_t) op->fixed * IMAGE_RING_FIXED_SIZE, result);
+			}
+			pthread_mutex_lock(&ring->lock);
+			ring->freeFixed[ring->numFreeFixed++] = op->fixed;
+			pthread_mutex_unlock(&ring->lock);
+		}
+		ImageRingRequest* request = op->request;
+		if(atomic_fetch_sub(&request->remaining, 1) == 1)
+		{
+			sem_post(&request->done);
+		}
+	}
+	return NULL;
+}
+
+ImageRing* imageRingStart(EFSState* state, unsigned int depth)
+{
+	ImageRing* ring = calloc(1, sizeof(ImageRing));
+	if(ring == NULL)
+	{
+		return NULL;
+	}
+	int result = io_uring_queue_init(depth, &ring->ring, 0);
+	if(result < 0)
+	{
+		printf("Could not create io_uring of depth %u: %s\n", depth, strerror(-result));
+		free(ring);
+		return NULL;
+	}
+	pthread_mutex_init(&ring->lock, NULL);
+	ring->depth = depth;
+	ring->numFds = state->stripe.numMembers;
+	ring->fds = malloc(sizeof(int) * ring->numFds);
+	if(ring->fds == NULL)
+	{
+		io_uring_queue_exit(&ring->ring);
+		free(ring);
+		return NULL;
+	}
+	for(unsigned int i = 0; i < ring->numFds; i++)
+	{
+		ring->fds[i] = state->stripe.members[i].fd;
+	}
+	ring->fileRegistered = io_uring_register_files(&ring->ring, ring->fds, ring->numFds) == 0;
+
+	/*
+	 * Registering buffers pins them, so failing to is not fatal; every
+	 * transfer then uses the caller's buffer directly.
+	 */
+	ring->numFixed = depth < IMAGE_RING_MAX_FIXED ? depth : IMAGE_RING_MAX_FIXED;
+	ring->freeFixed = malloc(sizeof(int) * ring->numFixed);
+	struct iovec* iovecs = malloc(sizeof(struct iovec) * ring->numFixed);
+	if(ring->freeFixed != NULL && iovecs != NULL
+		&& posix_memalign((void**) &ring->fixedBuffers, PAGE_SIZE,
+			(size_t) ring->numFixed * IMAGE_RING_FIXED_SIZE) == 0)
+	{
+		for(unsigned int i = 0; i < ring->numFixed; i++)
+		{
+			iovecs[i].iov_base = ring->fixedBuffers + (size_t) i * IMAGE_RING_FIXED_SIZE;
+			iovecs[i].iov_len = IMAGE_RING_FIXED_SIZE;
+			ring->freeFixed[i] = i;
+		}
+		ring->fixedRegistered = io_uring_register_buffers(&ring->ring, iovecs, ring->numFixed) == 0;
+	}
+	free(iovecs);
+	if(ring->fixedRegistered)
+	{
+		ring->numFreeFixed = ring->numFixed;
+	}
+	else
+	{
+		free(ring->fixedBuffers);
+		ring->fixedBuffers = NULL;
+		ring->numFixed = 0;
+	}
+
+	if(pthread_create(&ring->completionThread, NULL, completionThread, ring) != 0)
+	{
+		io_uring_queue_exit(&ring->ring);
+		free(ring->fixedBuffers);
+		free(ring->freeFixed);
+		free(ring->fds);
+		free(ring);
+		return NULL;
+	}
+	printf("Image I/O through io_uring, depth %u, %u registered buffers%s.\n", depth,
+		ring->numFixed, ring->fileRegistered ? ", fixed file" : "");
+	return ring;
+}
+
+/**
+ * Adds one operation to the submission queue, submitting what is already
+ * queued if the queue is full. Only called by the submitting thread.
+ */
+static void prepareOp(EFSState* state, ImageRing* ring, ImageRingOp* op,
+	bool write)
+{
+	struct io_uring_sqe* sqe;
+	while((sqe = io_uring_get_sqe(&ring->ring)) == NULL)
+	{
+		io_uring_submit(&ring->ring);
+		atomic_fetch_add(&state->stats.ringSubmissions, 1);
+	}
+	int fd = ring->fileRegistered ? (int) op->member : ring->fds[op->member];
+	if(op->fixed >= 0)
+	{
+		char* buffer = ring->fixedBuffers + (size_t) op->fixed * IMAGE_RING_FIXED_SIZE;
+		if(write)
+		{
+			io_uring_prep_write_fixed(sqe, fd, buffer, op->size, op->offset, op->fixed);
+		}
+		else
+		{
+			io_uring_prep_read_fixed(sqe, fd, buffer, op->size, op->offset, op->fixed);
+		}
+	}
+	else if(write)
+	{
+		io_uring_prep_write(sqe, fd, op->buffer, op->size, op->offset);
+	}
+	else
+	{
+		io_uring_prep_read(sqe, fd, op->buffer, op->size, op->offset);
+	}
+	if(ring->fileRegistered)
+	{
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	}
+	io_uring_sqe_set_data(sqe, op);
+	atomic_fetch_add(&state->stats.ringOperations, 1);
+}
+
+/**
+ * Submits every queued request, including any queued by other threads
+ * while this one was submitting, then gives up the role of submitter.
+ * Must be called with the ring's lock held and submitting set; returns
+ * with the lock released.
+ */
+static void submitQueued(EFSState* state, ImageRing* ring)
+{
+	for(;;)
+	{
+		ImageRingRequest* request = ring->queueHead;
+		ring->queueHead = NULL;
+		ring->queueTail = NULL;
+		if(request == NULL)
+		{
+			ring->submitting = false;
+			pthread_mutex_unlock(&ring->lock);
+			return;
+		}
+		pthread_mutex_unlock(&ring->lock);
+		while(request != NULL)
+		{
+			/*
+			 * The request may complete, and its caller return, as soon
+			 * as its last operation is submitted.
+			 */
+			ImageRingRequest* next = request->next;
+			for(size_t i = 0; i < request->numOps; i++)
+			{
+				prepareOp(state, ring, &request->ops[i], request->write);
+			}
+			request = next;
+		}
+		int result;
+		while((result = io_uring_submit(&ring->ring)) == -EAGAIN
+			|| result == -EBUSY || result == -EINTR)
+		{
+			sched_yield();
+		}
+		atomic_fetch_add(&state->stats.ringSubmissions, 1);
+		pthread_mutex_lock(&ring->lock);
+	}
+}
+
+/**
+ * Transfers the part of an operation the kernel did not, with ordinary
+ * system calls.
+ */
+static bool finishOp(ImageRing* ring, ImageRingOp* op, bool write)
+{
+	size_t done = op->result > 0 ? op->result : 0;
+	if(op->result < 0 && op->result != -EAGAIN && op->result != -EINTR)
+	{
+		return false;
+	}
+	return imageTransferRange(ring->fds[op->member], op->buffer + done,
+		op->size - done, op->offset + done, write);
+}
+
+bool imageRingTransfer(EFSState* state, ImageRing* ring,
+	const ImageVector* vectors, size_t count, bool write)
+{
+	size_t numPieces = imageStripeSplit(&state->stripe, vectors, count, NULL);
+	if(numPieces == 0)
+	{
+		return true;
+	}
+	ScratchMark mark = scratchSave();
+	ImageRingOp* ops = scratchAlloc(sizeof(ImageRingOp) * numPieces);
+	StripePiece* pieces = scratchAlloc(sizeof(StripePiece) * numPieces);
+	if(ops == NULL || pieces == NULL)
+	{
+		scratchRestore(mark);
+		return false;
+	}
+	imageStripeSplit(&state->stripe, vectors, count, pieces);
+	count = numPieces;
+	ImageRingRequest request;
+	request.ops = ops;
+	request.numOps = count;
+	request.write = write;
+	request.next = NULL;
+	atomic_init(&request.remaining, count);
+	sem_init(&request.done, 0, 0);
+
+	pthread_mutex_lock(&ring->lock);
+	for(size_t i = 0; i < count; i++)
+	{
+		ops[i].request = &request;
+		ops[i].buffer = pieces[i].buffer;
+		ops[i].size = pieces[i].size;
+		ops[i].offset = pieces[i].offset;
+		ops[i].member = pieces[i].member;
+		ops[i].result = 0;
+		ops[i].fixed = pieces[i].size <= IMAGE_RING_FIXED_SIZE && ring->numFreeFixed > 0
+			? ring->freeFixed[--ring->numFreeFixed] : -1;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	for(size_t i = 0; write && i < count; i++)
+	{
+		if(ops[i].fixed >= 0)
+		{
+			memcpy(ring->fixedBuffers + (size_t) ops[i].fixed * IMAGE_RING_FIXED_SIZE,
+				ops[i].buffer, ops[i].size);
+		}
+	}
+
+	/*
+	 * Whichever caller finds no submission in progress submits for every
+	 * caller queued behind it, so concurrent requests share a single
+	 * system call.
+	 */
+	pthread_mutex_lock(&ring->lock);
+	if(ring->queueTail != NULL)
+	{
+		ring->queueTail->next = &request;
+	}
+	else
+	{
+		ring->queueHead = &request;
+	}
+	ring->queueTail = &request;
+	if(!ring->submitting)
+	{
+		ring->submitting = true;
+		submitQueued(state, ring);
+	}
+	else
+	{
+		pthread_mutex_unlock(&ring->lock);
+	}
+	while(sem_wait(&request.done) != 0 && errno == EINTR)
+	{
+	}
+	sem_destroy(&request.done);
+
+	bool success = true;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(ops[i].result != (int) ops[i].size)
+		{
+			success = finishOp(ring, &ops[i], write) && success;
+		}
+	}
+	scratchRestore(mark);
+	return success;
+}
+
+void imageRingStop(ImageRing* ring)
+{
+	/*
+	 * Every caller has finished with the ring by now, so the only entry
+	 * left to reap is the one telling the completion thread to exit.
+	 */
+	struct io_uring_sqe* sqe = io_uring_get_sqe(&ring->ring);
+	if(sqe != NULL)
+	{
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		io_uring_submit(&ring->ring);
+		pthread_join(ring->completionThread, NULL);
+	}
+	else
+	{
+		pthread_cancel(ring->completionThread);
+		pthread_join(ring->completionThread, NULL);
+	}
+	if(ring->fixedRegistered)
+	{
+		io_uring_unregister_buffers(&ring->ring);
+	}
+	if(ring->fileRegistered)
+	{
+		io_uring_unregister_files(&ring->ring);
+	}
+	io_uring_queue_exit(&ring->ring);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring->fixedBuffers);
+	free(ring->freeFixed);
+	free(ring->fds);
+	free(ring);
+}
@@ -0,0 +1,230 @@
+#ifndef __EFSFUSE_IMAGE_RING
+#define __EFSFUSE_IMAGE_RING
+
+#include <liburing.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_io.h"
+
+/**
+ * The size in bytes of each registered buffer. Transfers no larger than
+ * this are staged through a registered buffer, so the kernel does not
+ * have to map the caller's pages for every operation.
+ */
+#define IMAGE_RING_FIXED_SIZE (64 * 1024)
+
+struct image_ring_request;
+
+/**
+ * A single read or write of one contiguous range of the image, submitted
+ * as one entry of the submission queue.
+ */
+typedef struct image_ring_op
+{
+	/**
+	 * The request this operation is part of.
+	 */
+	struct image_ring_request* request;
+
+	/**
+	 * The caller's buffer.
+	 */
+	char* buffer;
+
+	/**
+	 * The number of bytes to transfer.
+	 */
+	size_t size;
+
+	/**
+	 * The byte offset within the member.
+	 */
+	uint64_t offset;
+
+	/**
+	 * The member of the image to transfer.
+	 */
+	unsigned int member;
+
+	/**
+	 * The index of the registered buffer staging this operation, or -1
+	 * if the caller's buffer is used directly.
+	 */
+	int fixed;
+
+	/**
+	 * The number of bytes the kernel transferred, or a negative error.
+	 */
+	int result;
+
+} ImageRingOp;
+
+/**
+ * Every operation queued by one call to imageRingTransfer. The caller
+ * sleeps until the completion thread has reaped all of them.
+ */
+typedef struct image_ring_request
+{
+	/**
+	 * The operations of this request.
+	 */
+	ImageRingOp* ops;
+
+	/**
+	 * The number of entries in ops.
+	 */
+	size_t numOps;
+
+	/**
+	 * Set for writes, clear for reads.
+	 */
+	bool write;
+
+	/**
+	 * The number of operations not yet completed.
+	 */
+	atomic_size_t remaining;
+
+	/**
+	 * Posted by the completion thread once every operation is complete.
+	 */
+	sem_t done;
+
+	/**
+	 * The next request waiting to be submitted.
+	 */
+	struct image_ring_request* next;
+
+} ImageRingRequest;
+
+/**
+ * An io_uring instance shared by every thread that accesses the image.
+ * Callers queue whole requests; whichever caller finds no submission in
+ * progress submits every queued request in a single system call, so that
+ * concurrent requests share submissions. A dedicated thread reaps
+ * completions, so callers never poll the completion queue themselves.
+ */
+typedef struct image_ring
+{
+	/**
+	 * The ring itself.
+	 */
+	struct io_uring ring;
+
+	/**
+	 * The thread which reaps completions.
+	 */
+	pthread_t completionThread;
+
+	/**
+	 * Protects the queue of requests, the submitting flag and the free
+	 * list of registered buffers.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The first request waiting to be submitted.
+	 */
+	ImageRingRequest* queueHead;
+
+	/**
+	 * The last request waiting to be submitted.
+	 */
+	ImageRingRequest* queueTail;
+
+	/**
+	 * Set while a caller is submitting queued requests.
+	 */
+	bool submitting;
+
+	/**
+	 * The number of submission queue entries.
+	 */
+	unsigned int depth;
+
+	/**
+	 * The registered buffers, IMAGE_RING_FIXED_SIZE bytes each.
+	 */
+	char* fixedBuffers;
+
+	/**
+	 * The number of registered buffers.
+	 */
+	unsigned int numFixed;
+
+	/**
+	 * Indices of registered buffers not in use.
+	 */
+	int* freeFixed;
+
+	/**
+	 * The number of entries in freeFixed.
+	 */
+	unsigned int numFreeFixed;
+
+	/**
+	 * Set if buffers could be registered with the kernel.
+	 */
+	bool fixedRegistered;
+
+	/**
+	 * Set if the members of the image could be registered as fixed files,
+	 * indexed by member.
+	 */
+	bool fileRegistered;
+
+	/**
+	 * The descriptor of each member of the image, used when they are not
+	 * registered.
+	 */
+	int* fds;
+
+	/**
+	 * The number of entries in fds.
+	 */
+	unsigned int numFds;
+
+} ImageRing;
+
+/**
+ * Creates a ring of the given depth on the image, registers every member
+ * of the image and a set of staging buffers with it, and starts the completion thread.
+ *
+ * @param state The current filesystem state
+ * @param depth The number of submission queue entries
+ *
+ * @returns The new ring, or NULL if io_uring is unavailable.
+ */
+ImageRing* imageRingStart(struct efs_state* state, unsigned int depth);
+
+/**
+ * Reads or writes several ranges of the image in one submission, and
+ * waits for all of them to complete. Ranges of a striped image are split
+ * at stripe unit boundaries, so every member is kept busy at once. Short transfers are completed with
+ * ordinary system calls.
+ *
+ * @param state The current filesystem state
+ * @param ring The ring to submit to
+ * @param vectors The ranges to transfer
+ * @param count The number of entries in vectors
+ * @param write Set to write, clear to read
+ *
+ * @returns true if every range was transferred, otherwise false.
+ */
+bool imageRingTransfer(struct efs_state* state, ImageRing* ring,
+	const ImageVector* vectors, size_t count, bool write);
+
+/**
+ * Waits for every outstanding operation, stops the completion thread and
+ * destroys the ring.
+ *
+ * @param ring The ring to destroy
+ */
+void imageRingStop(ImageRing* ring);
+
+#endif
@@ -0,0 +1,493 @@
+#include "image_stripe.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "scratch.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The pieces of one transfer held by a single member, transferred either
+ * by the calling thread or by the member's thread.
+ */
+typedef struct stripe_job
+{
+	/**
+	 * The pieces to transfer.
+	 */
+	StripePiece* pieces;
+
+	/**
+	 * The number of entries in pieces.
+	 */
+	size_t numPieces;
+
+	/**
+	 * Set to write, clear to read.
+	 */
+	bool write;
+
+	/**
+	 * Set once every piece has been transferred.
+	 */
+	bool success;
+
+	/**
+	 * The number of jobs of the transfer not yet finished by member
+	 * threads.
+	 */
+	atomic_size_t* remaining;
+
+	/**
+	 * Posted when the last job of the transfer finishes.
+	 */
+	sem_t* done;
+
+	/**
+	 * The next job queued on the same member.
+	 */
+	struct stripe_job* next;
+
+} StripeJob;
+
+bool imageStripeAddMember(EFSState* state, const char* path)
+{
+	ImageStripe* stripe = &state->stripe;
+	FILE* stream = fopen(path, "r+");
+	if(stream == NULL)
+	{
+		return false;
+	}
+	StripeMember* members = realloc(stripe->members, sizeof(StripeMember) * (stripe->numMembers + 1));
+	if(members == NULL)
+	{
+		fclose(stream);
+		return false;
+	}
+	stripe->members = members;
+	memset(&members[stripe->numMembers], 0, sizeof(StripeMember));
+	members[stripe->numMembers].stream = stream;
+	members[stripe->numMembers].fd = fileno(stream);
+	if(stripe->numMembers == 0)
+	{
+		state->filesystemStream = stream;
+	}
+	stripe->numMembers++;
+	return true;
+}
+
+/**
+ * Calculates how many bytes of an image of the given size are held by a
+ * member.
+ */
+static uint64_t memberSize(const ImageStripe* stripe, unsigned int member,
+	uint64_t imageSize)
+{
+	uint64_t numUnits = (imageSize + stripe->unit - 1) / stripe->unit;
+	uint64_t size = (numUnits / stripe->numMembers
+		+ (member < numUnits % stripe->numMembers ? 1 : 0)) * stripe->unit;
+	if(numUnits > 0 && (numUnits - 1) % stripe->numMembers == member)
+	{
+		size -= numUnits * stripe->unit - imageSize;
+	}
+	return size;
+}
+
+/**
+ * Moves the image, held entirely in the first member, to where it belongs
+ * across every member. Units held by the other members are copied first.
+ * Those staying in the first member then move towards its start, each to
+ * a unit which has already been moved out of the way.
+ */
+static bool restripe(EFSState* state)
+{
+	ImageStripe* stripe = &state->stripe;
+	uint64_t imageSize = state->filesystemSize * PAGE_SIZE;
+	uint64_t numUnits = (imageSize + stripe->unit - 1) / stripe->unit;
+	char* buffer = malloc(stripe->unit);
+	if(buffer == NULL)
+	{
+		return false;
+	}
+	printf("Striping the image across %u members. It is rewritten in place, so this must not be interrupted.\n",
+		stripe->numMembers);
+	bool success = true;
+	for(int pass = 0; success && pass < 2; pass++)
+	{
+		for(uint64_t unit = 1; success && unit < numUnits; unit++)
+		{
+			unsigned int member = unit % stripe->numMembers;
+			if((member == 0) != (pass == 1))
+			{
+				continue;
+			}
+			uint64_t size = imageSize - unit * stripe->unit;
+			if(size > stripe->unit)
+			{
+				size = stripe->unit;
+			}
+			success = imageTransferRange(stripe->members[0].fd, buffer, size, unit * stripe->unit, false)
+				&& imageTransferRange(stripe->members[member].fd, buffer, size,
+					unit / stripe->numMembers * stripe->unit, true);
+		}
+		/*
+		 * The other members must hold their units before the first
+		 * starts overwriting its copies of them.
+		 */
+		for(unsigned int i = 1; success && pass == 0 && i < stripe->numMembers; i++)
+		{
+			success = fdatasync(stripe->members[i].fd) == 0;
+		}
+	}
+	free(buffer);
+
+	StripeRecord record;
+	memcpy(record.magic, STRIPE_RECORD_MAGIC, sizeof(record.magic));
+	record.unitPages = stripe->unit / PAGE_SIZE;
+	record.numMembers = stripe->numMembers;
+	success = success
+		&& imageTransferRange(stripe->members[0].fd, (char*) &record, sizeof(record), STRIPE_RECORD_OFFSET, true)
+		&& fdatasync(stripe->members[0].fd) == 0;
+	if(success && ftruncate(stripe->members[0].fd, memberSize(stripe, 0, imageSize)) != 0)
+	{
+		printf("Could not shrink the first member of the image.\n");
+	}
+	return success;
+}
+
+bool imageStripeOpen(EFSState* state, unsigned int unitKB)
+{
+	ImageStripe* stripe = &state->stripe;
+	StripeRecord record;
+	if(!imageTransferRange(stripe->members[0].fd, (char*) &record, sizeof(record), STRIPE_RECORD_OFFSET, false))
+	{
+		printf("Could not read the stripe record.\n");
+		return false;
+	}
+	bool exists = memcmp(record.magic, STRIPE_RECORD_MAGIC, sizeof(record.magic)) == 0;
+	if(stripe->numMembers == 1)
+	{
+		if(exists && record.numMembers > 1)
+		{
+			printf("The image is striped across %" PRIu64 " members, all of which must be given.\n", record.numMembers);
+			return false;
+		}
+		return true;
+	}
+
+	if(exists)
+	{
+		if(record.numMembers != stripe->numMembers || record.unitPages == 0)
+		{
+			printf("The image is striped across %" PRIu64 " members, but %u were given.\n",
+				record.numMembers, stripe->numMembers);
+			return false;
+		}
+		stripe->unit = record.unitPages * PAGE_SIZE;
+	}
+	else
+	{
+		if(unitKB == 0)
+		{
+			printf("The image has no stripe record, so it cannot be opened from %u members.\n", stripe->numMembers);
+			return false;
+		}
+		else if((uint64_t) unitKB * 1024 % PAGE_SIZE != 0)
+		{
+			printf("The stripe unit must be a multiple of %d KB.\n", PAGE_SIZE / 1024);
+			return false;
+		}
+		stripe->unit = (uint64_t) unitKB * 1024;
+		for(unsigned int i = 1; i < stripe->numMembers; i++)
+		{
+			struct stat status;
+			if(fstat(stripe->members[i].fd, &status) != 0 || status.st_size != 0)
+			{
+				printf("Member %u is not empty. Every member but the first must be empty to stripe an image.\n", i);
+				return false;
+			}
+		}
+		if(!restripe(state))
+		{
+			printf("Failed to stripe the image.\n");
+			return false;
+		}
+	}
+
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		struct stat status;
+		uint64_t size = memberSize(stripe, i, state->filesystemSize * PAGE_SIZE);
+		if(fstat(stripe->members[i].fd, &status) != 0 || (uint64_t) status.st_size < size)
+		{
+			printf("Member %u is smaller than the %" PRIu64 " bytes it should hold.\n", i, size);
+			return false;
+		}
+	}
+	printf("Image striped across %u members in units of %" PRIu64 " KB.\n", stripe->numMembers, stripe->unit / 1024);
+	return true;
+}
+
+size_t imageStripeSplit(const ImageStripe* stripe, const ImageVector* vectors,
+	size_t count, StripePiece* pieces)
+{
+	size_t numPieces = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		char* buffer = vectors[i].buffer;
+		size_t size = vectors[i].size;
+		uint64_t offset = vectors[i].offset;
+		while(size > 0)
+		{
+			uint64_t unit = stripe->numMembers > 1 ? offset / stripe->unit : 0;
+			uint64_t within = stripe->numMembers > 1 ? offset % stripe->unit : offset;
+			size_t length = size;
+			if(stripe->numMembers > 1 && length > stripe->unit - within)
+			{
+				length = stripe->unit - within;
+			}
+			if(pieces != NULL)
+			{
+				pieces[numPieces].buffer = buffer;
+				pieces[numPieces].size = length;
+				pieces[numPieces].member = stripe->numMembers > 1 ? unit % stripe->numMembers : 0;
+				pieces[numPieces].offset = stripe->numMembers > 1
+					? unit / stripe->numMembers * stripe->unit + within : within;
+			}
+			numPieces++;
+			buffer += length;
+			size -= length;
+			offset += length;
+		}
+	}
+	return numPieces;
+}
+
+static void runJob(ImageStripe* stripe, StripeJob* job)
+{
+	job->success = true;
+	for(size_t i = 0; job->success && i < job->numPieces; i++)
+	{
+		StripePiece* piece = &job->pieces[i];
+		job->success = imageTransferRange(stripe->members[piece->member].fd,
+			piece->buffer, piece->size, piece->offset, job->write);
+	}
+}
+
+typedef struct member_thread_data
+{
+	ImageStripe* stripe;
+	unsigned int member;
+} MemberThreadData;
+
+/**
+ * Transfers the jobs queued on one member until asked to exit.
+ */
+static void* memberThread(void* data)
+{
+	MemberThreadData* threadData = data;
+	ImageStripe* stripe = threadData->stripe;
+	StripeMember* member = &stripe->members[threadData->member];
+	free(threadData);
+	pthread_mutex_lock(&member->lock);
+	for(;;)
+	{
+		while(member->queueHead == NULL && member->running)
+		{
+			pthread_cond_wait(&member->wake, &member->lock);
+		}
+		StripeJob* job = member->queueHead;
+		if(job == NULL)
+		{
+			break;
+		}
+		member->queueHead = job->next;
+		if(member->queueHead == NULL)
+		{
+			member->queueTail = NULL;
+		}
+		pthread_mutex_unlock(&member->lock);
+		/*
+		 * The caller may return as soon as the last job is finished, so
+		 * nothing in the job is used after posting.
+		 */
+		sem_t* done = job->done;
+		runJob(stripe, job);
+		if(atomic_fetch_sub(job->remaining, 1) == 1)
+		{
+			sem_post(done);
+		}
+		pthread_mutex_lock(&member->lock);
+	}
+	pthread_mutex_unlock(&member->lock);
+	return NULL;
+}
+
+bool imageStripeTransfer(EFSState* state, const ImageVector* vectors,
+	size_t count, bool write)
+{
+	ImageStripe* stripe = &state->stripe;
+	size_t numPieces = imageStripeSplit(stripe, vectors, count, NULL);
+	ScratchMark mark = scratchSave();
+	StripePiece* pieces = scratchAlloc(sizeof(StripePiece) * numPieces * 2);
+	size_t* firstPiece = scratchAlloc(sizeof(size_t) * (stripe->numMembers + 1));
+	StripeJob* jobs = scratchAlloc(sizeof(StripeJob) * stripe->numMembers);
+	if(pieces == NULL || firstPiece == NULL || jobs == NULL)
+	{
+		scratchRestore(mark);
+		return false;
+	}
+	memset(firstPiece, 0, sizeof(size_t) * (stripe->numMembers + 1));
+
+	/*
+	 * The pieces are gathered by member, keeping their order within each
+	 * member, so each job is one run of them.
+	 */
+	StripePiece* split = pieces + numPieces;
+	imageStripeSplit(stripe, vectors, count, split);
+	for(size_t i = 0; i < numPieces; i++)
+	{
+		firstPiece[split[i].member + 1]++;
+	}
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		firstPiece[i + 1] += firstPiece[i];
+	}
+	size_t numJobs = 0;
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		if(firstPiece[i + 1] > firstPiece[i])
+		{
+			jobs[numJobs].pieces = pieces + firstPiece[i];
+			jobs[numJobs].numPieces = 0;
+			jobs[numJobs].write = write;
+			jobs[numJobs].next = NULL;
+			numJobs++;
+		}
+	}
+	for(size_t i = 0; i < numPieces; i++)
+	{
+		pieces[firstPiece[split[i].member]++] = split[i];
+	}
+	for(size_t i = 0; i < numJobs; i++)
+	{
+		jobs[i].numPieces = (i + 1 < numJobs ? jobs[i + 1].pieces : pieces + numPieces) - jobs[i].pieces;
+	}
+
+	/*
+	 * The calling thread transfers the first job itself, and hands the
+	 * others to their members' threads.
+	 */
+	atomic_size_t remaining;
+	sem_t done;
+	bool parallel = stripe->threaded && numJobs > 1;
+	if(parallel)
+	{
+		atomic_init(&remaining, numJobs - 1);
+		sem_init(&done, 0, 0);
+		for(size_t i = 1; i < numJobs; i++)
+		{
+			StripeMember* member = &stripe->members[jobs[i].pieces[0].member];
+			jobs[i].remaining = &remaining;
+			jobs[i].done = &done;
+			pthread_mutex_lock(&member->lock);
+			if(member->queueTail != NULL)
+			{
+				member->queueTail->next = &jobs[i];
+			}
+			else
+			{
+				member->queueHead = &jobs[i];
+			}
+			member->queueTail = &jobs[i];
+			pthread_cond_signal(&member->wake);
+			pthread_mutex_unlock(&member->lock);
+		}
+		atomic_fetch_add(&state->stats.stripeParallelTransfers, 1);
+	}
+	for(size_t i = 0; i < (parallel ? 1 : numJobs); i++)
+	{
+		runJob(stripe, &jobs[i]);
+	}
+	if(parallel)
+	{
+		while(sem_wait(&done) != 0 && errno == EINTR)
+		{
+		}
+		sem_destroy(&done);
+	}
+	atomic_fetch_add(&state->stats.stripePieces, numPieces);
+
+	bool success = true;
+	for(size_t i = 0; i < numJobs; i++)
+	{
+		success = success && jobs[i].success;
+	}
+	scratchRestore(mark);
+	return success;
+}
+
+bool imageStripeSync(EFSState* state)
+{
+	ImageStripe* stripe = &state->stripe;
+	bool success = true;
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		success = fdatasync(stripe->members[i].fd) == 0 && success;
+	}
+	return success;
+}
+
+bool imageStripeStart(EFSState* state)
+{
+	ImageStripe* stripe = &state->stripe;
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		StripeMember* member = &stripe->members[i];
+		MemberThreadData* data = malloc(sizeof(MemberThreadData));
+		if(data == NULL)
+		{
+			imageStripeStop(state);
+			return false;
+		}
+		data->stripe = stripe;
+		data->member = i;
+		pthread_mutex_init(&member->lock, NULL);
+		pthread_cond_init(&member->wake, NULL);
+		member->running = true;
+		if(pthread_create(&member->thread, NULL, memberThread, data) != 0)
+		{
+			free(data);
+			member->running = false;
+			imageStripeStop(state);
+			return false;
+		}
+	}
+	stripe->threaded = true;
+	return true;
+}
+
+void imageStripeStop(EFSState* state)
+{
+	ImageStripe* stripe = &state->stripe;
+	stripe->threaded = false;
+	for(unsigned int i = 0; i < stripe->numMembers; i++)
+	{
+		StripeMember* member = &stripe->members[i];
+		if(!member->running)
+		{
+			continue;
+		}
+		pthread_mutex_lock(&member->lock);
+		member->running = false;
+		pthread_cond_signal(&member->wake);
+		pthread_mutex_unlock(&member->lock);
+		pthread_join(member->thread, NULL);
+	}
+}
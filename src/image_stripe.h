@@ -0,0 +1,240 @@
+#ifndef __EFSFUSE_IMAGE_STRIPE
+#define __EFSFUSE_IMAGE_STRIPE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct efs_state;
+struct image_vector;
+struct stripe_job;
+
+/**
+ * The offset within the first page of the image of the record describing
+ * how the image is striped, following the checksum record.
+ */
+#define STRIPE_RECORD_OFFSET (PAGE_SIZE / 2 + 64)
+
+/**
+ * Identifies the record describing how the image is striped.
+ */
+#define STRIPE_RECORD_MAGIC "EFSSTRIP"
+
+/**
+ * The record, stored in the first page of the image, describing how the
+ * pages of the image are spread across its members.
+ */
+typedef struct stripe_record
+{
+	/**
+	 * Always \link STRIPE_RECORD_MAGIC \endlink, without a terminator.
+	 */
+	char magic[8];
+
+	/**
+	 * The number of consecutive pages stored in one member before moving
+	 * on to the next.
+	 */
+	uint64_t unitPages;
+
+	/**
+	 * The number of members the image is striped across.
+	 */
+	uint64_t numMembers;
+
+} StripeRecord;
+
+/**
+ * One contiguous range of a single member, part of a transfer.
+ */
+typedef struct stripe_piece
+{
+	/**
+	 * The location to read into or write from.
+	 */
+	char* buffer;
+
+	/**
+	 * The number of bytes to transfer.
+	 */
+	size_t size;
+
+	/**
+	 * The byte offset within the member.
+	 */
+	uint64_t offset;
+
+	/**
+	 * The index of the member.
+	 */
+	unsigned int member;
+
+} StripePiece;
+
+/**
+ * One of the files the image is striped across, and the thread which
+ * transfers pieces of it on behalf of other threads.
+ */
+typedef struct stripe_member
+{
+	/**
+	 * The stream the member was opened with.
+	 */
+	FILE* stream;
+
+	/**
+	 * The descriptor of the member.
+	 */
+	int fd;
+
+	/**
+	 * The thread transferring queued jobs.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Protects the queue and running.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Signalled when a job is queued or the thread is asked to exit.
+	 */
+	pthread_cond_t wake;
+
+	/**
+	 * The first job waiting for the thread, or NULL.
+	 */
+	struct stripe_job* queueHead;
+
+	/**
+	 * The last job waiting for the thread, or NULL.
+	 */
+	struct stripe_job* queueTail;
+
+	/**
+	 * Cleared to ask the thread to exit.
+	 */
+	bool running;
+
+} StripeMember;
+
+/**
+ * The files holding the image. The pages of the image are dealt out to
+ * the members in turn, one stripe unit at a time, so page 0 is always at
+ * the start of the first member. An image held in a single file is a
+ * stripe of one member.
+ */
+typedef struct image_stripe
+{
+	/**
+	 * The members, in the order given on the command line.
+	 */
+	StripeMember* members;
+
+	/**
+	 * The number of entries in members.
+	 */
+	unsigned int numMembers;
+
+	/**
+	 * The number of bytes stored in one member before moving on to the
+	 * next. Unused if there is a single member.
+	 */
+	uint64_t unit;
+
+	/**
+	 * Set once a thread has been started for every member, so transfers
+	 * spanning several members are made in parallel.
+	 */
+	bool threaded;
+
+} ImageStripe;
+
+/**
+ * Opens a file and appends it to the members of the image. The first
+ * member is also used as the filesystem stream.
+ *
+ * @param state The current filesystem state
+ * @param path The file to open
+ *
+ * @returns true upon success, false if the file could not be opened.
+ */
+bool imageStripeAddMember(struct efs_state* state, const char* path);
+
+/**
+ * Reads the stripe record of an image with several members and checks
+ * that the members match it. If the image has no record, every member
+ * but the first must be empty; the image held in the first member is
+ * then striped across all of them. Must be called after the superblock
+ * has been read, and before any other page of the image.
+ *
+ * @param state The current filesystem state
+ * @param unitKB The stripe unit in kilobytes, used if the image is not
+ * yet striped, or 0 to refuse to stripe it
+ *
+ * @returns true upon success, false if the members do not match the
+ * record or the image could not be striped.
+ */
+bool imageStripeOpen(struct efs_state* state, unsigned int unitKB);
+
+/**
+ * Splits ranges of the image at stripe unit boundaries into ranges of
+ * individual members.
+ *
+ * @param stripe The members of the image
+ * @param vectors The ranges of the image
+ * @param count The number of entries in vectors
+ * @param pieces Receives the ranges of members, or NULL to only count
+ * them
+ *
+ * @returns The number of ranges of members.
+ */
+size_t imageStripeSplit(const ImageStripe* stripe,
+	const struct image_vector* vectors, size_t count, StripePiece* pieces);
+
+/**
+ * Reads or writes several ranges of an image with more than one member.
+ * Once the member threads are started, the pieces of each member are
+ * transferred in parallel with those of the others.
+ *
+ * @param state The current filesystem state
+ * @param vectors The ranges to transfer
+ * @param count The number of entries in vectors
+ * @param write Set to write, clear to read
+ *
+ * @returns true if every range was transferred, otherwise false.
+ */
+bool imageStripeTransfer(struct efs_state* state,
+	const struct image_vector* vectors, size_t count, bool write);
+
+/**
+ * Flushes every member to stable storage.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if any member failed.
+ */
+bool imageStripeSync(struct efs_state* state);
+
+/**
+ * Starts a thread for each member of an image with more than one.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if a thread could not be created.
+ * Transfers are then made one member after another.
+ */
+bool imageStripeStart(struct efs_state* state);
+
+/**
+ * Stops the member threads, if they were started. Must be called once no
+ * other thread accesses the image.
+ *
+ * @param state The current filesystem state
+ */
+void imageStripeStop(struct efs_state* state);
+
+#endif
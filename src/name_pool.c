@@ -0,0 +1,154 @@
+#include "name_pool.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The number of buckets a new pool starts with.
+ */
+#define NAME_POOL_INITIAL_BUCKETS 1024
+
+bool namePoolInit(NamePool* pool, EFSStats* stats)
+{
+	pool->buckets = calloc(NAME_POOL_INITIAL_BUCKETS, sizeof(InternedName*));
+	if(pool->buckets == NULL)
+	{
+		return false;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->numBuckets = NAME_POOL_INITIAL_BUCKETS;
+	pool->numNames = 0;
+	pool->stats = stats;
+	return true;
+}
+
+uint32_t nameHash(const char* name, size_t length)
+{
+	/*
+	 * FNV-1a, which is cheap for the short names files usually have.
+	 */
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < length; i++)
+	{
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Doubles the number of buckets once the pool holds more names than it has
+ * buckets. If the new buckets cannot be allocated, the pool keeps working
+ * with longer chains.
+ */
+static void growBuckets(NamePool* pool)
+{
+	size_t numBuckets = pool->numBuckets * 2;
+	InternedName** buckets = calloc(numBuckets, sizeof(InternedName*));
+	if(buckets == NULL)
+	{
+		return;
+	}
+	for(size_t i = 0; i < pool->numBuckets; i++)
+	{
+		InternedName* name = pool->buckets[i];
+		while(name != NULL)
+		{
+			InternedName* next = name->next;
+			size_t bucket = name->hash & (numBuckets - 1);
+			name->next = buckets[bucket];
+			buckets[bucket] = name;
+			name = next;
+		}
+	}
+	free(pool->buckets);
+	pool->buckets = buckets;
+	pool->numBuckets = numBuckets;
+}
+
+char* namePoolIntern(NamePool* pool, const char* text)
+{
+	size_t length = strlen(text);
+	uint32_t hash = nameHash(text, length);
+	pthread_mutex_lock(&pool->lock);
+	InternedName** bucket = &pool->buckets[hash & (pool->numBuckets - 1)];
+	for(InternedName* name = *bucket; name != NULL; name = name->next)
+	{
+		if(name->hash == hash && name->length == length && memcmp(name->text, text, length) == 0)
+		{
+			name->refs++;
+			pthread_mutex_unlock(&pool->lock);
+			atomic_fetch_add(&pool->stats->nameReferences, 1);
+			atomic_fetch_add(&pool->stats->nameBytesSaved, length + 1);
+			return name->text;
+		}
+	}
+	InternedName* name = malloc(sizeof(InternedName) + length + 1);
+	if(name == NULL)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+	name->pool = pool;
+	name->refs = 1;
+	name->hash = hash;
+	name->length = length;
+	memcpy(name->text, text, length + 1);
+	name->next = *bucket;
+	*bucket = name;
+	pool->numNames++;
+	if(pool->numNames > pool->numBuckets)
+	{
+		growBuckets(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	atomic_fetch_add(&pool->stats->namesInterned, 1);
+	atomic_fetch_add(&pool->stats->nameReferences, 1);
+	atomic_fetch_add(&pool->stats->nameBytes, sizeof(InternedName) + length + 1);
+	return name->text;
+}
+
+void internedNameRelease(void* text)
+{
+	if(text == NULL)
+	{
+		return;
+	}
+	InternedName* name = internedName(text);
+	NamePool* pool = name->pool;
+	pthread_mutex_lock(&pool->lock);
+	atomic_fetch_sub(&pool->stats->nameReferences, 1);
+	if(--name->refs > 0)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		atomic_fetch_sub(&pool->stats->nameBytesSaved, name->length + 1);
+		return;
+	}
+	InternedName** link = &pool->buckets[name->hash & (pool->numBuckets - 1)];
+	while(*link != name)
+	{
+		link = &(*link)->next;
+	}
+	*link = name->next;
+	pool->numNames--;
+	pthread_mutex_unlock(&pool->lock);
+	atomic_fetch_sub(&pool->stats->namesInterned, 1);
+	atomic_fetch_sub(&pool->stats->nameBytes, sizeof(InternedName) + name->length + 1);
+	free(name);
+}
+
+void namePoolDestroy(NamePool* pool)
+{
+	for(size_t i = 0; i < pool->numBuckets; i++)
+	{
+		InternedName* name = pool->buckets[i];
+		while(name != NULL)
+		{
+			InternedName* next = name->next;
+			free(name);
+			name = next;
+		}
+	}
+	free(pool->buckets);
+	pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,146 @@
+#ifndef __EFSFUSE_NAME_POOL
+#define __EFSFUSE_NAME_POOL
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct efs_stats;
+
+/**
+ * A filename stored once for every file with that name. Descriptors point
+ * at text, so that they can use the name as an ordinary string, and the
+ * rest of the structure is found from it with \link internedName \endlink.
+ */
+typedef struct interned_name
+{
+	/**
+	 * The pool the name belongs to.
+	 */
+	struct name_pool* pool;
+
+	/**
+	 * The number of descriptors using the name. Only changed with the
+	 * pool's lock held.
+	 */
+	uint32_t refs;
+
+	/**
+	 * The hash of the name, as computed by \link nameHash \endlink.
+	 */
+	uint32_t hash;
+
+	/**
+	 * The length of the name, excluding the null terminator.
+	 */
+	uint32_t length;
+
+	/**
+	 * The next name in the same bucket of the pool.
+	 */
+	struct interned_name* next;
+
+	/**
+	 * The name itself, null terminated.
+	 */
+	char text[];
+
+} InternedName;
+
+/**
+ * A hash table holding every distinct filename in the filesystem.
+ */
+typedef struct name_pool
+{
+	/**
+	 * Held while names are added, referenced or released.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The buckets of the table, each a chain of names.
+	 */
+	InternedName** buckets;
+
+	/**
+	 * The number of entries in buckets. Always a power of two.
+	 */
+	size_t numBuckets;
+
+	/**
+	 * The number of distinct names in the pool.
+	 */
+	size_t numNames;
+
+	/**
+	 * The statistics counting the names and the memory they save.
+	 */
+	struct efs_stats* stats;
+
+} NamePool;
+
+/**
+ * Initializes an empty pool.
+ *
+ * @param pool The pool to initialize
+ * @param stats The statistics to update as names are added and released
+ *
+ * @returns true upon success, false if memory could not be allocated.
+ */
+bool namePoolInit(NamePool* pool, struct efs_stats* stats);
+
+/**
+ * Hashes a name. The same hash is kept with every interned name, so that
+ * names can be compared by hash before their bytes are.
+ *
+ * @param name The name to hash
+ * @param length The length of the name
+ *
+ * @returns The hash of the name.
+ */
+uint32_t nameHash(const char* name, size_t length);
+
+/**
+ * Returns a reference to the interned copy of a name, adding it to the
+ * pool if no file has it yet.
+ *
+ * @param pool The pool to intern into
+ * @param text The name to intern
+ *
+ * @returns The text of the interned name, which must not be modified and
+ * must be released with \link internedNameRelease \endlink. NULL if
+ * memory could not be allocated.
+ */
+char* namePoolIntern(NamePool* pool, const char* text);
+
+/**
+ * Drops a reference to an interned name, and removes it from its pool once
+ * no descriptor uses it. Takes a void pointer so that it can be passed to
+ * epochRetire.
+ *
+ * @param text The text of the interned name. May be null.
+ */
+void internedNameRelease(void* text);
+
+/**
+ * Deallocates the pool and every name left in it.
+ *
+ * @param pool The pool to deallocate
+ */
+void namePoolDestroy(NamePool* pool);
+
+/**
+ * Finds the interned name a string returned by \link namePoolIntern
+ * \endlink belongs to.
+ *
+ * @param text The text of an interned name
+ *
+ * @returns The interned name.
+ */
+static inline InternedName* internedName(const char* text)
+{
+	return (InternedName*) (text - offsetof(InternedName, text));
+}
+
+#endif
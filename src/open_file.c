@@ -0,0 +1,194 @@
+#include "open_file.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "efsstate.h"
+#include "image_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+OpenFile* openFileCreate(uint64_t inode, int flags)
+{
+	OpenFile* handle = calloc(1, sizeof(OpenFile));
+	if(handle != NULL)
+	{
+		pthread_mutex_init(&handle->lock, NULL);
+		handle->inode = inode;
+		handle->flags = flags;
+	}
+	return handle;
+}
+
+/**
+ * Rebuilds the cached extent map of a handle from the fragments of the
+ * file, if they have changed since it was last built.
+ */
+static bool refreshExtents(OpenFile* handle, FileTableNode* file)
+{
+	if(handle->extentsValid && handle->extentGeneration == file->extentGeneration)
+	{
+		return true;
+	}
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	uint64_t numFragments = descriptor->numFragments;
+	if(numFragments > handle->numExtents || handle->extents == NULL)
+	{
+		OpenFileExtent* extents = realloc(handle->extents,
+			sizeof(OpenFileExtent) * (numFragments > 0 ? numFragments : 1));
+		if(extents == NULL)
+		{
+			handle->extentsValid = false;
+			return false;
+		}
+		handle->extents = extents;
+	}
+	uint64_t start = 0;
+	for(uint64_t i = 0; i < numFragments; i++)
+	{
+		handle->extents[i].start = start;
+		handle->extents[i].location = descriptor->fragments[i].fragmentLocation;
+		handle->extents[i].size = fragmentPages(&descriptor->fragments[i]);
+		handle->extents[i].compressed = fragmentIsCompressed(&descriptor->fragments[i]);
+		start += handle->extents[i].size;
+	}
+	handle->numExtents = numFragments;
+	handle->extentGeneration = file->extentGeneration;
+	handle->extentsValid = true;
+	return true;
+}
+
+bool openFileMap(OpenFile* handle, FileTableNode* file, uint64_t offset,
+	uint64_t* imageOffset, uint64_t* length)
+{
+	if(!refreshExtents(handle, file) || handle->numExtents == 0)
+	{
+		return false;
+	}
+	uint64_t page = offset / PAGE_SIZE;
+	size_t low = 0;
+	size_t high = handle->numExtents;
+	while(high - low > 1)
+	{
+		size_t middle = low + (high - low) / 2;
+		if(handle->extents[middle].start <= page)
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+	OpenFileExtent* extent = &handle->extents[low];
+	if(page < extent->start || page >= extent->start + extent->size || extent->compressed)
+	{
+		return false;
+	}
+	uint64_t extentOffset = offset - extent->start * PAGE_SIZE;
+	*imageOffset = extent->location * PAGE_SIZE + extentOffset;
+	*length = extent->size * PAGE_SIZE - extentOffset;
+	return true;
+}
+
+/**
+ * Copies a read out of the readahead data, if all of it is held there and
+ * the file has not been written since it was read.
+ */
+static bool readaheadHit(OpenFile* handle, uint64_t generation,
+	uint64_t offset, uint64_t size, char* buffer)
+{
+	if(handle->readaheadLength == 0 || handle->readaheadGeneration != generation
+		|| offset < handle->readaheadOffset
+		|| offset + size > handle->readaheadOffset + handle->readaheadLength)
+	{
+		return false;
+	}
+	memcpy(buffer, handle->readahead + (offset - handle->readaheadOffset), size);
+	return true;
+}
+
+bool openFileRead(EFSState* state, OpenFile* handle, FileTableNode* file,
+	uint64_t generation, uint64_t offset, uint64_t size, char* buffer)
+{
+	bool sequential = offset == handle->nextOffset;
+	handle->nextOffset = offset + size;
+	if(!sequential)
+	{
+		handle->window = 0;
+	}
+	if(readaheadHit(handle, generation, offset, size, buffer))
+	{
+		return true;
+	}
+	if(!sequential || size > OPEN_FILE_READAHEAD_MAX)
+	{
+		return false;
+	}
+
+	size_t window = handle->window == 0 ? OPEN_FILE_READAHEAD_MIN : handle->window * 2;
+	if(window > OPEN_FILE_READAHEAD_MAX)
+	{
+		window = OPEN_FILE_READAHEAD_MAX;
+	}
+	if(window < size)
+	{
+		window = size;
+	}
+	if(window > handle->readaheadCapacity)
+	{
+		char* readahead = realloc(handle->readahead, window);
+		if(readahead == NULL)
+		{
+			return false;
+		}
+		handle->readahead = readahead;
+		handle->readaheadCapacity = window;
+	}
+	handle->window = window;
+
+	/*
+	 * Only data already allocated is read ahead, and only as far as the
+	 * end of the fragment holding offset, so that it takes a single read
+	 * of the image. Pending data is already in memory.
+	 */
+	uint64_t imageOffset;
+	uint64_t length;
+	if(!openFileMap(handle, file, offset, &imageOffset, &length))
+	{
+		return false;
+	}
+	uint64_t filesize = file->fileDescriptor->filesize;
+	uint64_t fill = window;
+	if(fill > length)
+	{
+		fill = length;
+	}
+	if(fill > filesize - offset)
+	{
+		fill = filesize - offset;
+	}
+	if(fill < size)
+	{
+		return false;
+	}
+	handle->readaheadLength = 0;
+	if(!imageRead(state, handle->readahead, fill, imageOffset)
+		|| !checksumVerify(state, imageOffset, handle->readahead, fill))
+	{
+		return false;
+	}
+	handle->readaheadOffset = offset;
+	handle->readaheadLength = fill;
+	handle->readaheadGeneration = generation;
+	memcpy(buffer, handle->readahead, size);
+	atomic_fetch_add(&state->stats.readaheadBytes, fill);
+	return true;
+}
+
+void openFileDestroy(OpenFile* handle)
+{
+	pthread_mutex_destroy(&handle->lock);
+	free(handle->extents);
+	free(handle->readahead);
+	free(handle);
+}
@@ -0,0 +1,201 @@
+#ifndef __EFSFUSE_OPEN_FILE
+#define __EFSFUSE_OPEN_FILE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_table.h"
+
+struct efs_state;
+
+/**
+ * The smallest amount of data, in bytes, read ahead once a handle is read
+ * sequentially.
+ */
+#define OPEN_FILE_READAHEAD_MIN (128 * 1024)
+
+/**
+ * The largest amount of data, in bytes, read ahead at once. The window
+ * doubles with each sequential read until it reaches this size.
+ */
+#define OPEN_FILE_READAHEAD_MAX (2 * 1024 * 1024)
+
+/**
+ * A fragment of a file, together with where it starts within the file, so
+ * that the fragment holding a byte can be found by binary search.
+ */
+typedef struct open_file_extent
+{
+	/**
+	 * The index within the file of the first page of this fragment.
+	 */
+	uint64_t start;
+
+	/**
+	 * The page index within the image of the first page of this fragment.
+	 */
+	uint64_t location;
+
+	/**
+	 * The size of this fragment in pages.
+	 */
+	uint64_t size;
+
+	/**
+	 * Set if the data of this fragment is compressed, in which case it
+	 * cannot be read directly from the image.
+	 */
+	bool compressed;
+
+} OpenFileExtent;
+
+/**
+ * The state of a single open handle of a file, stored in the fh field of
+ * the handle. Any number of handles may be open on a file at once; each
+ * keeps its own cached extent map and readahead state, so handles do not
+ * contend with one another except through the lock of the file.
+ */
+typedef struct open_file
+{
+	/**
+	 * Held while the handle's cached state is read or changed. Taken after
+	 * the lock of the file, since a handle may be used by several requests
+	 * at once.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * The inode the handle was opened on.
+	 */
+	uint64_t inode;
+
+	/**
+	 * The flags the handle was opened with.
+	 */
+	int flags;
+
+	/**
+	 * The fragments of the file, as of extentGeneration.
+	 */
+	OpenFileExtent* extents;
+
+	/**
+	 * The number of entries in extents.
+	 */
+	size_t numExtents;
+
+	/**
+	 * The extent generation of the file when extents was built. The map
+	 * is rebuilt when the file's generation differs.
+	 */
+	uint64_t extentGeneration;
+
+	/**
+	 * Set once extents has been built at least once.
+	 */
+	bool extentsValid;
+
+	/**
+	 * The byte offset one past the end of the last read, used to detect
+	 * sequential reads.
+	 */
+	uint64_t nextOffset;
+
+	/**
+	 * The number of bytes the next readahead will fetch. 0 until the
+	 * handle has been read sequentially.
+	 */
+	size_t window;
+
+	/**
+	 * Data read ahead from the file. Allocated on first use, and grown
+	 * with the window.
+	 */
+	char* readahead;
+
+	/**
+	 * The number of bytes allocated for readahead.
+	 */
+	size_t readaheadCapacity;
+
+	/**
+	 * The offset within the file of the first byte of readahead.
+	 */
+	uint64_t readaheadOffset;
+
+	/**
+	 * The number of valid bytes in readahead.
+	 */
+	uint64_t readaheadLength;
+
+	/**
+	 * The generation of the file's pending data when readahead was
+	 * filled. Any write to the file changes it, discarding the data.
+	 */
+	uint64_t readaheadGeneration;
+
+} OpenFile;
+
+/**
+ * Allocates the state of a new handle on a file.
+ *
+ * @param inode The inode being opened
+ * @param flags The flags the file is being opened with
+ *
+ * @returns The new handle, or NULL if it could not be allocated.
+ */
+OpenFile* openFileCreate(uint64_t inode, int flags);
+
+/**
+ * Finds where a byte of a file is stored within the image, using the
+ * handle's cached extent map. The map is rebuilt first if the fragments of
+ * the file have changed. Must be called with the file's lock held and the
+ * handle's lock held.
+ *
+ * @param handle The handle to map through
+ * @param file The file the handle is open on
+ * @param offset The offset of the byte within the file
+ * @param imageOffset Set to the offset of the byte within the image
+ * @param length Set to the number of bytes from offset to the end of the
+ * fragment containing it
+ *
+ * @returns true upon success, false if offset lies beyond the pages
+ * allocated to the file or in a compressed fragment, or the map could not
+ * be allocated.
+ */
+bool openFileMap(OpenFile* handle, FileTableNode* file, uint64_t offset,
+	uint64_t* imageOffset, uint64_t* length);
+
+/**
+ * Serves a read from the handle's readahead data. If the read continues a
+ * sequential stream and is not already held, the data is first refilled
+ * with a window starting at offset, which grows with each sequential read.
+ * Must be called with the file's lock held for reading and the handle's
+ * lock held.
+ *
+ * @param state The current filesystem state
+ * @param handle The handle being read from
+ * @param file The file the handle is open on
+ * @param generation The current generation of the file's pending data
+ * @param offset The offset within the file to read from
+ * @param size The number of bytes to read. Must not extend past the end of
+ * the file.
+ * @param buffer The location to read into
+ *
+ * @returns true if the read was served, false if the caller must read
+ * the data itself.
+ */
+bool openFileRead(struct efs_state* state, OpenFile* handle,
+	FileTableNode* file, uint64_t generation, uint64_t offset, uint64_t size,
+	char* buffer);
+
+/**
+ * Deallocates the state of a handle.
+ *
+ * @param handle The handle to deallocate
+ */
+void openFileDestroy(OpenFile* handle);
+
+#endif
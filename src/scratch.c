@@ -0,0 +1,111 @@
+#include "scratch.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * The arena of the calling thread.
+ */
+static __thread ScratchArena localArena = { NULL, 0, NULL };
+
+/**
+ * Used to free the arena of a thread when it exits.
+ */
+static pthread_key_t arenaKey;
+
+static pthread_once_t arenaKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Frees the allocations of a thread made since a mark, down to the
+ * given number of bytes of its arena.
+ */
+static void release(ScratchArena* arena, size_t used, ScratchBlock* blocks)
+{
+	while(arena->blocks != blocks)
+	{
+		ScratchBlock* block = arena->blocks;
+		arena->blocks = block->previous;
+		free(block);
+	}
+	arena->used = used;
+}
+
+/**
+ * Frees the arena of an exiting thread.
+ */
+static void releaseArena(void* data)
+{
+	ScratchArena* arena = data;
+	release(arena, 0, NULL);
+	free(arena->data);
+	arena->data = NULL;
+}
+
+static void createKey()
+{
+	pthread_key_create(&arenaKey, releaseArena);
+}
+
+/**
+ * Allocates the calling thread's arena.
+ */
+static bool createArena(ScratchArena* arena)
+{
+	pthread_once(&arenaKeyOnce, createKey);
+	arena->data = malloc(SCRATCH_ARENA_SIZE);
+	if(arena->data == NULL)
+	{
+		return false;
+	}
+	pthread_setspecific(arenaKey, arena);
+	return true;
+}
+
+void* scratchAlloc(size_t size)
+{
+	ScratchArena* arena = &localArena;
+	size_t aligned = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	if(aligned >= size && (arena->data != NULL || createArena(arena))
+		&& aligned <= SCRATCH_ARENA_SIZE - arena->used)
+	{
+		void* memory = arena->data + arena->used;
+		arena->used += aligned;
+		return memory;
+	}
+
+	/*
+	 * The allocation is taken from the heap, and kept in a list so it is
+	 * freed along with the arena's.
+	 */
+	if(size > SIZE_MAX - sizeof(ScratchBlock))
+	{
+		return NULL;
+	}
+	ScratchBlock* block = malloc(sizeof(ScratchBlock) + size);
+	if(block == NULL)
+	{
+		return NULL;
+	}
+	block->previous = arena->blocks;
+	arena->blocks = block;
+	return block + 1;
+}
+
+ScratchMark scratchSave()
+{
+	ScratchMark mark = { localArena.used, localArena.blocks };
+	return mark;
+}
+
+void scratchRestore(ScratchMark mark)
+{
+	release(&localArena, mark.used, mark.blocks);
+}
+
+void scratchReset()
+{
+	release(&localArena, 0, NULL);
+}
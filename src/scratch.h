@@ -0,0 +1,104 @@
+#ifndef __EFSFUSE_SCRATCH
+#define __EFSFUSE_SCRATCH
+
+#include <stddef.h>
+
+/**
+ * The number of bytes of each thread's arena. Large enough for the reply
+ * to the largest read the kernel sends, along with what the image engines
+ * need to transfer it.
+ */
+#define SCRATCH_ARENA_SIZE (2 * 1024 * 1024)
+
+/**
+ * Memory for one allocation too large for the rest of an arena, taken
+ * from the heap instead.
+ */
+typedef struct scratch_block
+{
+	/**
+	 * The block allocated before this one.
+	 */
+	struct scratch_block* previous;
+
+} __attribute__((aligned(16))) ScratchBlock;
+
+/**
+ * The scratch memory of one thread. Allocations are taken from the front
+ * of the arena in order and handed back all at once, so building a reply
+ * never goes through the heap or touches memory shared with other
+ * threads.
+ */
+typedef struct scratch_arena
+{
+	/**
+	 * The memory allocations are taken from, or NULL until the thread
+	 * first allocates.
+	 */
+	char* data;
+
+	/**
+	 * The number of bytes at the front of data in use.
+	 */
+	size_t used;
+
+	/**
+	 * The most recent allocation which did not fit in the arena, or NULL.
+	 */
+	ScratchBlock* blocks;
+
+} ScratchArena;
+
+/**
+ * The allocations of a thread at some point, to which they can be
+ * returned.
+ */
+typedef struct scratch_mark
+{
+	/**
+	 * The number of bytes of the arena in use.
+	 */
+	size_t used;
+
+	/**
+	 * The most recent allocation which did not fit in the arena.
+	 */
+	ScratchBlock* blocks;
+
+} ScratchMark;
+
+/**
+ * Allocates memory from the calling thread's arena, or from the heap if
+ * the arena does not have room. The memory stays valid until the thread
+ * resets its arena or restores a mark taken before the allocation, and
+ * may be used by other threads until then.
+ *
+ * @param size The number of bytes to allocate
+ *
+ * @returns The memory, or NULL if it could not be allocated.
+ */
+void* scratchAlloc(size_t size);
+
+/**
+ * Records the allocations of the calling thread, so that those made
+ * afterwards can be freed without freeing any made before.
+ *
+ * @returns The mark to restore.
+ */
+ScratchMark scratchSave();
+
+/**
+ * Frees every allocation the calling thread has made since a mark was
+ * taken. Marks must be restored in the reverse order they were taken in.
+ *
+ * @param mark The mark to return to
+ */
+void scratchRestore(ScratchMark mark);
+
+/**
+ * Frees every allocation of the calling thread. Called once a request
+ * has been replied to.
+ */
+void scratchReset();
+
+#endif
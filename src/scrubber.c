@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include "scrubber.h"
+#include "allocator.h"
+#include "checksum.h"
+#include "efsstate.h"
+#include "image_io.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * The number of pages read and verified at a time while holding the lock
+ * of a file.
+ */
+#define SCRUB_CHUNK_PAGES 64
+
+/**
+ * Where the scrubber has got to within a file: a page of the image within
+ * one of the file's fragments.
+ */
+typedef struct scrub_position
+{
+	uint64_t fragment;
+	uint64_t page;
+} ScrubPosition;
+
+static bool isRunning(Scrubber* scrubber)
+{
+	return __atomic_load_n(&scrubber->running, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Sleeps for the specified time, or until the thread is asked to exit.
+ *
+ * @returns true if the thread should keep running.
+ */
+static bool scrubberSleep(Scrubber* scrubber, uint64_t milliseconds)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += milliseconds / 1000;
+	deadline.tv_nsec += (milliseconds % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&scrubber->lock);
+	while(scrubber->running)
+	{
+		if(pthread_cond_timedwait(&scrubber->wake, &scrubber->lock, &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	bool running = scrubber->running;
+	pthread_mutex_unlock(&scrubber->lock);
+	return running;
+}
+
+/**
+ * Sleeps for long enough that reading the specified number of bytes since
+ * start does not exceed the configured bandwidth.
+ *
+ * @returns true if the thread should keep running.
+ */
+static bool throttle(Scrubber* scrubber, uint64_t bytes,
+	const struct timespec* start)
+{
+	if(scrubber->bandwidth == 0)
+	{
+		return isRunning(scrubber);
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t elapsed = (now.tv_sec - start->tv_sec) * 1000
+		+ (now.tv_nsec - start->tv_nsec) / 1000000;
+	uint64_t allowed = bytes / 1024 * 1000 / scrubber->bandwidth;
+	if(allowed > elapsed)
+	{
+		return scrubberSleep(scrubber, allowed - elapsed);
+	}
+	return isRunning(scrubber);
+}
+
+/**
+ * Reads and verifies the next chunk of a file, and advances the position
+ * past it. The fragments of the file may change between chunks, in which
+ * case the position simply carries on through the new fragments.
+ *
+ * @returns The number of pages read, or 0 once the end of the file has
+ * been reached or it has been removed.
+ */
+static uint64_t scrubChunk(EFSState* state, uint64_t inode,
+	ScrubPosition* position, char* buffer, uint64_t* mismatches)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* file = fileTableSearchInode(state->fileTable, inode);
+	if(file == NULL)
+	{
+		return 0;
+	}
+	pthread_rwlock_rdlock(&file->lock);
+	EFSCompactFileDescriptor* descriptor = file->fileDescriptor;
+	while(position->fragment < descriptor->numFragments
+		&& position->page >= fragmentPhysicalPages(&descriptor->fragments[position->fragment]))
+	{
+		position->fragment++;
+		position->page = 0;
+	}
+	if(position->fragment >= descriptor->numFragments)
+	{
+		pthread_rwlock_unlock(&file->lock);
+		return 0;
+	}
+	EFSFragmentDescriptor* fragment = &descriptor->fragments[position->fragment];
+	uint64_t pages = fragmentPhysicalPages(fragment) - position->page;
+	if(pages > SCRUB_CHUNK_PAGES)
+	{
+		pages = SCRUB_CHUNK_PAGES;
+	}
+	uint64_t location = fragment->fragmentLocation + position->page;
+	if(imageRead(state, buffer, pages * PAGE_SIZE, location * PAGE_SIZE))
+	{
+		uint64_t found = checksumScrub(state, location, buffer, pages);
+		if(found > 0)
+		{
+			printf("Scrub found %" PRIu64 " corrupt pages of inode %" PRIu64 " at page %" PRIu64 ".\n", found, inode, location);
+			*mismatches += found;
+		}
+	}
+	else
+	{
+		printf("Scrub could not read inode %" PRIu64 " at page %" PRIu64 ".\n", inode, location);
+	}
+	pthread_rwlock_unlock(&file->lock);
+	position->page += pages;
+	return pages;
+}
+
+/**
+ * Scrubs a file, throttled to the configured bandwidth. Stops early if
+ * the thread is asked to exit.
+ */
+static uint64_t scrubFile(EFSState* state, uint64_t inode, bool throttled)
+{
+	Scrubber* scrubber = &state->scrubber;
+	char* buffer = malloc(SCRUB_CHUNK_PAGES * PAGE_SIZE);
+	if(buffer == NULL)
+	{
+		return 0;
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ScrubPosition position = { 0, 0 };
+	uint64_t mismatches = 0;
+	uint64_t bytes = 0;
+	uint64_t pages;
+	while((pages = scrubChunk(state, inode, &position, buffer, &mismatches)) > 0)
+	{
+		bytes += pages * PAGE_SIZE;
+		atomic_fetch_add(&state->stats.scrubBytes, pages * PAGE_SIZE);
+		if(throttled && !throttle(scrubber, bytes, &start))
+		{
+			break;
+		}
+	}
+	free(buffer);
+	return mismatches;
+}
+
+uint64_t scrubberScrubFile(EFSState* state, uint64_t inode)
+{
+	return scrubFile(state, inode, false);
+}
+
+/**
+ * Scrubs every file in the file table.
+ */
+static void scrubberPass(EFSState* state)
+{
+	Scrubber* scrubber = &state->scrubber;
+	pthread_mutex_lock(&state->metadataLock);
+	size_t numFiles = 0;
+	uint64_t* inodes = malloc(sizeof(uint64_t) * (state->fileTable->size + 1));
+	if(inodes == NULL)
+	{
+		pthread_mutex_unlock(&state->metadataLock);
+		return;
+	}
+	for(FileTableNode* node = state->fileTable->head->next; node != NULL; node = node->next)
+	{
+		if(__atomic_load_n(&node->fileDescriptor->numFragments, __ATOMIC_RELAXED) > 0)
+		{
+			inodes[numFiles++] = node->fileDescriptor->fileID;
+		}
+	}
+	pthread_mutex_unlock(&state->metadataLock);
+
+	uint64_t mismatches = 0;
+	for(size_t i = 0; i < numFiles && isRunning(scrubber); i++)
+	{
+		mismatches += scrubFile(state, inodes[i], true);
+	}
+	if(isRunning(scrubber))
+	{
+		printf("Scrubbed %zu files, %" PRIu64 " corrupt pages found.\n", numFiles, mismatches);
+		atomic_fetch_add(&state->stats.scrubPasses, 1);
+	}
+	free(inodes);
+}
+
+static void* scrubberThread(void* data)
+{
+	EFSState* state = data;
+	Scrubber* scrubber = &state->scrubber;
+	struct sched_param parameters = { 0 };
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+	while(scrubberSleep(scrubber, (uint64_t) scrubber->interval * 1000))
+	{
+		scrubberPass(state);
+	}
+	return NULL;
+}
+
+bool scrubberStart(EFSState* state)
+{
+	Scrubber* scrubber = &state->scrubber;
+	pthread_mutex_init(&scrubber->lock, NULL);
+	pthread_cond_init(&scrubber->wake, NULL);
+	scrubber->running = true;
+	if(pthread_create(&scrubber->thread, NULL, scrubberThread, state) != 0)
+	{
+		scrubber->running = false;
+		return false;
+	}
+	return true;
+}
+
+void scrubberStop(EFSState* state)
+{
+	Scrubber* scrubber = &state->scrubber;
+	if(!scrubber->running)
+	{
+		return;
+	}
+	pthread_mutex_lock(&scrubber->lock);
+	__atomic_store_n(&scrubber->running, false, __ATOMIC_RELEASE);
+	pthread_cond_signal(&scrubber->wake);
+	pthread_mutex_unlock(&scrubber->lock);
+	pthread_join(scrubber->thread, NULL);
+}
@@ -0,0 +1,84 @@
+#ifndef __EFSFUSE_SCRUBBER
+#define __EFSFUSE_SCRUBBER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct efs_state;
+
+/**
+ * State of the optional background thread that reads every page of every
+ * file and verifies it against its checksum, so that corruption is found
+ * before the data is needed. The thread runs at idle priority, and limits
+ * the rate at which it reads so that it does not compete with requests
+ * from the mount.
+ */
+typedef struct scrubber
+{
+	/**
+	 * The background scrubber thread.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Protects running, and is held while the thread sleeps.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Signalled to wake the thread early, so that it can exit.
+	 */
+	pthread_cond_t wake;
+
+	/**
+	 * Cleared to ask the scrubber thread to exit.
+	 */
+	bool running;
+
+	/**
+	 * The time in seconds between passes over the file table.
+	 */
+	unsigned int interval;
+
+	/**
+	 * The maximum rate in kilobytes per second at which pages are read.
+	 * 0 if the rate is not limited.
+	 */
+	unsigned int bandwidth;
+
+} Scrubber;
+
+/**
+ * Starts the scrubber thread, configured with the interval and bandwidth
+ * already stored in state->scrubber. The image must have a checksum
+ * table.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if the thread could not be created.
+ */
+bool scrubberStart(struct efs_state* state);
+
+/**
+ * Stops the scrubber thread, waiting for the file being scrubbed to be
+ * abandoned. Does nothing if the thread was never started.
+ *
+ * @param state The current filesystem state
+ */
+void scrubberStop(struct efs_state* state);
+
+/**
+ * Verifies every page of a file against its checksum, and records the
+ * checksums of any pages which have none. Pages are read a chunk at a
+ * time with the file's lock held for reading, so the file can still be
+ * written between chunks.
+ *
+ * @param state The current filesystem state
+ * @param inode The file to scrub
+ *
+ * @returns The number of pages which did not match their checksum.
+ */
+uint64_t scrubberScrubFile(struct efs_state* state, uint64_t inode);
+
+#endif
@@ -0,0 +1,246 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t descriptorWritesSaved(EFSStats* stats)
+{
+	uint64_t dirtied = atomic_load(&stats->descriptorPagesDirtied);
+	uint64_t calls = atomic_load(&stats->descriptorWriteCalls);
+	return dirtied > calls ? dirtied - calls : 0;
+}
+
+static double fragmentsPerFile(EFSStats* stats)
+{
+	uint64_t files = atomic_load(&stats->files);
+	uint64_t fragments = atomic_load(&stats->fragments);
+	return files > 0 ? (double) fragments / files : 0.0;
+}
+
+static double compressionRatio(EFSStats* stats)
+{
+	uint64_t in = atomic_load(&stats->compressionBytesIn);
+	uint64_t out = atomic_load(&stats->compressionBytesOut);
+	return out > 0 ? (double) in / out : 0.0;
+}
+
+static double imageCacheHitRate(EFSStats* stats)
+{
+	uint64_t hits = atomic_load(&stats->imageCacheHits);
+	uint64_t misses = atomic_load(&stats->imageCacheMisses);
+	return hits + misses > 0 ? (double) hits / (hits + misses) : 0.0;
+}
+
+static double decompressCacheHitRate(EFSStats* stats)
+{
+	uint64_t hits = atomic_load(&stats->decompressCacheHits);
+	uint64_t misses = atomic_load(&stats->decompressCacheMisses);
+	return hits + misses > 0 ? (double) hits / (hits + misses) : 0.0;
+}
+
+#define STATS_COUNTER(name, field) { name, offsetof(EFSStats, field), NULL, NULL }
+#define STATS_DERIVED(name, function) { name, 0, function, NULL }
+#define STATS_RATIO(name, function) { name, 0, NULL, function }
+
+/**
+ * Maps the name of each statistic to either a counter in EFSStats, or a
+ * function that derives its value from other counters. Ratios are
+ * formatted with two decimal places.
+ */
+static const struct
+{
+	const char* name;
+	size_t offset;
+	uint64_t (*derive)(EFSStats*);
+	double (*ratio)(EFSStats*);
+} statistics[] = {
+	STATS_COUNTER("descriptor_pages_dirtied", descriptorPagesDirtied),
+	STATS_COUNTER("descriptor_pages_written", descriptorPagesWritten),
+	STATS_COUNTER("descriptor_write_calls", descriptorWriteCalls),
+	STATS_DERIVED("descriptor_writes_saved", descriptorWritesSaved),
+	STATS_COUNTER("timestamps_deferred", timestampsDeferred),
+	STATS_COUNTER("writeback_flushes", writebackFlushes),
+	STATS_COUNTER("fsync_requests", fsyncRequests),
+	STATS_COUNTER("image_syncs", imageSyncs),
+	STATS_COUNTER("files", files),
+	STATS_COUNTER("fragments", fragments),
+	STATS_RATIO("fragments_per_file", fragmentsPerFile),
+	STATS_COUNTER("delayed_allocations", delayedAllocations),
+	STATS_COUNTER("bytes_copied_in_image", bytesCopiedInImage),
+	STATS_COUNTER("defrag_passes", defragPasses),
+	STATS_COUNTER("defrag_files_pending", defragFilesPending),
+	STATS_COUNTER("defrag_files_relocated", defragFilesRelocated),
+	STATS_COUNTER("defrag_fragments_reclaimed", defragFragmentsReclaimed),
+	STATS_COUNTER("defrag_bytes_copied", defragBytesCopied),
+	STATS_COUNTER("open_handles", openHandles),
+	STATS_COUNTER("readahead_bytes", readaheadBytes),
+	STATS_COUNTER("uring_submissions", ringSubmissions),
+	STATS_COUNTER("uring_operations", ringOperations),
+	STATS_COUNTER("stripe_parallel_transfers", stripeParallelTransfers),
+	STATS_COUNTER("stripe_pieces", stripePieces),
+	STATS_COUNTER("image_cache_hits", imageCacheHits),
+	STATS_COUNTER("image_cache_misses", imageCacheMisses),
+	STATS_RATIO("image_cache_hit_rate", imageCacheHitRate),
+	STATS_COUNTER("image_read_modify_writes", imageReadModifyWrites),
+	STATS_COUNTER("requests_in_flight", requestsInFlight),
+	STATS_COUNTER("names_interned", namesInterned),
+	STATS_COUNTER("name_references", nameReferences),
+	STATS_COUNTER("name_bytes", nameBytes),
+	STATS_COUNTER("name_bytes_saved", nameBytesSaved),
+	STATS_COUNTER("inline_files", inlineFiles),
+	STATS_COUNTER("inline_reads", inlineReads),
+	STATS_COUNTER("compressed_units", compressedUnits),
+	STATS_COUNTER("compression_bytes_in", compressionBytesIn),
+	STATS_COUNTER("compression_bytes_out", compressionBytesOut),
+	STATS_RATIO("compression_ratio", compressionRatio),
+	STATS_COUNTER("compression_declined", compressionDeclined),
+	STATS_COUNTER("compression_expansions", compressionExpansions),
+	STATS_COUNTER("decompress_cache_hits", decompressCacheHits),
+	STATS_COUNTER("decompress_cache_misses", decompressCacheMisses),
+	STATS_RATIO("decompress_cache_hit_rate", decompressCacheHitRate),
+	STATS_COUNTER("checksum_pages_verified", checksumPagesVerified),
+	STATS_COUNTER("checksum_failures", checksumFailures),
+	STATS_COUNTER("scrub_passes", scrubPasses),
+	STATS_COUNTER("scrub_bytes", scrubBytes),
+	STATS_COUNTER("scrub_pages_adopted", scrubPagesAdopted),
+	STATS_COUNTER("dedup_extents_indexed", dedupExtentsIndexed),
+	STATS_COUNTER("dedup_fragments_shared", dedupFragmentsShared),
+	STATS_COUNTER("dedup_pages_saved", dedupPagesSaved),
+	STATS_COUNTER("dedup_copies", dedupCopies),
+	STATS_COUNTER("dedup_collisions", dedupCollisions),
+	STATS_COUNTER("dedup_bytes_scanned", dedupBytesScanned),
+};
+
+#define NUM_STATISTICS (sizeof(statistics) / sizeof(statistics[0]))
+
+/**
+ * The names of the counters kept for each pinned worker, which are
+ * exposed as worker<N>_<name>.
+ */
+static const char* workerStatistics[] = { "requests", "busy_ms", "utilization" };
+
+#define NUM_WORKER_STATISTICS (sizeof(workerStatistics) / sizeof(workerStatistics[0]))
+
+uint64_t statsNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Formats a statistic of a single pinned worker, named worker<N>_<name>.
+ */
+static bool formatWorker(EFSStats* stats, const char* name, char* text,
+	size_t size, size_t* length)
+{
+	unsigned int index;
+	int consumed = 0;
+	EFSWorkerStats* workers = atomic_load(&stats->workers);
+	if(workers == NULL || sscanf(name, "worker%u_%n", &index, &consumed) != 1
+		|| consumed == 0 || index >= stats->numWorkers)
+	{
+		return false;
+	}
+	EFSWorkerStats* worker = &workers[index];
+	const char* field = name + consumed;
+	uint64_t busyTime = atomic_load(&worker->busyTime);
+	if(strcmp(field, "requests") == 0)
+	{
+		*length = snprintf(text, size, "%" PRIu64, (uint64_t) atomic_load(&worker->requests));
+	}
+	else if(strcmp(field, "busy_ms") == 0)
+	{
+		*length = snprintf(text, size, "%" PRIu64, busyTime / 1000000);
+	}
+	else if(strcmp(field, "utilization") == 0)
+	{
+		uint64_t elapsed = statsNow() - worker->started;
+		*length = snprintf(text, size, "%.2f", elapsed > 0 ? (double) busyTime / elapsed : 0.0);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+bool statsFormat(EFSStats* stats, const char* name, char* buffer,
+	size_t size, size_t* length)
+{
+	size_t prefixLength = strlen(EFS_STATS_XATTR_PREFIX);
+	if(strncmp(name, EFS_STATS_XATTR_PREFIX, prefixLength) != 0)
+	{
+		return false;
+	}
+	char text[32];
+	if(formatWorker(stats, name + prefixLength, text, sizeof(text), length))
+	{
+		if(size >= *length)
+		{
+			memcpy(buffer, text, *length);
+		}
+		return true;
+	}
+	for(size_t i = 0; i < NUM_STATISTICS; i++)
+	{
+		if(strcmp(name + prefixLength, statistics[i].name) == 0)
+		{
+			if(statistics[i].ratio != NULL)
+			{
+				*length = snprintf(text, sizeof(text), "%.2f", statistics[i].ratio(stats));
+			}
+			else
+			{
+				uint64_t value;
+				if(statistics[i].derive != NULL)
+				{
+					value = statistics[i].derive(stats);
+				}
+				else
+				{
+					value = atomic_load((atomic_uint_fast64_t*) ((char*) stats + statistics[i].offset));
+				}
+				*length = snprintf(text, sizeof(text), "%" PRIu64, value);
+			}
+			if(size >= *length)
+			{
+				memcpy(buffer, text, *length);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t statsList(EFSStats* stats, char* buffer, size_t size)
+{
+	size_t needed = 0;
+	for(size_t i = 0; i < NUM_STATISTICS; i++)
+	{
+		size_t length = strlen(EFS_STATS_XATTR_PREFIX) + strlen(statistics[i].name) + 1;
+		if(needed + length <= size)
+		{
+			sprintf(buffer + needed, "%s%s", EFS_STATS_XATTR_PREFIX, statistics[i].name);
+		}
+		needed += length;
+	}
+	unsigned int numWorkers = atomic_load(&stats->workers) != NULL ? stats->numWorkers : 0;
+	for(unsigned int worker = 0; worker < numWorkers; worker++)
+	{
+		for(size_t i = 0; i < NUM_WORKER_STATISTICS; i++)
+		{
+			char name[64];
+			size_t length = snprintf(name, sizeof(name), "%sworker%u_%s",
+				EFS_STATS_XATTR_PREFIX, worker, workerStatistics[i]) + 1;
+			if(needed + length <= size)
+			{
+				memcpy(buffer + needed, name, length);
+			}
+			needed += length;
+		}
+	}
+	return needed;
+}
@@ -0,0 +1,385 @@
+#ifndef __EFSFUSE_STATS
+#define __EFSFUSE_STATS
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The prefix of the extended attribute names used to expose statistics.
+ * Statistics are read with getxattr on the root directory of the mount,
+ * e.g. `getfattr -n user.efs.descriptor_pages_dirtied MOUNTPOINT`.
+ */
+#define EFS_STATS_XATTR_PREFIX "user.efs."
+
+/**
+ * Counters describing a single thread of the worker pool. Each is only
+ * written by its own thread, and is kept on its own cache line.
+ */
+typedef struct efs_worker_stats
+{
+	/**
+	 * The number of requests the worker has processed.
+	 */
+	atomic_uint_fast64_t requests;
+
+	/**
+	 * The time in nanoseconds the worker has spent processing requests,
+	 * as opposed to waiting for them.
+	 */
+	atomic_uint_fast64_t busyTime;
+
+	/**
+	 * The monotonic time in nanoseconds at which the worker started.
+	 */
+	uint64_t started;
+
+} __attribute__((aligned(64))) EFSWorkerStats;
+
+/**
+ * Counters describing the behaviour of the filesystem since it was
+ * mounted. Every counter may be updated from any thread.
+ */
+typedef struct efs_stats
+{
+	/**
+	 * The number of times a descriptor slot was modified in memory.
+	 * Without writeback, each of these would have been a page write.
+	 */
+	atomic_uint_fast64_t descriptorPagesDirtied;
+
+	/**
+	 * The number of descriptor pages actually written back to disk.
+	 */
+	atomic_uint_fast64_t descriptorPagesWritten;
+
+	/**
+	 * The number of write calls used to write back descriptor pages.
+	 * Contiguous dirty pages are merged into a single call.
+	 */
+	atomic_uint_fast64_t descriptorWriteCalls;
+
+	/**
+	 * The number of times a descriptor slot's timestamps changed while it
+	 * had no changed timestamps waiting, and were left to be written back
+	 * later instead of dirtying the slot.
+	 */
+	atomic_uint_fast64_t timestampsDeferred;
+
+	/**
+	 * The number of times the writeback thread flushed dirty
+	 * descriptors, whether due to its timer, the dirty threshold, or an
+	 * explicit barrier.
+	 */
+	atomic_uint_fast64_t writebackFlushes;
+
+	/**
+	 * The number of fsync and fsyncdir requests which needed the image
+	 * to be synced.
+	 */
+	atomic_uint_fast64_t fsyncRequests;
+
+	/**
+	 * The number of times the image was actually synced. Concurrent
+	 * fsync requests share a sync, so this may be far smaller than
+	 * fsyncRequests.
+	 */
+	atomic_uint_fast64_t imageSyncs;
+
+	/**
+	 * The number of files and directories currently in the filesystem.
+	 */
+	atomic_uint_fast64_t files;
+
+	/**
+	 * The number of fragments currently allocated across all files.
+	 */
+	atomic_uint_fast64_t fragments;
+
+	/**
+	 * The number of times pending data was given space and written to
+	 * the image by delayed allocation.
+	 */
+	atomic_uint_fast64_t delayedAllocations;
+
+	/**
+	 * The number of bytes copied between files by copy_file_range,
+	 * without passing through the kernel.
+	 */
+	atomic_uint_fast64_t bytesCopiedInImage;
+
+	/**
+	 * The number of passes the defragmenter has completed.
+	 */
+	atomic_uint_fast64_t defragPasses;
+
+	/**
+	 * The number of fragmented files the current defragmenter pass has
+	 * yet to process.
+	 */
+	atomic_uint_fast64_t defragFilesPending;
+
+	/**
+	 * The number of files moved into a single fragment by the
+	 * defragmenter.
+	 */
+	atomic_uint_fast64_t defragFilesRelocated;
+
+	/**
+	 * The number of fragments removed by the defragmenter.
+	 */
+	atomic_uint_fast64_t defragFragmentsReclaimed;
+
+	/**
+	 * The number of bytes of file data copied by the defragmenter,
+	 * including copies which were abandoned.
+	 */
+	atomic_uint_fast64_t defragBytesCopied;
+
+	/**
+	 * The number of file handles currently open.
+	 */
+	atomic_uint_fast64_t openHandles;
+
+	/**
+	 * The number of bytes read from the image ahead of sequential reads.
+	 */
+	atomic_uint_fast64_t readaheadBytes;
+
+	/**
+	 * The number of times queued operations were submitted to the
+	 * io_uring. Concurrent requests share submissions, so this may be
+	 * far smaller than ringOperations.
+	 */
+	atomic_uint_fast64_t ringSubmissions;
+
+	/**
+	 * The number of reads and writes submitted to the io_uring.
+	 */
+	atomic_uint_fast64_t ringOperations;
+
+	/**
+	 * The number of transfers of a striped image whose pieces were
+	 * handed to several member threads at once.
+	 */
+	atomic_uint_fast64_t stripeParallelTransfers;
+
+	/**
+	 * The number of single-member ranges transfers of a striped image
+	 * were split into.
+	 */
+	atomic_uint_fast64_t stripePieces;
+
+	/**
+	 * The number of image pages found in the cache kept for direct
+	 * access.
+	 */
+	atomic_uint_fast64_t imageCacheHits;
+
+	/**
+	 * The number of image pages looked up in the cache kept for direct
+	 * access and read from the image.
+	 */
+	atomic_uint_fast64_t imageCacheMisses;
+
+	/**
+	 * The number of pages partly written with direct access, which had to
+	 * be read first.
+	 */
+	atomic_uint_fast64_t imageReadModifyWrites;
+
+	/**
+	 * The number of distinct filenames held in the name pool.
+	 */
+	atomic_uint_fast64_t namesInterned;
+
+	/**
+	 * The number of descriptors referring to a name in the name pool.
+	 */
+	atomic_uint_fast64_t nameReferences;
+
+	/**
+	 * The bytes allocated for names in the name pool, including the
+	 * header of each name.
+	 */
+	atomic_uint_fast64_t nameBytes;
+
+	/**
+	 * The bytes of names that would have been copied for each descriptor
+	 * sharing a name, had names not been interned.
+	 */
+	atomic_uint_fast64_t nameBytesSaved;
+
+	/**
+	 * The number of files whose data is stored inline in their
+	 * descriptor.
+	 */
+	atomic_uint_fast64_t inlineFiles;
+
+	/**
+	 * The number of reads served from inline data, without reading the
+	 * image.
+	 */
+	atomic_uint_fast64_t inlineReads;
+
+	/**
+	 * The number of units of data stored compressed.
+	 */
+	atomic_uint_fast64_t compressedUnits;
+
+	/**
+	 * The number of bytes of file data stored compressed.
+	 */
+	atomic_uint_fast64_t compressionBytesIn;
+
+	/**
+	 * The number of bytes of the image compressed data was stored in.
+	 */
+	atomic_uint_fast64_t compressionBytesOut;
+
+	/**
+	 * The number of flushes whose data was stored uncompressed because
+	 * compressing it did not save enough space.
+	 */
+	atomic_uint_fast64_t compressionDeclined;
+
+	/**
+	 * The number of compressed fragments rewritten uncompressed so that
+	 * they could be written to.
+	 */
+	atomic_uint_fast64_t compressionExpansions;
+
+	/**
+	 * The number of reads of a compressed unit served from the cache of
+	 * decompressed units.
+	 */
+	atomic_uint_fast64_t decompressCacheHits;
+
+	/**
+	 * The number of compressed units read from the image and
+	 * decompressed.
+	 */
+	atomic_uint_fast64_t decompressCacheMisses;
+
+	/**
+	 * The number of pages read from the image and verified against their
+	 * checksums, by reads or by the scrubber.
+	 */
+	atomic_uint_fast64_t checksumPagesVerified;
+
+	/**
+	 * The number of pages read whose contents did not match their
+	 * checksums.
+	 */
+	atomic_uint_fast64_t checksumFailures;
+
+	/**
+	 * The number of complete passes the scrubber has made over the file
+	 * table.
+	 */
+	atomic_uint_fast64_t scrubPasses;
+
+	/**
+	 * The number of bytes of file data read by the scrubber.
+	 */
+	atomic_uint_fast64_t scrubBytes;
+
+	/**
+	 * The number of pages with no checksum which were given one by the
+	 * scrubber.
+	 */
+	atomic_uint_fast64_t scrubPagesAdopted;
+
+	/**
+	 * The number of extents indexed by contents so that identical data
+	 * written later can share them.
+	 */
+	atomic_uint_fast64_t dedupExtentsIndexed;
+
+	/**
+	 * The number of fragments which were made to share an extent instead
+	 * of holding their own copy of its data.
+	 */
+	atomic_uint_fast64_t dedupFragmentsShared;
+
+	/**
+	 * The number of pages currently saved by sharing extents.
+	 */
+	atomic_uint_fast64_t dedupPagesSaved;
+
+	/**
+	 * The number of shared fragments copied so that they could be
+	 * changed.
+	 */
+	atomic_uint_fast64_t dedupCopies;
+
+	/**
+	 * The number of extents whose checksum matched data being
+	 * deduplicated but whose contents did not.
+	 */
+	atomic_uint_fast64_t dedupCollisions;
+
+	/**
+	 * The number of bytes read while scanning existing files for
+	 * identical extents.
+	 */
+	atomic_uint_fast64_t dedupBytesScanned;
+
+	/**
+	 * The number of requests received from the kernel by pinned workers
+	 * and not yet answered.
+	 */
+	atomic_uint_fast64_t requestsInFlight;
+
+	/**
+	 * The counters of each pinned worker, or NULL if the pool is not
+	 * running. Exposed as worker<N>_requests, worker<N>_busy_ms and
+	 * worker<N>_utilization.
+	 */
+	_Atomic(EFSWorkerStats*) workers;
+
+	/**
+	 * The number of entries in workers.
+	 */
+	unsigned int numWorkers;
+
+} EFSStats;
+
+/**
+ * Formats the value of the named statistic as a decimal string. The
+ * name must include \link EFS_STATS_XATTR_PREFIX \endlink.
+ *
+ * @param stats The statistics to read from
+ * @param name The name of the statistic
+ * @param buffer The location to write the value to. May be null if size
+ * is 0.
+ * @param size The size of buffer
+ * @param length Set to the length of the formatted value
+ *
+ * @returns true if the statistic exists, otherwise false.
+ */
+bool statsFormat(EFSStats* stats, const char* name, char* buffer,
+	size_t size, size_t* length);
+
+/**
+ * Writes the names of all statistics to buffer as a sequence of null
+ * terminated strings, in the format expected by listxattr.
+ *
+ * @param stats The statistics to list
+ * @param buffer The location to write the names to. May be null if size
+ * is 0.
+ * @param size The size of buffer
+ *
+ * @returns The number of bytes needed to hold every name.
+ */
+size_t statsList(EFSStats* stats, char* buffer, size_t size);
+
+/**
+ * Reads the monotonic clock.
+ *
+ * @returns The current monotonic time in nanoseconds.
+ */
+uint64_t statsNow();
+
+#endif
@@ -0,0 +1,445 @@
+#include "trace.h"
+#include "efsstate.h"
+#include "epoch.h"
+#include "file_table.h"
+
+#include <string.h>
+
+/**
+ * The number the calling thread records operations under, or 0 until it
+ * records its first.
+ */
+static __thread uint16_t localThread = 0;
+
+/**
+ * The time in nanoseconds since recording started.
+ */
+static uint64_t elapsed(Trace* trace)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - trace->started.tv_sec) * 1000000000ULL
+		+ now.tv_nsec - trace->started.tv_nsec;
+}
+
+/**
+ * Writes the record of an operation which was dispatched at time and
+ * finished at end.
+ */
+static void record(EFSState* state, uint64_t time, uint64_t end, TraceOp op,
+	const uint64_t* args, uint8_t numArgs, const char* name)
+{
+	Trace* trace = &state->trace;
+	uint64_t duration = end - time;
+	if(localThread == 0)
+	{
+		localThread = atomic_fetch_add(&trace->threads, 1) + 1;
+	}
+	TraceRecord header;
+	memset(&header, 0, sizeof(header));
+	header.time = time;
+	header.duration = duration < UINT32_MAX ? duration : UINT32_MAX;
+	header.thread = localThread;
+	header.op = op;
+	header.numArgs = numArgs;
+	size_t nameLength = name != NULL ? strlen(name) : 0;
+	header.nameLength = nameLength < UINT16_MAX ? nameLength : UINT16_MAX;
+	pthread_mutex_lock(&trace->lock);
+	if(trace->stream != NULL && !atomic_load(&trace->failed))
+	{
+		bool written = fwrite(&header, sizeof(header), 1, trace->stream) == 1
+			&& fwrite(args, sizeof(uint64_t), numArgs, trace->stream) == numArgs
+			&& fwrite(name, 1, header.nameLength, trace->stream) == header.nameLength;
+		if(!written)
+		{
+			printf("Failed to write to the trace, no more operations will be recorded.\n");
+			atomic_store(&trace->failed, true);
+		}
+		atomic_fetch_add(&trace->numRecords, 1);
+	}
+	pthread_mutex_unlock(&trace->lock);
+}
+
+/**
+ * Finds the inode a name refers to once an operation on it has finished.
+ */
+static uint64_t findResult(EFSState* state, fuse_ino_t parent, const char* name)
+{
+	EPOCH_READ_SECTION(&state->epoch);
+	FileTableNode* node = fileTableFindChild(state->fileTable, parent, name);
+	return node != NULL ? node->fileDescriptor->fileID : 0;
+}
+
+/*
+ * Each operation is recorded once the original has replied. The request
+ * is freed by the reply, so everything needed from it is taken before.
+ * The end is taken as soon as the original returns, so that looking up
+ * the result is not counted in the duration.
+ */
+
+static void traceLookup(fuse_req_t request, fuse_ino_t parent, const char* name)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.lookup(request, parent, name);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { parent, findResult(state, parent, name) };
+	record(state, time, end, TRACE_LOOKUP, args, 2, name);
+}
+
+static void traceGetAttr(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.getattr(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode };
+	record(state, time, end, TRACE_GETATTR, args, 1, NULL);
+}
+
+static void traceSetAttr(fuse_req_t request, fuse_ino_t inode,
+	struct stat* attributes, int toSet, struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	uint64_t args[] = { inode, toSet, attributes->st_size, attributes->st_mode,
+		attributes->st_uid, attributes->st_gid, attributes->st_atime,
+		attributes->st_mtime };
+	state->trace.operations.setattr(request, inode, attributes, toSet, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	record(state, time, end, TRACE_SETATTR, args, 8, NULL);
+}
+
+static void traceOpen(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.open(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->flags, fileInfo->fh };
+	record(state, time, end, TRACE_OPEN, args, 3, NULL);
+}
+
+static void traceCreate(fuse_req_t request, fuse_ino_t parent,
+	const char* name, mode_t mode, struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.create(request, parent, name, mode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { parent, mode, fileInfo->flags,
+		findResult(state, parent, name), fileInfo->fh };
+	record(state, time, end, TRACE_CREATE, args, 5, name);
+}
+
+static void traceMkdir(fuse_req_t request, fuse_ino_t parent,
+	const char* name, mode_t mode)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.mkdir(request, parent, name, mode);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { parent, mode, findResult(state, parent, name) };
+	record(state, time, end, TRACE_MKDIR, args, 3, name);
+}
+
+static void traceUnlink(fuse_req_t request, fuse_ino_t parent,
+	const char* name)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.unlink(request, parent, name);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { parent };
+	record(state, time, end, TRACE_UNLINK, args, 1, name);
+}
+
+static void traceRmdir(fuse_req_t request, fuse_ino_t parent,
+	const char* name)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.rmdir(request, parent, name);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { parent };
+	record(state, time, end, TRACE_RMDIR, args, 1, name);
+}
+
+static void traceOpenDir(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.opendir(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->flags, fileInfo->fh };
+	record(state, time, end, TRACE_OPENDIR, args, 3, NULL);
+}
+
+static void traceReadDir(fuse_req_t request, fuse_ino_t inode, size_t size,
+	off_t offset, struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.readdir(request, inode, size, offset, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, size, offset };
+	record(state, time, end, TRACE_READDIR, args, 4, NULL);
+}
+
+static void traceReleaseDir(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.releasedir(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh };
+	record(state, time, end, TRACE_RELEASEDIR, args, 2, NULL);
+}
+
+static void traceStatFs(fuse_req_t request, fuse_ino_t inode)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.statfs(request, inode);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode };
+	record(state, time, end, TRACE_STATFS, args, 1, NULL);
+}
+
+static void traceRelease(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh };
+	state->trace.operations.release(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	record(state, time, end, TRACE_RELEASE, args, 2, NULL);
+}
+
+static void traceRead(fuse_req_t request, fuse_ino_t inode, size_t size,
+	off_t offset, struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.read(request, inode, size, offset, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, size, offset };
+	record(state, time, end, TRACE_READ, args, 4, NULL);
+}
+
+static void traceWrite(fuse_req_t request, fuse_ino_t inode,
+	const char* buffer, size_t size, off_t offset,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.write(request, inode, buffer, size, offset, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, size, offset };
+	record(state, time, end, TRACE_WRITE, args, 4, NULL);
+}
+
+static void traceFallocate(fuse_req_t request, fuse_ino_t inode, int mode,
+	off_t offset, off_t length, struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.fallocate(request, inode, mode, offset, length, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, mode, offset, length };
+	record(state, time, end, TRACE_FALLOCATE, args, 5, NULL);
+}
+
+static void traceCopyFileRange(fuse_req_t request, fuse_ino_t inodeIn,
+	off_t offsetIn, struct fuse_file_info* fileInfoIn, fuse_ino_t inodeOut,
+	off_t offsetOut, struct fuse_file_info* fileInfoOut, size_t length,
+	int flags)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.copy_file_range(request, inodeIn, offsetIn,
+		fileInfoIn, inodeOut, offsetOut, fileInfoOut, length, flags);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inodeIn, fileInfoIn->fh, offsetIn, inodeOut,
+		fileInfoOut->fh, offsetOut, length, flags };
+	record(state, time, end, TRACE_COPY_FILE_RANGE, args, 8, NULL);
+}
+
+static void traceGetXattr(fuse_req_t request, fuse_ino_t inode,
+	const char* name, size_t size)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.getxattr(request, inode, name, size);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, size };
+	record(state, time, end, TRACE_GETXATTR, args, 2, name);
+}
+
+static void traceListXattr(fuse_req_t request, fuse_ino_t inode, size_t size)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.listxattr(request, inode, size);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, size };
+	record(state, time, end, TRACE_LISTXATTR, args, 2, NULL);
+}
+
+static void traceSyncDir(fuse_req_t request, fuse_ino_t inode, int datasync,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.fsyncdir(request, inode, datasync, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, datasync };
+	record(state, time, end, TRACE_FSYNCDIR, args, 3, NULL);
+}
+
+static void traceSync(fuse_req_t request, fuse_ino_t inode, int datasync,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.fsync(request, inode, datasync, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh, datasync };
+	record(state, time, end, TRACE_FSYNC, args, 3, NULL);
+}
+
+static void traceFlush(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.flush(request, inode, fileInfo);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh };
+	record(state, time, end, TRACE_FLUSH, args, 2, NULL);
+}
+
+static void tracePoll(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo, struct fuse_pollhandle* pollHandle)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.poll(request, inode, fileInfo, pollHandle);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh };
+	record(state, time, end, TRACE_POLL, args, 2, NULL);
+}
+
+static void traceAccess(fuse_req_t request, fuse_ino_t inode, int mask)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.access(request, inode, mask);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, mask };
+	record(state, time, end, TRACE_ACCESS, args, 2, NULL);
+}
+
+static void traceGetLock(fuse_req_t request, fuse_ino_t inode,
+	struct fuse_file_info* fileInfo, struct flock* lock)
+{
+	EFSState* state = fuse_req_userdata(request);
+	uint64_t time = elapsed(&state->trace);
+	state->trace.operations.getlk(request, inode, fileInfo, lock);
+	uint64_t end = elapsed(&state->trace);
+	uint64_t args[] = { inode, fileInfo->fh };
+	record(state, time, end, TRACE_GETLK, args, 2, NULL);
+}
+
+/**
+ * Replaces an entry of the operations table with the one recording it,
+ * if the filesystem implements it.
+ */
+#define TRACE_REPLACE(field, function) \
+	if(operations->field != NULL) \
+	{ \
+		operations->field = function; \
+	}
+
+bool traceStart(EFSState* state, const char* path,
+	struct fuse_lowlevel_ops* operations)
+{
+	Trace* trace = &state->trace;
+	trace->stream = fopen(path, "wb");
+	if(trace->stream == NULL)
+	{
+		printf("Failed to create the trace %s.\n", path);
+		return false;
+	}
+	pthread_mutex_init(&trace->lock, NULL);
+	atomic_init(&trace->threads, 0);
+	atomic_init(&trace->numRecords, 0);
+	atomic_init(&trace->failed, false);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &trace->started);
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(TraceRecord);
+	header.started = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if(fwrite(&header, sizeof(header), 1, trace->stream) != 1)
+	{
+		printf("Failed to write to the trace %s.\n", path);
+		fclose(trace->stream);
+		trace->stream = NULL;
+		return false;
+	}
+
+	trace->operations = *operations;
+	TRACE_REPLACE(lookup, traceLookup);
+	TRACE_REPLACE(getattr, traceGetAttr);
+	TRACE_REPLACE(setattr, traceSetAttr);
+	TRACE_REPLACE(open, traceOpen);
+	TRACE_REPLACE(create, traceCreate);
+	TRACE_REPLACE(mkdir, traceMkdir);
+	TRACE_REPLACE(unlink, traceUnlink);
+	TRACE_REPLACE(rmdir, traceRmdir);
+	TRACE_REPLACE(opendir, traceOpenDir);
+	TRACE_REPLACE(readdir, traceReadDir);
+	TRACE_REPLACE(releasedir, traceReleaseDir);
+	TRACE_REPLACE(statfs, traceStatFs);
+	TRACE_REPLACE(release, traceRelease);
+	TRACE_REPLACE(read, traceRead);
+	TRACE_REPLACE(write, traceWrite);
+	TRACE_REPLACE(fallocate, traceFallocate);
+	TRACE_REPLACE(copy_file_range, traceCopyFileRange);
+	TRACE_REPLACE(getxattr, traceGetXattr);
+	TRACE_REPLACE(listxattr, traceListXattr);
+	TRACE_REPLACE(fsyncdir, traceSyncDir);
+	TRACE_REPLACE(fsync, traceSync);
+	TRACE_REPLACE(flush, traceFlush);
+	TRACE_REPLACE(poll, tracePoll);
+	TRACE_REPLACE(access, traceAccess);
+	TRACE_REPLACE(getlk, traceGetLock);
+	printf("Recording operations to %s.\n", path);
+	return true;
+}
+
+void traceStop(EFSState* state)
+{
+	Trace* trace = &state->trace;
+	if(trace->stream == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&trace->lock);
+	bool closed = fclose(trace->stream) == 0;
+	trace->stream = NULL;
+	pthread_mutex_unlock(&trace->lock);
+	printf("Recorded %llu operations%s.\n",
+		(unsigned long long) atomic_load(&trace->numRecords),
+		closed && !atomic_load(&trace->failed) ? "" : ", but the trace is incomplete");
+	pthread_mutex_destroy(&trace->lock);
+}
@@ -0,0 +1,234 @@
+#ifndef __EFSFUSE_TRACE
+#define __EFSFUSE_TRACE
+
+#define FUSE_USE_VERSION 312
+
+#include <fuse3/fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+struct efs_state;
+
+/**
+ * The first bytes of a trace, without a terminator.
+ */
+#define TRACE_MAGIC "EFSTRACE"
+
+/**
+ * The version of the format records are written in. Changed whenever
+ * the arguments recorded for an operation change.
+ */
+#define TRACE_VERSION 1
+
+/**
+ * The most arguments any operation records.
+ */
+#define TRACE_MAX_ARGS 8
+
+/**
+ * The operations a trace records, each listed with the arguments recorded
+ * for it. Handles are the fh the filesystem gave the file or directory
+ * when it was opened, and results the inode a name was found or created
+ * as, or 0 if there was none.
+ */
+typedef enum trace_op
+{
+	/** parent, result; followed by the name */
+	TRACE_LOOKUP = 1,
+	/** inode */
+	TRACE_GETATTR,
+	/** inode, toSet, size, mode, uid, gid, atime, mtime */
+	TRACE_SETATTR,
+	/** inode, flags, handle */
+	TRACE_OPEN,
+	/** parent, mode, flags, result, handle; followed by the name */
+	TRACE_CREATE,
+	/** parent, mode, result; followed by the name */
+	TRACE_MKDIR,
+	/** parent; followed by the name */
+	TRACE_UNLINK,
+	/** parent; followed by the name */
+	TRACE_RMDIR,
+	/** inode, flags, handle */
+	TRACE_OPENDIR,
+	/** inode, handle, size, offset */
+	TRACE_READDIR,
+	/** inode, handle */
+	TRACE_RELEASEDIR,
+	/** inode */
+	TRACE_STATFS,
+	/** inode, handle */
+	TRACE_RELEASE,
+	/** inode, handle, size, offset */
+	TRACE_READ,
+	/** inode, handle, size, offset */
+	TRACE_WRITE,
+	/** inode, handle, mode, offset, length */
+	TRACE_FALLOCATE,
+	/** inodeIn, handleIn, offsetIn, inodeOut, handleOut, offsetOut, length, flags */
+	TRACE_COPY_FILE_RANGE,
+	/** inode, size; followed by the name */
+	TRACE_GETXATTR,
+	/** inode, size */
+	TRACE_LISTXATTR,
+	/** inode, handle, datasync */
+	TRACE_FSYNCDIR,
+	/** inode, handle, datasync */
+	TRACE_FSYNC,
+	/** inode, handle */
+	TRACE_FLUSH,
+	/** inode, handle */
+	TRACE_POLL,
+	/** inode, mask */
+	TRACE_ACCESS,
+	/** inode, handle */
+	TRACE_GETLK,
+	TRACE_NUM_OPS
+
+} TraceOp;
+
+/**
+ * The start of a trace.
+ */
+typedef struct trace_header
+{
+	/**
+	 * Always \link TRACE_MAGIC \endlink.
+	 */
+	char magic[8];
+
+	/**
+	 * The version of the format the trace is written in.
+	 */
+	uint32_t version;
+
+	/**
+	 * The size of each trace_record, which precedes its arguments.
+	 */
+	uint32_t recordSize;
+
+	/**
+	 * When recording started, in nanoseconds since the epoch.
+	 */
+	uint64_t started;
+
+} TraceHeader;
+
+/**
+ * One operation dispatched by the session. Followed in the trace by its
+ * arguments, then by its name if it has one, without a terminator.
+ * Records are written as operations finish, so they are not in order of
+ * time.
+ */
+typedef struct trace_record
+{
+	/**
+	 * When the operation was dispatched, in nanoseconds since recording
+	 * started.
+	 */
+	uint64_t time;
+
+	/**
+	 * The time in nanoseconds the filesystem took to process and reply
+	 * to the operation, or UINT32_MAX if it took longer.
+	 */
+	uint32_t duration;
+
+	/**
+	 * The thread which processed the operation, numbered from 1 in the
+	 * order threads first recorded an operation.
+	 */
+	uint16_t thread;
+
+	/**
+	 * The number of bytes of the name, or 0 if there is none.
+	 */
+	uint16_t nameLength;
+
+	/**
+	 * The operation, one of \link trace_op \endlink.
+	 */
+	uint8_t op;
+
+	/**
+	 * The number of 64-bit arguments following the record.
+	 */
+	uint8_t numArgs;
+
+	uint8_t reserved[6];
+
+} TraceRecord;
+
+/**
+ * The recorder of the operations dispatched to the filesystem. While it
+ * runs, each entry of the operations table is replaced by one that calls
+ * the original and records it.
+ */
+typedef struct trace
+{
+	/**
+	 * The file records are written to, or NULL if nothing is recorded.
+	 */
+	FILE* stream;
+
+	/**
+	 * Held while a record is written, so records are not interleaved.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * When recording started, by the monotonic clock.
+	 */
+	struct timespec started;
+
+	/**
+	 * The number of threads which have recorded an operation.
+	 */
+	atomic_uint threads;
+
+	/**
+	 * The number of records written.
+	 */
+	atomic_uint_fast64_t numRecords;
+
+	/**
+	 * Set once a record could not be written, after which nothing more is
+	 * recorded.
+	 */
+	atomic_bool failed;
+
+	/**
+	 * The operations the filesystem implements, called by those which
+	 * record them.
+	 */
+	struct fuse_lowlevel_ops operations;
+
+} Trace;
+
+/**
+ * Creates a trace file and starts recording every operation of a table.
+ * Must be called before a session is created with the table.
+ *
+ * @param state The current filesystem state
+ * @param path The path of the trace file to create
+ * @param operations The operations table, each of whose entries is
+ * replaced by one which records the operation
+ *
+ * @returns true upon success, false if the file could not be created.
+ */
+bool traceStart(struct efs_state* state, const char* path,
+	struct fuse_lowlevel_ops* operations);
+
+/**
+ * Stops recording and closes the trace file. Does nothing if no trace was
+ * started. No operation may be dispatched afterwards.
+ *
+ * @param state The current filesystem state
+ */
+void traceStop(struct efs_state* state);
+
+#endif
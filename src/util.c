@@ -1,4 +1,6 @@
 #include "util.h"
+#include "image_io.h"
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,26 +8,25 @@
 #include <EFS/file_descriptor_node.h>
 #include <EFS/free_space_node.h>
 
-void genFileAttributes(EFSCompactFileDescriptor* file, 
-	struct stat* attributes)
+void genFileAttributes(FileRecord* file, struct stat* attributes)
 {
 	if(file == NULL || attributes == NULL)
 	{
 		return;
 	}
-	memset(attributes, 0, sizeof(attributes));
-	attributes->st_ino = file->fileID;
+	memset(attributes, 0, sizeof(*attributes));
+	attributes->st_ino = file->inode;
 	/* 
 	 * Currently, EFS does not support hard links. The filesystem assumes
 	 * that any given descriptor is the only one corresponding to a
 	 * particular inode.
 	 */
 	attributes->st_nlink = 1;
-	attributes->st_uid = file->ownerUUID;
-	attributes->st_gid = file->groupUUID;
-	attributes->st_size = file->filesize;
-	attributes->st_atime = file->lastAccessed;
-	attributes->st_mtime = file->lastModified;
+	attributes->st_uid = file->uid;
+	attributes->st_gid = file->gid;
+	attributes->st_size = file->size;
+	attributes->st_atime = file->accessed;
+	attributes->st_mtime = file->modified;
 	/*
 	 * EFS does not currently track the time of the last status change.
 	 */
@@ -35,25 +36,26 @@ void genFileAttributes(EFSCompactFileDescriptor* file,
 	 * The total number of blocks a file should occupy is its filesize
 	 * divided by the blocksize rounded up to the nearest integer.
 	 */
-	attributes->st_blocks =	  (file->filesize / PAGE_SIZE)
-							+ (file->filesize % PAGE_SIZE > 0 ? 1 : 0) + 1;
-	attributes->st_mode =	  file->isLink == 1 ? S_IFLNK 
-								: (file->isFile == 1 ? S_IFREG 
-								: S_IFDIR)
-							| (file->ownerRead == 1 ? S_IRUSR : 0)
-							| (file->ownerWrite == 1 ? S_IWUSR : 0)
-							| (file->ownerExecute == 1 ? S_IXUSR : 0)
-							| (file->groupRead == 1 ? S_IRGRP : 0)
-							| (file->groupWrite == 1 ? S_IWGRP : 0)
-							| (file->groupExecute == 1 ? S_IXGRP : 0)
-							| (file->othersRead == 1 ? S_IROTH : 0)
-							| (file->othersWrite == 1 ? S_IWOTH : 0)
-							| (file->othersExecute == 1 ? S_IXOTH : 0);
+	attributes->st_blocks =	  (file->size / PAGE_SIZE)
+							+ (file->size % PAGE_SIZE > 0 ? 1 : 0) + 1;
+	attributes->st_mode = file->mode;
 }
 
-void compactFileDescriptor(EFSFileDescriptor* src, 
-	EFSCompactFileDescriptor* dest)
+void setFilePermissions(EFSCompactFileDescriptor* file, mode_t mode)
+{
+	file->ownerRead = (mode & S_IRUSR) != 0;
+	file->ownerWrite = (mode & S_IWUSR) != 0;
+	file->ownerExecute = (mode & S_IXUSR) != 0;
+	file->groupRead = (mode & S_IRGRP) != 0;
+	file->groupWrite = (mode & S_IWGRP) != 0;
+	file->groupExecute = (mode & S_IXGRP) != 0;
+	file->othersRead = (mode & S_IROTH) != 0;
+	file->othersWrite = (mode & S_IWOTH) != 0;
+	file->othersExecute = (mode & S_IXOTH) != 0;
+}
 
+bool compactFileDescriptor(NamePool* names, EFSFileDescriptor* src, 
+	EFSCompactFileDescriptor* dest)
 {
 	dest->fileID = src->fileID;
 	dest->isFile = src->isFile;
@@ -73,8 +75,12 @@ void compactFileDescriptor(EFSFileDescriptor* src,
 	dest->lastAccessed = src->lastAccessed;
 	dest->lastModified = src->lastModified;
 	dest->filesize = src->filesize;
-	dest->filename = malloc(strlen(src->filename + 1));
-	memcpy(dest->filename, src->filename, strlen(src->filename) + 1);
+	/*
+	 * The name on disk is not necessarily terminated if it fills the
+	 * whole field.
+	 */
+	src->filename[EFS_MAX_FILENAME] = '\0';
+	dest->filename = namePoolIntern(names, src->filename);
 	int fragmentCount = 0;
 	while(src->fragments[fragmentCount].fragmentLocation != 0)
 	{
@@ -82,44 +88,146 @@ void compactFileDescriptor(EFSFileDescriptor* src,
 	}
 	dest->fragments = malloc(sizeof(EFSFragmentDescriptor) * fragmentCount);
 	dest->numFragments = fragmentCount;
+	if(dest->filename == NULL || (dest->fragments == NULL && fragmentCount > 0))
+	{
+		internedNameRelease(dest->filename);
+		free(dest->fragments);
+		return false;
+	}
+	memcpy(dest->fragments, src->fragments, sizeof(EFSFragmentDescriptor) * fragmentCount);
+	return true;
+}
+
+void destroyFileDescriptor(void* descriptor)
+{
+	EFSCompactFileDescriptor* file = descriptor;
+	internedNameRelease(file->filename);
+	free(file->fragments);
+	free(file);
+}
+
+void expandFileDescriptor(EFSCompactFileDescriptor* src,
+	EFSFileDescriptor* dest)
+{
+	memset(dest, 0, sizeof(EFSFileDescriptor));
+	dest->fileID = src->fileID;
+	dest->isFile = src->isFile;
+	dest->isLink = src->isLink;
+	dest->ownerRead = src->ownerRead;
+	dest->ownerWrite = src->ownerWrite;
+	dest->ownerExecute = src->ownerExecute;
+	dest->groupRead = src->groupRead;
+	dest->groupWrite = src->groupWrite;
+	dest->groupExecute = src->groupExecute;
+	dest->othersRead = src->othersRead;
+	dest->othersWrite = src->othersWrite;
+	dest->othersExecute = src->othersExecute;
+	dest->ownerUUID = src->ownerUUID;
+	dest->groupUUID = src->groupUUID;
+	dest->parentID = src->parentID;
+	dest->lastAccessed = src->lastAccessed;
+	dest->lastModified = src->lastModified;
+	dest->filesize = src->filesize;
+	strncpy(dest->filename, src->filename, sizeof(dest->filename) - 1);
+	/*
+	 * The list of fragments on disk is terminated by a fragment at page
+	 * 0, so the last entry must always be left empty.
+	 */
+	uint64_t fragmentCount = src->numFragments < EFS_MAX_FRAGMENTS
+		? src->numFragments : EFS_MAX_FRAGMENTS - 1;
 	memcpy(dest->fragments, src->fragments, sizeof(EFSFragmentDescriptor) * fragmentCount);
 }
 
+InlineData* readInlineData(EFSFileDescriptor* src)
+{
+	char* page = (char*) src;
+	uint32_t header[2];
+	memcpy(header, page + EFS_INLINE_OFFSET, sizeof(header));
+	if(header[0] != EFS_INLINE_MAGIC || header[1] != src->filesize
+		|| header[1] > EFS_INLINE_CAPACITY || src->fragments[0].fragmentLocation != 0)
+	{
+		return NULL;
+	}
+	InlineData* data = malloc(sizeof(InlineData) + header[1]);
+	if(data != NULL)
+	{
+		data->size = header[1];
+		memcpy(data->data, page + EFS_INLINE_OFFSET + sizeof(header), header[1]);
+	}
+	return data;
+}
+
+void writeInlineData(InlineData* src, EFSFileDescriptor* dest)
+{
+	char* page = (char*) dest;
+	uint32_t header[2] = { EFS_INLINE_MAGIC, src->size };
+	memcpy(page + EFS_INLINE_OFFSET, header, sizeof(header));
+	memcpy(page + EFS_INLINE_OFFSET + sizeof(header), src->data, src->size);
+}
+
 FileTable* readFileTable(EFSState* state)
 {
 	FileTable* table = constructFileTable();
+	DescriptorTable* descriptorTable = constructDescriptorTable();
 	EFSFileDescriptorNode* node = malloc(sizeof(EFSFileDescriptorNode));
+	EFSFileDescriptor* descriptorPage = malloc(sizeof(EFSFileDescriptor));
 	int nextNode = state->fileDescriptorList;
 	while(nextNode != 0)
 	{
 		printf("Block of file descriptors at page %d.\n", nextNode);
-		fseek(state->filesystemStream, PAGE_SIZE * nextNode, SEEK_SET);
-		fread(node, PAGE_SIZE, 1, state->filesystemStream);
+		imageRead(state, node, PAGE_SIZE, (uint64_t) PAGE_SIZE * nextNode);
 		printf("There are %d entries in this block.\n", node->numFileDescriptors);
-		for(int i = 1; i < 256; i++)
+		DescriptorTableNode* descriptorNode = descriptorTableInsert(descriptorTable,
+			descriptorTable->last, nextNode);
+		if(descriptorNode == NULL)
 		{
-			EFSFileDescriptor* descriptorPage = malloc(sizeof(EFSFileDescriptor));
-			fseek(state->filesystemStream, PAGE_SIZE * nextNode + PAGE_SIZE * i, SEEK_SET);
-			fread(descriptorPage, PAGE_SIZE, 1, state->filesystemStream);
+			return NULL;
+		}
+		for(int i = 1; i < FT_NODE_SIZE; i++)
+		{
+			imageRead(state, descriptorPage, PAGE_SIZE, (uint64_t) PAGE_SIZE * (nextNode + i));
 			if(descriptorPage->fileID != 0)
 			{
-				EFSCompactFileDescriptor* descriptor = malloc(sizeof(EFSFileDescriptor));
-				compactFileDescriptor(descriptorPage, descriptor);
-				if(fileTableInsert(table, table->last, descriptor) == NULL)
+				EFSCompactFileDescriptor* descriptor = malloc(sizeof(EFSCompactFileDescriptor));
+				if(descriptor == NULL
+					|| !compactFileDescriptor(&state->namePool, descriptorPage, descriptor))
+				{
+					return NULL;
+				}
+				FileTableNode* fileNode = fileTableInsert(table, table->last, descriptor);
+				if(fileNode == NULL)
 				{
 					return NULL;
 				}
+				fileNode->descriptorNode = descriptorNode;
+				fileNode->descriptorSlot = i;
+				descriptorTableNodeStore(descriptorNode, i, descriptor);
+				if(descriptor->numFragments == 0 && descriptor->filesize > 0)
+				{
+					descriptorNode->inlineData[i] = readInlineData(descriptorPage);
+					if(descriptorNode->inlineData[i] != NULL)
+					{
+						atomic_fetch_add(&state->stats.inlineFiles, 1);
+					}
+				}
+				atomic_fetch_add(&state->stats.files, 1);
+				atomic_fetch_add(&state->stats.fragments, descriptor->numFragments);
+				if(descriptor->fileID >= state->nextFileID)
+				{
+					state->nextFileID = descriptor->fileID + 1;
+				}
 			}
-			free(descriptorPage);
 		}
 		nextNode = node->next;
 	}
+	free(descriptorPage);
 	free(node);
 	state->fileTable = table;
+	state->descriptorTable = descriptorTable;
 	return table;
 }
 
-FreeSpaceTable* readFreeSpaceTable(EFSState* state)
+bool readFreeSpaceTable(EFSState* state)
 {
 	FreeSpaceTable* table = constructFreeSpaceTable();
 	if(table != NULL)
@@ -130,23 +238,28 @@ FreeSpaceTable* readFreeSpaceTable(EFSState* state)
 			int nextNode = state->freeRegionList;
 			while(nextNode != 0)
 			{
-				fseek(state->filesystemStream, PAGE_SIZE * nextNode, SEEK_SET);
-				fread(node, PAGE_SIZE, 1, state->filesystemStream);
+				imageRead(state, node, PAGE_SIZE, (uint64_t) PAGE_SIZE * nextNode);
 				printf("Region of free space at page %d with size %d\n", nextNode, node->size);
 				if(freeSpaceTableInsert(table, table->last, nextNode, node->size) == NULL)
 				{
-					return NULL;
+					return false;
 				}
 				nextNode = node->next;
 			}
 			free(node);
-			state->freeSpaceTable = table;
+			if(!allocationGroupsInit(&state->allocationGroups, table,
+				state->filesystemSize, state->options.allocGroups))
+			{
+				return false;
+			}
+			printf("Free space split into %zu allocation groups of %" PRIu64 " pages.\n",
+				state->allocationGroups.numGroups, state->allocationGroups.groupSize);
+			return true;
 		}
 		else
 		{
 			free(table);
-			return NULL;
 		}
 	}
-	return table;
+	return false;
 }
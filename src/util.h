@@ -1,7 +1,7 @@
 #ifndef __EFSFUSE_UTIL
 #define __EFSFUSE_UTIL
 
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
 #include <EFS/file_descriptor.h>
 #include <fuse3/fuse_lowlevel.h>
@@ -12,31 +12,118 @@
 #include "efsstate.h"
 
 /**
- * Read file attributes from the given descriptor, and writes them to a
- * stat structure. Sets st_dev, st_rdev, and st_ctime to 0. If either
- * parameter is a null pointer, this function returns without doing
- * anything.
+ * The maximum number of fragments that can be stored in a file descriptor
+ * on disk.
+ */
+#define EFS_MAX_FRAGMENTS (sizeof(((EFSFileDescriptor*) 0)->fragments) \
+	/ sizeof(EFSFragmentDescriptor))
+
+/**
+ * The maximum length of a filename, excluding the null terminator, that
+ * can be stored in a file descriptor on disk.
+ */
+#define EFS_MAX_FILENAME (sizeof(((EFSFileDescriptor*) 0)->filename) - 1)
+
+/**
+ * The offset within a descriptor on disk of the data of a file stored
+ * inline. A file with inline data has no fragments, so everything past
+ * the first entry of its list of fragments, which terminates the list, is
+ * unused.
+ */
+#define EFS_INLINE_OFFSET (offsetof(EFSFileDescriptor, fragments) \
+	+ sizeof(EFSFragmentDescriptor))
+
+/**
+ * Identifies inline data in a descriptor on disk. Stored as the first of
+ * two 32-bit words before the data, followed by its size.
+ */
+#define EFS_INLINE_MAGIC 0x494C4E45
+
+/**
+ * The largest file whose data fits inline in its descriptor.
+ */
+#define EFS_INLINE_CAPACITY (PAGE_SIZE - EFS_INLINE_OFFSET - 2 * sizeof(uint32_t))
+
+/**
+ * Read file attributes from the given record, and writes them to a stat
+ * structure. Sets st_dev, st_rdev, and st_ctime to 0. If either parameter
+ * is a null pointer, this function returns without doing anything.
  * 
- * @param file The descriptor to read from
+ * @param file The record to read from. Must not be used by another file
+ * while this is called, so the file's lock must be held and the file must
+ * still be in its table.
  * @param attributes The stat structure to write to
  */
-void genFileAttributes(EFSCompactFileDescriptor* file, 
-	struct stat* attributes);
+void genFileAttributes(FileRecord* file, struct stat* attributes);
+
+/**
+ * Sets the permission flags of the given descriptor from the permission
+ * bits of a mode. The file type bits of the mode are ignored.
+ * 
+ * @param file The descriptor to update
+ * @param mode The mode to read permissions from
+ */
+void setFilePermissions(EFSCompactFileDescriptor* file, mode_t mode);
 
 /**
  * Copies all data from a file descriptor into a more compact structure
  * which stores similar data, but does not match the format of a file
- * descriptor as it is stored on disk.
+ * descriptor as it is stored on disk. The filename is interned, so that
+ * files with the same name share one copy of it.
  * 
+ * @param names The pool to intern the filename into
  * @param src The padded version to read from
  * @param dest The compact version to write to
+ * 
+ * @returns true upon success, false if memory could not be allocated.
  */
-void compactFileDescriptor(EFSFileDescriptor* src, 
+bool compactFileDescriptor(NamePool* names, EFSFileDescriptor* src, 
 	EFSCompactFileDescriptor* dest);
+
+/**
+ * Deallocates a compact file descriptor along with its fragments, and
+ * releases its interned filename. Takes a void pointer so that it can be passed to epochRetire.
+ * 
+ * @param descriptor The compact file descriptor to deallocate
+ */
+void destroyFileDescriptor(void* descriptor);
+
+/**
+ * Copies all data from a compact file descriptor into a file descriptor
+ * in the format it is stored on disk. The destination is cleared first,
+ * so unused space in it is always zero.
+ * 
+ * @param src The compact version to read from
+ * @param dest The padded version to write to
+ */
+void expandFileDescriptor(EFSCompactFileDescriptor* src,
+	EFSFileDescriptor* dest);
 	
+/**
+ * Reads the inline data of a file from its descriptor on disk.
+ * 
+ * @param src The descriptor to read from, which must be a whole page
+ * 
+ * @returns A new copy of the data, to be deallocated with free. NULL if
+ * the descriptor holds no inline data matching the size of the file, or
+ * memory could not be allocated.
+ */
+InlineData* readInlineData(EFSFileDescriptor* src);
+
+/**
+ * Writes the inline data of a file into its descriptor on disk. The
+ * descriptor must have been expanded from a file with no fragments.
+ * 
+ * @param src The data to write
+ * @param dest The descriptor to write to, which must be a whole page
+ */
+void writeInlineData(InlineData* src, EFSFileDescriptor* dest);
+
 /**
  * Constructs a table containing the file descriptor of every file in the
  * filesystem, and sets the file table pointer the the filesystem state.
+ * Also constructs the descriptor table, recording which slot of which
+ * descriptor node each descriptor was read from.
  * 
  * @param state The current filesystem state
  * 
@@ -46,14 +133,14 @@ void compactFileDescriptor(EFSFileDescriptor* src,
 FileTable* readFileTable(EFSState* state);
 
 /**
- * Constructs a table containing the size and location of every region of free
- * space in the filesystem, and set the free space pointer in the filesystem
+ * Reads the size and location of every region of free space in the
+ * filesystem, and splits them into the allocation groups of the filesystem
  * state.
  * 
  * @param state The current filesystem state
  * 
- * @returns A pointer to the free space table. Null upon failure.
+ * @returns true upon success, false upon failure.
  */
-FreeSpaceTable* readFreeSpaceTable(EFSState* state);
+bool readFreeSpaceTable(EFSState* state);
 
 #endif
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
+
+#include "worker_pool.h"
+#include "efsstate.h"
+
+#include <errno.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * The time a thread waiting for the pool to stop sleeps before checking
+ * whether the session has been asked to exit. A signal only interrupts
+ * the thread it is delivered to, so the waiting thread may never see it.
+ */
+#define WORKER_POOL_POLL_MS 500
+
+static void freeBuffer(void* buffer)
+{
+	free(((struct fuse_buf*) buffer)->mem);
+}
+
+static void* workerThread(void* data)
+{
+	Worker* worker = data;
+	WorkerPool* pool = worker->pool;
+	EFSStats* stats = &pool->state->stats;
+	EFSWorkerStats* workerStats = &atomic_load(&stats->workers)[worker - pool->workers];
+	struct fuse_buf buffer = { 0 };
+	int result = 0;
+
+	/*
+	 * A worker may only be cancelled while it waits for a request, never
+	 * while it holds locks processing one.
+	 */
+	pthread_cleanup_push(freeBuffer, &buffer);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while(!fuse_session_exited(pool->session))
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		result = fuse_session_receive_buf(pool->session, &buffer);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if(result == -EINTR)
+		{
+			result = 0;
+			continue;
+		}
+		else if(result <= 0)
+		{
+			break;
+		}
+		uint64_t start = statsNow();
+		atomic_fetch_add(&stats->requestsInFlight, 1);
+		fuse_session_process_buf(pool->session, &buffer);
+		atomic_fetch_sub(&stats->requestsInFlight, 1);
+		atomic_fetch_add(&workerStats->busyTime, statsNow() - start);
+		atomic_fetch_add(&workerStats->requests, 1);
+		result = 0;
+	}
+	pthread_cleanup_pop(1);
+
+	worker->result = result;
+	fuse_session_exit(pool->session);
+	pthread_mutex_lock(&pool->lock);
+	pool->numStopped++;
+	pthread_cond_signal(&pool->stopped);
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * Creates a worker pinned to the given CPU.
+ */
+static bool startWorker(WorkerPool* pool, Worker* worker, int cpu)
+{
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setaffinity_np(&attributes, sizeof(cpus), &cpus);
+	worker->pool = pool;
+	worker->cpu = cpu;
+	worker->result = 0;
+	worker->started = pthread_create(&worker->thread, &attributes, workerThread, worker) == 0;
+	pthread_attr_destroy(&attributes);
+	return worker->started;
+}
+
+/**
+ * Waits until any worker stops, or the session is asked to exit.
+ */
+static void waitForStop(WorkerPool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->numStopped == 0 && !fuse_session_exited(pool->session))
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += WORKER_POOL_POLL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&pool->stopped, &pool->lock, &deadline);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int workerPoolRun(EFSState* state, struct fuse_session* session)
+{
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		return -errno;
+	}
+	WorkerPool pool;
+	pool.state = state;
+	pool.session = session;
+	pool.numWorkers = CPU_COUNT(&allowed);
+	pool.numStopped = 0;
+	pool.workers = calloc(pool.numWorkers, sizeof(Worker));
+	EFSWorkerStats* workerStats = aligned_alloc(64, sizeof(EFSWorkerStats) * pool.numWorkers);
+	if(pool.workers == NULL || workerStats == NULL)
+	{
+		free(pool.workers);
+		free(workerStats);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.stopped, NULL);
+	uint64_t started = statsNow();
+	for(unsigned int i = 0; i < pool.numWorkers; i++)
+	{
+		atomic_init(&workerStats[i].requests, 0);
+		atomic_init(&workerStats[i].busyTime, 0);
+		workerStats[i].started = started;
+	}
+	state->stats.numWorkers = pool.numWorkers;
+	atomic_store(&state->stats.workers, workerStats);
+
+	int result = 0;
+	unsigned int worker = 0;
+	for(int cpu = 0; cpu < CPU_SETSIZE && worker < pool.numWorkers; cpu++)
+	{
+		if(CPU_ISSET(cpu, &allowed))
+		{
+			if(!startWorker(&pool, &pool.workers[worker], cpu))
+			{
+				printf("Failed to start worker on CPU %d.\n", cpu);
+				result = -EAGAIN;
+				fuse_session_exit(session);
+				break;
+			}
+			worker++;
+		}
+	}
+	if(result == 0)
+	{
+		printf("Running %u workers pinned to their own CPUs...\n", pool.numWorkers);
+		waitForStop(&pool);
+		fuse_session_exit(session);
+	}
+
+	/*
+	 * The remaining workers are blocked waiting for requests which will
+	 * never arrive, and are cancelled there.
+	 */
+	for(unsigned int i = 0; i < pool.numWorkers; i++)
+	{
+		if(pool.workers[i].started)
+		{
+			pthread_cancel(pool.workers[i].thread);
+		}
+	}
+	for(unsigned int i = 0; i < pool.numWorkers; i++)
+	{
+		if(pool.workers[i].started)
+		{
+			pthread_join(pool.workers[i].thread, NULL);
+			if(result == 0 && pool.workers[i].result < 0 && pool.workers[i].result != -ENODEV)
+			{
+				result = pool.workers[i].result;
+			}
+		}
+	}
+	fuse_session_reset(session);
+
+	atomic_store(&state->stats.workers, NULL);
+	state->stats.numWorkers = 0;
+	pthread_cond_destroy(&pool.stopped);
+	pthread_mutex_destroy(&pool.lock);
+	free(workerStats);
+	free(pool.workers);
+	return result;
+}
@@ -0,0 +1,105 @@
+#ifndef __EFSFUSE_WORKER_POOL
+#define __EFSFUSE_WORKER_POOL
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+struct efs_state;
+struct fuse_session;
+
+/**
+ * A thread of the worker pool, pinned to a single CPU.
+ */
+typedef struct worker
+{
+	/**
+	 * The thread itself.
+	 */
+	pthread_t thread;
+
+	/**
+	 * The CPU the thread runs on.
+	 */
+	int cpu;
+
+	/**
+	 * The pool the thread belongs to.
+	 */
+	struct worker_pool* pool;
+
+	/**
+	 * The result of the last receive, once the thread has stopped. 0 if
+	 * the filesystem was unmounted, otherwise a negative error.
+	 */
+	int result;
+
+	/**
+	 * Set once the thread has been created.
+	 */
+	bool started;
+
+} Worker;
+
+/**
+ * A set of threads, one per CPU the process may run on, which each take
+ * requests from the session and process them on their own CPU. Keeping
+ * a request on one CPU from receipt to reply keeps the per-thread state
+ * it touches, such as epoch records, in that CPU's cache.
+ */
+typedef struct worker_pool
+{
+	/**
+	 * The current filesystem state.
+	 */
+	struct efs_state* state;
+
+	/**
+	 * The session requests are taken from.
+	 */
+	struct fuse_session* session;
+
+	/**
+	 * The workers, one per CPU.
+	 */
+	Worker* workers;
+
+	/**
+	 * The number of entries in workers.
+	 */
+	unsigned int numWorkers;
+
+	/**
+	 * Protects numStopped.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Signalled when a worker stops, to wake the thread waiting in
+	 * workerPoolRun.
+	 */
+	pthread_cond_t stopped;
+
+	/**
+	 * The number of workers which have stopped.
+	 */
+	unsigned int numStopped;
+
+} WorkerPool;
+
+/**
+ * Processes requests from a session with one pinned worker per CPU the
+ * process may run on, until the session is unmounted or exits. Per-worker
+ * counters are exposed through the statistics while the pool runs.
+ *
+ * @param state The current filesystem state
+ * @param session The session to process requests of
+ *
+ * @returns 0 if the session ended normally, otherwise a negative error.
+ */
+int workerPoolRun(struct efs_state* state, struct fuse_session* session);
+
+#endif
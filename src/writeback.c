@@ -0,0 +1,742 @@
+#include "writeback.h"
+#include "allocation_groups.h"
+#include "checksum.h"
+#include "delayed_allocation.h"
+#include "efsstate.h"
+#include "image_io.h"
+#include "util.h"
+
+#include <EFS/file_descriptor_node.h>
+#include <EFS/free_space_node.h>
+#include <EFS/superblock.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static bool slotIsDirty(const uint64_t* bitmap, unsigned int slot)
+{
+	return (bitmap[slot / 64] & (1ULL << (slot % 64))) != 0;
+}
+
+/**
+ * Writes the on-disk form of a single slot of a descriptor node into a
+ * page-sized buffer.
+ */
+static void serializeSlot(DescriptorTableNode* node, unsigned int slot,
+	char* page)
+{
+	memset(page, 0, PAGE_SIZE);
+	if(slot == 0)
+	{
+		EFSFileDescriptorNode* header = (EFSFileDescriptorNode*) page;
+		header->numFileDescriptors = descriptorTableNodeCount(node);
+		header->next = node->next != NULL ? node->next->location : 0;
+	}
+	else if(node->descriptors[slot] != NULL)
+	{
+		/*
+		 * The fragments of a file may be replaced while this runs, since
+		 * the file's lock is not held. Loading the count before the array
+		 * guarantees the array holds at least that many entries.
+		 */
+		EFSCompactFileDescriptor* descriptor = node->descriptors[slot];
+		EFSCompactFileDescriptor snapshot = *descriptor;
+		snapshot.numFragments = __atomic_load_n(&descriptor->numFragments, __ATOMIC_ACQUIRE);
+		snapshot.fragments = __atomic_load_n(&descriptor->fragments, __ATOMIC_ACQUIRE);
+		expandFileDescriptor(&snapshot, (EFSFileDescriptor*) page);
+		InlineData* inlineData = __atomic_load_n(&node->inlineData[slot], __ATOMIC_ACQUIRE);
+		if(inlineData != NULL && snapshot.numFragments == 0)
+		{
+			writeInlineData(inlineData, (EFSFileDescriptor*) page);
+		}
+	}
+}
+
+/**
+ * Marks the region before the first region of each allocation group as
+ * dirty, if that first region has changed. The regions of every group
+ * form a single list on disk, so the pointer to a group's first region is
+ * held by the last region of an earlier group. The pointer held by the
+ * superblock is checked separately. Must be called with every group
+ * locked.
+ */
+static void markGroupHeadsDirty(EFSState* state)
+{
+	AllocationGroups* groups = &state->allocationGroups;
+	FreeSpaceTableNode* previous = NULL;
+	for(size_t i = 0; i < groups->numGroups; i++)
+	{
+		FreeSpaceTable* table = groups->groups[i].table;
+		if(table->headDirty && previous != NULL)
+		{
+			previous->dirty = true;
+		}
+		table->headDirty = false;
+		if(table->last != table->head)
+		{
+			previous = table->last;
+		}
+	}
+}
+
+/**
+ * Rewrites the header of every region of free space that has changed
+ * since the last flush, and the superblock if the first descriptor node
+ * or the first region of free space has changed.
+ */
+static bool flushFreeSpace(EFSState* state)
+{
+	AllocationGroups* groups = &state->allocationGroups;
+	bool success = true;
+	pthread_mutex_lock(&state->metadataLock);
+	allocationGroupsLockAll(groups);
+	markGroupHeadsDirty(state);
+	size_t numDirty = 0;
+	for(size_t g = 0; g < groups->numGroups; g++)
+	{
+		FreeSpaceTableNode* node = groups->groups[g].table->head;
+		while(node->next != NULL)
+		{
+			node = node->next;
+			numDirty += node->dirty ? 1 : 0;
+		}
+	}
+	EFSFreeSpaceNode* headers = numDirty > 0 ? malloc(PAGE_SIZE * numDirty) : NULL;
+	uint64_t* locations = numDirty > 0 ? malloc(sizeof(uint64_t) * numDirty) : NULL;
+	if(numDirty > 0 && (headers == NULL || locations == NULL))
+	{
+		free(headers);
+		free(locations);
+		allocationGroupsUnlockAll(groups);
+		pthread_mutex_unlock(&state->metadataLock);
+		return false;
+	}
+
+	/*
+	 * The successor of a region may lie in a later group, so the pointer
+	 * in each dirty header is filled in when the next region is reached.
+	 */
+	size_t i = 0;
+	EFSFreeSpaceNode* waiting = NULL;
+	uint64_t firstRegion = 0;
+	for(size_t g = 0; g < groups->numGroups; g++)
+	{
+		FreeSpaceTableNode* node = groups->groups[g].table->head;
+		while(node->next != NULL)
+		{
+			node = node->next;
+			if(firstRegion == 0)
+			{
+				firstRegion = node->location;
+			}
+			if(waiting != NULL)
+			{
+				waiting->next = node->location;
+				waiting = NULL;
+			}
+			if(node->dirty)
+			{
+				memset(&headers[i], 0, PAGE_SIZE);
+				headers[i].size = node->size;
+				locations[i] = node->location;
+				node->dirty = false;
+				waiting = &headers[i];
+				i++;
+			}
+		}
+	}
+	if(firstRegion != state->freeRegionList)
+	{
+		state->freeRegionList = firstRegion;
+		state->superblockDirty = true;
+	}
+	allocationGroupsUnlockAll(groups);
+	bool superblockDirty = state->superblockDirty;
+	uint64_t fileDescriptorList = state->fileDescriptorList;
+	uint64_t freeRegionList = state->freeRegionList;
+	state->superblockDirty = false;
+	pthread_mutex_unlock(&state->metadataLock);
+
+	for(i = 0; i < numDirty; i++)
+	{
+		if(!imageWrite(state, &headers[i], PAGE_SIZE, PAGE_SIZE * locations[i]))
+		{
+			printf("Failed to write free space header at page %" PRIu64 ".\n", locations[i]);
+			success = false;
+		}
+	}
+	free(headers);
+	free(locations);
+	if(superblockDirty)
+	{
+		EFSSuperblock superblock;
+		if(imageRead(state, &superblock, sizeof(superblock), 0))
+		{
+			superblock.fileDescriptorTable = fileDescriptorList;
+			superblock.freeSpaceTable = freeRegionList;
+			success = imageWrite(state, &superblock, sizeof(superblock), 0) && success;
+		}
+		else
+		{
+			success = false;
+		}
+	}
+	return success;
+}
+
+void writebackMarkDirty(EFSState* state, DescriptorTableNode* node,
+	unsigned int slot)
+{
+	Writeback* writeback = &state->writeback;
+	atomic_fetch_add(&state->stats.descriptorPagesDirtied, 1);
+	pthread_mutex_lock(&writeback->lock);
+	if(descriptorTableNodeMarkDirty(node, slot))
+	{
+		writeback->numDirty++;
+		if(writeback->numDirty >= writeback->threshold && !writeback->flushRequested)
+		{
+			writeback->flushRequested = true;
+			pthread_cond_signal(&writeback->wake);
+		}
+	}
+	pthread_mutex_unlock(&writeback->lock);
+}
+
+void writebackMarkRemoved(EFSState* state, DescriptorTableNode* node,
+	unsigned int slot, uint64_t parent)
+{
+	Writeback* writeback = &state->writeback;
+	writebackMarkDirty(state, node, slot);
+	writebackMarkDirty(state, node, 0);
+	pthread_mutex_lock(&writeback->lock);
+	if(writeback->numRemoved == writeback->removedCapacity)
+	{
+		size_t capacity = writeback->removedCapacity > 0 ? writeback->removedCapacity * 2 : 64;
+		RemovedSlot* removed = realloc(writeback->removed, sizeof(RemovedSlot) * capacity);
+		if(removed != NULL)
+		{
+			writeback->removed = removed;
+			writeback->removedCapacity = capacity;
+		}
+	}
+	if(writeback->numRemoved < writeback->removedCapacity)
+	{
+		writeback->removed[writeback->numRemoved++] = (RemovedSlot) { parent, node, slot };
+	}
+	else
+	{
+		writeback->removedLost = true;
+	}
+	pthread_mutex_unlock(&writeback->lock);
+}
+
+void writebackMarkTimes(EFSState* state, DescriptorTableNode* node,
+	unsigned int slot)
+{
+	uint64_t bit = 1ULL << (slot % 64);
+	if((__atomic_fetch_or(&node->lazy[slot / 64], bit, __ATOMIC_RELEASE) & bit) == 0)
+	{
+		atomic_fetch_add(&state->stats.timestampsDeferred, 1);
+	}
+}
+
+/**
+ * Writes back the dirty slots of a single descriptor node which are also
+ * set in mask, and those whose timestamps alone have changed if times is
+ * set. Each run of contiguous slots is written with a single call,
+ * however many times each slot was modified. Must be called with the
+ * flush lock held.
+ */
+static bool flushNode(EFSState* state, DescriptorTableNode* node,
+	const uint64_t* mask, char* buffer, bool times)
+{
+	Writeback* writeback = &state->writeback;
+	bool success = true;
+	uint64_t dirty[FT_NODE_SIZE / 64];
+	EPOCH_READ_SECTION(&state->epoch);
+	pthread_mutex_lock(&state->metadataLock);
+	pthread_mutex_lock(&writeback->lock);
+	size_t numDirty = 0;
+	size_t numWritten = 0;
+	for(int i = 0; i < FT_NODE_SIZE / 64; i++)
+	{
+		dirty[i] = node->dirty[i] & mask[i];
+		node->dirty[i] &= ~mask[i];
+		numDirty += __builtin_popcountll(dirty[i]);
+
+		/*
+		 * Changed timestamps go out with any write of their slot. The
+		 * bits are cleared before the slots are serialized, so a
+		 * timestamp changed meanwhile is either written now or later.
+		 */
+		uint64_t lazy = __atomic_load_n(&node->lazy[i], __ATOMIC_ACQUIRE)
+			& (times ? mask[i] : dirty[i]);
+		if(lazy != 0)
+		{
+			__atomic_fetch_and(&node->lazy[i], ~lazy, __ATOMIC_ACQ_REL);
+		}
+		dirty[i] |= lazy;
+		numWritten += __builtin_popcountll(dirty[i]);
+	}
+	node->numDirty -= numDirty;
+	writeback->numDirty -= numDirty;
+	for(unsigned int slot = 0; numWritten > 0 && slot < FT_NODE_SIZE; slot++)
+	{
+		if(slotIsDirty(dirty, slot))
+		{
+			serializeSlot(node, slot, buffer + PAGE_SIZE * slot);
+		}
+	}
+	pthread_mutex_unlock(&writeback->lock);
+	pthread_mutex_unlock(&state->metadataLock);
+	if(numWritten == 0)
+	{
+		return true;
+	}
+
+	unsigned int slot = 0;
+	while(slot < FT_NODE_SIZE)
+	{
+		if(!slotIsDirty(dirty, slot))
+		{
+			slot++;
+			continue;
+		}
+		unsigned int end = slot + 1;
+		while(end < FT_NODE_SIZE && slotIsDirty(dirty, end))
+		{
+			end++;
+		}
+		if(imageWrite(state, buffer + PAGE_SIZE * slot, PAGE_SIZE * (end - slot),
+			PAGE_SIZE * (node->location + slot)))
+		{
+			atomic_fetch_add(&state->stats.descriptorPagesWritten, end - slot);
+			atomic_fetch_add(&state->stats.descriptorWriteCalls, 1);
+		}
+		else
+		{
+			printf("Failed to write back descriptor node %" PRIu64 ".\n", node->location);
+			success = false;
+			pthread_mutex_lock(&writeback->lock);
+			for(unsigned int i = slot; i < end; i++)
+			{
+				if(descriptorTableNodeMarkDirty(node, i))
+				{
+					writeback->numDirty++;
+				}
+			}
+			pthread_mutex_unlock(&writeback->lock);
+		}
+		slot = end;
+	}
+	return success;
+}
+
+/**
+ * Writes back every dirty descriptor slot, and every slot whose
+ * timestamps alone have changed if times is set, followed by checksums
+ * and free space.
+ */
+static bool flushDescriptors(EFSState* state, bool times)
+{
+	Writeback* writeback = &state->writeback;
+	bool success = true;
+	uint64_t everySlot[FT_NODE_SIZE / 64];
+	memset(everySlot, 0xFF, sizeof(everySlot));
+	pthread_mutex_lock(&writeback->flushLock);
+	char* buffer = malloc(PAGE_SIZE * FT_NODE_SIZE);
+	if(buffer == NULL)
+	{
+		pthread_mutex_unlock(&writeback->flushLock);
+		return false;
+	}
+
+	/*
+	 * Every slot removed so far is written below. Slots removed from here
+	 * on may be missed, so they are kept.
+	 */
+	pthread_mutex_lock(&writeback->lock);
+	writeback->numRemoved = 0;
+	writeback->removedLost = false;
+	pthread_mutex_unlock(&writeback->lock);
+	DescriptorTableNode* node = state->descriptorTable->head;
+	while(node->next != NULL)
+	{
+		node = node->next;
+		success = flushNode(state, node, everySlot, buffer, times) && success;
+	}
+	free(buffer);
+	success = checksumFlush(state) && success;
+	success = flushFreeSpace(state) && success;
+	atomic_fetch_add(&state->stats.writebackFlushes, 1);
+	pthread_mutex_unlock(&writeback->flushLock);
+	return success;
+}
+
+bool writebackFlush(EFSState* state)
+{
+	return flushDescriptors(state, true);
+}
+
+/**
+ * Sets a deadline one writeback interval from now.
+ */
+static void nextDeadline(Writeback* writeback, struct timespec* deadline)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += writeback->interval / 1000;
+	deadline->tv_nsec += (writeback->interval % 1000) * 1000000L;
+	if(deadline->tv_nsec >= 1000000000L)
+	{
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool deadlinePassed(const struct timespec* deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > deadline->tv_sec
+		|| (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+static void* writebackThread(void* data)
+{
+	EFSState* state = data;
+	Writeback* writeback = &state->writeback;
+	/*
+	 * The deadline is kept across flushes requested by the threshold, so
+	 * that the work done once per interval still runs under constant
+	 * churn.
+	 */
+	struct timespec deadline;
+	nextDeadline(writeback, &deadline);
+	pthread_mutex_lock(&writeback->lock);
+	while(writeback->running)
+	{
+		while(writeback->running && !writeback->flushRequested
+			&& writeback->numDirty < writeback->threshold)
+		{
+			if(pthread_cond_timedwait(&writeback->wake, &writeback->lock, &deadline) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+		bool timedOut = deadlinePassed(&deadline);
+		if(timedOut)
+		{
+			nextDeadline(writeback, &deadline);
+		}
+		writeback->flushRequested = false;
+		if(writeback->running && timedOut)
+		{
+			/*
+			 * Pending file data is only allocated once the interval has
+			 * passed, so that a burst of descriptor changes does not cut
+			 * delayed allocation short. Allocating it dirties descriptors,
+			 * so it is done before they are flushed.
+			 */
+			pthread_mutex_unlock(&writeback->lock);
+			delayedAllocationFlushAll(state);
+			pthread_mutex_lock(&writeback->lock);
+		}
+		bool times = false;
+		if(writeback->running && timedOut)
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			times = now.tv_sec - writeback->timesFlushed >= writeback->timesInterval;
+			if(times)
+			{
+				writeback->timesFlushed = now.tv_sec;
+			}
+		}
+		if(writeback->running && (writeback->numDirty > 0 || times))
+		{
+			pthread_mutex_unlock(&writeback->lock);
+			flushDescriptors(state, times);
+			pthread_mutex_lock(&writeback->lock);
+		}
+		if(writeback->running && timedOut)
+		{
+			/*
+			 * Retired metadata is otherwise only reclaimed once enough of
+			 * it builds up, so a quiet filesystem would never free it.
+			 */
+			pthread_mutex_unlock(&writeback->lock);
+			epochReclaim(&state->epoch);
+			pthread_mutex_lock(&writeback->lock);
+		}
+	}
+	pthread_mutex_unlock(&writeback->lock);
+	return NULL;
+}
+
+bool writebackStart(EFSState* state)
+{
+	Writeback* writeback = &state->writeback;
+	pthread_mutex_init(&writeback->lock, NULL);
+	pthread_mutex_init(&writeback->flushLock, NULL);
+	pthread_cond_init(&writeback->wake, NULL);
+	pthread_mutex_init(&writeback->syncLock, NULL);
+	pthread_cond_init(&writeback->syncDone, NULL);
+	writeback->syncRequested = 0;
+	writeback->syncCompleted = 0;
+	writeback->syncInProgress = false;
+	writeback->syncFailures = 0;
+	writeback->running = true;
+	writeback->flushRequested = false;
+	writeback->numDirty = 0;
+	writeback->removed = NULL;
+	writeback->numRemoved = 0;
+	writeback->removedCapacity = 0;
+	writeback->removedLost = false;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	writeback->timesFlushed = now.tv_sec;
+	if(pthread_create(&writeback->thread, NULL, writebackThread, state) != 0)
+	{
+		writeback->running = false;
+		return false;
+	}
+	return true;
+}
+
+void writebackStop(EFSState* state)
+{
+	Writeback* writeback = &state->writeback;
+	pthread_mutex_lock(&writeback->lock);
+	bool wasRunning = writeback->running;
+	writeback->running = false;
+	pthread_cond_signal(&writeback->wake);
+	pthread_mutex_unlock(&writeback->lock);
+	if(wasRunning)
+	{
+		pthread_join(writeback->thread, NULL);
+	}
+	if(!delayedAllocationFlushAll(state))
+	{
+		printf("Failed to allocate space for pending file data.\n");
+	}
+	if(!writebackFlush(state) || !imageSync(state))
+	{
+		printf("Failed to write back %zu descriptor pages.\n", writeback->numDirty);
+	}
+	free(writeback->removed);
+	writeback->removed = NULL;
+	writeback->numRemoved = 0;
+	writeback->removedCapacity = 0;
+}
+
+/**
+ * Adds a slot to the mask of the node it is stored in, adding the node
+ * to the list of nodes to flush if it is not already there.
+ */
+static void addToFlush(DescriptorTableNode* node, unsigned int slot,
+	DescriptorTableNode** nodes, uint64_t (*masks)[FT_NODE_SIZE / 64],
+	size_t* numNodes)
+{
+	size_t i = 0;
+	while(i < *numNodes && nodes[i] != node)
+	{
+		i++;
+	}
+	if(i == *numNodes)
+	{
+		nodes[i] = node;
+		memset(masks[i], 0, sizeof(masks[i]));
+		masks[i][0] = 1;
+		(*numNodes)++;
+	}
+	masks[i][slot / 64] |= 1ULL << (slot % 64);
+}
+
+static void addSlotToFlush(FileTableNode* file, DescriptorTableNode** nodes,
+	uint64_t (*masks)[FT_NODE_SIZE / 64], size_t* numNodes)
+{
+	if(file != NULL && file->descriptorNode != NULL)
+	{
+		addToFlush(file->descriptorNode, file->descriptorSlot, nodes, masks, numNodes);
+	}
+}
+
+/**
+ * Adds the slots removed from a directory, forgetting them, since they are
+ * about to be written. Must be called with the flush lock held.
+ *
+ * @returns false if a removal was lost, and every dirty slot must be
+ * written instead.
+ */
+static bool addRemovedToFlush(Writeback* writeback, uint64_t parent,
+	DescriptorTableNode** nodes, uint64_t (*masks)[FT_NODE_SIZE / 64],
+	size_t* numNodes)
+{
+	pthread_mutex_lock(&writeback->lock);
+	size_t kept = 0;
+	for(size_t i = 0; i < writeback->numRemoved; i++)
+	{
+		RemovedSlot* removed = &writeback->removed[i];
+		if(removed->parent == parent)
+		{
+			addToFlush(removed->node, removed->slot, nodes, masks, numNodes);
+		}
+		else
+		{
+			writeback->removed[kept++] = *removed;
+		}
+	}
+	writeback->numRemoved = kept;
+	bool complete = !writeback->removedLost;
+	pthread_mutex_unlock(&writeback->lock);
+	return complete;
+}
+
+/**
+ * Adds the header of the node before each node to flush, which holds the
+ * link to it. Only a link not yet written is dirty, so only that is
+ * written. The link to the first node is held by the superblock, which
+ * flushFreeSpace writes. Must be called with the metadata lock held.
+ */
+static void addLinksToFlush(DescriptorTable* table, DescriptorTableNode** nodes,
+	uint64_t (*masks)[FT_NODE_SIZE / 64], size_t* numNodes)
+{
+	size_t numLinked = *numNodes;
+	for(DescriptorTableNode* node = table->head->next; node != NULL && node->next != NULL; node = node->next)
+	{
+		for(size_t i = 0; i < numLinked; i++)
+		{
+			if(nodes[i] == node->next)
+			{
+				addToFlush(node, 0, nodes, masks, numNodes);
+				break;
+			}
+		}
+	}
+}
+
+bool writebackFlushFile(EFSState* state, FileTableNode* file,
+	bool includeChildren)
+{
+	Writeback* writeback = &state->writeback;
+	uint64_t inode = file->fileDescriptor->fileID;
+	char* buffer = malloc(PAGE_SIZE * FT_NODE_SIZE);
+	if(buffer == NULL)
+	{
+		return false;
+	}
+	pthread_mutex_lock(&writeback->flushLock);
+	pthread_mutex_lock(&state->metadataLock);
+	/*
+	 * The table only grows with the metadata lock held, so sizing the
+	 * arrays under it guarantees room for every node walked.
+	 */
+	size_t capacity = includeChildren ? state->descriptorTable->size + 2 : 4;
+	DescriptorTableNode** nodes = malloc(sizeof(DescriptorTableNode*) * capacity);
+	uint64_t (*masks)[FT_NODE_SIZE / 64] = malloc(sizeof(*masks) * capacity);
+	if(nodes == NULL || masks == NULL)
+	{
+		pthread_mutex_unlock(&state->metadataLock);
+		pthread_mutex_unlock(&writeback->flushLock);
+		free(nodes);
+		free(masks);
+		free(buffer);
+		return false;
+	}
+	size_t numNodes = 0;
+	bool complete = true;
+	addSlotToFlush(file, nodes, masks, &numNodes);
+	addSlotToFlush(fileTableSearchInode(state->fileTable, file->fileDescriptor->parentID),
+		nodes, masks, &numNodes);
+	if(includeChildren)
+	{
+		DirectoryEntry entries[64];
+		uint64_t position = 0;
+		size_t count;
+		do
+		{
+			count = fileTableListChildren(state->fileTable, inode, position, entries, 64);
+			for(size_t i = 0; i < count; i++)
+			{
+				addSlotToFlush(entries[i].node, nodes, masks, &numNodes);
+			}
+			position = count > 0 ? entries[count - 1].position + 1 : position;
+		} while(count == 64);
+		complete = addRemovedToFlush(writeback, inode, nodes, masks, &numNodes);
+	}
+	addLinksToFlush(state->descriptorTable, nodes, masks, &numNodes);
+	pthread_mutex_unlock(&state->metadataLock);
+	if(!complete)
+	{
+		pthread_mutex_unlock(&writeback->flushLock);
+		free(nodes);
+		free(masks);
+		free(buffer);
+		return flushDescriptors(state, true);
+	}
+
+	bool success = true;
+	for(size_t i = 0; i < numNodes; i++)
+	{
+		success = flushNode(state, nodes[i], masks[i], buffer, true) && success;
+	}
+	success = checksumFlush(state) && success;
+	success = flushFreeSpace(state) && success;
+	pthread_mutex_unlock(&writeback->flushLock);
+	free(nodes);
+	free(masks);
+	free(buffer);
+	return success;
+}
+
+bool writebackSyncImage(EFSState* state)
+{
+	Writeback* writeback = &state->writeback;
+	atomic_fetch_add(&state->stats.fsyncRequests, 1);
+	pthread_mutex_lock(&writeback->syncLock);
+	uint64_t ticket = ++writeback->syncRequested;
+	uint64_t failures = writeback->syncFailures;
+	while(writeback->syncCompleted < ticket)
+	{
+		if(writeback->syncInProgress)
+		{
+			pthread_cond_wait(&writeback->syncDone, &writeback->syncLock);
+			continue;
+		}
+		/*
+		 * This thread leads the next sync. It waits for the batching
+		 * window so that requests arriving shortly after it can share
+		 * the same sync, then covers every request made up to that point.
+		 */
+		writeback->syncInProgress = true;
+		pthread_mutex_unlock(&writeback->syncLock);
+		if(writeback->syncWindow > 0)
+		{
+			struct timespec window = { writeback->syncWindow / 1000000,
+				(writeback->syncWindow % 1000000) * 1000L };
+			nanosleep(&window, NULL);
+		}
+		pthread_mutex_lock(&writeback->syncLock);
+		uint64_t target = writeback->syncRequested;
+		pthread_mutex_unlock(&writeback->syncLock);
+		bool synced = imageSync(state);
+		atomic_fetch_add(&state->stats.imageSyncs, 1);
+		pthread_mutex_lock(&writeback->syncLock);
+		writeback->syncInProgress = false;
+		writeback->syncCompleted = target;
+		writeback->syncFailures += !synced;
+		pthread_cond_broadcast(&writeback->syncDone);
+	}
+	/*
+	 * Later syncs may have completed before this thread woke, so the
+	 * result of the last one says nothing about this request. Any sync
+	 * which failed meanwhile, including the one covering it, fails it.
+	 */
+	bool success = writeback->syncFailures == failures;
+	pthread_mutex_unlock(&writeback->syncLock);
+	return success;
+}
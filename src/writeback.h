@@ -0,0 +1,277 @@
+#ifndef __EFSFUSE_WRITEBACK
+#define __EFSFUSE_WRITEBACK
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "descriptor_table.h"
+#include "file_table.h"
+
+struct efs_state;
+
+/**
+ * A descriptor slot cleared by the removal of a file. Once cleared, the
+ * slot no longer records the directory the file was in, so it is kept
+ * here until written back, for an fsync of that directory to find.
+ */
+typedef struct removed_slot
+{
+	/**
+	 * The inode of the directory the file was removed from.
+	 */
+	uint64_t parent;
+
+	/**
+	 * The descriptor node containing the cleared slot.
+	 */
+	DescriptorTableNode* node;
+
+	/**
+	 * The index of the cleared slot within the node.
+	 */
+	unsigned int slot;
+
+} RemovedSlot;
+
+/**
+ * State of the background thread that writes modified descriptors back
+ * to disk. Descriptors are modified in memory and marked dirty; the
+ * thread periodically merges the dirty slots of each descriptor node
+ * into as few contiguous writes as possible.
+ */
+typedef struct writeback
+{
+	/**
+	 * The background writeback thread.
+	 */
+	pthread_t thread;
+
+	/**
+	 * Protects the dirty bitmaps of every descriptor node, and every
+	 * other field of this structure.
+	 */
+	pthread_mutex_t lock;
+
+	/**
+	 * Held for the duration of a flush, so that two flushes cannot write
+	 * the same pages out of order.
+	 */
+	pthread_mutex_t flushLock;
+
+	/**
+	 * Signalled to wake the writeback thread before its timer expires.
+	 */
+	pthread_cond_t wake;
+
+	/**
+	 * Cleared to ask the writeback thread to exit.
+	 */
+	bool running;
+
+	/**
+	 * Set when the dirty threshold has been reached and the thread has
+	 * been asked to flush early.
+	 */
+	bool flushRequested;
+
+	/**
+	 * The maximum time in milliseconds a descriptor may stay dirty
+	 * before it is written back.
+	 */
+	unsigned int interval;
+
+	/**
+	 * The number of dirty slots that triggers a flush before the timer
+	 * expires.
+	 */
+	size_t threshold;
+
+	/**
+	 * The total number of dirty slots across every descriptor node.
+	 */
+	size_t numDirty;
+
+	/**
+	 * The maximum time in seconds a timestamp changed only in memory may
+	 * wait before it is written back.
+	 */
+	unsigned int timesInterval;
+
+	/**
+	 * When timestamps changed only in memory were last written back,
+	 * measured by the monotonic clock in seconds. Only used by the
+	 * writeback thread.
+	 */
+	time_t timesFlushed;
+
+	/**
+	 * The slots cleared by removals since the last full flush.
+	 */
+	RemovedSlot* removed;
+
+	/**
+	 * The number of entries in removed.
+	 */
+	size_t numRemoved;
+
+	/**
+	 * The number of entries removed has space for.
+	 */
+	size_t removedCapacity;
+
+	/**
+	 * Set if a removal could not be added to removed, so that the next
+	 * fsync of a directory must write back every dirty slot.
+	 */
+	bool removedLost;
+
+	/**
+	 * Protects the fields used to batch syncs of the image.
+	 */
+	pthread_mutex_t syncLock;
+
+	/**
+	 * Broadcast whenever a sync of the image completes.
+	 */
+	pthread_cond_t syncDone;
+
+	/**
+	 * The number of sync requests made so far. Each request is given
+	 * the value of this counter as its ticket.
+	 */
+	uint64_t syncRequested;
+
+	/**
+	 * The ticket of the last request covered by a completed sync.
+	 */
+	uint64_t syncCompleted;
+
+	/**
+	 * Set while a thread is syncing the image on behalf of every request
+	 * made before it started.
+	 */
+	bool syncInProgress;
+
+	/**
+	 * The number of syncs which have failed. A request fails if any
+	 * sync completing after it was made failed, since the data it asked
+	 * to be synced may have been dropped by that sync.
+	 */
+	uint64_t syncFailures;
+
+	/**
+	 * The time in microseconds the thread leading a sync waits for other
+	 * requests to join it before syncing the image.
+	 */
+	unsigned int syncWindow;
+
+} Writeback;
+
+/**
+ * Initializes the writeback state and starts the writeback thread. The
+ * interval and threshold must be set beforehand.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if the thread could not be started.
+ */
+bool writebackStart(struct efs_state* state);
+
+/**
+ * Stops the writeback thread, then writes back every remaining dirty
+ * descriptor.
+ *
+ * @param state The current filesystem state
+ */
+void writebackStop(struct efs_state* state);
+
+/**
+ * Marks a descriptor slot as modified, so that it is written back by the
+ * next flush. Must be called after the in-memory descriptor has been
+ * changed. Wakes the writeback thread if the dirty threshold is reached.
+ *
+ * @param state The current filesystem state
+ * @param node The descriptor node containing the modified slot
+ * @param slot The index of the slot within the node. Slot 0 refers to
+ * the node header.
+ */
+void writebackMarkDirty(struct efs_state* state, DescriptorTableNode* node,
+	unsigned int slot);
+
+/**
+ * Marks the slot of a removed file as modified, along with the header of
+ * its node, and remembers the directory the file was removed from so
+ * that an fsync of the directory writes the slot back. Must be called
+ * after the slot has been cleared.
+ *
+ * @param state The current filesystem state
+ * @param node The descriptor node containing the cleared slot
+ * @param slot The index of the slot within the node
+ * @param parent The inode of the directory the file was removed from
+ */
+void writebackMarkRemoved(struct efs_state* state, DescriptorTableNode* node,
+	unsigned int slot, uint64_t parent);
+
+/**
+ * Records that only the timestamps of a descriptor slot have changed.
+ * Unlike \link writebackMarkDirty \endlink, this does not count towards
+ * the dirty threshold or cause a write by itself: the slot is written
+ * along with the next write of the same slot, an fsync of its file, or
+ * once the timestamp interval has passed. Must be called after the
+ * in-memory descriptor has been changed.
+ *
+ * @param state The current filesystem state
+ * @param node The descriptor node containing the modified slot
+ * @param slot The index of the slot within the node
+ */
+void writebackMarkTimes(struct efs_state* state, DescriptorTableNode* node,
+	unsigned int slot);
+
+/**
+ * Writes back every descriptor slot that was marked dirty before this
+ * function was called, including those whose timestamps alone have
+ * changed, along with any changed pages of the checksum table and free
+ * space. Acts as a barrier: when this function returns,
+ * those slots have been handed to the image, though not necessarily
+ * synced to stable storage.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true upon success, false if an I/O error occurred. Slots that
+ * could not be written remain dirty.
+ */
+bool writebackFlush(struct efs_state* state);
+
+/**
+ * Writes back the dirty descriptor slots of a single file and of its
+ * parent directory, including changed timestamps, along with any changes
+ * to checksums and free space. The links to the nodes holding those slots
+ * are written too, so that a node newly added to the chain can be found.
+ * Optionally also writes back the slots of the file's children, which
+ * hold the entries of a directory, and the slots of children removed from
+ * it. Other dirty slots are left to the writeback thread.
+ *
+ * @param state The current filesystem state
+ * @param file The file to write back
+ * @param includeChildren Whether to write back the file's children
+ *
+ * @returns true upon success, false if an I/O error occurred.
+ */
+bool writebackFlushFile(struct efs_state* state, FileTableNode* file,
+	bool includeChildren);
+
+/**
+ * Syncs the image to stable storage. Requests made by several threads
+ * within the sync window of each other share a single sync.
+ *
+ * @param state The current filesystem state
+ *
+ * @returns true if every sync completed since this request was made
+ * succeeded, otherwise false.
+ */
+bool writebackSyncImage(struct efs_state* state);
+
+#endif
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Measures what checksums cost reads, which should stay within a few
+# percent.
+#
+#   tools/bench_checksum.sh IMAGE MOUNTPOINT [SIZE_MB]
+#
+# A file of SIZE_MB (default 256) of random data is written with and
+# without -o checksum, and read back twice after remounting: once with
+# the image in the host page cache, where the cost of checksums shows
+# most, and once cold. The rates are printed in MB/s, together with the
+# pages verified. For the speed of the CRC32C kernels alone, build and
+# run checksum_bench with `make checksum_bench`.
+
+IMAGE=$1
+MOUNTPOINT=$2
+SIZE=${3:-256}
+. "$(dirname "$0")/bench_common.sh"
+
+# Writes the test file, then prints its read rates with the image cached
+# and cold, and the number of pages verified by both reads.
+run()
+{
+	local options=$1
+	efs_mount "$options"
+	head -c "${SIZE}M" /dev/urandom | dd of="$MOUNTPOINT/data" bs=1M conv=fsync status=none
+	efs_unmount
+	efs_remount "$options"
+	local cached=$(read_rate "$MOUNTPOINT/data")
+	local verified=$(efs_stat checksum_pages_verified)
+	efs_unmount
+	drop_caches
+	efs_remount "$options"
+	local cold=$(read_rate "$MOUNTPOINT/data")
+	verified=$((verified + $(efs_stat checksum_pages_verified)))
+	efs_unmount
+	echo "$cached $cold $verified"
+}
+
+printf "%-10s %8s %8s %10s\n" mode cached cold verified
+read cached cold verified <<< "$(run noatime)"
+printf "%-10s %8s %8s %10s\n" plain $cached $cold $verified
+read cached cold verified <<< "$(run noatime,checksum)"
+printf "%-10s %8s %8s %10s\n" checksum $cached $cold $verified
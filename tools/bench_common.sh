@@ -0,0 +1,102 @@
+# Helpers shared by the benchmark scripts in this directory. Source it
+# after setting IMAGE (an empty EFS image, which is never modified) and
+# MOUNTPOINT (an empty directory).
+#
+# Every run mounts a fresh copy of IMAGE, so runs do not see each other's
+# files. Set EFSFUSE to use a binary other than the one built in the root
+# of the repository, and WORKDIR to keep the copies somewhere other than
+# /tmp.
+
+EFSFUSE=${EFSFUSE:-$(dirname "$0")/../efsfuse}
+WORKDIR=${WORKDIR:-/tmp}
+COPY="$WORKDIR/efsfuse-bench.$$"
+EFS_PID=
+
+if [ ! -x "$EFSFUSE" ]; then
+	echo "No efsfuse binary at $EFSFUSE; run make first." >&2
+	exit 1
+fi
+if [ ! -f "$IMAGE" ] || [ ! -d "$MOUNTPOINT" ]; then
+	echo "Usage: $0 IMAGE MOUNTPOINT" >&2
+	exit 1
+fi
+
+# Mounts a fresh copy of the image with the given -o options.
+efs_mount()
+{
+	cp "$IMAGE" "$COPY"
+	efs_remount "$@"
+}
+
+# Mounts the copy left by the last run as it is, to read back what it
+# wrote without any of it cached by efsfuse or the kernel.
+efs_remount()
+{
+	local options=${1:-noatime}
+	"$EFSFUSE" -f -o "$options" "$MOUNTPOINT" "$COPY" > "$COPY.log" 2>&1 &
+	EFS_PID=$!
+	for i in $(seq 100); do
+		mountpoint -q "$MOUNTPOINT" && return 0
+		sleep 0.1
+	done
+	echo "efsfuse did not mount; see $COPY.log" >&2
+	exit 1
+}
+
+efs_unmount()
+{
+	fusermount3 -u "$MOUNTPOINT"
+	wait "$EFS_PID"
+	EFS_PID=
+}
+
+efs_cleanup()
+{
+	if [ -n "$EFS_PID" ]; then
+		efs_unmount
+	fi
+	rm -f "$COPY" "$COPY.log"
+}
+trap efs_cleanup EXIT
+
+# Prints a statistic of the mounted filesystem.
+efs_stat()
+{
+	getfattr --only-values -n "user.efs.$1" "$MOUNTPOINT" 2>/dev/null
+}
+
+# Prints the resident memory of the running efsfuse in KiB.
+efs_rss()
+{
+	awk '/^VmRSS:/ { print $2 }' "/proc/$EFS_PID/status"
+}
+
+# Drops the host page cache, so that reads of the image reach the disk.
+# Only root can do this; otherwise cold reads may be served from memory.
+drop_caches()
+{
+	sync
+	if [ -w /proc/sys/vm/drop_caches ]; then
+		echo 3 > /proc/sys/vm/drop_caches
+	fi
+}
+if [ ! -w /proc/sys/vm/drop_caches ]; then
+	echo "Not root: the host page cache is not dropped between runs." >&2
+fi
+
+# Prints the time in seconds a command takes to run.
+elapsed()
+{
+	local start=$(date +%s%N)
+	"$@" > /dev/null
+	local end=$(date +%s%N)
+	awk -v ns=$((end - start)) 'BEGIN { printf "%.3f", ns / 1e9 }'
+}
+
+# Prints the rate in MB/s at which a file is read in 1 MiB blocks.
+read_rate()
+{
+	local bytes=$(stat -c %s "$1")
+	local seconds=$(elapsed dd if="$1" of=/dev/null bs=1M status=none)
+	awk -v b=$bytes -v s=$seconds 'BEGIN { printf "%.0f", s > 0 ? b / s / 1e6 : 0 }'
+}
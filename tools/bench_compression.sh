@@ -0,0 +1,64 @@
+#!/bin/bash
+# Measures what compression saves and costs, to check the threshold in
+# compressionWrite at which data is stored compressed: a fragment must
+# shrink by at least an eighth.
+#
+#   tools/bench_compression.sh IMAGE MOUNTPOINT [SIZE_MB]
+#
+# For each share of incompressible bytes, a file of SIZE_MB (default 256)
+# is written with and without -o compress. Each 64 KiB compression unit
+# of the file holds that share of random bytes followed by zeroes. The
+# image is then remounted, so that the file is read cold. Printed per
+# share:
+#
+#   ratio     compression_ratio once the file is flushed
+#   declined  flushes stored uncompressed for saving less than an eighth
+#   plain     read rate of the file written without compression, MB/s
+#   packed    read rate of the file written with compression, MB/s
+#
+# Data is stored compressed once ratio reaches 8/7 (1.14). If packed is
+# well below plain for the shares just under that point, the threshold
+# is too low; if shares past it, which are declined, would still read
+# faster packed than plain, it is too high.
+
+IMAGE=$1
+MOUNTPOINT=$2
+SIZE=${3:-256}
+. "$(dirname "$0")/bench_common.sh"
+
+# Writes SIZE MiB in which each unit starts with the given percentage of
+# random bytes.
+generate()
+{
+	python3 -c '
+import os, sys
+unit = 64 * 1024
+random = int(unit * float(sys.argv[1]) / 100)
+out = sys.stdout.buffer
+for i in range(int(sys.argv[2]) * 16):
+	out.write(os.urandom(random) + bytes(unit - random))
+' "$1" "$SIZE"
+}
+
+# Writes the test file and prints its compression ratio and the number of
+# flushes stored uncompressed, then remounts and prints its read rate.
+run()
+{
+	local options=$1
+	local share=$2
+	efs_mount "$options"
+	generate "$share" | dd of="$MOUNTPOINT/data" bs=1M conv=fsync status=none
+	echo -n "$(efs_stat compression_ratio) $(efs_stat compression_declined) "
+	efs_unmount
+	drop_caches
+	efs_remount "$options"
+	read_rate "$MOUNTPOINT/data"
+	efs_unmount
+}
+
+printf "%8s %8s %8s %8s %8s\n" random ratio declined plain packed
+for share in 0 50 75 80 85 87.5 90 95 100; do
+	read _ _ plain <<< "$(run noatime $share)"
+	read ratio declined packed <<< "$(run noatime,compress $share)"
+	printf "%7s%% %8s %8s %8s %8s\n" $share $ratio $declined $plain $packed
+done
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Compares buffered image access with -o direct, which should cache each
+# page of the image once rather than in both the host page cache and
+# efsfuse.
+#
+#   tools/bench_direct.sh IMAGE MOUNTPOINT [SIZE_MB]
+#
+# A file of SIZE_MB (default 1024) of random data is written, and read
+# back cold after a remount, twice in a row. Printed for each mode:
+#
+#   first     rate of the first read in MB/s
+#   second    rate of the second read in MB/s
+#   rss       resident memory of efsfuse after the reads, in MiB
+#   cached    growth of the host page cache over the reads, in MiB
+#   hit_rate  image_cache_hit_rate, for -o direct
+#
+# The second read is served by the kernel's cache of the FUSE file in
+# both modes. That cache is part of cached, so buffered mode counts the
+# data there twice, once for the file and once for the image; rss +
+# cached is the memory the data takes up in all.
+
+IMAGE=$1
+MOUNTPOINT=$2
+SIZE=${3:-1024}
+. "$(dirname "$0")/bench_common.sh"
+
+# Prints the size of the host page cache in KiB.
+page_cache()
+{
+	awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+
+run()
+{
+	local options=$1
+	efs_mount "$options"
+	head -c "${SIZE}M" /dev/urandom | dd of="$MOUNTPOINT/data" bs=1M conv=fsync status=none
+	efs_unmount
+	drop_caches
+	local before=$(page_cache)
+	efs_remount "$options"
+	local first=$(read_rate "$MOUNTPOINT/data")
+	local second=$(read_rate "$MOUNTPOINT/data")
+	local rss=$(efs_rss)
+	local after=$(page_cache)
+	local rate=$(efs_stat image_cache_hit_rate)
+	efs_unmount
+	echo "$first $second $((rss / 1024)) $(((after - before) / 1024)) $rate"
+}
+
+printf "%-10s %8s %8s %8s %8s %8s\n" mode first second rss cached hit_rate
+read first second rss cached rate <<< "$(run noatime)"
+printf "%-10s %8s %8s %8s %8s %8s\n" buffered $first $second $rss $cached -
+read first second rss cached rate <<< "$(run noatime,direct)"
+printf "%-10s %8s %8s %8s %8s %8s\n" direct $first $second $rss $cached $rate
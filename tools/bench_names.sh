@@ -0,0 +1,56 @@
+#!/bin/bash
+# Reports the memory saved by interning filenames, on trees shaped like
+# real ones.
+#
+#   tools/bench_names.sh IMAGE MOUNTPOINT [PACKAGES]
+#
+# Two trees are created on fresh copies of the image, each with PACKAGES
+# (default 2000) directories of 12 files:
+#
+#   packages  every directory holds the same names, like node_modules or
+#             a Python tree (index.js, package.json, __init__.py, ...)
+#   unique    no two files share a name, for comparison
+#
+# IMAGE needs room for the descriptors of PACKAGES * 13 files.
+#
+# For each, the image is remounted so that every name is read from disk
+# as efsfuse does when mounting, and the statistics of the name pool are
+# printed: distinct names, descriptors referring to them, bytes held, and
+# bytes that copying each name would have taken in addition. rss is the
+# resident memory of efsfuse in MiB.
+
+IMAGE=$1
+MOUNTPOINT=$2
+PACKAGES=${3:-2000}
+. "$(dirname "$0")/bench_common.sh"
+
+# Creates the tree of the given shape.
+populate()
+{
+	python3 -c '
+import os, sys
+mount, shape, packages = sys.argv[1], sys.argv[2], int(sys.argv[3])
+names = ["index.js", "package.json", "README.md", "LICENSE", "CHANGELOG.md",
+	"__init__.py", "setup.py", "Makefile", "main.o", "main.d", ".gitignore",
+	"tsconfig.json"]
+for package in range(packages):
+	directory = os.path.join(mount, "package-%d" % package)
+	os.mkdir(directory)
+	for i, name in enumerate(names):
+		if shape == "unique":
+			name = "%d-%s" % (package, name)
+		open(os.path.join(directory, name), "w").close()
+' "$MOUNTPOINT" "$1" "$PACKAGES"
+}
+
+printf "%-10s %8s %10s %10s %12s %6s\n" tree names references bytes bytes_saved rss
+for shape in packages unique; do
+	efs_mount
+	populate $shape
+	efs_unmount
+	efs_remount
+	printf "%-10s %8s %10s %10s %12s %6s\n" $shape \
+		$(efs_stat names_interned) $(efs_stat name_references) \
+		$(efs_stat name_bytes) $(efs_stat name_bytes_saved) $(($(efs_rss) / 1024))
+	efs_unmount
+done
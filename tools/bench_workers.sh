@@ -0,0 +1,78 @@
+#!/bin/bash
+# Compares the default pool of worker threads with -o pin_workers, which
+# runs one worker per CPU, each reading its own cloned /dev/fuse.
+#
+#   tools/bench_workers.sh IMAGE MOUNTPOINT [CLIENTS] [SECONDS]
+#
+# CLIENTS processes (default twice the online CPUs) each issue requests
+# for SECONDS (default 10), in two loads:
+#
+#   getxattr  reads a statistic of the mount, which the kernel never
+#             caches, so it measures the cost of handing out requests
+#   write     overwrites 4 KiB at a time in a file of each client
+#
+# The requests served per second are printed for each mode, followed by
+# the utilization of each pinned worker.
+
+IMAGE=$1
+MOUNTPOINT=$2
+CLIENTS=${3:-$(($(nproc) * 2))}
+SECONDS_PER_LOAD=${4:-10}
+. "$(dirname "$0")/bench_common.sh"
+
+# Runs a load from CLIENTS processes at once, and prints the requests
+# served per second by all of them.
+load()
+{
+	python3 -c '
+import multiprocessing, os, sys, time
+mount, kind, clients, seconds = sys.argv[1], sys.argv[2], int(sys.argv[3]), float(sys.argv[4])
+def client(index, counts):
+	if kind == "write":
+		fd = os.open(os.path.join(mount, "client%d" % index), os.O_RDWR | os.O_CREAT)
+		block = os.urandom(4096)
+	count = 0
+	end = time.monotonic() + seconds
+	while time.monotonic() < end:
+		for i in range(64):
+			if kind == "write":
+				os.pwrite(fd, block, i * 4096)
+			else:
+				os.getxattr(mount, "user.efs.files")
+		count += 64
+	counts[index] = count
+counts = multiprocessing.Array("q", clients)
+processes = [multiprocessing.Process(target=client, args=(i, counts)) for i in range(clients)]
+for process in processes:
+	process.start()
+for process in processes:
+	process.join()
+print("%.0f" % (sum(counts) / seconds))
+' "$MOUNTPOINT" "$1" "$CLIENTS" "$SECONDS_PER_LOAD"
+}
+
+# Prints the utilization of every pinned worker.
+utilization()
+{
+	local worker=0
+	local value
+	while value=$(efs_stat worker${worker}_utilization) && [ -n "$value" ]; do
+		echo -n " $value"
+		worker=$((worker + 1))
+	done
+}
+
+printf "%-8s %10s %10s\n" mode getxattr write
+for mode in pool pinned; do
+	options=noatime
+	if [ $mode = pinned ]; then
+		options=noatime,pin_workers
+	fi
+	efs_mount $options
+	getxattr=$(load getxattr)
+	write=$(load write)
+	workers=$(utilization)
+	efs_unmount
+	printf "%-8s %10s %10s\n" $mode $getxattr $write
+done
+echo "pinned worker utilization:$workers"
@@ -0,0 +1,84 @@
+/**
+ * Measures the throughput of the CRC32C kernels used to checksum pages,
+ * on a single core:
+ *
+ * 		checksum_bench [MB]
+ *
+ * Each kernel checksums MB megabytes (default 1024), a page at a time as
+ * the read path does, and once as a single buffer. The accelerated kernel
+ * is only timed where the processor has SSE4.2.
+ */
+#include "../src/checksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_PAGE 4096
+#define BENCH_BUFFER (16 * 1024 * 1024)
+
+/**
+ * Receives every checksum, so that none of the work can be optimized
+ * away.
+ */
+static volatile uint32_t sink;
+
+static double now()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * Checksums total bytes of buffer in pieces of the given length, and
+ * prints the rate achieved.
+ */
+static void run(const char* name, uint32_t (*kernel)(uint32_t, const void*, size_t),
+	const char* buffer, size_t piece, size_t total)
+{
+	uint32_t sum = 0;
+	double start = now();
+	for(size_t done = 0; done < total; done += piece)
+	{
+		size_t offset = done % BENCH_BUFFER;
+		sum ^= kernel(0, buffer + offset, piece);
+	}
+	double seconds = now() - start;
+	sink = sum;
+	printf("%-12s %8zu B  %8.0f MB/s\n", name, piece, total / seconds / 1e6);
+}
+
+int main(int argc, char** args)
+{
+	size_t total = (size_t) (argc > 1 ? atoi(args[1]) : 1024) * 1024 * 1024;
+	total -= total % BENCH_BUFFER;
+	char* buffer = malloc(BENCH_BUFFER);
+	if(buffer == NULL || total == 0)
+	{
+		printf("Usage: checksum_bench [MB], with MB at least %d\n", BENCH_BUFFER / (1024 * 1024));
+		return 1;
+	}
+	unsigned int seed = 1;
+	for(size_t i = 0; i < BENCH_BUFFER; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+	if(crc32c(0, buffer, BENCH_BUFFER) != crc32cTable(0, buffer, BENCH_BUFFER))
+	{
+		printf("The kernels disagree.\n");
+		return 1;
+	}
+	size_t pieces[] = { BENCH_PAGE, BENCH_BUFFER };
+	for(size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+	{
+		run("table", crc32cTable, buffer, pieces[i], total);
+		if(crc32cAccelerated())
+		{
+			run("sse4.2", crc32c, buffer, pieces[i], total);
+		}
+	}
+	free(buffer);
+	return 0;
+}